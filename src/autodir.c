@@ -41,14 +41,17 @@ I acknowledge autofs people for any
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <linux/types.h>
 #include <linux/auto_fs4.h>
 
 #include "miscfuncs.h"
 #include "msg.h"
-#include "workon.h"
+#include "session.h"
 #include "options.h"
 #include "mpacket.h"
 #include "thread.h"
@@ -60,6 +63,7 @@ I acknowledge autofs people for any
 #include "thread_cache.h"
 #include "expire.h"
 #include "time_mono.h"
+#include "stats.h"
 #include "autodir.h"
 
 static struct {
@@ -82,13 +86,20 @@ static struct {
 	char *pid_file;
 	int shutdown;
 	volatile sig_atomic_t stop;
-	pthread_t sig_th; /* independent thread for handling singals*/
+
+	int epfd;	/* event loop: kernel pipe, signals and timer*/
+	int sigfd;	/* all blocked signals are read from here*/
+	int timerfd;	/* deferred retry of kernel pipe reads*/
+
+	int n_threads; /*workers handling missing directories*/
+	int affinity; /*same worker always handles the same name?*/
 
 	int multi_path; /*multi path feature requested?*/
 	char multi_prefix; /*prefix char for multipath*/
 
 	thread_cache expire_tc;
 	thread_cache missing_tc;
+	thread_cache worker_tc; /*both packet types, keyed by name*/
 } self;
 
 /* all slashes are removed from argv[0]*/
@@ -168,6 +179,7 @@ static int umount_all( void )
 {
 	char path[ PATH_MAX+1 ];
 	struct dirent *de;
+	Session *s;
 	DIR *dp;
 
 	if( ! ( dp = opendir( autodir.path ) ) )
@@ -191,7 +203,11 @@ static int umount_all( void )
 			msglog( MSG_WARNING, "could not unmount %s", path );
 			continue;
 		}
-		else lockfile_remove( de->d_name );
+		else if( ( s = session_get( de->d_name ) ) )
+		{
+			lockfile_remove( s );
+			session_put( s );
+		}
 	}
 	closedir( dp );
 	return 1;
@@ -241,68 +257,21 @@ static void mount_autodir( char *path, pid_t pgrp,
 	autodir.dev = st.st_dev;
 }
 
-static int poll_read( int fd, char *buf, int sz )
-{
-	int r, n;
-	struct pollfd pf;
-
-	pf.fd = fd;
-	pf.events = POLLIN;
-
-	while( sz )
-	{
-		r = poll( &pf, 1, 1000 );
-
-		if( r == -1 && errno != EINTR )
-		{
-			msglog( MSG_ERR|LOG_ERRNO, "poll_read: poll" );
-			return -1;
-		}
-		if( r == 0 && (self.shutdown || self.stop) )
-			return 0;
-		if( r <= 0 ) continue; /*including errno == EINTR */
-
-		while( ( n = read( fd, buf, sz ) ) == -1 &&
-				errno == EINTR );
-		if( n > 0 )
-		{
-			sz -= n;
-			buf += n;
-		}
-		else if( ! n )
-		{
-			msglog( MSG_ALERT, "poll_read: kernel pipe closed" );
-			return -1;
-		}
-		else if( n == -1 )
-		{
-			if( errno == EAGAIN )
-			{
-				sleep( 1 );
-				continue;
-			}
-			msglog( MSG_ERR|LOG_ERRNO, "poll_read: read" );
-			return -1;
-		}
-	}
-	return 1;
-}
-
 #define SEND_FAIL		0
 #define SEND_READY		1
 
 /*exit code for thread handle_missing*/
-static void missing_exit( char *mname, char *name, autofs_wqt_t wqt, int result )
+static void missing_exit( Session *ms, Session *s, autofs_wqt_t wqt, int result )
 {
 	if( result == SEND_READY )
 		send_ready( wqt );
 	else
 		send_fail( wqt );
 
-	if( mname )
-		workon_release( mname );
-	if( name && mname != name )
-		workon_release( name );
+	if( ms )
+		session_release( ms );
+	if( s && ms != s )
+		session_release( s );
 }
 
 /*missing directory handling for autofs mounted directory*/
@@ -317,6 +286,7 @@ static void handle_missing( Packet *pkt )
 	struct stat st;
 	autofs_wqt_t wqt;
 	struct autofs_packet_missing *pmis;
+	Session *ms, *s;
 
 	pmis = &( pkt->ap.missing );
 	wqt = pmis->wait_queue_token;
@@ -350,15 +320,22 @@ static void handle_missing( Packet *pkt )
 	}
 
 	/*preliminary setup. get mutex on name string*/
-	if( ! workon_name( mname ) )
+	if( ! ( ms = session_acquire( mname ) ) )
 		return missing_exit( NULL, NULL, wqt, SEND_FAIL );
 
+	/*everything about the name without multi prefix
+	  hangs on its own session*/
+	if( mname == name )
+		s = ms;
+	else if( ! ( s = session_get( name ) ) )
+		return missing_exit( ms, NULL, wqt, SEND_FAIL );
+
 	/* any backup running or 
 	   entry under process? stop it*/
-	backup_remove( name, name != mname );
+	backup_remove( s, name != mname );
 
-	if( mname != name && ! workon_name( name ) )
-		return missing_exit( mname, NULL, wqt, SEND_FAIL );
+	if( mname != name )
+		session_lock( s );
 
 	/*Create virtual dir on autofs mount point.*/
 	snprintf( vpath, sizeof(vpath), "%s/%s", autodir.path, mname );
@@ -368,7 +345,7 @@ static void handle_missing( Packet *pkt )
 	if( lstat( vpath, &st ) && errno != ENOENT )
 	{
 		msglog( MSG_ERR|LOG_ERRNO, "handle_missing: lstat %s", vpath );
-		return missing_exit( mname, name, wqt, SEND_FAIL );
+		return missing_exit( ms, s, wqt, SEND_FAIL );
 	}
 
 	/*directory exist already!*/
@@ -379,26 +356,26 @@ static void handle_missing( Packet *pkt )
 		{
 			msglog( MSG_ALERT, "handle_missing: " \
 				"unexpected file type %s", vpath );
-			return missing_exit( mname, name, wqt, SEND_FAIL );
+			return missing_exit( ms, s, wqt, SEND_FAIL );
 		}
 
 		/*everything is there already for us. no need to work!*/
 		if( autodir.dev != st.st_dev )
-			return missing_exit( mname, name, wqt, SEND_READY );
+			return missing_exit( ms, s, wqt, SEND_READY );
 	}
 	else if( mkdir( vpath, 0700 ) ) /*does not exist. create it.*/
 	{
 		msglog( MSG_ERR|LOG_ERRNO, "handle_missing: mkdir %s", vpath );
-		return missing_exit( mname, name, wqt, SEND_FAIL );
+		return missing_exit( ms, s, wqt, SEND_FAIL );
 	}
 
 	/*get lock file first before mounting*/
-	if( ! lockfile_create( mname ) )
+	if( ! lockfile_create( ms ) )
 	{
 		msglog( MSG_ERR, "handle_missing: could not get " \
 				"lock file for %s", mname );
 		rmdir( vpath );
-		return missing_exit( mname, name, wqt, SEND_FAIL );
+		return missing_exit( ms, s, wqt, SEND_FAIL );
 	}
 
 	/*assign some work to our module. Create real dir if it does not exist*/
@@ -407,8 +384,8 @@ static void handle_missing( Packet *pkt )
 		msglog( MSG_ALERT, "module %s failed on %s",
 					self.module_name, name );
 		rmdir( vpath );
-		lockfile_remove( mname );
-		return missing_exit( mname, name, wqt, SEND_FAIL );
+		lockfile_remove( ms );
+		return missing_exit( ms, s, wqt, SEND_FAIL );
 	}
 
 	msglog( MSG_INFO, "mounting %s on %s", rpath, vpath );
@@ -418,19 +395,22 @@ static void handle_missing( Packet *pkt )
 	{
 		msglog( MSG_ERR|LOG_ERRNO, "handle_missing: mount %s", rpath );
 		rmdir( vpath );
-		lockfile_remove( mname );
-		return missing_exit( mname, name, wqt, SEND_FAIL );
+		lockfile_remove( ms );
+		return missing_exit( ms, s, wqt, SEND_FAIL );
 	}
 
-	if( self.multi_path && ! multipath_inc( name ) )
+	if( self.multi_path && ! multipath_inc( s ) )
 	{
 		umount( vpath );
 		rmdir( vpath );
-		lockfile_remove( mname );
-		return missing_exit( mname, name, wqt, SEND_FAIL );
+		lockfile_remove( ms );
+		return missing_exit( ms, s, wqt, SEND_FAIL );
 	}
 
-	return missing_exit( mname, name, wqt, SEND_READY );
+	/*watch for writes through it*/
+	backup_mounted( s, vpath );
+
+	return missing_exit( ms, s, wqt, SEND_READY );
 }
 
 static void handle_expire( Packet *pkt )
@@ -440,6 +420,7 @@ static void handle_expire( Packet *pkt )
 	char path[ PATH_MAX+1 ];
 	struct autofs_packet_expire_multi *exppkt;
 	autofs_wqt_t wqt;
+	Session *s, *ns;
 
 	exppkt = &( pkt->ap.expire_multi );
 	wqt = exppkt->wait_queue_token;
@@ -462,7 +443,7 @@ static void handle_expire( Packet *pkt )
 	/*If we can not get lock on name, do not send error
 	  so that it does not end up as ENOENT
 	  as everything there is in right order.*/
-	if( ! workon_name( name ) )
+	if( ! ( s = session_acquire( name ) ) )
 	{
 		send_ready( wqt );
 		return;
@@ -474,18 +455,20 @@ static void handle_expire( Packet *pkt )
 
 	if( r == UMOUNT_SUCCESS )
 	{
-		/*get real path from module*/
-		mod_dir( path, sizeof(path), name );
-		lockfile_remove( name );
+		lockfile_remove( s );
 
+		/*real path is asked from module when backup starts*/
 		if( self.multi_path )
 		{
 			n = self.multi_prefix == *name ? name + 1 : name;
-			if( ! multipath_dec( n ) && ! self.stop )
-				backup_add( n, path );
+			ns = n == name ? s : session_get( n );
+			if( ns && ! multipath_dec( ns ) && ! self.stop )
+				backup_add( ns );
+			if( ns && ns != s )
+				session_put( ns );
 		}
 		else if ( ! self.stop )
-			backup_add( name, path );
+			backup_add( s );
 
 		send_ready( wqt );
 	}
@@ -494,48 +477,314 @@ static void handle_expire( Packet *pkt )
 	/*umount_dir left with incomplete state*/
 	else send_fail( wqt );
 
-	workon_release( name );
+	session_release( s );
 	return;
 }
 
-/* main loop to handle all events from autofs kernel*/
-static void handle_events( int fd )
+/*worker of name affinity mode. Packets for one name always
+  come here through the same worker, one after another*/
+static void handle_packet( Packet *pkt )
 {
-	Packet *pkt;
-	union autofs_packet_union *autopkt;
+	if( pkt->ap.hdr.type == autofs_ptype_missing )
+		handle_missing( pkt );
+	else handle_expire( pkt );
+}
 
-	while( 1 )
+/*key for selecting worker. Name is taken in the
+  same way handlers do, so that multi path names
+  go to the worker of their real name*/
+static unsigned int packet_key( Packet *pkt )
+{
+	char name[ NAME_MAX+1 ], *n = name;
+	struct autofs_packet_missing *pmis = &( pkt->ap.missing );
+	struct autofs_packet_expire_multi *exppkt = &( pkt->ap.expire_multi );
+
+	if( pkt->ap.hdr.type == autofs_ptype_missing )
+	{
+		if( pmis->len > NAME_MAX || pmis->len < 1 )
+			return 0;
+		memcpy( name, pmis->name, pmis->len );
+		name[ pmis->len ] = 0;
+	}
+	else
 	{
-		if( ! ( pkt = packet_allocate() ) )
+		if( exppkt->len > NAME_MAX || exppkt->len < 1 )
+			return 0;
+		memcpy( name, exppkt->name, exppkt->len );
+		name[ exppkt->len ] = 0;
+	}
+
+	string_safe( name, ' ' );
+	if( self.multi_path && self.multi_prefix == *n )
+		++n;
+	return string_hash( n );
+}
+
+#define EVENT_PIPE		1
+#define EVENT_SIGNAL		2
+#define EVENT_TIMER		3
+
+#define PACKET_RETRY		3	/*seconds to wait for a free packet*/
+
+#define PACKET_BATCH		64	/*max packets taken in one read*/
+
+/*packets being read from kernel pipe. The first n are
+  complete, and the next may be partially filled*/
+static struct {
+	Packet *pkts[ PACKET_BATCH ];
+	int n;
+	size_t got;
+} kread;
+
+static void event_add( int fd, int ev, uint32_t tag )
+{
+	struct epoll_event e;
+
+	e.events = ev;
+	e.data.u32 = tag;
+	if( epoll_ctl( self.epfd, EPOLL_CTL_ADD, fd, &e ) )
+		msglog( MSG_FATAL|LOG_ERRNO, "event_add: epoll_ctl" );
+}
+
+static void event_mod( int fd, int ev, uint32_t tag )
+{
+	struct epoll_event e;
+
+	e.events = ev;
+	e.data.u32 = tag;
+	if( epoll_ctl( self.epfd, EPOLL_CTL_MOD, fd, &e ) )
+		msglog( MSG_ERR|LOG_ERRNO, "event_mod: epoll_ctl" );
+}
+
+/*set up event loop. Signals are already blocked in all threads
+  so that they are only delivered through signalfd*/
+static void events_init( void )
+{
+	sigset_t set;
+
+	if( ( self.epfd = epoll_create1( EPOLL_CLOEXEC ) ) == -1 )
+		msglog( MSG_FATAL|LOG_ERRNO, "events_init: epoll_create1" );
+
+	sigfillset( &set );
+	if( ( self.sigfd = signalfd( -1, &set,
+				SFD_NONBLOCK|SFD_CLOEXEC ) ) == -1 )
+		msglog( MSG_FATAL|LOG_ERRNO, "events_init: signalfd" );
+
+	if( ( self.timerfd = timerfd_create( clockid,
+				TFD_NONBLOCK|TFD_CLOEXEC ) ) == -1 )
+		msglog( MSG_FATAL|LOG_ERRNO, "events_init: timerfd_create" );
+
+	event_add( autodir.k_pipe, EPOLLIN, EVENT_PIPE );
+	event_add( self.sigfd, EPOLLIN, EVENT_SIGNAL );
+	event_add( self.timerfd, EPOLLIN, EVENT_TIMER );
+}
+
+/*stop watching kernel pipe and retry after secs*/
+static void events_defer( int secs )
+{
+	struct itimerspec its;
+
+	memset( &its, 0, sizeof(its) );
+	its.it_value.tv_sec = secs;
+	if( timerfd_settime( self.timerfd, 0, &its, NULL ) )
+		msglog( MSG_FATAL|LOG_ERRNO, "events_defer: timerfd_settime" );
+	event_mod( autodir.k_pipe, 0, EVENT_PIPE );
+}
+
+static void events_timer( void )
+{
+	uint64_t exp;
+
+	if( read( self.timerfd, &exp, sizeof(exp) ) != sizeof(exp) )
+		return;
+	event_mod( autodir.k_pipe, EPOLLIN, EVENT_PIPE );
+}
+
+static void events_signal( void )
+{
+	struct signalfd_siginfo si;
+
+	while( read( self.sigfd, &si, sizeof(si) ) == sizeof(si) )
+	{
+		/*what is going on inside*/
+		if( si.ssi_signo == SIGUSR1 )
+			stats_dump();
+		else if( si.ssi_signo != SIGCHLD
+				&& si.ssi_signo != SIGALRM
+				&& si.ssi_signo != SIGHUP
+				&& si.ssi_signo != SIGPIPE )
 		{
-			msglog( MSG_CRIT, "handle_events: " \
-				"could not get free packet" );
-			sleep( 3 );
-			continue;
+			msglog( MSG_NOTICE, "signal received %d", si.ssi_signo );
+			self.stop = 1;
 		}
+	}
+}
 
-		autopkt = &( pkt->ap );
-		if( poll_read( autodir.k_pipe, (char *) autopkt,
-					sizeof(*autopkt) ) != 1 )
-			return;
+/*dispatch complete packets to handling threads.
+  Packets are handed over in one go per thread cache*/
+static int packet_dispatch( Packet **pkts, int n )
+{
+	Packet *missing[ PACKET_BATCH ], *expire[ PACKET_BATCH ];
+	Packet *all[ PACKET_BATCH ];
+	union autofs_packet_union *autopkt;
+	int i, nm = 0, ne = 0, na = 0, ok = 1;
+
+	for( i = 0 ; i < n ; i++ )
+	{
+		autopkt = &( pkts[ i ]->ap );
 
-		if( autopkt->hdr.proto_version != AUTODIR_PROTO_DEFAULT )
+		if( ! ok )
+			packet_free( pkts[ i ] );
+		else if( autopkt->hdr.proto_version != AUTODIR_PROTO_DEFAULT )
 		{
 			msglog( MSG_ALERT, "autofs protocol '%d' not supported",
 					autopkt->hdr.proto_version );
-			return;
+			packet_free( pkts[ i ] );
+			ok = 0;
 		}
-		if( autopkt->hdr.type == autofs_ptype_missing )
-			thread_cache_new( &self.missing_tc, pkt);
+		/*in affinity mode arrival order is kept for all packets*/
+		else if( self.affinity &&
+			( autopkt->hdr.type == autofs_ptype_missing ||
+			autopkt->hdr.type == autofs_ptype_expire_multi ) )
+			all[ na++ ] = pkts[ i ];
+		else if( autopkt->hdr.type == autofs_ptype_missing )
+			missing[ nm++ ] = pkts[ i ];
 		else if( autopkt->hdr.type == autofs_ptype_expire_multi )
-			thread_cache_new( &self.expire_tc, pkt );
+			expire[ ne++ ] = pkts[ i ];
 		else
 		{
 			msglog( MSG_ALERT, "handle_events: " \
 					"unexpected autofs packet type %d",
 					autopkt->hdr.type );
+			packet_free( pkts[ i ] );
+			ok = 0;
+		}
+	}
+
+	if( na )
+		thread_cache_new_batch( &self.worker_tc, all, na );
+	if( nm )
+		thread_cache_new_batch( &self.missing_tc, missing, nm );
+	if( ne )
+		thread_cache_new_batch( &self.expire_tc, expire, ne );
+	return ok;
+}
+
+/*hand complete packets over, and move the partial one
+  to the front. returns 0 on fatal error*/
+static int pipe_flush( void )
+{
+	int i, j, n = kread.n;
+
+	if( ! n )
+		return 1;
+	i = packet_dispatch( kread.pkts, n );
+
+	for( j = 0 ; j + n < PACKET_BATCH ; j++ )
+		kread.pkts[ j ] = kread.pkts[ j + n ];
+	for( ; j < PACKET_BATCH ; j++ )
+		kread.pkts[ j ] = NULL;
+	kread.n = 0;
+	return i;
+}
+
+/*read kernel pipe until it is drained. autofs pipe gives
+  one packet a read, so packets are gathered over reads and
+  handed over together.
+  returns 0 on fatal error*/
+static int pipe_read( int fd )
+{
+	struct iovec iov[ PACKET_BATCH ];
+	const size_t sz = sizeof(union autofs_packet_union);
+	ssize_t n;
+	int i, k;
+
+	while( ! self.stop )
+	{
+		for( i = kread.n, k = 0 ; i < PACKET_BATCH ; i++, k++ )
+		{
+			if( ! kread.pkts[ i ] &&
+				! ( kread.pkts[ i ] = packet_allocate() ) )
+				break;
+			iov[ k ].iov_base = &( kread.pkts[ i ]->ap );
+			iov[ k ].iov_len = sz;
+		}
+		if( ! k )
+		{
+			if( kread.n )
+			{
+				if( ! pipe_flush() )
+					return 0;
+				continue;
+			}
+			msglog( MSG_CRIT, "handle_events: " \
+				"could not get free packet" );
+			events_defer( PACKET_RETRY );
+			return 1;
+		}
+		iov[ 0 ].iov_base = (char *) iov[ 0 ].iov_base + kread.got;
+		iov[ 0 ].iov_len -= kread.got;
+
+		n = readv( fd, iov, k );
+		if( n == -1 )
+		{
+			if( errno == EINTR )
+				continue;
+			if( errno == EAGAIN )
+				return pipe_flush();
+			msglog( MSG_ERR|LOG_ERRNO, "pipe_read: readv" );
+			return 0;
+		}
+		if( ! n )
+		{
+			msglog( MSG_ALERT, "pipe_read: kernel pipe closed" );
+			return 0;
+		}
+
+		kread.n += ( kread.got + n ) / sz;
+		kread.got = ( kread.got + n ) % sz;
+
+		if( kread.n == PACKET_BATCH && ! pipe_flush() )
+			return 0;
+	}
+	return pipe_flush();
+}
+
+/* main loop to handle all events from autofs kernel*/
+static void handle_events( int fd )
+{
+	struct epoll_event ev[ 3 ];
+	int i, n;
+
+	events_init();
+
+	while( ! self.stop )
+	{
+		n = epoll_wait( self.epfd, ev, 3, -1 );
+		if( n == -1 )
+		{
+			if( errno == EINTR )
+				continue;
+			msglog( MSG_ERR|LOG_ERRNO, "handle_events: epoll_wait" );
 			return;
 		}
+
+		for( i = 0 ; i < n ; i++ )
+		{
+			switch( ev[ i ].data.u32 )
+			{
+				case EVENT_SIGNAL:
+					events_signal();
+					break;
+				case EVENT_TIMER:
+					events_timer();
+					break;
+				case EVENT_PIPE:
+					if( ! pipe_read( fd ) )
+						return;
+					break;
+			}
+		}
 	}
 }
 
@@ -589,33 +838,6 @@ static void write_pidfile( pid_t pid )
 	}
 }
 
-/*separate thread to handle unix signals*/
-static void *signal_handle( void *v )
-{
-        int sig;
-        sigset_t set;
-                                                                                
-	pthread_setcanceltype( PTHREAD_CANCEL_ASYNCHRONOUS, NULL );
-        sigfillset( &set );
-
-        while( 1 )
-	{
-		sig = 0;
-                sigwait( &set, &sig );
-
-		if( sig != SIGUSR1
-				&& sig != SIGCHLD
-				&& sig != SIGALRM
-				&& sig != SIGHUP
-				&& sig != SIGPIPE )
-		{
-			msglog( MSG_NOTICE, "signal received %d", sig );
-                        self.stop = 1;
-                        return NULL;
-		}
-        }
-}
-
 static void signal_block( void )
 {
         sigset_t set;
@@ -629,8 +851,12 @@ static void autodir_clean( void )
 {
 	mod_clean();
 
-	if( self.sig_th )
-		pthread_cancel( self.sig_th );
+	if( self.epfd >= 0 )
+		close( self.epfd );
+	if( self.sigfd >= 0 )
+		close( self.sigfd );
+	if( self.timerfd >= 0 )
+		close( self.timerfd );
 
 	if( autodir.ioctlfd >= 0 )
 	{
@@ -672,10 +898,8 @@ int main( int argc, char *argv[] )
 
 	thread_init();
 	packet_init();
-	workon_init();
+	session_init();
         time_mono_init();
-	if( self.multi_path )
-		multipath_init();
 
 	if( self.fg ) setpgrp(); /*stay foreground */
 	else become_daemon();
@@ -685,18 +909,30 @@ int main( int argc, char *argv[] )
 	self.pgrp = getpgrp();
 	self.shutdown = 0;
 	self.stop = 0;
-	self.sig_th = 0;
+	self.epfd = self.sigfd = self.timerfd = -1;
 
 	/*thread starting initializations
 	  should be done only after forking*/
 	backup_init();
+	module_run();
 
 	lockfile_init( self.pid, self.module_name );
 
-	/*OPTIMIZE spare threads*/
-	/*final argument defines how many cached threads to keep*/
-	thread_cache_init( &self.expire_tc, handle_expire, 100, 10 );
-	thread_cache_init( &self.missing_tc, handle_missing, 1000, 30 );
+	/*final argument defines how many worker threads to start.
+	  Unmounts are far less urgent, so they get a smaller share*/
+	if( self.affinity )
+	{
+		session_affinity();
+		thread_cache_init_keyed( &self.worker_tc, handle_packet,
+				packet_key, 256, self.n_threads );
+	}
+	else
+	{
+		thread_cache_init( &self.expire_tc, handle_expire, 128,
+				( self.n_threads + 3 ) / 4 );
+		thread_cache_init( &self.missing_tc, handle_missing, 1024,
+				self.n_threads );
+	}
 
 	write_pidfile( self.pid );
 
@@ -712,9 +948,6 @@ int main( int argc, char *argv[] )
 
 	create_dir( autodir.path , 0700 );
 
-	if( ! thread_new_joinable( signal_handle, NULL, &self.sig_th ) )
-		msglog( MSG_FATAL, "could not start signal handler thread" );
-
 	mount_autodir( autodir.path, self.pgrp, self.pid,
 			AUTODIR_PROTO_MIN, AUTODIR_PROTO_MAX );
 
@@ -747,6 +980,8 @@ int main( int argc, char *argv[] )
 	/* wait for all expiry threads to finish*/
 	thread_cache_stop( &self.missing_tc );
 
+	thread_cache_stop( &self.worker_tc );
+
 	umount_all();
 
 	if( autodir.mounted )
@@ -800,6 +1035,23 @@ void autodir_option_multipath( char ch, char *arg, int valid )
 	self.multi_path = valid ? 1 : 0;
 }
 
+#define DFLT_THREADS		64
+#define MAX_THREADS		4096
+
+void autodir_option_threads( char ch, char *arg, int valid )
+{
+	if( ! valid )
+		self.n_threads = DFLT_THREADS;
+	else if( ! string_to_number( arg, &self.n_threads ) ||
+			self.n_threads < 1 || self.n_threads > MAX_THREADS )
+		msglog( MSG_FATAL, "invalid argument for threads -%c option", ch );
+}
+
+void autodir_option_affinity( char ch, char *arg, int valid )
+{
+	self.affinity = valid ? 1 : 0;
+}
+
 #define DEFLT_MULTI_PREFIX	'.'
 
 void autodir_option_multiprefix( char ch, char *arg, int valid )
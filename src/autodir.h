@@ -43,5 +43,7 @@ void autodir_option_timeout( char ch, char *arg, int valid );
 void autodir_option_fg( char ch, char *arg, int valid );
 void autodir_option_multipath( char ch, char *arg, int valid );
 void autodir_option_multiprefix( char ch, char *arg, int valid );
+void autodir_option_threads( char ch, char *arg, int valid );
+void autodir_option_affinity( char ch, char *arg, int valid );
 
 #endif
@@ -18,12 +18,22 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#include <string.h>
 #include "msg.h"
 #include "miscfuncs.h"
 #include "backup_queue.h"
 #include "backup_child.h"
 #include "backup_argv.h"
+#include "backup_fork.h"
 #include "backup_pid.h"
+#include "backup_psi.h"
+#include "backup_cgroup.h"
+#include "backup_dev.h"
+#include "backup_batch.h"
+#include "backup_journal.h"
+#include "backup_track.h"
+#include "backup_snap.h"
+#include "backup_engine.h"
 #include "backup.h"
 
 #define DFLT_BACK_WAIT		(0)
@@ -33,6 +43,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define BACKUP_WAIT_MAX		86400 /*one day*/
 
+/*backup starts per second and how many may start at once*/
+#define DFLT_RATE		10
+#define DFLT_BURST		10
+
+#define BACKUP_WORKERS_MAX	256
+
+#define DFLT_ENGINE_THREADS	4
+
 static char *backup_path = 0;
 static int do_backup = 0;
 static int backup_wait_before = 0;
@@ -40,36 +58,96 @@ static int backup_wait2finish = 0;
 static int backup_limit = 0;
 static int backup_nokill = 0;
 static int backup_life = 0;
+static int backup_rate = DFLT_RATE;
+static int backup_burst = DFLT_BURST;
+static int backup_batch = 1;
+static int backup_batch_age = 0;
+static int backup_workers = 0;
+static char *backup_engine_dir = 0;
+static int backup_engine_threads = DFLT_ENGINE_THREADS;
 
 void backup_init( void )
 {
 	if( ! do_backup )
 		return;
+	if( backup_workers && backup_batch > 1 )
+		msglog( MSG_FATAL, "backup batches and workers " \
+				"can not be used together" );
+	if( backup_engine_dir && ( backup_path || backup_workers ||
+						backup_batch > 1 ) )
+		msglog( MSG_FATAL, "built in backup can not be used together " \
+				"with backup program, batches or workers" );
+	backup_journal_init();
+	backup_track_init();
+	backup_snap_init();
 	backup_argv_init( backup_path );
-	backup_queue_init( backup_wait_before, backup_limit );
-	backup_pid_init( backup_limit );
+	backup_cgroup_init();
+	backup_queue_init( backup_wait_before, backup_limit,
+				backup_rate, backup_burst,
+				backup_batch, backup_batch_age,
+				backup_workers, backup_engine_dir != NULL );
+	backup_pid_init();
+	backup_psi_init();
+	backup_dev_init();
 	backup_child_init( backup_limit, backup_life );
+	backup_batch_init( backup_life, backup_workers, backup_limit );
+	backup_engine_init( backup_engine_dir, backup_engine_threads,
+							backup_life );
+	backup_journal_replay();
+}
+
+void backup_add( Session *s )
+{
+	if( do_backup <= 0 )
+		return;
+
+	if( ! backup_track_needed( s ) )
+		return;
+
+	/*backup of older snapshot is out of date now. It is not
+	  waited for; new entry stays queued until it is gone*/
+	if( backup_snap_held( s ) )
+	{
+		backup_queue_remove( s );
+		backup_child_cancel( s );
+	}
+	backup_snap_take( s );
+	backup_queue_add( s );
 }
 
-void backup_add( const char *name, const char *path )
+/*name is bind mounted on vpath*/
+void backup_mounted( Session *s, const char *vpath )
 {
 	if( do_backup <= 0 )
 		return;
 
-	backup_queue_add( name, path );
+	backup_track_mount( s, vpath );
 }
 
-void backup_remove( const char *name, int force )
+void backup_remove( Session *s, int force )
 {
+	int stopped;
+
 	if( do_backup <= 0 || backup_nokill )
 		return;
 
-	backup_queue_remove( name );
+	/*backup reads snapshot, not what is mounted*/
+	if( backup_snap_held( s ) )
+		return;
+
+	stopped = backup_queue_remove( s );
 
 	if( backup_wait2finish && ! force )
-		backup_child_wait( name );
-	else
-		backup_child_kill( name );
+	{
+		if( backup_child_wait( s ) )
+			stopped = 1;
+	}
+	else if( backup_child_cancel( s ) )
+		stopped = 1;
+
+	/*what it was to save is still to be saved*/
+	if( stopped )
+		backup_track_changed( s );
 }
 
 void backup_stop_set( void )
@@ -77,6 +155,9 @@ void backup_stop_set( void )
 	if( ! do_backup )
 		return;
 	do_backup = -1;
+	backup_journal_stop_set();
+	backup_batch_stop_set();
+	backup_engine_stop_set();
 	backup_child_stop_set();
 	backup_queue_stop_set();
 }
@@ -88,7 +169,12 @@ void backup_stop( void )
 	backup_stop_set();
 
 	backup_queue_stop();
+	backup_batch_stop();
+	backup_engine_stop();
 	backup_child_stop();
+	backup_track_stop();
+	backup_snap_stop();
+	backup_journal_stop();
 }
 
 /**********command line option handling funtions***************/
@@ -156,6 +242,85 @@ void backup_option_life( char ch, char *arg, int valid )
 	else backup_life = life;
 }
 
+/*RATE[,BURST]. Rate 0 starts backups without a limit*/
+void backup_option_rate( char ch, char *arg, int valid )
+{
+	char *burst;
+
+	if( ! valid )
+		return;
+
+	if( ( burst = strchr( arg, ',' ) ) )
+		*burst++ = '\0';
+
+	if( ! string_to_number( arg, &backup_rate ) ||
+			( burst && ( ! string_to_number( burst, &backup_burst )
+				|| backup_burst < 1 ) ) )
+		msglog( MSG_FATAL, "invalid argument for -%c", ch );
+
+	/*default burst is no more than a second of starts*/
+	if( ! burst && backup_rate > 0 && backup_rate < DFLT_BURST )
+		backup_burst = backup_rate;
+}
+
+/*DIR[,THREADS]. Backups into DIR without backup program*/
+void backup_option_engine( char ch, char *arg, int valid )
+{
+	char *threads;
+
+	if( ! valid )
+		return;
+
+	if( ( threads = strchr( arg, ',' ) ) )
+		*threads++ = '\0';
+
+	if( ! check_abs_path( arg ) )
+		msglog( MSG_FATAL, "invalid argument for path -%c option", ch );
+
+	if( threads && ( ! string_to_number( threads, &backup_engine_threads )
+			|| backup_engine_threads < 1
+			|| backup_engine_threads > BACKUP_ENGINE_MAX ) )
+		msglog( MSG_FATAL, "invalid argument for -%c. " \
+				"1 to %d threads expected", ch,
+						BACKUP_ENGINE_MAX );
+
+	backup_engine_dir = arg;
+	do_backup = 1;
+}
+
+void backup_option_workers( char ch, char *arg, int valid )
+{
+	if( ! valid )
+		return;
+
+	if( ! string_to_number( arg, &backup_workers ) ||
+		backup_workers < 1 || backup_workers > BACKUP_WORKERS_MAX )
+		msglog( MSG_FATAL, "invalid argument for -%c. " \
+				"1 to %d expected", ch, BACKUP_WORKERS_MAX );
+}
+
+/*NUM[,SECS]. Names for one backup process, and how long
+  due names may wait for a batch to fill*/
+void backup_option_batch( char ch, char *arg, int valid )
+{
+	char *age;
+
+	if( ! valid )
+		return;
+
+	if( ( age = strchr( arg, ',' ) ) )
+		*age++ = '\0';
+
+	if( ! string_to_number( arg, &backup_batch ) || backup_batch < 1
+			|| backup_batch > BACKUP_BATCH_MAX )
+		msglog( MSG_FATAL, "invalid batch size for -%c. " \
+				"1 to %d expected", ch, BACKUP_BATCH_MAX );
+
+	if( age && ( ! string_to_number( age, &backup_batch_age )
+			|| backup_batch_age > BACKUP_WAIT_MAX ) )
+		msglog( MSG_FATAL, "invalid argument for -%c", ch );
+}
+
 
 
 
@@ -174,17 +339,18 @@ char *autodir_name(void)
     return "test autodir";
 }
 
-void *test_th(void *s)
+void *test_th(void *v)
 {
-    char *str = (char *) s;
+    char *str = (char *) v;
+    Session *s = session_get(str);
     int i = 0;
 
     sleep(2);
     while (1) {
 	i++;
-	backup_add(str, "/tmp");
+	backup_add(s);
 	//sleep( 1 );
-	backup_remove(str, 0);
+	backup_remove(s, 0);
 	if (i == 1000000) {
 	    printf("%s: %d\n", str, i);
 	    i = 0;
@@ -205,6 +371,7 @@ int main(void)
     backup_option_max_proc('x', "20000", 1);
     //backup_option_max_proc( 'x', "", 0 );
     //backup_option_wait2finish('x', "", 1);
+    session_init();
     backup_init();
 
     pthread_create(&id, 0, test_th, "1");
@@ -293,9 +460,10 @@ char *autodir_name(void)
     return "test autodir";
 }
 
-void *test_th(void *s)
+void *test_th(void *v)
 {
-    char *str = (char *) s;
+    char *str = (char *) v;
+    Session *s;
     int i = 0;
     int r;
     char buf[200];
@@ -305,9 +473,9 @@ void *test_th(void *s)
 	i++;
 	r = rand() % 1000;
 	snprintf(buf, sizeof(buf), "%s%d", str, r);
-	workon_name(buf);
-	backup_add(buf, "/tmp");
-	workon_release(buf);
+	s = session_acquire(buf);
+	backup_add(s);
+	session_release(s);
 	//sleep(1);
 	if (i == 1000000) {
 	    printf("ADD %s: %d\n", str, i);
@@ -317,9 +485,10 @@ void *test_th(void *s)
     }
 }
 
-void *test_th2(void *s)
+void *test_th2(void *v)
 {
-    char *str = (char *) s;
+    char *str = (char *) v;
+    Session *s;
     int i = 0;
     int r;
     char buf[200];
@@ -330,9 +499,9 @@ void *test_th2(void *s)
 	r = rand() % 1000;
 	snprintf(buf, sizeof(buf), "%s%d", str, r);
 	//sleep(1);
-	workon_name(buf);
-	backup_remove(buf, 1);
-	workon_release(buf);
+	s = session_acquire(buf);
+	backup_remove(s, 1);
+	session_release(s);
 	if (i == 1000000) {
 	    printf("REMOVE....................... %s: %d\n", str, i);
 	    i = 0;
@@ -341,9 +510,10 @@ void *test_th2(void *s)
     }
 }
 
-void *test_th3(void *s)
+void *test_th3(void *v)
 {
-    char *str = (char *) s;
+    char *str = (char *) v;
+    Session *s;
     int i = 0;
     int r;
     char buf[200];
@@ -354,9 +524,9 @@ void *test_th3(void *s)
 	r = rand() % 1000;
 	snprintf(buf, sizeof(buf), "%s%d", str, r);
 	//sleep(1);
-	workon_name(buf);
-	backup_remove(buf, 0);
-	workon_release(buf);
+	s = session_acquire(buf);
+	backup_remove(s, 0);
+	session_release(s);
 	if (i == 1000000) {
 	    printf("REMOVE2........................ %s: %d\n", str, i);
 	    i = 0;
@@ -375,7 +545,7 @@ int main(void)
     msg_console_on();
     backup_option_path('x', strdup("/home/devel/testautodir/backup"), 1);
     backup_option_max_proc('x', "20000", 1);
-    workon_init();
+    session_init();
     backup_option_wait2finish('x', "", 1);
     backup_init();
 
@@ -21,9 +21,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef _BACKUP_H_INCLUDED_
 #define _BACKUP_H_INCLUDED_
 
+#include "session.h"
+
 void backup_init( void );
-void backup_add( const char *name, const char *path );
-void backup_remove( const char *name, int force );
+void backup_add( Session *s );
+void backup_mounted( Session *s, const char *vpath );
+void backup_remove( Session *s, int force );
 void backup_stop( void );
 void backup_stop_set( void );
 
@@ -33,5 +36,9 @@ void backup_option_wait2finish( char ch, char *arg, int valid );
 void backup_option_nokill( char ch, char *arg, int valid );
 void backup_option_max_proc( char ch, char *arg, int valid );
 void backup_option_life( char ch, char *arg, int valid );
+void backup_option_rate( char ch, char *arg, int valid );
+void backup_option_batch( char ch, char *arg, int valid );
+void backup_option_workers( char ch, char *arg, int valid );
+void backup_option_engine( char ch, char *arg, int valid );
 
 #endif
@@ -141,8 +141,8 @@ static int backarg_expand( char *buf, const int len, const char *fmt,
 }
 
 /*
- Expected to be called from
- child process for prepaining argv vector
+ Prepares argv vector in the parent before spawning.
+ Free with backup_argv_free
 */
 int backup_argv_get( const char *name, const char *path, char ***argv )
 {
@@ -155,15 +155,15 @@ int backup_argv_get( const char *name, const char *path, char ***argv )
 	ct = time( NULL );
 	if( ! localtime_r( &ct, &tm ) )
 	{
-		fprintf( stderr, "backarg_get_argv: localtime_r error\n" );
+		msglog( MSG_ERR, "backup_argv_get: localtime_r error" );
 		return 0;
 	}
 
-	av = (char **) malloc( sizeof(char *) * ( barg_list.count + 1) );
+	av = (char **) calloc( barg_list.count + 1, sizeof(char *) );
 	if( ! av )
 	{
-		fprintf( stderr, "backarg_get_argv: malloc: " \
-				"could not allocate memory\n" );
+		msglog( MSG_ALERT, "backup_argv_get: calloc: " \
+				"could not allocate memory" );
 		return 0;
 	}
 
@@ -178,16 +178,18 @@ int backup_argv_get( const char *name, const char *path, char ***argv )
 					arg->arg, name, path, hostname, &tm );
 			if( ! ret )
 			{
-				fprintf( stderr, "backarg_get_argv: " \
-						"could not expand back args\n");
+				msglog( MSG_ERR, "backup_argv_get: " \
+					"could not expand backup args" );
+				backup_argv_free( av );
 				return 0;
 			}
 
 			av[ i ] = strdup( arg_buf );
 			if( ! av[ i ] )
 			{
-				fprintf( stderr, "backarg_get_argv: strdup: " \
-						"could not allocate memory\n");
+				msglog( MSG_ALERT, "backup_argv_get: strdup: " \
+						"could not allocate memory" );
+				backup_argv_free( av );
 				return 0;
 			}
 		}
@@ -198,6 +200,22 @@ int backup_argv_get( const char *name, const char *path, char ***argv )
 	return 1;
 }
 
+/*only expanded arguments are our own copies*/
+void backup_argv_free( char **argv )
+{
+	Barg *arg;
+	int i;
+
+	arg = barg_list.start;
+	for( i = 0 ; i < barg_list.count && argv[ i ] ; i++ )
+	{
+		if( arg->type == ARG_DYNAMIC )
+			free( argv[ i ] );
+		arg = arg->next;
+	}
+	free( argv );
+}
+
 /*before termination*/
 static void backarg_clean( void )
 {
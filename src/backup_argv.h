@@ -24,5 +24,6 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 void backup_argv_init( char *bopt );
 int backup_argv_get( const char *name, const char *path, char ***argv );
+void backup_argv_free( char **argv );
 
 #endif
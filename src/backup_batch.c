@@ -0,0 +1,705 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* one backup process for many names.
+
+   Names and real paths are written to stdin of the process
+   as NAME NUL PATH NUL pairs, and an empty NAME ends the
+   list. Names coming back while their backup is on are
+   written after that as NAME NUL, asking the process to
+   skip or stop them. Process tells on descriptor 3 when it
+   is done with a name, as NAME NUL STATUS NUL.
+
+   Each batch is looked after by a thread of its own, which
+   is left once the process is reaped.
+
+   Workers are batches whose process stays to take more
+   names, and is started again if it goes away. Jobs are
+   NAME NUL PATH NUL as above, and cancellation of a job is
+   NAME NUL NUL. There is no end of list.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include "msg.h"
+#include "miscfuncs.h"
+#include "thread.h"
+#include "time_mono.h"
+#include "backup_fork.h"
+#include "backup_child.h"
+#include "backup_batch.h"
+#include "backup_snap.h"
+#include "backup_queue.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open		434
+#endif
+
+#define KILL_GRACE		1	/*secs between SIGTERM and SIGKILL*/
+#define WORKER_RESPAWN		1	/*secs. least time between starts*/
+#define RESULT_MAX		( NAME_MAX + 64 )
+
+enum { KILL_NONE = 0, KILL_TERM, KILL_KILL };
+
+typedef struct backup_batch {
+	pid_t pid;
+	int pidfd;	/*-1 if none. Then EOF on res_fd tells exit*/
+	int in_fd;	/*stdin of process*/
+	int res_fd;	/*descriptor 3 of process*/
+	int wake_fd;	/*cancellation asked*/
+	char label[ 32 ];
+	time_t started;
+	int worker;	/*takes jobs while running*/
+	int running;	/*process is there to write to*/
+
+	pthread_mutex_t lock;	/*for items and cancel*/
+	int n;
+	Backup_pid **items;	/*NULL once done*/
+	char *cancel;		/*asked. 2 when written*/
+	int pending;		/*asked and not written yet*/
+	int jobs;		/*names in items*/
+
+	/*still to be written to stdin*/
+	char *out;
+	size_t out_len;
+	size_t out_off;
+	size_t out_size;
+
+	char res[ RESULT_MAX ];	/*result record being read*/
+	size_t res_len;
+
+	struct backup_batch *next;
+	struct backup_batch *prev;
+} Backup_batch;
+
+static struct {
+	int life;	/*backup life in secs. 0 for no limit*/
+	int stop;
+	unsigned long seq;
+
+	pthread_mutex_t lock;
+	pthread_cond_t gone;	/*a batch is over*/
+	Backup_batch *active;
+
+	Backup_batch **workers;
+	int n_workers;
+} BB;
+
+static int out_add( Backup_batch *b, const char *str )
+{
+	size_t len = strlen( str ) + 1;
+	char *tmp;
+
+	if( b->out_len + len > b->out_size )
+	{
+		if( ! ( tmp = realloc( b->out, ( b->out_len + len ) * 2 ) ) )
+		{
+			msglog( MSG_ALERT, "backup_batch: could not " \
+						"allocate memory" );
+			return 0;
+		}
+		b->out = tmp;
+		b->out_size = ( b->out_len + len ) * 2;
+	}
+	memcpy( b->out + b->out_len, str, len );
+	b->out_len += len;
+	return 1;
+}
+
+static Backup_batch *batch_alloc( int n )
+{
+	Backup_batch *b;
+
+	if( ! ( b = calloc( 1, sizeof(*b) ) ) ||
+			! ( b->items = calloc( n, sizeof(*b->items) ) ) ||
+			! ( b->cancel = calloc( n, 1 ) ) )
+	{
+		if( b )
+			free( b->items );
+		free( b );
+		msglog( MSG_ALERT, "backup_batch: could not allocate memory" );
+		return NULL;
+	}
+	b->pid = -1;
+	b->pidfd = b->in_fd = b->res_fd = b->wake_fd = -1;
+	thread_mutex_init( &b->lock );
+	return b;
+}
+
+static void batch_free( Backup_batch *b )
+{
+	if( b->pidfd >= 0 ) close( b->pidfd );
+	if( b->in_fd >= 0 ) close( b->in_fd );
+	if( b->res_fd >= 0 ) close( b->res_fd );
+	if( b->wake_fd >= 0 ) close( b->wake_fd );
+	pthread_mutex_destroy( &b->lock );
+	free( b->out );
+	free( b->cancel );
+	free( b->items );
+	free( b );
+}
+
+/*name is over. Anyone waiting for it goes on*/
+static void item_done( Backup_batch *b, int i, const char *status )
+{
+	Backup_pid *bp;
+
+	pthread_mutex_lock( &b->lock );
+	if( ( bp = b->items[ i ] ) )
+		b->jobs--;
+	b->items[ i ] = NULL;
+	/*slot may take another job of a worker*/
+	if( b->cancel[ i ] == 1 )
+		b->pending--;
+	b->cancel[ i ] = 0;
+	pthread_mutex_unlock( &b->lock );
+	if( ! bp )
+		return;
+
+	if( status )
+		msglog( MSG_INFO, "backup for %s in %s finished with %s",
+					bp->s->name, b->label, status );
+	else
+		msglog( MSG_NOTICE, "backup for %s in %s gave no result",
+					bp->s->name, b->label );
+	backup_child_item_done( bp );
+}
+
+static void batch_unlink( Backup_batch *b )
+{
+	pthread_mutex_lock( &BB.lock );
+	if( b->prev ) b->prev->next = b->next;
+	else if( BB.active == b ) BB.active = b->next;
+	if( b->next ) b->next->prev = b->prev;
+	pthread_cond_broadcast( &BB.gone );
+	pthread_mutex_unlock( &BB.lock );
+}
+
+/*process is reaped or never started*/
+static void batch_finish( Backup_batch *b )
+{
+	int i;
+
+	for( i = 0; i < b->n; i++ )
+		item_done( b, i, NULL );
+	batch_unlink( b );
+	batch_free( b );
+}
+
+/*cancellations asked go after list*/
+static void batch_cancel_out( Backup_batch *b )
+{
+	int i;
+
+	pthread_mutex_lock( &b->lock );
+	for( i = 0; b->pending && i < b->n; i++ )
+		if( b->cancel[ i ] == 1 )
+		{
+			b->cancel[ i ] = 2;
+			b->pending--;
+			if( b->items[ i ] && b->in_fd >= 0 &&
+				out_add( b, b->items[ i ]->s->name ) &&
+								b->worker )
+				out_add( b, "" );
+		}
+	pthread_mutex_unlock( &b->lock );
+}
+
+/*lock is held, as workers get jobs from other threads*/
+static void batch_write( Backup_batch *b )
+{
+	ssize_t r;
+
+	pthread_mutex_lock( &b->lock );
+	r = write( b->in_fd, b->out + b->out_off, b->out_len - b->out_off );
+	if( r < 0 )
+	{
+		if( errno == EAGAIN || errno == EINTR )
+		{
+			pthread_mutex_unlock( &b->lock );
+			return;
+		}
+		/*process does not read any more*/
+		if( errno != EPIPE )
+			msglog( MSG_ERR|LOG_ERRNO, "backup_batch: write" );
+		close( b->in_fd );
+		b->in_fd = -1;
+		b->running = 0;	/*no more jobs for a worker*/
+		r = b->out_len - b->out_off;
+	}
+	if( ( b->out_off += r ) == b->out_len )
+		b->out_off = b->out_len = 0;
+	pthread_mutex_unlock( &b->lock );
+}
+
+static void batch_result( Backup_batch *b, const char *name,
+						const char *status )
+{
+	int i;
+
+	for( i = 0; i < b->n; i++ )
+	{
+		pthread_mutex_lock( &b->lock );
+		if( b->items[ i ] && ! strcmp( b->items[ i ]->s->name, name ) )
+		{
+			pthread_mutex_unlock( &b->lock );
+			item_done( b, i, status );
+			return;
+		}
+		pthread_mutex_unlock( &b->lock );
+	}
+	msglog( MSG_NOTICE, "%s: result for unknown name %s",
+						b->label, name );
+}
+
+/*returns 0 at EOF, -1 if nothing to read now*/
+static int batch_read( Backup_batch *b )
+{
+	char buf[ 4096 ], *status;
+	ssize_t r;
+	int i;
+
+	if( ( r = read( b->res_fd, buf, sizeof(buf) ) ) < 0 )
+	{
+		if( errno != EAGAIN && errno != EINTR )
+		{
+			msglog( MSG_ERR|LOG_ERRNO, "backup_batch: read" );
+			return 0;
+		}
+		return -1;
+	}
+	for( i = 0; i < r; i++ )
+	{
+		if( b->res_len == sizeof(b->res) )
+		{
+			msglog( MSG_NOTICE, "%s: result record too long",
+								b->label );
+			b->res_len = 0;
+		}
+		b->res[ b->res_len++ ] = buf[ i ];
+		if( buf[ i ] )
+			continue;
+
+		/*record is complete with second NUL*/
+		status = memchr( b->res, '\0', b->res_len );
+		if( status + 1 == b->res + b->res_len )
+			continue;
+		batch_result( b, b->res, status + 1 );
+		b->res_len = 0;
+	}
+	return r > 0;
+}
+
+/*process with stdin and descriptor 3 to us*/
+static int batch_spawn( Backup_batch *b )
+{
+	int in[ 2 ], res[ 2 ];
+	int i;
+
+	in[ 0 ] = in[ 1 ] = res[ 0 ] = res[ 1 ] = -1;
+	if( pipe2( in, O_CLOEXEC ) || pipe2( res, O_CLOEXEC ) ||
+		( b->wake_fd < 0 && ( b->wake_fd =
+			eventfd( 0, EFD_CLOEXEC|EFD_NONBLOCK ) ) < 0 ) )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "backup_batch: could not " \
+					"start %s", b->label );
+		goto err;
+	}
+	fcntl( in[ 1 ], F_SETFL, O_NONBLOCK );
+	if( ( b->pid = backup_fork_batch( b->label, in[ 0 ], res[ 1 ] ) ) <= 0 )
+		goto err;
+	close( in[ 0 ] );
+	close( res[ 1 ] );
+	b->res_fd = res[ 0 ];
+	b->started = time_mono();
+	if( ( b->pidfd = syscall( SYS_pidfd_open, b->pid, 0 ) ) < 0
+						&& errno != ENOSYS )
+		msglog( MSG_ERR|LOG_ERRNO, "pidfd_open %ld for %s",
+						(long) b->pid, b->label );
+
+	pthread_mutex_lock( &b->lock );
+	b->in_fd = in[ 1 ];
+	b->running = 1;
+	pthread_mutex_unlock( &b->lock );
+	return 1;
+
+err:
+	for( i = 0; i < 2; i++ )
+	{
+		if( in[ i ] >= 0 ) close( in[ i ] );
+		if( res[ i ] >= 0 ) close( res[ i ] );
+	}
+	return 0;
+}
+
+static void batch_active( Backup_batch *b )
+{
+	pthread_mutex_lock( &BB.lock );
+	b->prev = NULL;
+	if( ( b->next = BB.active ) )
+		BB.active->prev = b;
+	BB.active = b;
+	pthread_mutex_unlock( &BB.lock );
+}
+
+/*process is there till it is reaped here*/
+static void batch_run( Backup_batch *b )
+{
+	struct pollfd pfd[ 4 ];
+	time_t now, due;
+	int kill = KILL_NONE;
+	int timeout;
+	uint64_t val;
+
+	due = BB.life && ! b->worker ? b->started + BB.life : 0;
+
+	while( b->res_fd >= 0 )
+	{
+		now = time_mono();
+		if( BB.stop && kill == KILL_NONE )
+			due = now;
+		if( due && now >= due )
+		{
+			if( kill == KILL_NONE )
+			{
+				backup_soft_signal( b->pid );
+				kill = KILL_TERM;
+			}
+			else
+			{
+				backup_hard_signal( b->pid );
+				kill = KILL_KILL;
+			}
+			due = now + KILL_GRACE;
+		}
+		batch_cancel_out( b );
+
+		pfd[ 0 ].fd = b->res_fd;
+		pfd[ 0 ].events = POLLIN;
+		pfd[ 1 ].fd = b->wake_fd;
+		pfd[ 1 ].events = POLLIN;
+		pfd[ 2 ].fd = b->in_fd;
+		pfd[ 2 ].events = b->out_len ? POLLOUT : 0;
+		pfd[ 3 ].fd = b->pidfd;
+		pfd[ 3 ].events = POLLIN;
+		timeout = due ? ( due - now ) * 1000 : -1;
+
+		if( poll( pfd, 4, timeout ) < 0 )
+		{
+			if( errno != EINTR )
+			{
+				msglog( MSG_ERR|LOG_ERRNO, "backup_batch: poll" );
+				sleep( 1 );
+			}
+			continue;
+		}
+		if( pfd[ 1 ].revents & POLLIN )
+			if( read( b->wake_fd, &val, sizeof(val) ) < 0 )
+				msglog( MSG_ERR|LOG_ERRNO, "backup_batch: read" );
+		if( pfd[ 2 ].revents && b->out_len )
+			batch_write( b );
+
+		/*descendants may keep descriptor 3 open after
+		  process exits. What is there is read and no more*/
+		if( pfd[ 3 ].revents & POLLIN )
+		{
+			fcntl( b->res_fd, F_SETFL, O_NONBLOCK );
+			while( batch_read( b ) > 0 );
+		}
+		else if( ! pfd[ 0 ].revents || batch_read( b ) )
+			continue;
+		close( b->res_fd );
+		b->res_fd = -1;
+	}
+
+	pthread_mutex_lock( &b->lock );
+	b->running = 0;
+	b->out_len = b->out_off = 0;
+	b->res_len = 0;
+	if( b->in_fd >= 0 )
+		close( b->in_fd );
+	b->in_fd = -1;
+	pthread_mutex_unlock( &b->lock );
+	if( b->pidfd >= 0 )
+		close( b->pidfd );
+	b->pidfd = -1;
+
+	backup_waitpid( b->pid, b->label, 1 );
+}
+
+static void *batch_thread( void *x )
+{
+	Backup_batch *b = x;
+
+	batch_run( b );
+	batch_finish( b );
+	return x;
+}
+
+/*worker process is started here, not by the thread setting
+  up workers. Jobs left by a process gone are not done again*/
+static void *worker_thread( void *x )
+{
+	Backup_batch *b = x;
+	int i;
+
+	while( 1 )
+	{
+		while( ! BB.stop && ! batch_spawn( b ) )
+			sleep( WORKER_RESPAWN );
+		if( BB.stop )
+			break;
+		/*jobs waiting for a worker*/
+		backup_queue_wake();
+
+		batch_run( b );
+		for( i = 0; i < b->n; i++ )
+			item_done( b, i, NULL );
+		if( BB.stop )
+			break;
+
+		/*not to go round fast with a broken worker*/
+		if( time_mono() - b->started < WORKER_RESPAWN )
+			sleep( WORKER_RESPAWN );
+	}
+
+	/*queue may still look at workers. They stay till exit*/
+	batch_unlink( b );
+	return x;
+}
+
+/*a batch can be asked to stop any of its names. Called
+  while name is still in batch*/
+void backup_batch_cancel( Backup_pid *bp )
+{
+	Backup_batch *b = bp->batch;
+	uint64_t val = 1;
+	int i;
+
+	pthread_mutex_lock( &b->lock );
+	for( i = 0; i < b->n; i++ )
+		if( b->items[ i ] == bp && ! b->cancel[ i ] )
+		{
+			b->cancel[ i ] = 1;
+			b->pending++;
+		}
+	pthread_mutex_unlock( &b->lock );
+
+	if( write( b->wake_fd, &val, sizeof(val) ) < 0 )
+		msglog( MSG_ERR|LOG_ERRNO, "backup_batch_cancel: write" );
+}
+
+/*Starts one backup process for names given. Names which
+  have a backup running already are left out, and set to
+  NULL in s. Device slots go with names started, or are
+  given back. Returns number of names started*/
+int backup_batch_start( Session **s, Backup_dev **dev, int n )
+{
+	char path[ PATH_MAX + 1 ];
+	Backup_batch *b;
+	Backup_pid *bp;
+	int i, started;
+
+	if( ! ( b = batch_alloc( n ) ) )
+	{
+		for( i = 0; i < n; i++ )
+		{
+			backup_dev_put( dev[ i ] );
+			s[ i ] = NULL;
+		}
+		return 0;
+	}
+	snprintf( b->label, sizeof(b->label), "batch-%lu",
+			__atomic_add_fetch( &BB.seq, 1, __ATOMIC_RELAXED ) );
+
+	for( i = 0; i < n; i++ )
+	{
+		if( ! ( bp = backup_child_item_add( s[ i ], dev[ i ], b ) ) )
+		{
+			backup_dev_put( dev[ i ] );
+			s[ i ] = NULL;
+			continue;
+		}
+		b->items[ b->n++ ] = bp;
+		b->jobs++;
+		backup_snap_path( s[ i ], path, sizeof(path) );
+		out_add( b, s[ i ]->name );
+		out_add( b, path );
+	}
+	out_add( b, "" );
+
+	if( ! b->n )
+	{
+		batch_free( b );
+		return 0;
+	}
+
+	msglog( MSG_INFO, "starting %s with %d names", b->label, b->n );
+	if( ! batch_spawn( b ) )
+	{
+		for( i = 0; i < b->n; i++ )
+			item_done( b, i, "not started" );
+		batch_free( b );
+		return 0;
+	}
+	batch_active( b );
+
+	/*batch may be gone soon after its thread starts*/
+	started = b->n;
+	if( ! thread_new( batch_thread, b, NULL ) )
+	{
+		backup_fast_kill( b->pid, b->label );
+		batch_finish( b );
+		return 0;
+	}
+	return started;
+}
+
+/*job for worker with fewest jobs. Device slot goes with
+  job when taken. Returns -1 if no worker has room for it
+  now, and 0 if it can not be given at all*/
+int backup_worker_start( Session *s, Backup_dev *dev )
+{
+	char path[ PATH_MAX + 1 ];
+	Backup_batch *b, *w = NULL;
+	Backup_pid *bp;
+	uint64_t val = 1;
+	size_t len;
+	int i, ok;
+
+	for( i = 0; i < BB.n_workers; i++ )
+	{
+		b = BB.workers[ i ];
+		if( b->running && b->jobs < b->n && ( ! w || b->jobs < w->jobs ) )
+			w = b;
+	}
+	if( BB.stop )
+		return 0;
+	if( ! w )
+		return -1;
+	if( ! ( bp = backup_child_item_add( s, dev, w ) ) )
+		return 0;
+
+	backup_snap_path( s, path, sizeof(path) );
+	pthread_mutex_lock( &w->lock );
+	len = w->out_len;
+	if( ! ( w->running && w->jobs < w->n ) )
+		ok = -1;
+	else if( out_add( w, s->name ) && out_add( w, path ) )
+	{
+		for( i = 0; w->items[ i ]; i++ );
+		w->items[ i ] = bp;
+		w->jobs++;
+		ok = 1;
+	}
+	else
+	{
+		w->out_len = len;
+		ok = 0;
+	}
+	pthread_mutex_unlock( &w->lock );
+
+	/*worker went away meanwhile. Caller keeps device slot*/
+	if( ok <= 0 )
+	{
+		bp->dev = NULL;
+		backup_child_item_done( bp );
+		return ok;
+	}
+
+	msglog( MSG_INFO, "backup for %s given to %s", s->name, w->label );
+	if( write( w->wake_fd, &val, sizeof(val) ) < 0 )
+		msglog( MSG_ERR|LOG_ERRNO, "backup_worker_start: write" );
+	return 1;
+}
+
+static void backup_worker_init( int n, int jobs )
+{
+	Backup_batch *b;
+	int i;
+
+	if( ! ( BB.workers = calloc( n, sizeof(*BB.workers) ) ) )
+		msglog( MSG_FATAL, "backup_worker_init: could not " \
+					"allocate memory" );
+	for( i = 0; i < n; i++ )
+	{
+		if( ! ( b = batch_alloc( jobs ) ) )
+			msglog( MSG_FATAL, "backup_worker_init: could not " \
+						"allocate memory" );
+		b->worker = 1;
+		b->n = jobs;
+		snprintf( b->label, sizeof(b->label), "worker-%d", i + 1 );
+		msglog( MSG_INFO, "starting %s", b->label );
+		batch_active( b );
+		BB.workers[ BB.n_workers++ ] = b;
+		if( ! thread_new( worker_thread, b, NULL ) )
+			msglog( MSG_FATAL, "backup_worker_init: could not " \
+						"start new thread" );
+	}
+}
+
+void backup_batch_stop_set( void )
+{
+	Backup_batch *b;
+	uint64_t val = 1;
+
+	pthread_mutex_lock( &BB.lock );
+	BB.stop = 1;
+	for( b = BB.active; b; b = b->next )
+		if( write( b->wake_fd, &val, sizeof(val) ) < 0 )
+			msglog( MSG_ERR|LOG_ERRNO, "backup_batch: write" );
+	pthread_mutex_unlock( &BB.lock );
+}
+
+/*batch threads signal their processes and reap them*/
+void backup_batch_stop( void )
+{
+	backup_batch_stop_set();
+	pthread_mutex_lock( &BB.lock );
+	while( BB.active )
+		pthread_cond_wait( &BB.gone, &BB.lock );
+	pthread_mutex_unlock( &BB.lock );
+}
+
+/*workers are started here, each taking up to jobs names*/
+void backup_batch_init( int blife, int workers, int jobs )
+{
+	BB.life = blife;
+	BB.stop = 0;
+	BB.active = NULL;
+	thread_mutex_init( &BB.lock );
+	thread_cond_init( &BB.gone );
+
+	if( workers > 0 )
+		backup_worker_init( workers, jobs );
+}
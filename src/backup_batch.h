@@ -0,0 +1,38 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _BACKUP_BATCH_H_INCLUDED_
+#define _BACKUP_BATCH_H_INCLUDED_
+
+#include "session.h"
+#include "backup_dev.h"
+#include "backup_pid.h"
+
+/*names given to one backup process at most*/
+#define BACKUP_BATCH_MAX	256
+
+void backup_batch_init( int blife, int workers, int jobs );
+int backup_batch_start( Session **s, Backup_dev **dev, int n );
+int backup_worker_start( Session *s, Backup_dev *dev );
+void backup_batch_cancel( Backup_pid *bp );
+void backup_batch_stop_set( void );
+void backup_batch_stop( void );
+
+#endif
@@ -0,0 +1,276 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* cgroup v2 placement of backups.
+
+   Every backup gets a leaf group of its own under one
+   subtree, so that io, cpu and memory of all backups are
+   limited together by the subtree weights, while io done
+   by each one can be read back from its leaf when reaped.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include "msg.h"
+#include "miscfuncs.h"
+#include "backup_cgroup.h"
+
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC	0x63677270
+#endif
+
+#define WEIGHT_MIN		1
+#define WEIGHT_MAX		10000
+
+#define LEAF_PREFIX		"backup-"
+#define CONTROLLERS		"+io +cpu +memory"
+
+static struct {
+	char *path;	/*subtree. NULL when not used*/
+	int io_weight;	/*0 leaves it as it is*/
+	int cpu_weight;
+	char *memory_high;
+} cg;
+
+static int cg_write( const char *dir, const char *file, const char *val )
+{
+	char path[ PATH_MAX + 1 ];
+	int fd, ok;
+
+	snprintf( path, sizeof(path), "%s/%s", dir, file );
+	if( ( fd = open( path, O_WRONLY|O_CLOEXEC ) ) == -1 )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "open %s", path );
+		return 0;
+	}
+	if( ! ( ok = write_all( fd, val, strlen( val ) ) ) )
+		msglog( MSG_ERR|LOG_ERRNO, "could not write '%s' to %s",
+								val, path );
+	close( fd );
+	return ok;
+}
+
+static void cg_leaf( char *buf, int len, const char *name )
+{
+	snprintf( buf, len, "%s/" LEAF_PREFIX "%s", cg.path, name );
+}
+
+/*leaf group for backup of name. Returns descriptor of its
+  cgroup.procs, which backup process writes itself to before
+  exec, so that all it starts is in group too. -1 if none*/
+int backup_cgroup_open( const char *name )
+{
+	char path[ PATH_MAX + sizeof("/cgroup.procs") ];
+	int fd;
+
+	if( ! cg.path )
+		return -1;
+
+	cg_leaf( path, PATH_MAX + 1, name );
+
+	/*previous one may be left over by descendants of a backup*/
+	if( mkdir( path, 0755 ) == -1 && errno != EEXIST )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "mkdir %s", path );
+		return -1;
+	}
+	strcat( path, "/cgroup.procs" );
+	if( ( fd = open( path, O_WRONLY|O_CLOEXEC ) ) == -1 )
+		msglog( MSG_ERR|LOG_ERRNO, "open %s", path );
+	return fd;
+}
+
+/*sum of bytes over all devices*/
+static void cg_io_stat( const char *name,
+		unsigned long long *rbytes, unsigned long long *wbytes )
+{
+	char path[ PATH_MAX + 1 ];
+	char line[ 512 ];
+	char *p;
+	FILE *fp;
+
+	*rbytes = *wbytes = 0;
+	snprintf( path, sizeof(path), "%s/" LEAF_PREFIX "%s/io.stat",
+							cg.path, name );
+	if( ! ( fp = fopen( path, "r" ) ) )
+		return;
+	while( fgets( line, sizeof(line), fp ) )
+	{
+		if( ( p = strstr( line, " rbytes=" ) ) )
+			*rbytes += strtoull( p + 8, NULL, 10 );
+		if( ( p = strstr( line, " wbytes=" ) ) )
+			*wbytes += strtoull( p + 8, NULL, 10 );
+	}
+	fclose( fp );
+}
+
+/*backup is reaped. Tell how much io it did and drop its group*/
+void backup_cgroup_release( const char *name )
+{
+	char path[ PATH_MAX + 1 ];
+	unsigned long long rbytes, wbytes;
+
+	if( ! cg.path )
+		return;
+
+	cg_io_stat( name, &rbytes, &wbytes );
+	msglog( MSG_INFO, "backup for %s read %llu bytes, wrote %llu bytes",
+						name, rbytes, wbytes );
+
+	cg_leaf( path, sizeof(path), name );
+	/*descendants still running are left alone. Group is
+	  used again for next backup of the name*/
+	if( rmdir( path ) == -1 && errno != ENOENT )
+		msglog( MSG_NOTICE|LOG_ERRNO, "rmdir %s", path );
+}
+
+static void backup_cgroup_clean( void )
+{
+	rmdir( cg.path );
+}
+
+void backup_cgroup_init( void )
+{
+	char parent[ PATH_MAX + 1 ];
+	char val[ 64 ];
+	struct statfs sf;
+	char *slash;
+
+	if( ! cg.path )
+		return;
+
+	if( ! create_dir( cg.path, 0755 ) )
+		msglog( MSG_FATAL, "could not create cgroup %s", cg.path );
+	if( statfs( cg.path, &sf ) == -1 )
+		msglog( MSG_FATAL|LOG_ERRNO, "statfs %s", cg.path );
+	if( sf.f_type != CGROUP2_SUPER_MAGIC )
+		msglog( MSG_FATAL, "%s is not in a cgroup v2 hierarchy",
+								cg.path );
+
+	/*weights of subtree need controllers from its parent.
+	  They may be there already, so failure is not fatal*/
+	string_n_copy( parent, cg.path, sizeof(parent) );
+	if( ( slash = strrchr( parent, '/' ) ) && slash != parent )
+	{
+		*slash = '\0';
+		cg_write( parent, "cgroup.subtree_control", CONTROLLERS );
+	}
+	/*for io.stat of each leaf*/
+	cg_write( cg.path, "cgroup.subtree_control", CONTROLLERS );
+
+	if( cg.io_weight )
+	{
+		snprintf( val, sizeof(val), "default %d", cg.io_weight );
+		cg_write( cg.path, "io.weight", val );
+	}
+	if( cg.cpu_weight )
+	{
+		snprintf( val, sizeof(val), "%d", cg.cpu_weight );
+		cg_write( cg.path, "cpu.weight", val );
+	}
+	if( cg.memory_high )
+		cg_write( cg.path, "memory.high", cg.memory_high );
+
+	if( atexit( backup_cgroup_clean ) )
+		msglog( MSG_FATAL, "backup_cgroup_init: " \
+				"could not register cleanup method" );
+}
+
+/**********command line option handling funtions***************/
+
+static int weight_option_check( char *value, const char *name )
+{
+	int w;
+
+	if( ! value || ! string_to_number( value, &w )
+			|| w < WEIGHT_MIN || w > WEIGHT_MAX )
+		msglog( MSG_FATAL, "invalid value for cgroup suboption %s",
+								name );
+	return w;
+}
+
+/*path=PATH,io=WEIGHT,cpu=WEIGHT,memory=BYTES*/
+void backup_cgroup_option( char ch, char *arg, int valid )
+{
+	char *value;
+
+	enum {
+		PATH_IDX = 0,
+		IO_IDX,
+		CPU_IDX,
+		MEMORY_IDX,
+		END
+	};
+
+	char *const sos[] = {
+		[ PATH_IDX   ] = "path",
+		[ IO_IDX     ] = "io",
+		[ CPU_IDX    ] = "cpu",
+		[ MEMORY_IDX ] = "memory",
+		[ END        ] = NULL
+	};
+
+	if( ! valid )
+		return;
+
+	while( *arg != 0 )
+	{
+		switch( getsubopt( &arg, sos, &value ) )
+		{
+			case PATH_IDX:
+				if( ! value || ! check_abs_path( value ) )
+					msglog( MSG_FATAL, "absolute path " \
+						"expected for cgroup path" );
+				cg.path = value;
+				break;
+
+			case IO_IDX:
+				cg.io_weight = weight_option_check( value,
+							sos[ IO_IDX ] );
+				break;
+
+			case CPU_IDX:
+				cg.cpu_weight = weight_option_check( value,
+							sos[ CPU_IDX ] );
+				break;
+
+			case MEMORY_IDX:
+				if( ! value || ! *value )
+					msglog( MSG_FATAL, "invalid value for " \
+						"cgroup suboption memory" );
+				cg.memory_high = value;
+				break;
+
+			default:
+				msglog( MSG_FATAL, "unknown cgroup " \
+						"suboption %s", value );
+		}
+	}
+	if( ! cg.path )
+		msglog( MSG_FATAL, "path suboption required for -%c", ch );
+}
@@ -19,109 +19,170 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include "thread.h"
 #include "msg.h"
 #include "miscfuncs.h"
 #include "time_mono.h"
+#include "module.h"
 #include "backup_pid.h"
 #include "backup_child.h"
 
 #ifdef TEST
-extern void backup_kill( pid_t pid, const char *name );
 extern int backup_waitpid(pid_t pid, const char *name, int block);
+extern void backup_soft_signal( pid_t pid );
+extern void backup_hard_signal( pid_t pid );
+extern void backup_fast_kill( pid_t pid, const char *name );
+extern void backup_batch_cancel( Backup_pid *bp );
+extern void backup_journal_started( Session *s );
+extern void backup_journal_finished( Session *s );
+extern void backup_snap_path( Session *s, char *path, int size );
+extern void backup_snap_done( Session *s );
+extern void backup_queue_wake( void );
 #else
 #include "backup_fork.h"
+#include "backup_batch.h"
+#include "backup_journal.h"
+#include "backup_snap.h"
+#include "backup_queue.h"
 #endif
 
-static Backup_pid **hash;
-static int hash_size;
-static int hash_used;
-static pthread_mutex_t hash_lock;
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open		434
+#endif
+
+#define MONITOR_EVENTS		64
+#define MONITOR_SCAN		1	/*secs. for backups without pidfd*/
+#define CANCEL_GRACE		1	/*secs between SIGTERM and SIGKILL*/
+#define CHILD_WAIT_MAX		300	/*secs a mount waits without backup life*/
+
+/*backup cancellation stages in kill*/
+#define KILL_NONE		0
+#define KILL_TERM		1
+#define KILL_KILL		2
+
+/*running backups in time order. Every entry in a list waits
+  the same period, so the first one is always due first*/
+typedef struct blist {
+	Backup_pid *start_t;
+	Backup_pid *end_t;
+	time_t period;
+} Blist;
+
+/*running backup of a name hangs on its session*/
+static int child_used;
+static pthread_mutex_t child_lock;
 static pthread_t backup_monitor_th;
 static int stop;
-static int backup_life;
 
-#define entry_key( s )		( (s) % hash_size )
+/*backup exits are waited with epoll on pidfds.
+  Only monitor thread reaps backups*/
+static int child_epfd = -1;
+static int child_wakefd = -1;
 
-#define ENTRY_LOCATE( name, h, dptr )				\
-do {								\
-	dptr = &( hash[ entry_key( h ) ] );			\
-	while( *dptr ) 						\
-	{							\
-		if( (*dptr)->hash == h && 			\
-			*name == (*dptr)->name[0] &&		\
-		       	! strcmp( name, (*dptr)->name ) ) 	\
-			break; 					\
-		dptr = &( (*dptr)->next ); 			\
-	} 							\
-} while( 0 )
+/*Under child_lock*/
+static Blist life;	/*running. due when life time is over*/
+static Blist cancel;	/*signalled. due when SIGKILL is next*/
+static int child_nofd;	/*backups to be looked for by scanning*/
 
-#if 0
-static int backup_child_add( const char *name, pid_t pid )
+static void blist_append( Blist *l, Backup_pid *bp, time_t stamp )
 {
-	unsigned int h;
-	Backup_pid **dptr, *new_ent, *ent;
+	bp->due = stamp + l->period;
+	bp->on = l;
+	bp->next_t = NULL;
+	bp->prev_t = l->end_t;
+	if( l->end_t )
+		l->end_t->next_t = bp;
+	else
+		l->start_t = bp;
+	l->end_t = bp;
+}
 
-	if( pid < 0 )
-		return 0;
+static void blist_unlink( Backup_pid *bp )
+{
+	Blist *l;
 
-	/*PERFORMANCE:
-	we allocate in advance. in almost all cases we
-	need new entry to be added.*/
-	new_ent = backup_pidmem_allocate();
-	if( ! new_ent )
-	{
-		msglog( MSG_ALERT, "backup_child: " \
-				"could not allocate memory" );
-		return 0;
-	}
+	if( ! ( l = bp->on ) )
+		return;
 
-	h = string_hash( name );
-	string_n_copy( new_ent->name, name, sizeof(new_ent->name) );
-	new_ent->hash = h;
-	new_ent->next = NULL;
+	if( bp->prev_t ) bp->prev_t->next_t = bp->next_t;
+	else l->start_t = bp->next_t;
+	if( bp->next_t ) bp->next_t->prev_t = bp->prev_t;
+	else l->end_t = bp->prev_t;
 
-	/*Now the actual part*/
- 	pthread_mutex_lock( &hash_lock );
-	ENTRY_LOCATE( name, h, dptr );
-	ent = *dptr;
-	if( ent ) /*entry exists*/
+	bp->next_t = bp->prev_t = NULL;
+	bp->on = NULL;
+}
+
+static void monitor_wake( void )
+{
+	uint64_t val = 1;
+
+	if( write( child_wakefd, &val, sizeof(val) ) < 0 )
+		msglog( MSG_ERR|LOG_ERRNO, "backup_child: write" );
+}
+
+static int pidfd_open( pid_t pid )
+{
+	return syscall( SYS_pidfd_open, pid, 0 );
+}
+
+/*let monitor know when backup exits. Without pidfd
+  (old kernels), monitor looks for it from time to time*/
+static void child_watch( Backup_pid *bp )
+{
+	struct epoll_event ev;
+
+	if( bp->pidfd >= 0 )
 	{
-		pthread_mutex_unlock( &hash_lock );
-		/*we need to free new entry allocated above*/
-		backup_pidmem_free( new_ent );
-		msglog( MSG_ALERT, "backup_child: already exists" );
-		return 0;
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = bp;
+		if( ! epoll_ctl( child_epfd, EPOLL_CTL_ADD, bp->pidfd, &ev ) )
+			return;
+		msglog( MSG_ERR|LOG_ERRNO, "backup_child: epoll_ctl" );
+		close( bp->pidfd );
+		bp->pidfd = -1;
 	}
+	child_nofd++;
+}
 
-	(*dptr) = new_ent;
-	hash_used++;
-	new_ent->pid = pid;
-	pthread_mutex_unlock( &hash_lock );
-	return 1;
+/*Mutual exclusion should be in effect. Newly first entry
+  of a list means monitor may be sleeping too long*/
+static void child_due( Blist *l, Backup_pid *bp, time_t stamp )
+{
+	blist_unlink( bp );
+	if( l->period <= 0 )
+		return;
+	blist_append( l, bp, stamp );
+	if( l->start_t == bp )
+		monitor_wake();
 }
-#endif
 
-static int backup_child_add( const char *name, pid_t pid, time_t started )
+static int backup_child_add( Session *s, pid_t pid, Backup_dev *dev )
 {
-	unsigned int h;
-	Backup_pid **dptr, *new_ent, *ent;
+	Backup_pid *new_ent;
 
 	if( pid < 0 )
 		return 0;
-	h = string_hash( name );
-	started = time_mono();
+
+	/*running backup keeps session alive*/
+	session_hold( s );
 
 	/*Now the actual part*/
- 	pthread_mutex_lock( &hash_lock );
-	ENTRY_LOCATE( name, h, dptr );
-	ent = *dptr;
-	if( ent ) /*entry exists*/
+ 	pthread_mutex_lock( &child_lock );
+	if( s->bp ) /*entry exists*/
 	{
-		pthread_mutex_unlock( &hash_lock );
+		pthread_mutex_unlock( &child_lock );
+		session_put( s );
 		return 0;
 	}
 
@@ -129,285 +190,395 @@ static int backup_child_add( const char *name, pid_t pid, time_t started )
 
 	if( ! new_ent )
 	{
-		pthread_mutex_unlock( &hash_lock );
+		pthread_mutex_unlock( &child_lock );
+		session_put( s );
 		msglog( MSG_ALERT, "backup_child: " \
 				"could not allocate memory" );
 		return 0;
 	}
 
-	string_n_copy( new_ent->name, name, sizeof(new_ent->name) );
-	new_ent->hash = h;
-	new_ent->started = started;
+	new_ent->s = s;
+	new_ent->started = time_mono();
 	new_ent->pid = pid;
+	new_ent->dev = dev;
 	new_ent->next = NULL;
-	(*dptr) = new_ent;
-	hash_used++;
-	pthread_mutex_unlock( &hash_lock );
+	if( ( new_ent->pidfd = pidfd_open( pid ) ) < 0 && errno != ENOSYS )
+		msglog( MSG_ERR|LOG_ERRNO, "pidfd_open %ld for %s",
+							(long) pid, s->name );
+	s->bp = new_ent;
+	backup_journal_started( s );
+	child_due( &life, new_ent, new_ent->started );
+	child_watch( new_ent );
+	child_used++;
+
+	/*monitor may be sleeping without a timeout*/
+	if( new_ent->pidfd < 0 && child_nofd == 1 )
+		monitor_wake();
+	pthread_mutex_unlock( &child_lock );
 	return 1;
 }
 
-static pid_t get_pid( const char *name, Backup_pid **id, int mark_kill )
+/*backup is gone. Wake up whoever waits for it*/
+static void remove_pid( Backup_pid *bp )
 {
-	unsigned int h;
-	Backup_pid **dptr, *bp;
-	pid_t pid;
-
-	h = string_hash( name );
+	Session *s = bp->s;
+	int waiting;
 
- 	pthread_mutex_lock( &hash_lock );
-	ENTRY_LOCATE( name, h, dptr );
-	if( ( bp = *dptr ) ) /*entry exists*/
+ 	pthread_mutex_lock( &child_lock );
+	if( s->bp == bp ) /*must exist*/
 	{
+		s->bp = NULL;
+		backup_journal_finished( s );
+		blist_unlink( bp );
+		if( bp->pidfd < 0 && ! bp->batch && ! bp->engine )
+			child_nofd--;
+		child_used--;
+		pthread_mutex_unlock( &child_lock );
+		backup_dev_put( bp->dev );
+		backup_snap_done( s );
+
 		pthread_mutex_lock( &bp->lock );
-		pthread_mutex_unlock( &hash_lock );
-		pid = bp->pid;
-		if( pid > 0 )
+		bp->done = 1;
+		if( ( waiting = bp->waiting ) )
+			pthread_cond_broadcast( &bp->wait );
+		pthread_mutex_unlock( &bp->lock );
+
+		/*last waiter frees otherwise*/
+		if( ! waiting )
+			backup_pidmem_free( bp );
+		session_put( s );
+
+		/*room for one more, and name may be backed up again*/
+		backup_queue_wake();
+		return;
+	}
+ 	pthread_mutex_unlock( &child_lock );
+}
+
+/*next step of cancellation. Mutual exclusion should be in
+  effect. Process group is signalled only while backup is
+  not reaped, so that pid cannot belong to someone else*/
+static void child_signal( Backup_pid *bp, time_t now )
+{
+	pthread_mutex_lock( &bp->lock );
+	if( bp->pid > 0 )
+	{
+		if( bp->kill == KILL_NONE )
 		{
-			bp->pid = 0;
-			pthread_mutex_unlock( &bp->lock );
-			*id = bp;
-			return pid;
+			backup_soft_signal( bp->pid );
+			bp->kill = KILL_TERM;
 		}
-		if( mark_kill )
-			bp->kill = 1;
-		/*pid taken by someone else. so wait until 
-		  they do work for us and cleanup if we are 
-		  the last one to hold this memory*/
-		bp->waiting++;
-		pthread_cond_wait( &bp->wait, &bp->lock );
-		bp->waiting--;
-		if( bp->waiting == 0 )
+		else
 		{
-			pthread_mutex_unlock( &bp->lock );
-			/*we do not call backup_child_delete because,
-			  found_wait signaled by that funtion itself.
-			  Calling it again does not make sense.*/
-			backup_pidmem_free( bp );
-			return 0;
+			/*keep on until it is gone*/
+			backup_hard_signal( bp->pid );
+			bp->kill = KILL_KILL;
 		}
-		pthread_mutex_unlock( &bp->lock );
-		return 0;
 	}
- 	pthread_mutex_unlock( &hash_lock );
-	return 0;
+	pthread_mutex_unlock( &bp->lock );
+	child_due( &cancel, bp, now );
 }
 
-#define PTR_LOCATE( bp, dptr )					\
-do {								\
-	dptr = &( hash[ entry_key( bp->hash ) ] );		\
-	while( *dptr ) 						\
-	{							\
-		if( (*dptr) == bp )				\
-			break; 					\
-		dptr = &( (*dptr)->next ); 			\
-	} 							\
-} while( 0 )
+/*backup exited. Entry is not freed until monitor
+  reclaims it, so it is safe to look at*/
+static void child_exited( Backup_pid *bp )
+{
+	pid_t pid;
 
-static void remove_pid( Backup_pid *bp )
+	pthread_mutex_lock( &bp->lock );
+	if( ( pid = bp->pid ) > 0 )
+		bp->pid = 0;
+	pthread_mutex_unlock( &bp->lock );
+	if( pid <= 0 )
+		return;
+
+	backup_waitpid( pid, bp->s->name, 0 );
+	remove_pid( bp );
+}
+
+/*backups without pidfd. Exit is checked without reaping,
+  so that it is reaped only through child_exited*/
+static void child_scan_list( Blist *l, Backup_pid **found, int *n )
 {
-	Backup_pid **dptr;
+	Backup_pid *bp;
+	siginfo_t si;
+	pid_t pid;
 
- 	pthread_mutex_lock( &hash_lock );
-	PTR_LOCATE( bp, dptr );
-	if( *dptr ) /*must exist*/
+	for( bp = l->start_t; bp && *n < MONITOR_EVENTS; bp = bp->next_t )
 	{
-		(*dptr) = bp->next;
-		hash_used--;
-		pthread_mutex_unlock( &hash_lock );
-
-		/*this locking/unlocking will make sure 
-		  no one is on back of us*/
+		if( bp->pidfd >= 0 )
+			continue;
 		pthread_mutex_lock( &bp->lock );
+		pid = bp->pid;
 		pthread_mutex_unlock( &bp->lock );
+		if( pid <= 0 )
+			continue;
 
-		if( bp->waiting )
-		{
-			pthread_cond_broadcast( &bp->wait );
-			return;
-		}
-		backup_pidmem_free( bp );
-		return;
+		si.si_pid = 0;
+		if( ! waitid( P_PID, pid, &si, WEXITED|WNOHANG|WNOWAIT )
+				&& si.si_pid )
+			found[ (*n)++ ] = bp;
 	}
- 	pthread_mutex_unlock( &hash_lock );
 }
 
-static pid_t wait_pid( pid_t pid, Backup_pid *bp )
+static void child_scan( void )
 {
-	pthread_mutex_lock( &bp->lock );
-	if( ! bp->kill )
-	{
-		bp->pid = pid;
-		bp->waiting++;
-		pthread_cond_wait( &bp->wait, &bp->lock );
-		bp->waiting--;
-		if( bp->waiting == 0 )
-		{
-			pthread_mutex_unlock( &bp->lock );
-			/*we do not call backup_child_delete because,
-			  found_wait signaled by that funtion itself.
-			  Calling it again does not make sense.*/
-			backup_pidmem_free( bp );
-			return 0;
-		}
-		pthread_mutex_unlock( &bp->lock );
+	Backup_pid *found[ MONITOR_EVENTS ];
+	int n = 0;
+	int i;
+
+	pthread_mutex_lock( &child_lock );
+	child_scan_list( &life, found, &n );
+	child_scan_list( &cancel, found, &n );
+	pthread_mutex_unlock( &child_lock );
+
+	for( i = 0 ; i < n ; i++ )
+		child_exited( found[ i ] );
+}
+
+/*first entry of list due? Returns milliseconds until
+  it is due otherwise, or -1 if list is empty*/
+static int blist_wait( Blist *l, time_t now )
+{
+	if( ! l->start_t )
+		return -1;
+	if( l->start_t->due <= now )
 		return 0;
+	return ( l->start_t->due - now ) * 1000;
+}
+
+/*backups running longer than their life and backups not
+  gone after signalled are taken to next step of cancellation.
+  Returns milliseconds until next one is due*/
+static int child_expire( void )
+{
+	Backup_pid *bp;
+	time_t now;
+	int lw, cw;
+
+	pthread_mutex_lock( &child_lock );
+	now = time_mono();
+	while( ( lw = blist_wait( &life, now ) ) == 0 )
+	{
+		bp = life.start_t;
+		msglog( MSG_INFO, "backup timedout for %s", bp->s->name );
+		child_signal( bp, now );
 	}
-	pthread_mutex_unlock( &bp->lock );
-	return pid;
+	while( ( cw = blist_wait( &cancel, now ) ) == 0 )
+		child_signal( cancel.start_t, now );
+	pthread_mutex_unlock( &child_lock );
+
+	if( lw < 0 || ( cw >= 0 && cw < lw ) )
+		return cw;
+	return lw;
 }
 
 static void *backup_monitor_thread( void *x )
 {
-	Backup_pids *pids;
-	int i = 0;
-	pid_t pid = 0;
-	Backup_pid *bp;
-	time_t now = 0;
+	struct epoll_event ev[ MONITOR_EVENTS ];
+	time_t last_scan = 0;
+	uint64_t val;
+	int timeout;
+	int n, i;
 
-	sleep (1);
+	while( ! stop )
+	{
+		timeout = child_expire();
+		if( child_nofd && ( timeout < 0
+				|| timeout > MONITOR_SCAN * 1000 ) )
+			timeout = MONITOR_SCAN * 1000;
 
-	while (1) {
-		pids = backup_pids_get();
-		if( pids->count == 0 )
+		n = epoll_wait( child_epfd, ev, MONITOR_EVENTS, timeout );
+		if( n < 0 && errno != EINTR )
 		{
-			backup_pids_unget(pids);
-			if( stop )
-				pthread_exit( NULL );
-			sleep( 2 );
-			continue;
+			msglog( MSG_ERR|LOG_ERRNO, "backup_monitor: epoll_wait" );
+			sleep( 1 );
 		}
-		if( backup_life > 0 )
-			now = time_mono();
-		for( i = 0; i < pids->size; i++ )
+
+		for( i = 0 ; i < n ; i++ )
+		{
+			if( ev[ i ].data.ptr )
+				child_exited( ev[ i ].data.ptr );
+			else if( read( child_wakefd, &val, sizeof(val) ) < 0 )
+				msglog( MSG_ERR|LOG_ERRNO, "backup_monitor: read" );
+		}
+
+		if( child_nofd && time_mono() - last_scan >= MONITOR_SCAN )
 		{
-			if( stop ) {
-				backup_pids_unget(pids);
-				pthread_exit( NULL );
-			}
-
-			if( ( bp = pids->s[ i ] ) == 0 )
-				continue;
-			if( bp->pid <= 0 )
-				continue;
-
-			if( pthread_mutex_trylock( &bp->lock ) )
-				continue;
-			pid = bp->pid;
-			if( pid > 0 )
-				bp->pid = 0;
-			pthread_mutex_unlock( &bp->lock );
-			if( pid <= 0 )
-				continue;
-
-			if( backup_life > 0 &&
-					now - bp->started > backup_life )
-			{
-				msglog( MSG_INFO, "backup timedout for %s",
-								bp->name );
-				backup_kill( pid, bp->name );
-			}
-			else if( backup_waitpid( pid, bp->name, 0 ) <= 0 )
-			{
-				pthread_mutex_lock( &bp->lock );
-				if( ! bp->kill )
-				{
-					bp->pid = pid;
-					pthread_mutex_unlock( &bp->lock );
-					continue;
-				}
-				pthread_mutex_unlock( &bp->lock );
-				backup_kill( pid, bp->name );
-			}
-			remove_pid( bp );
+			child_scan();
+			last_scan = time_mono();
 		}
-		backup_pids_unget( pids );
-		if( stop )
-			pthread_exit( NULL );
-		sleep( 2 );
+
+		/*no events pending for released entries now*/
+		backup_pidmem_reclaim();
 	}
+	return x;
 }
 
-#if 0
-int backup_child_running( const char *name )
+/*Does not wait. Backup gets SIGTERM now and SIGKILL
+  later from monitor if it is still there. Returns 1
+  if name had a backup not yet done*/
+int backup_child_cancel( Session *s )
 {
-	unsigned int h;
-	Backup_pid **dptr;
+	Backup_pid *bp;
 	int ret;
 
-	h = string_hash( name );
-
- 	pthread_mutex_lock( &hash_lock );
-	ENTRY_LOCATE( name, h, dptr );
-	ret = *dptr ? 1 : 0;
- 	pthread_mutex_unlock( &hash_lock );
+	pthread_mutex_lock( &child_lock );
+	ret = s->bp ? 1 : 0;
+	if( ( bp = s->bp ) && bp->kill == KILL_NONE )
+	{
+		msglog( MSG_INFO, "cancelling backup for %s", s->name );
+		if( bp->batch )
+		{
+			/*others in batch go on*/
+			backup_batch_cancel( bp );
+			bp->kill = KILL_TERM;
+		}
+		/*engine looks for it*/
+		else if( bp->engine )
+			__atomic_store_n( &bp->kill, KILL_TERM, __ATOMIC_RELAXED );
+		else child_signal( bp, time_mono() );
+	}
+	pthread_mutex_unlock( &child_lock );
 	return ret;
 }
-#endif
 
-void backup_child_kill( const char *name )
+/*wait for backup to finish. With backup life, no longer than
+  what is left of it and the grace after; without, CHILD_WAIT_MAX.
+  Backup still there then is cancelled, and 1 returned*/
+int backup_child_wait( Session *s )
 {
+	struct timespec ts;
 	Backup_pid *bp;
-	pid_t pid;
+	time_t secs;
+	int last, timedout;
 
-	pid = get_pid( name, &bp, 1 );
-	if( pid == 0 )
-		return;
-	backup_kill( pid, name );
-	remove_pid( bp );
+	pthread_mutex_lock( &child_lock );
+	if( ! ( bp = s->bp ) )
+	{
+		pthread_mutex_unlock( &child_lock );
+		return 0;
+	}
+	if( ! bp->on )
+		secs = CHILD_WAIT_MAX;
+	else if( ( secs = bp->due - time_mono() ) < 0 )
+		secs = 2 * CANCEL_GRACE;
+	else secs += 2 * CANCEL_GRACE;
+	pthread_mutex_lock( &bp->lock );
+	pthread_mutex_unlock( &child_lock );
+
+	thread_cond_timespec( &ts, secs );
+	bp->waiting++;
+	while( ! bp->done )
+		if( pthread_cond_timedwait( &bp->wait, &bp->lock,
+						&ts ) == ETIMEDOUT )
+			break;
+	timedout = ! bp->done;
+	/*backup not done frees it when it is*/
+	last = ( --bp->waiting == 0 ) && ! timedout;
+	pthread_mutex_unlock( &bp->lock );
+
+	if( last )
+		backup_pidmem_free( bp );
+	if( ! timedout )
+		return 0;
+
+	msglog( MSG_NOTICE, "backup of %s still running after %ld secs",
+						s->name, (long) secs );
+	backup_child_cancel( s );
+	return 1;
+}
+
+/*only a hint for the queue. Changed under child_lock*/
+int backup_child_count( void )
+{
+	return __atomic_load_n( &child_used, __ATOMIC_RELAXED );
 }
 
-void backup_child_wait( const char *name )
+/*name is part of a batch. Its process is looked after
+  by batch, which says when name is done. Without batch,
+  backup runs in engine, which does the same*/
+Backup_pid *backup_child_item_add( Session *s, Backup_dev *dev,
+					struct backup_batch *batch )
 {
-	Backup_pid *bp;
-	pid_t pid;
+	Backup_pid *new_ent;
 
-	pid = get_pid( name, &bp, 0 );
-	if( pid == 0 )
-		return;
-	if( backup_waitpid( pid, name, 0 ) <= 0 )
+	session_hold( s );
+ 	pthread_mutex_lock( &child_lock );
+	if( s->bp || ! ( new_ent = backup_pidmem_allocate() ) )
 	{
-		if( ( pid = wait_pid( pid, bp ) ) == 0 )
-			return;
-		backup_kill( pid, name );
+		pthread_mutex_unlock( &child_lock );
+		session_put( s );
+		return NULL;
 	}
-	remove_pid( bp );
+	new_ent->s = s;
+	new_ent->started = time_mono();
+	new_ent->pid = 0;
+	new_ent->dev = dev;
+	new_ent->batch = batch;
+	new_ent->engine = ! batch;
+	s->bp = new_ent;
+	backup_journal_started( s );
+	child_used++;
+	pthread_mutex_unlock( &child_lock );
+	return new_ent;
 }
 
-int backup_child_count( void )
+void backup_child_item_done( Backup_pid *bp )
 {
-	int ret;
+	remove_pid( bp );
+}
 
-	if( pthread_mutex_trylock( &hash_lock ) )
-		return -1;
-	ret = hash_used;
-	pthread_mutex_unlock( &hash_lock );
-	return (ret);
+/*backup running in engine is to stop*/
+int backup_child_cancelled( Backup_pid *bp )
+{
+	return __atomic_load_n( &bp->kill, __ATOMIC_RELAXED ) != KILL_NONE;
 }
 
-void backup_child_start(const char *name, const char *path)
+/*device slot is kept until backup is reaped when started.
+  Caller gives it back otherwise*/
+int backup_child_start( Session *s, Backup_dev *dev )
 {
+	char path[ PATH_MAX+1 ];
 	pid_t pid;
 
-	pid = backup_fork_new( name, path );
-	if( pid <= 0 )
-		return;
-	if( backup_child_add( name, pid, time_mono() ) == 0 )
-		backup_kill( pid, name );
+	/*previous one still on its way out*/
+	if( s->bp )
+		return 0;
+
+	/*real path of the name, or its snapshot*/
+	backup_snap_path( s, path, sizeof(path) );
+
+	pid = backup_fork_new( s->name, path );
+	if( pid > 0 && backup_child_add( s, pid, dev ) == 0 )
+		backup_fast_kill( pid, s->name );
+	else if( pid > 0 )
+		return 1;
+	backup_snap_done( s );
+	return 0;
 }
 
 void backup_child_init( int size, int blife )
 {
-	hash = ( Backup_pid ** ) calloc( size, sizeof(Backup_pid *) );
-
-	if( ! hash )
-		msglog( MSG_FATAL, "backup_child_init: " \
-			"could not allocate hash table" );
+	struct epoll_event ev;
 
 	stop = 0;
-	hash_used = 0;
-	hash_size = size;
-        thread_mutex_init( &hash_lock );
-	backup_life = blife > 0 ? blife : 0;
+	child_used = 0;
+        thread_mutex_init( &child_lock );
+	memset( &life, 0, sizeof(life) );
+	memset( &cancel, 0, sizeof(cancel) );
+	life.period = blife > 0 ? blife : 0;
+	cancel.period = CANCEL_GRACE;
+	child_nofd = 0;
+
+	if( ( child_epfd = epoll_create1( EPOLL_CLOEXEC ) ) < 0 )
+		msglog( MSG_FATAL|LOG_ERRNO, "backup_child_init: epoll_create" );
+	if( ( child_wakefd = eventfd( 0, EFD_NONBLOCK|EFD_CLOEXEC ) ) < 0 )
+		msglog( MSG_FATAL|LOG_ERRNO, "backup_child_init: eventfd" );
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if( epoll_ctl( child_epfd, EPOLL_CTL_ADD, child_wakefd, &ev ) )
+		msglog( MSG_FATAL|LOG_ERRNO, "backup_child_init: epoll_ctl" );
 
 	if( ! thread_new_joinable( backup_monitor_thread, NULL,
 						    &backup_monitor_th ) )
@@ -418,61 +589,61 @@ void backup_child_init( int size, int blife )
 void backup_child_stop_set( void )
 {
 	stop = 1;
+	monitor_wake();
+}
+
+static void backup_signal_one( Session *s, void *unused )
+{
+	Backup_pid *bp;
+
+	if( ! ( bp = s->bp ) )
+		return;
+	pthread_mutex_lock( &bp->lock );
+	if( bp->pid > 0 )
+		backup_soft_signal( bp->pid );
+	pthread_mutex_unlock( &bp->lock );
 }
 
 static void backup_signal_all( void )
 {
-	int i;
-	Backup_pid *bp, **dptr;
+	pthread_mutex_lock( &child_lock );
+	session_foreach( backup_signal_one, NULL );
+	pthread_mutex_unlock( &child_lock );
+}
 
-	pthread_mutex_lock( &hash_lock );
-	for( i = 0; i < hash_size; i++ )
+/*monitor is gone. Nobody else will reap them*/
+static void backup_kill_one( Session *s, void *unused )
+{
+	Backup_pid *bp;
+
+	if( ! ( bp = s->bp ) )
+		return;
+	pthread_mutex_lock( &bp->lock );
+	if( bp->pid > 0 )
 	{
-		for( dptr = &hash[ i ]; *dptr; )
-		{
-			bp = *dptr;
-			dptr = &bp->next;
-			pthread_mutex_lock( &bp->lock );
-			if( bp->pid > 0 )
-				backup_soft_signal( bp->pid );
-			pthread_mutex_unlock( &bp->lock );
-		}
+		backup_fast_kill( bp->pid, s->name );
+		bp->pid = 0;
 	}
-	pthread_mutex_unlock( &hash_lock );
+	bp->done = 1;
+	pthread_cond_broadcast( &bp->wait );
+	pthread_mutex_unlock( &bp->lock );
 }
 
 static void backup_kill_all( void )
 {
-	int i;
-	Backup_pid *bp, **dptr;
-
-	pthread_mutex_lock( &hash_lock );
-	for( i = 0; i < hash_size; i++ )
-	{
-		for( dptr = &hash[ i ]; *dptr; )
-		{
-			bp = *dptr;
-			dptr = &bp->next;
-			pthread_mutex_lock( &bp->lock );
-			if( bp->pid > 0 )
-			{
-				backup_fast_kill( bp->pid, bp->name );
-				bp->pid = 0;
-				pthread_cond_broadcast( &bp->wait );
-			}
-			pthread_mutex_unlock( &bp->lock );
-		}
-	}
-	pthread_mutex_unlock( &hash_lock );
+	pthread_mutex_lock( &child_lock );
+	session_foreach( backup_kill_one, NULL );
+	pthread_mutex_unlock( &child_lock );
 }
 
 void backup_child_stop( void )
 {
-	stop = 1;
+	backup_child_stop_set();
 	pthread_join( backup_monitor_th, NULL );
 	backup_signal_all();
 	sleep( 1 );
 	backup_kill_all();
+	backup_pidmem_reclaim();
 }
 
 
@@ -488,14 +659,53 @@ void backup_child_stop( void )
 
 
 
+
 #ifdef TEST
 
 #include "backup_argv.h"
 
-void backup_kill( pid_t pid, const char *name )
+void backup_soft_signal( pid_t pid )
+{
+	//printf("term %lu\n", (long) pid);
+}
+
+void backup_hard_signal( pid_t pid )
+{
+	//printf("kill %lu\n", (long) pid);
+}
+
+void backup_fast_kill( pid_t pid, const char *name )
 {
 	//printf("kill %lu, name = %s\n", (long) pid, name);
-	//sleep( 3 );
+}
+
+void backup_batch_cancel( Backup_pid *bp )
+{
+}
+
+void backup_journal_started( Session *s )
+{
+}
+
+void backup_journal_finished( Session *s )
+{
+}
+
+void backup_snap_path( Session *s, char *path, int size )
+{
+	mod_dir( path, size, s->name );
+}
+
+void backup_snap_done( Session *s )
+{
+}
+
+void backup_dev_put( Backup_dev *d )
+{
+}
+
+void backup_queue_wake( void )
+{
 }
 
 int backup_waitpid(pid_t pid, const char *name, int block)
@@ -505,6 +715,13 @@ int backup_waitpid(pid_t pid, const char *name, int block)
 	return rand()%2;
 }
 
+static void test_dir( char *buf, int len, const char *name )
+{
+    snprintf(buf, len, "/tmp/%s", name);
+}
+
+void (*mod_dir)( char *, int , const char * ) = test_dir;
+
 pid_t backup_fork_new( const char *name, const char *path)
 {
 	//printf("fork name = %s\n", name);
@@ -519,15 +736,16 @@ char *autodir_name(void)
     return "test autodir";
 }
 
-void *test_th(void *s)
+void *test_th(void *v)
 {
-    char *str = (char *) s;
+    char *str = (char *) v;
+    Session *s = session_get(str);
     int i = 0;
 
     sleep(2);
     while (1) {
 	i++;
-	backup_child_start(str, "/tmp");
+	backup_child_start(s, NULL);
 	//backup_child_kill(str);
 	if (i == 1000000) {
 	    printf("KILL %s: %d\n", str, i);
@@ -537,15 +755,16 @@ void *test_th(void *s)
     }
 }
 
-void *test_th2(void *s)
+void *test_th2(void *v)
 {
-    char *str = (char *) s;
+    char *str = (char *) v;
+    Session *s = session_get(str);
     int i = 0;
 
     sleep(2);
     while (1) {
 	i++;
-	backup_child_wait(str);
+	backup_child_wait(s);
 	//backup_child_kill(str);
 	if (i == 1000000) {
 	    printf("WAIT %s: %d\n", str, i);
@@ -563,8 +782,9 @@ int main(void)
     msg_option_verbose('x', "", 1);
     msg_init();
     msg_console_on();
+    session_init();
     backup_argv_init(strdup("/home/devel/testautodir/backup"));
-    backup_pid_init(20000);
+    backup_pid_init();
     backup_child_init(20000, 0);
 
     pthread_create(&id, 0, test_th, "1");
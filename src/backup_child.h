@@ -21,14 +21,19 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef _BACKUP_CHILD_H_INCLUDED_
 #define _BACKUP_CHILD_H_INCLUDED_
 
+#include "session.h"
+#include "backup_dev.h"
+#include "backup_pid.h"
+
 void backup_child_init( int size, int blife );
-void backup_child_start( const char *name, const char *path );
-void backup_child_wait( const char *name );
-void backup_child_kill( const char *name );
+int backup_child_start( Session *s, Backup_dev *dev );
+Backup_pid *backup_child_item_add( Session *s, Backup_dev *dev,
+					struct backup_batch *batch );
+void backup_child_item_done( Backup_pid *bp );
+int backup_child_cancelled( Backup_pid *bp );
+int backup_child_wait( Session *s );
+int backup_child_cancel( Session *s );
 int backup_child_count( void );
-#if 0
-int backup_child_running( const char *name );
-#endif
 void backup_child_stop( void );
 void backup_child_stop_set( void );
 
@@ -0,0 +1,230 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* backup concurrency per device.
+
+   Backups of names on one disk compete for the same heads,
+   while other disks may be idle. Each device real paths are
+   on gets its own limit, and the queue passes over entries
+   of a busy device to start those of others.
+
+   Devices are few and never go away, so they are kept in
+   a small table which is only added to.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "msg.h"
+#include "miscfuncs.h"
+#include "thread.h"
+#include "stats.h"
+#include "module.h"
+#include "backup_dev.h"
+#include "backup_queue.h"
+
+/*given on command line as PATH=NUM. Device is known at init*/
+typedef struct {
+	const char *path;
+	int limit;
+} Dev_override;
+
+static struct {
+	int limit;	/*default for every device. 0 if not used*/
+
+	Dev_override over[ BACKUP_DEV_MAX ];
+	int n_over;
+
+	pthread_mutex_t lock;	/*for adding to table*/
+	Backup_dev table[ BACKUP_DEV_MAX ];
+	int used;
+	int full_msg;
+} devs;
+
+static Backup_dev *dev_find( dev_t dev )
+{
+	int i;
+
+	for( i = 0; i < devs.used; i++ )
+		if( devs.table[ i ].dev == dev )
+			return &devs.table[ i ];
+	return NULL;
+}
+
+static Backup_dev *dev_add( dev_t dev, int limit )
+{
+	Backup_dev *d;
+
+	if( ( d = dev_find( dev ) ) )
+		return d;
+
+	if( devs.used >= BACKUP_DEV_MAX )
+	{
+		if( ! devs.full_msg++ )
+			msglog( MSG_WARNING, "more than %d devices for " \
+				"backups. Others have no device limit",
+				BACKUP_DEV_MAX );
+		return NULL;
+	}
+	d = &devs.table[ devs.used ];
+	d->dev = dev;
+	d->limit = limit;
+	d->running = 0;
+	d->blocked = 0;
+	/*readers look without lock*/
+	__atomic_store_n( &devs.used, devs.used + 1, __ATOMIC_RELEASE );
+	return d;
+}
+
+/*device of real path of name. NULL when no limit applies*/
+Backup_dev *backup_dev_lookup( const char *name )
+{
+	char path[ PATH_MAX + 1 ];
+	struct stat st;
+	Backup_dev *d;
+	int i, used;
+
+	if( ! devs.limit )
+		return NULL;
+
+	mod_dir( path, sizeof(path), name );
+	if( stat( path, &st ) == -1 )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "backup_dev_lookup: stat %s", path );
+		return NULL;
+	}
+
+	used = __atomic_load_n( &devs.used, __ATOMIC_ACQUIRE );
+	for( i = 0; i < used; i++ )
+		if( devs.table[ i ].dev == st.st_dev )
+			return &devs.table[ i ];
+
+	pthread_mutex_lock( &devs.lock );
+	d = dev_add( st.st_dev, devs.limit );
+	pthread_mutex_unlock( &devs.lock );
+	return d;
+}
+
+/*room for one more backup on the device?*/
+int backup_dev_take( Backup_dev *d )
+{
+	if( ! d )
+		return 1;
+
+	if( __atomic_add_fetch( &d->running, 1, __ATOMIC_RELAXED ) > d->limit )
+	{
+		__atomic_sub_fetch( &d->running, 1, __ATOMIC_RELAXED );
+		d->blocked++;
+		return 0;
+	}
+	return 1;
+}
+
+/*entries waiting for device may start now*/
+void backup_dev_put( Backup_dev *d )
+{
+	if( ! d )
+		return;
+	__atomic_sub_fetch( &d->running, 1, __ATOMIC_RELAXED );
+	backup_queue_wake();
+}
+
+static void backup_dev_stats( void )
+{
+	Backup_dev *d;
+	int i;
+
+	for( i = 0; i < devs.used; i++ )
+	{
+		d = &devs.table[ i ];
+		msglog( MSG_NOTICE, "backup device %u:%u: %d running, " \
+			"limit %d, %lu times busy",
+			major( d->dev ), minor( d->dev ),
+			__atomic_load_n( &d->running, __ATOMIC_RELAXED ),
+			d->limit, d->blocked );
+	}
+}
+
+void backup_dev_init( void )
+{
+	struct stat st;
+	int i;
+
+	if( ! devs.limit )
+		return;
+
+	thread_mutex_init( &devs.lock );
+	for( i = 0; i < devs.n_over; i++ )
+	{
+		if( stat( devs.over[ i ].path, &st ) == -1 )
+			msglog( MSG_FATAL|LOG_ERRNO, "backup_dev_init: stat %s",
+							devs.over[ i ].path );
+		/*later one wins for same device*/
+		if( dev_find( st.st_dev ) )
+			dev_find( st.st_dev )->limit = devs.over[ i ].limit;
+		else
+			dev_add( st.st_dev, devs.over[ i ].limit );
+	}
+	stats_register( backup_dev_stats );
+}
+
+/**********command line option handling funtions***************/
+
+/*NUM[,PATH=NUM]... Default limit, then limits for
+  devices of given paths*/
+void backup_dev_option( char ch, char *arg, int valid )
+{
+	char *next, *eq;
+	int num;
+
+	if( ! valid )
+		return;
+
+	if( ( next = strchr( arg, ',' ) ) )
+		*next++ = '\0';
+	if( ! string_to_number( arg, &devs.limit ) || devs.limit < 1 )
+		msglog( MSG_FATAL, "invalid argument for -%c", ch );
+
+	for( arg = next; arg; arg = next )
+	{
+		if( ( next = strchr( arg, ',' ) ) )
+			*next++ = '\0';
+
+		if( ! ( eq = strchr( arg, '=' ) ) )
+			msglog( MSG_FATAL, "PATH=NUM expected for -%c", ch );
+		*eq++ = '\0';
+
+		if( ! check_abs_path( arg ) )
+			msglog( MSG_FATAL, "absolute path expected for -%c", ch );
+		if( ! string_to_number( eq, &num ) || num < 1 )
+			msglog( MSG_FATAL, "invalid limit for %s", arg );
+		if( devs.n_over >= BACKUP_DEV_MAX )
+			msglog( MSG_FATAL, "too many devices for -%c", ch );
+
+		devs.over[ devs.n_over ].path = arg;
+		devs.over[ devs.n_over ].limit = num;
+		devs.n_over++;
+	}
+}
@@ -0,0 +1,42 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _BACKUP_DEV_H_INCLUDED_
+#define _BACKUP_DEV_H_INCLUDED_
+
+#include <sys/types.h>
+
+#define BACKUP_DEV_MAX		64	/*devices with a limit of their own*/
+
+typedef struct backup_dev {
+	dev_t dev;
+	int limit;	/*backups at a time on this device*/
+	int running;	/*started and not reaped*/
+	unsigned long blocked;	/*times a due backup waited for it*/
+} Backup_dev;
+
+void backup_dev_init( void );
+Backup_dev *backup_dev_lookup( const char *name );
+int backup_dev_take( Backup_dev *d );
+void backup_dev_put( Backup_dev *d );
+
+void backup_dev_option( char ch, char *arg, int valid );
+
+#endif
@@ -0,0 +1,512 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* built in backup engine.
+
+   Instead of a backup program, a pool of threads copies each
+   name into DIR/NAME/STAMP, a tree of its own for every
+   backup. Files not changed since the last backup of the name,
+   by size, modification time, mode and owner, are hard links
+   into it, as with rsync --link-dest; other files are copied
+   with copy_file_range. DIR/NAME/current points to the last
+   backup completed. A backup not completed is left as
+   DIR/NAME/.partial, and removed by the next one.
+
+   Jobs are backup entries without a process, so that limits,
+   journal and cancellation work as for other backups. Limits
+   per device come with the device slot the queue gives.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "msg.h"
+#include "thread.h"
+#include "slab.h"
+#include "stats.h"
+#include "time_mono.h"
+#include "miscfuncs.h"
+#include "backup_fork.h"
+#include "backup_child.h"
+#include "backup_snap.h"
+#include "backup_tree.h"
+#include "backup_engine.h"
+
+#define ENGINE_CURRENT		"current"
+#define ENGINE_PARTIAL		".partial"
+#define ENGINE_CHUNK		( 8 << 20 )	/*bytes copied between checks*/
+#define ENGINE_BUF		65536	/*without copy_file_range*/
+#define ENGINE_SUFFIX_MAX	100	/*backups of name in a second*/
+
+typedef struct engine_job {
+	Backup_pid *bp;
+	char path[ PATH_MAX+1 ];
+	struct engine_job *next;
+} Engine_job;
+
+/*one backup in progress*/
+typedef struct engine_run {
+	Backup_tree t;
+	Backup_pid *bp;
+	char *buf;
+	int cancelled;
+	unsigned long long copied;
+	unsigned long long linked;
+} Engine_run;
+
+static struct {
+	char *dir;
+	int dfd;	/*of dir*/
+	int life;	/*seconds a backup may run. 0 for no limit*/
+
+	int n_threads;
+	pthread_t *threads;
+	pthread_mutex_t lock;	/*for jobs and stop*/
+	pthread_cond_t wake;
+	Engine_job *head;
+	Engine_job *tail;
+	int stop;
+
+	/*statistics*/
+	unsigned long done;
+	unsigned long failed;
+	unsigned long long copied;
+	unsigned long long linked;
+} E = {
+	.dfd = -1,
+};
+
+static Slab_cache jcache;
+
+/*remount, backup life or shutdown*/
+static int engine_cancelled( Engine_run *r )
+{
+	if( ! r->cancelled && ( backup_child_cancelled( r->bp ) ||
+			__atomic_load_n( &E.stop, __ATOMIC_RELAXED ) ||
+			( E.life && time_mono() - r->bp->started >= E.life ) ) )
+		r->cancelled = 1;
+	return r->cancelled;
+}
+
+/*file did not change since last backup*/
+static int engine_same( const struct stat *a, const struct stat *b )
+{
+	return S_ISREG( b->st_mode ) && a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+		a->st_mode == b->st_mode &&
+		a->st_uid == b->st_uid && a->st_gid == b->st_gid;
+}
+
+static int engine_copy_data( int in, int out, Engine_run *r )
+{
+	ssize_t n, w, off;
+	int rw = 0;
+
+	while( ! engine_cancelled( r ) )
+	{
+		if( ! rw )
+		{
+			if( ( n = copy_file_range( in, NULL, out, NULL,
+						ENGINE_CHUNK, 0 ) ) >= 0 )
+			{
+				if( ! n )
+					return 1;
+				r->copied += n;
+				continue;
+			}
+			/*not between these files. Nothing copied yet then*/
+			if( errno == EXDEV || errno == EINVAL ||
+					errno == ENOSYS || errno == EOPNOTSUPP )
+			{
+				rw = 1;
+				continue;
+			}
+			return 0;
+		}
+
+		if( ( n = read( in, r->buf, ENGINE_BUF ) ) <= 0 )
+			return n == 0;
+		for( off = 0; off < n; off += w )
+			if( ( w = write( out, r->buf + off, n - off ) ) < 0 )
+				return 0;
+		r->copied += n;
+	}
+	return 0;
+}
+
+static int engine_file( int sfd, int pfd, int dfd, const char *name,
+				const struct stat *st, Engine_run *r )
+{
+	struct stat pst;
+	int in, out, ok;
+
+	if( pfd >= 0 && ! fstatat( pfd, name, &pst, AT_SYMLINK_NOFOLLOW ) &&
+			engine_same( st, &pst ) )
+	{
+		if( ! linkat( pfd, name, dfd, name, 0 ) )
+		{
+			r->linked += st->st_size;
+			return 1;
+		}
+		/*too many links. A copy starts anew*/
+		if( errno != EMLINK )
+			return backup_tree_fail( &r->t, "link", name );
+	}
+
+	if( ( in = openat( sfd, name, O_RDONLY|O_NOFOLLOW|O_NOATIME|
+						O_CLOEXEC ) ) < 0 )
+		return backup_tree_fail( &r->t, "open", name );
+	if( ( out = openat( dfd, name, O_WRONLY|O_CREAT|O_EXCL|
+						O_CLOEXEC, 0600 ) ) < 0 )
+	{
+		close( in );
+		return backup_tree_fail( &r->t, "create", name );
+	}
+	if( ! engine_copy_data( in, out, r ) )
+		ok = backup_tree_fail( &r->t, "copy", name );
+	else ok = backup_tree_attr( in, out, st, &r->t );
+	close( in );
+	close( out );
+	return ok;
+}
+
+/*pfd is same directory in last backup. -1 if none*/
+static int engine_dir( int sfd, int pfd, int dfd, Engine_run *r )
+{
+	struct dirent *de;
+	struct stat st;
+	int nsfd, npfd, ndfd, ok = 1, fd;
+	DIR *d;
+
+	if( ( fd = dup( sfd ) ) < 0 || ! ( d = fdopendir( fd ) ) )
+	{
+		if( fd >= 0 )
+			close( fd );
+		return backup_tree_fail( &r->t, "opendir", "" );
+	}
+	while( ok && ( errno = 0, de = readdir( d ) ) )
+	{
+		if( ! strcmp( de->d_name, "." ) || ! strcmp( de->d_name, ".." ) )
+			continue;
+		if( engine_cancelled( r ) )
+			ok = backup_tree_fail( &r->t, "cancelled", de->d_name );
+		else if( fstatat( sfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW ) )
+			ok = backup_tree_fail( &r->t, "stat", de->d_name );
+		else if( S_ISREG( st.st_mode ) )
+			ok = engine_file( sfd, pfd, dfd, de->d_name, &st, r );
+		else if( ! S_ISDIR( st.st_mode ) )
+			ok = backup_tree_special( sfd, dfd, de->d_name, &st, &r->t );
+
+		/*mounts under name are not part of it*/
+		else if( st.st_dev == r->t.dev )
+		{
+			if( mkdirat( dfd, de->d_name, 0700 ) )
+				ok = backup_tree_fail( &r->t, "mkdir", de->d_name );
+			else if( ( nsfd = openat( sfd, de->d_name, O_RDONLY|
+					O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC ) ) < 0 )
+				ok = backup_tree_fail( &r->t, "open", de->d_name );
+			else
+			{
+				if( ( ndfd = openat( dfd, de->d_name, O_RDONLY|
+					O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC ) ) < 0 )
+					ok = backup_tree_fail( &r->t, "open",
+								de->d_name );
+				else
+				{
+					npfd = pfd < 0 ? -1 : openat( pfd,
+						de->d_name, O_RDONLY|O_DIRECTORY|
+						O_NOFOLLOW|O_CLOEXEC );
+					ok = engine_dir( nsfd, npfd, ndfd, r ) &&
+						backup_tree_attr( nsfd, ndfd,
+								&st, &r->t );
+					if( npfd >= 0 )
+						close( npfd );
+					close( ndfd );
+				}
+				close( nsfd );
+			}
+		}
+	}
+	if( ok && errno )
+		ok = backup_tree_fail( &r->t, "readdir", "" );
+	closedir( d );
+	return ok;
+}
+
+/*.partial becomes STAMP, or STAMP.N when that is taken*/
+static int engine_commit( int nfd, char *stamp, size_t size )
+{
+	size_t len = strlen( stamp );
+	int i;
+
+	for( i = 0; i < ENGINE_SUFFIX_MAX; i++ )
+	{
+		if( i )
+			snprintf( stamp + len, size - len, ".%d", i );
+		if( ! renameat2( nfd, ENGINE_PARTIAL, nfd, stamp,
+						RENAME_NOREPLACE ) )
+			break;
+		if( errno != EEXIST )
+			return 0;
+	}
+	if( i == ENGINE_SUFFIX_MAX )
+		return 0;
+
+	/*current is replaced at once*/
+	unlinkat( nfd, ENGINE_CURRENT ".new", 0 );
+	if( symlinkat( stamp, nfd, ENGINE_CURRENT ".new" ) ||
+			renameat( nfd, ENGINE_CURRENT ".new",
+					nfd, ENGINE_CURRENT ) )
+		msglog( MSG_ERR|LOG_ERRNO, "backup_engine: could not " \
+			"point %s/%s to it", E.dir, ENGINE_CURRENT );
+	return 1;
+}
+
+static int engine_backup( const char *name, const char *path,
+			Engine_run *r, char *stamp, size_t size )
+{
+	struct stat st;
+	struct tm tm;
+	time_t now;
+	int nfd, sfd = -1, pfd = -1, dfd = -1, ok = 0;
+
+	now = time( NULL );
+	localtime_r( &now, &tm );
+	strftime( stamp, size, "%Y-%m-%d-%H%M%S", &tm );
+
+	if( ( mkdirat( E.dfd, name, 0700 ) && errno != EEXIST ) ||
+			( nfd = openat( E.dfd, name, O_RDONLY|O_DIRECTORY|
+					O_NOFOLLOW|O_CLOEXEC ) ) < 0 )
+		return backup_tree_fail( &r->t, "open", name );
+
+	if( ! backup_tree_remove( nfd, ENGINE_PARTIAL ) )
+		backup_tree_fail( &r->t, "remove", ENGINE_PARTIAL );
+	else if( ( sfd = open( path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|
+					O_CLOEXEC ) ) < 0 || fstat( sfd, &st ) )
+		backup_tree_fail( &r->t, "open", path );
+	else if( mkdirat( nfd, ENGINE_PARTIAL, 0700 ) ||
+			( dfd = openat( nfd, ENGINE_PARTIAL, O_RDONLY|
+					O_DIRECTORY|O_CLOEXEC ) ) < 0 )
+		backup_tree_fail( &r->t, "mkdir", ENGINE_PARTIAL );
+	else
+	{
+		/*first backup of name has nothing to link to*/
+		pfd = openat( nfd, ENGINE_CURRENT, O_RDONLY|O_DIRECTORY|
+							O_CLOEXEC );
+		r->t.dev = st.st_dev;
+		ok = engine_dir( sfd, pfd, dfd, r ) &&
+			backup_tree_attr( sfd, dfd, &st, &r->t );
+		if( ok && ! ( ok = engine_commit( nfd, stamp, size ) ) )
+			backup_tree_fail( &r->t, "rename", ENGINE_PARTIAL );
+	}
+
+	/*left for next backup when stopping*/
+	if( ! ok && ! __atomic_load_n( &E.stop, __ATOMIC_RELAXED ) )
+		backup_tree_remove( nfd, ENGINE_PARTIAL );
+
+	if( pfd >= 0 )
+		close( pfd );
+	if( dfd >= 0 )
+		close( dfd );
+	if( sfd >= 0 )
+		close( sfd );
+	close( nfd );
+	return ok;
+}
+
+static void engine_run( Engine_job *j, char *buf )
+{
+	char stamp[ 64 ];
+	Session *s = j->bp->s;
+	Engine_run r;
+
+	memset( &r, 0, sizeof(r) );
+	r.bp = j->bp;
+	r.buf = buf;
+
+	if( ! backup_tree_begin( &r.t, 0 ) )
+		msglog( MSG_ALERT, "backup_engine: could not allocate memory" );
+	else if( engine_backup( s->name, j->path, &r, stamp, sizeof(stamp) ) )
+	{
+		__atomic_add_fetch( &E.done, 1, __ATOMIC_RELAXED );
+		msglog( MSG_INFO, "backup of %s done as %s/%s/%s. " \
+			"%llu bytes copied, %llu linked", s->name, E.dir,
+			s->name, stamp, r.copied, r.linked );
+	}
+	else if( r.cancelled )
+		msglog( MSG_INFO, "backup of %s cancelled", s->name );
+	else
+	{
+		__atomic_add_fetch( &E.failed, 1, __ATOMIC_RELAXED );
+		errno = r.t.err;
+		msglog( MSG_ERR|LOG_ERRNO, "backup of %s failed. %s %s",
+					s->name, r.t.what, r.t.name );
+	}
+	backup_tree_end( &r.t );
+
+	__atomic_add_fetch( &E.copied, r.copied, __ATOMIC_RELAXED );
+	__atomic_add_fetch( &E.linked, r.linked, __ATOMIC_RELAXED );
+	backup_child_item_done( j->bp );
+}
+
+static void *engine_thread( void *x )
+{
+	Engine_job *j;
+	char *buf;
+
+	if( ! ( buf = malloc( ENGINE_BUF ) ) )
+		msglog( MSG_FATAL, "backup_engine: could not allocate memory" );
+	backup_fork_prio_thread();
+
+	pthread_mutex_lock( &E.lock );
+	while( 1 )
+	{
+		if( ! ( j = E.head ) )
+		{
+			if( E.stop )
+				break;
+			pthread_cond_wait( &E.wake, &E.lock );
+			continue;
+		}
+		if( ! ( E.head = j->next ) )
+			E.tail = NULL;
+		pthread_mutex_unlock( &E.lock );
+
+		engine_run( j, buf );
+		slab_free( &jcache, j );
+		pthread_mutex_lock( &E.lock );
+	}
+	pthread_mutex_unlock( &E.lock );
+	free( buf );
+	return x;
+}
+
+/*Device slot goes with job when taken. Returns 0 if not*/
+int backup_engine_start( Session *s, Backup_dev *dev )
+{
+	Engine_job *j;
+	Backup_pid *bp;
+
+	if( __atomic_load_n( &E.stop, __ATOMIC_RELAXED ) )
+		return 0;
+	if( ! ( j = slab_alloc( &jcache ) ) )
+	{
+		msglog( MSG_ALERT, "backup_engine: could not allocate memory" );
+		return 0;
+	}
+	if( ! ( bp = backup_child_item_add( s, dev, NULL ) ) )
+	{
+		slab_free( &jcache, j );
+		return 0;
+	}
+
+	j->bp = bp;
+	j->next = NULL;
+	backup_snap_path( s, j->path, sizeof(j->path) );
+
+	pthread_mutex_lock( &E.lock );
+	if( E.tail )
+		E.tail->next = j;
+	else
+		E.head = j;
+	E.tail = j;
+	pthread_cond_signal( &E.wake );
+	pthread_mutex_unlock( &E.lock );
+	return 1;
+}
+
+static void backup_engine_stats( void )
+{
+	msglog( MSG_NOTICE, "backup engine: %lu backups done, %lu failed, " \
+			"%llu bytes copied, %llu bytes linked",
+			__atomic_load_n( &E.done, __ATOMIC_RELAXED ),
+			__atomic_load_n( &E.failed, __ATOMIC_RELAXED ),
+			__atomic_load_n( &E.copied, __ATOMIC_RELAXED ),
+			__atomic_load_n( &E.linked, __ATOMIC_RELAXED ) );
+}
+
+void backup_engine_init( char *dir, int threads, int blife )
+{
+	int i;
+
+	if( ! dir )
+		return;
+
+	E.dir = dir;
+	E.life = blife > 0 ? blife : 0;
+	thread_mutex_init( &E.lock );
+	thread_cond_init( &E.wake );
+	slab_init( &jcache, "backup engine", sizeof(Engine_job) );
+	stats_register( backup_engine_stats );
+
+	if( ! create_dir( E.dir, 0700 ) )
+		msglog( MSG_FATAL, "could not create backup dir %s", E.dir );
+	if( ( E.dfd = open( E.dir, O_RDONLY|O_DIRECTORY|
+					O_CLOEXEC ) ) < 0 )
+		msglog( MSG_FATAL|LOG_ERRNO, "backup_engine_init: %s", E.dir );
+
+	if( ! ( E.threads = calloc( threads, sizeof(*E.threads) ) ) )
+		msglog( MSG_FATAL, "backup_engine_init: " \
+				"could not allocate memory" );
+	for( i = 0; i < threads; i++, E.n_threads++ )
+		if( ! thread_new_joinable( engine_thread, NULL,
+							&E.threads[ i ] ) )
+			msglog( MSG_FATAL, "backup_engine_init: could not " \
+						"start new thread" );
+}
+
+void backup_engine_stop_set( void )
+{
+	if( ! E.dir )
+		return;
+
+	pthread_mutex_lock( &E.lock );
+	E.stop = 1;
+	pthread_cond_broadcast( &E.wake );
+	pthread_mutex_unlock( &E.lock );
+}
+
+/*jobs not started yet are done with. Journal keeps them*/
+void backup_engine_stop( void )
+{
+	int i;
+
+	if( ! E.dir )
+		return;
+
+	backup_engine_stop_set();
+	for( i = 0; i < E.n_threads; i++ )
+		pthread_join( E.threads[ i ], NULL );
+	close( E.dfd );
+}
@@ -0,0 +1,35 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _BACKUP_ENGINE_H_INCLUDED_
+#define _BACKUP_ENGINE_H_INCLUDED_
+
+#include "session.h"
+#include "backup_dev.h"
+
+/*threads of built in backup engine at most*/
+#define BACKUP_ENGINE_MAX	64
+
+void backup_engine_init( char *dir, int threads, int blife );
+int backup_engine_start( Session *s, Backup_dev *dev );
+void backup_engine_stop_set( void );
+void backup_engine_stop( void );
+
+#endif
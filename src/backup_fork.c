@@ -19,16 +19,25 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <sched.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include "msg.h"
 #include "backup_argv.h"
+#include "backup_cgroup.h"
 #include "miscfuncs.h"
 #include "backup_fork.h"
 
@@ -38,64 +47,164 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define PRIORITY_MAX		1
 #define PRIORITY_MIN		40
 
+/*from linux/ioprio.h, not there with older headers*/
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_LEVEL_MAX	7
+
 static int priority;
+static int ioprio;	/*0 keeps what daemon has*/
 
-static void reset_signals( void )
-{
-        sigset_t set;
-                                                                                
-        sigfillset( &set );
+#define SPAWN_STACK		( 64 * 1024 )
 
-        if( sigprocmask( SIG_UNBLOCK, &set, NULL ) )
-		msglog( MSG_ERR | LOG_ERRNO, "reset_signals: sigprocmask" );
-}
+extern char **environ;
 
-/* to be called only from forked child process*/
-static void backup_exec( const char *name, const char *path )
-{
+/*what child needs before exec. Parent waits meanwhile*/
+typedef struct spawn_job {
 	char **argv;
+	int fd0, fd3;	/*dup to stdin and descriptor 3. -1 for none*/
+	int cgfd;	/*cgroup.procs of its group. -1 for none*/
+	int err;	/*exec failed*/
+	int prio_err;	/*priorities could not be set*/
+	int cg_err;	/*not moved to its cgroup*/
+} Spawn_job;
+
+/*cgroup, nice value and io priority of backup are set in the
+  child, before it can start anything. It shares memory with
+  parent till exec, as with vfork, so only system calls are
+  made here*/
+static int spawn_child( void *x )
+{
+	Spawn_job *j = x;
+	struct sigaction sa;
+	sigset_t set;
+	int sig;
+
+	/*no handler of ours runs in child. Signals are
+	  still blocked as in daemon threads*/
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = SIG_DFL;
+	for( sig = 1; sig < _NSIG; sig++ )
+		sigaction( sig, &sa, NULL );
+
+	if( setpgid( 0, 0 ) )
+		goto err;
+	if( j->cgfd >= 0 && write( j->cgfd, "0", 1 ) != 1 )
+		j->cg_err = errno;
+	if( setpriority( PRIO_PROCESS, 0, priority ) )
+		j->prio_err = errno;
+	if( ioprio && syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS,
+							0, ioprio ) )
+		j->prio_err = errno;
+	if( ( j->fd0 >= 0 && dup2( j->fd0, 0 ) < 0 ) ||
+			( j->fd3 >= 0 && dup2( j->fd3, 3 ) < 0 ) )
+		goto err;
+
+	sigemptyset( &set );
+	sigprocmask( SIG_SETMASK, &set, NULL );
+	execve( j->argv[0], j->argv, environ );
+err:
+	j->err = errno;
+	_exit( 127 );
+}
 
-	reset_signals();
-	setpriority( PRIO_PROCESS, 0, priority );
-
-	if( ! backup_argv_get( name, path, &argv ) )
+/*clone with CLONE_VM|CLONE_VFORK. Nothing is copied, and
+  calling thread keeps its own priorities. Returns errno*/
+static int spawn( pid_t *pid, Spawn_job *j, const char *name )
+{
+	char *stack;
+
+	if( ! ( stack = malloc( SPAWN_STACK ) ) )
+		return ENOMEM;
+	j->err = j->prio_err = j->cg_err = 0;
+	*pid = clone( spawn_child, stack + SPAWN_STACK,
+				CLONE_VM|CLONE_VFORK|SIGCHLD, j );
+	free( stack );
+
+	if( *pid < 0 )
+		return errno;
+	if( j->err )
 	{
-		fprintf( stderr, "backup_exec: " \
-			"could not make argument vector" );
-		_exit( EXIT_FAILURE );
+		waitpid( *pid, NULL, 0 );
+		return j->err;
 	}
-
-	if( execv( argv[0], argv ) )
+	if( j->prio_err )
+	{
+		errno = j->prio_err;
+		msglog( MSG_ERR|LOG_ERRNO, "could not set priority " \
+				"of backup %s", name );
+	}
+	if( j->cg_err )
 	{
-		fprintf( stderr, "backup_exec: execv: %s", strerror( errno ) );
-		_exit( EXIT_FAILURE );
+		errno = j->cg_err;
+		msglog( MSG_ERR|LOG_ERRNO, "could not move backup " \
+					"process of %s to its cgroup", name );
 	}
-	_exit( EXIT_FAILURE );
+	return 0;
 }
 
-pid_t backup_fork_new( const char *name, const char *path )
+/*argument vector is prepared here in the parent, as child
+  runs nothing of ours before exec*/
+static pid_t fork_new( const char *name, const char *path,
+						int fd0, int fd3 )
 {
+	Spawn_job j;
 	pid_t pid;
+	int err;
 
-	msglog( MSG_INFO, "starting backup for %s", name );
-	pid = fork();
-	if( pid < 0 )
+	if( ! backup_argv_get( name, path, &j.argv ) )
 	{
-		msglog( MSG_NOTICE|LOG_ERRNO, "fork: could not start " \
-				"backup for %s", name );
+		msglog( MSG_NOTICE, "could not make argument vector " \
+				"for backup of %s", name );
 		return -1;
 	}
-	else if( pid == 0 ) 
+	j.fd0 = fd0;
+	j.fd3 = fd3;
+
+	j.cgfd = backup_cgroup_open( name );
+	err = spawn( &pid, &j, name );
+	backup_argv_free( j.argv );
+
+	if( err )
 	{
-		if( setpgrp() == -1 )
-			fprintf( stderr, "setpgrp: %s", strerror( errno ) );
-		backup_exec( name, path ); 
+		errno = err;
+		msglog( MSG_NOTICE|LOG_ERRNO, "could not start " \
+				"backup for %s", name );
+		pid = -1;
 	}
-	else
-		setpgid( pid, pid );
+	if( j.cgfd >= 0 )
+		close( j.cgfd );
 	return pid;
 }
 
+/*backup running in calling thread, not in a process. Thread
+  must be one of backup only, as it keeps the priorities*/
+void backup_fork_prio_thread( void )
+{
+	pid_t tid = syscall( SYS_gettid );
+
+	if( setpriority( PRIO_PROCESS, tid, priority ) )
+		msglog( MSG_ERR|LOG_ERRNO, "backup_fork: setpriority" );
+	if( ioprio && syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS,
+							tid, ioprio ) )
+		msglog( MSG_ERR|LOG_ERRNO, "backup_fork: ioprio_set" );
+}
+
+pid_t backup_fork_new( const char *name, const char *path )
+{
+	msglog( MSG_INFO, "starting backup for %s", name );
+	return fork_new( name, path, -1, -1 );
+}
+
+/*backup of many names. Names come on stdin from in_fd
+  and results go back on descriptor 3 to res_fd*/
+pid_t backup_fork_batch( const char *label, int in_fd, int res_fd )
+{
+	return fork_new( label, "", in_fd, res_fd );
+}
+
 int backup_waitpid(pid_t pid, const char *name, int block)
 {
 	int status;
@@ -143,6 +252,7 @@ again:
 					(long) pid, name );
 			goto again;
 		}
+		backup_cgroup_release( name );
 	}
 	return 1;
 }
@@ -152,32 +262,14 @@ void backup_soft_signal( pid_t pid )
 	kill( - pid, SIGTERM );
 }
 
-void backup_fast_kill( pid_t pid, const char *name )
+void backup_hard_signal( pid_t pid )
 {
 	kill( - pid, SIGKILL );
-	backup_waitpid( pid, name, 1 );
 }
 
-void backup_kill( pid_t pid, const char *name )
+void backup_fast_kill( pid_t pid, const char *name )
 {
-	int i;
-
-	if( backup_waitpid( pid, name, 0 ) != 0 )
-	    return;
-
-	/*send soft signal first and wait for some time*/
-	kill( - pid, SIGTERM );
-	sleep( 1 );
-	if( backup_waitpid( pid, name, 0 ) != 0 )
-	    return;
-
-	for( i = 0; i < 3; i++ )
-	{
-		kill( - pid, SIGKILL );
-		sleep( 1 );
-		if( backup_waitpid( pid, name, 0 ) != 0 )
-		    return;
-	}
+	kill( - pid, SIGKILL );
 	backup_waitpid( pid, name, 1 );
 }
 
@@ -198,20 +290,192 @@ void backup_fork_option_pri( char ch, char *arg, int valid )
 	else priority = pri - 21; /*change to -20 to +20 range*/
 }
 
+/*idle or be[,LEVEL]*/
+void backup_fork_option_ioclass( char ch, char *arg, int valid )
+{
+	int level = 4;
+	char *lvl;
+
+	if( ! valid )
+		return;
+
+	if( ( lvl = strchr( arg, ',' ) ) )
+		*lvl++ = '\0';
+
+	if( ! strcmp( arg, "idle" ) && ! lvl )
+		ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+
+	else if( strcmp( arg, "be" ) || ( lvl && ( ! string_to_number( lvl,
+				&level ) || level > IOPRIO_LEVEL_MAX ) ) )
+		msglog( MSG_FATAL, "invalid argument for -%c", ch );
+
+	else ioprio = ( IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT ) | level;
+}
+
 #ifdef TEST
 
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "time_mono.h"
+
 char *autodir_name(void)
 {
     return "test autodir";
 }
 
-int main(void)
+#define BENCH_SECS	3
+
+/*what backup launching was before: fork and prepare in child*/
+static pid_t old_fork_new(const char *name, const char *path)
+{
+    char **argv;
+    sigset_t set;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+	setpgrp();
+	sigfillset(&set);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+	setpriority(PRIO_PROCESS, 0, priority);
+	if (!backup_argv_get(name, path, &argv))
+	    _exit(EXIT_FAILURE);
+	execv(argv[0], argv);
+	_exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+static void bench(const char *what, pid_t (*fn)(const char *, const char *))
+{
+    time_t end = time_mono() + BENCH_SECS;
+    long n = 0;
+    pid_t pid;
+
+    while (time_mono() < end) {
+	if ((pid = fn("test", "/tmp")) > 0)
+	    backup_waitpid(pid, "test", 1);
+	n++;
+    }
+    printf("%-12s %8.1f spawns/sec\n", what, (double) n / BENCH_SECS);
+}
+
+/*jobs of a program started for each, against jobs handed
+  to one worker over stdin and descriptor 3. Both are this
+  program, run as '/proc/self/exe %N %L'*/
+static void bench_jobs(void)
+{
+    int in[2], res[2];
+    char buf[64];
+    time_t end;
+    ssize_t r;
+    long n;
+    pid_t pid;
+    int nul, i;
+
+    end = time_mono() + BENCH_SECS;
+    for (n = 0; time_mono() < end; n++)
+	if ((pid = backup_fork_new("test", "/tmp")) > 0)
+	    backup_waitpid(pid, "test", 1);
+    printf("%-12s %8.1f jobs/sec\n", "fork", (double) n / BENCH_SECS);
+
+    if (pipe2(in, O_CLOEXEC) || pipe2(res, O_CLOEXEC))
+	msglog(MSG_FATAL | LOG_ERRNO, "pipe");
+    if ((pid = backup_fork_batch("worker-1", in[0], res[1])) <= 0)
+	msglog(MSG_FATAL, "could not start worker");
+    close(in[0]);
+    close(res[1]);
+
+    end = time_mono() + BENCH_SECS;
+    for (n = 0; time_mono() < end; n++) {
+	if (write(in[1], "test\0/tmp", 10) != 10)
+	    msglog(MSG_FATAL | LOG_ERRNO, "write");
+	/*NAME NUL STATUS NUL back*/
+	for (nul = 0; nul < 2; ) {
+	    if ((r = read(res[0], buf, sizeof(buf))) <= 0)
+		msglog(MSG_FATAL | LOG_ERRNO, "read");
+	    for (i = 0; i < r; i++)
+		nul += !buf[i];
+	}
+    }
+    printf("%-12s %8.1f jobs/sec\n", "worker", (double) n / BENCH_SECS);
+
+    close(in[1]);
+    backup_waitpid(pid, "worker-1", 1);
+    close(res[0]);
+}
+
+/*one job as its own process, or a worker reading jobs*/
+static int bench_job(char *argv[])
+{
+    char *name = NULL, *path = NULL;
+    size_t nlen = 0, plen = 0;
+    FILE *res;
+
+    if (*argv[2])
+	return 0;
+    if (!(res = fdopen(3, "w")))
+	return 1;
+    while (getdelim(&name, &nlen, '\0', stdin) > 0 &&
+	   getdelim(&path, &plen, '\0', stdin) > 0) {
+	if (!*path)
+	    continue;
+	fprintf(res, "%s%c0%c", name, '\0', '\0');
+	fflush(res);
+    }
+    return 0;
+}
+
+/* compile gcc -DTEST backup_fork.c backup_argv.o msg.o miscfuncs.o
+		time_mono.o thread.o backup_cgroup.o -lpthread
+
+   bench [MB] compares spawning /bin/true with clone vfork
+   and with fork, with MB megabytes of touched memory
+   (default 1024) to stand for daemon RSS
+
+   jobs compares a backup program started for each job
+   with one backup worker taking jobs */
+int main(int argc, char *argv[])
 {
 	pid_t pid;
+	size_t mb = 1024;
+	char *mem;
+
+	if (argc == 3 && strcmp(argv[1], "bench"))
+	    return bench_job(argv);
 
 	msg_option_verbose('x', "", 1);
 	msg_init();
 	msg_console_on();
+	time_mono_init();
+
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+	    if (argc > 2)
+		mb = atol(argv[2]);
+	    mem = mmap(NULL, mb << 20, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    if (mem == MAP_FAILED)
+		msglog(MSG_FATAL | LOG_ERRNO, "mmap");
+	    memset(mem, 1, mb << 20);
+	    msg_option_verbose('x', "", 0);
+	    backup_fork_option_pri('x', "", 0);
+	    backup_argv_init(strdup("/bin/true %N %L"));
+	    printf("RSS %lu MB\n", (unsigned long) mb);
+	    bench("clone vfork", backup_fork_new);
+	    bench("fork", old_fork_new);
+	    return 0;
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "jobs")) {
+	    msg_option_verbose('x', "", 0);
+	    backup_fork_option_pri('x', "", 0);
+	    backup_argv_init(strdup("/proc/self/exe %N %L"));
+	    bench_jobs();
+	    return 0;
+	}
+
 	backup_argv_init( strdup( "/home/devel/testautodir/backup" ) );
 
 	while (1)
@@ -219,7 +483,7 @@ int main(void)
 		pid = backup_fork_new( "test", "/tmp" );
 		if( pid > 0 )
 		{
-			backup_kill( pid, "test" );
+			backup_fast_kill( pid, "test" );
 		}
 	}
 }
@@ -25,11 +25,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 
 pid_t backup_fork_new( const char *name, const char *path );
+pid_t backup_fork_batch( const char *label, int in_fd, int res_fd );
+void backup_fork_prio_thread( void );
 int backup_waitpid(pid_t pid, const char *name, int block);
-void backup_kill( pid_t pid, const char *name );
 void backup_soft_signal( pid_t pid );
+void backup_hard_signal( pid_t pid );
 void backup_fast_kill( pid_t pid, const char *name );
 
 void backup_fork_option_pri( char ch, char *arg, int valid );
+void backup_fork_option_ioclass( char ch, char *arg, int valid );
 
 #endif
@@ -0,0 +1,671 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* backup queue kept on disk across restarts.
+
+   Names queued for backup, taken off the queue, started
+   and finished are appended as records to a journal file.
+   At startup names queued or started but not finished are
+   queued again with the time they were first queued.
+
+   Records are put in a buffer under a short lock, and the
+   journal thread copies them to the mapped file and syncs
+   it every interval, so no one waits for the disk. When the
+   file grows well past what is still pending, it is written
+   again with pending names only and renamed over the old one.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "msg.h"
+#include "miscfuncs.h"
+#include "thread.h"
+#include "time_mono.h"
+#include "stats.h"
+#include "session.h"
+#include "backup_queue.h"
+#include "backup_journal.h"
+
+#define JOURNAL_MAGIC		"autodir journal\n"
+#define JOURNAL_HDR		16	/*bytes of magic*/
+#define JOURNAL_CHUNK		( 1024 * 1024 )	/*file grows by this*/
+#define JOURNAL_SLACK		4	/*times pending size before compaction*/
+
+#define DFLT_INTERVAL		5	/*secs*/
+#define INTERVAL_MAX		3600
+
+/*record types*/
+enum { J_ADD = 'A', J_REMOVE = 'R', J_STARTED = 'S', J_FINISHED = 'F' };
+
+/*state of a name*/
+enum { J_NONE = 0, J_QUEUED, J_RUNNING };
+
+typedef struct jrec {
+	int64_t sec;	/*wall clock time name was queued*/
+	uint32_t nsec;
+	uint32_t sum;	/*of whole record with sum as 0*/
+	uint16_t len;	/*whole record, padded to 8 bytes*/
+	uint8_t type;
+	uint8_t pad[ 5 ];
+	char name[];	/*NUL ended*/
+} Jrec;
+
+static struct {
+	char *path;
+	int interval;
+	int enabled;
+	int stop;
+
+	pthread_mutex_t lock;	/*for buffer and states of names*/
+	pthread_cond_t wake;
+	pthread_t thread;
+
+	/*records not in file yet*/
+	char *buf;
+	size_t len;
+	size_t size;
+	int pending;	/*names queued or started*/
+
+	/*used by journal thread only, once started*/
+	int fd;
+	char *map;
+	size_t map_size;
+	size_t tail;		/*end of last record*/
+	size_t compacted;	/*tail after last compaction*/
+	unsigned long written;
+	unsigned long compactions;
+} J = {
+	.interval = DFLT_INTERVAL,
+	.fd = -1,
+};
+
+static uint32_t jrec_sum( const Jrec *r )
+{
+	const unsigned char *p = (const unsigned char *) r;
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for( i = 0; i < r->len; i++ )
+	{
+		/*sum field counts as 0*/
+		h ^= ( i >= offsetof( Jrec, sum ) &&
+			i < offsetof( Jrec, sum ) + sizeof(r->sum) ) ? 0 : p[ i ];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*record appended to buffer given*/
+static int jrec_add( char **buf, size_t *len, size_t *size, int type,
+			const char *name, const struct timespec *stamp )
+{
+	size_t rlen = ( sizeof(Jrec) + strlen( name ) + 1 + 7 ) & ~7;
+	Jrec *r;
+	char *tmp;
+
+	if( *len + rlen > *size )
+	{
+		if( ! ( tmp = realloc( *buf, ( *len + rlen ) * 2 ) ) )
+		{
+			msglog( MSG_ALERT, "backup_journal: could not " \
+						"allocate memory" );
+			return 0;
+		}
+		*buf = tmp;
+		*size = ( *len + rlen ) * 2;
+	}
+	r = (Jrec *) ( *buf + *len );
+	memset( r, 0, rlen );
+	r->sec = stamp->tv_sec;
+	r->nsec = stamp->tv_nsec;
+	r->len = rlen;
+	r->type = type;
+	strcpy( r->name, name );
+	r->sum = jrec_sum( r );
+	*len += rlen;
+	return 1;
+}
+
+/*name state after record. Returns 0 if record
+  changes nothing. Lock held*/
+static int jstate_apply( Session *s, int type, const struct timespec *stamp )
+{
+	int was = s->jstate;
+
+	switch( type )
+	{
+		case J_ADD:
+			s->jstate = J_QUEUED;
+			s->jstamp = *stamp;
+			break;
+		case J_REMOVE:
+			if( was == J_QUEUED )
+				s->jstate = J_NONE;
+			break;
+		case J_STARTED:
+			if( was == J_QUEUED )
+				s->jstate = J_RUNNING;
+			break;
+		case J_FINISHED:
+			/*a new one may be queued meanwhile*/
+			if( was == J_RUNNING )
+				s->jstate = J_NONE;
+			break;
+	}
+	J.pending += ( s->jstate != J_NONE ) - ( was != J_NONE );
+	return type == J_ADD || s->jstate != was;
+}
+
+static void journal_log( Session *s, int type, const struct timespec *stamp )
+{
+	pthread_mutex_lock( &J.lock );
+	if( ! J.stop && jstate_apply( s, type, stamp ? stamp : &s->jstamp ) )
+		jrec_add( &J.buf, &J.len, &J.size, type, s->name, &s->jstamp );
+	pthread_mutex_unlock( &J.lock );
+}
+
+/*queue keeps time stamps of the monotonic clock*/
+void backup_journal_add( Session *s, const struct timespec *estamp )
+{
+	struct timespec now, wall;
+
+	if( ! J.enabled )
+		return;
+
+	mono_timespec( &now, 0, 0 );
+	clock_gettime( CLOCK_REALTIME, &wall );
+	wall.tv_sec -= now.tv_sec - estamp->tv_sec;
+	wall.tv_nsec -= now.tv_nsec - estamp->tv_nsec;
+	if( wall.tv_nsec < 0 )
+	{
+		wall.tv_nsec += 1000000000;
+		wall.tv_sec--;
+	}
+	else if( wall.tv_nsec >= 1000000000 )
+	{
+		wall.tv_nsec -= 1000000000;
+		wall.tv_sec++;
+	}
+	journal_log( s, J_ADD, &wall );
+}
+
+void backup_journal_remove( Session *s )
+{
+	if( J.enabled )
+		journal_log( s, J_REMOVE, NULL );
+}
+
+void backup_journal_started( Session *s )
+{
+	if( J.enabled )
+		journal_log( s, J_STARTED, NULL );
+}
+
+void backup_journal_finished( Session *s )
+{
+	if( J.enabled )
+		journal_log( s, J_FINISHED, NULL );
+}
+
+/***********************************************/
+/* journal file			               */
+/***********************************************/
+
+/*file and mapping are at least size bytes. Journal
+  thread only, or before it starts*/
+static int journal_map( size_t size )
+{
+	char *map;
+
+	size = ( size + JOURNAL_CHUNK - 1 ) / JOURNAL_CHUNK * JOURNAL_CHUNK;
+	if( size <= J.map_size )
+		return 1;
+
+	if( ftruncate( J.fd, size ) )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "backup_journal: ftruncate %s",
+								J.path );
+		return 0;
+	}
+	map = mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, J.fd, 0 );
+	if( map == MAP_FAILED )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "backup_journal: mmap %s", J.path );
+		return 0;
+	}
+	if( J.map )
+		munmap( J.map, J.map_size );
+	J.map = map;
+	J.map_size = size;
+	return 1;
+}
+
+static void journal_unmap( void )
+{
+	if( J.map )
+		munmap( J.map, J.map_size );
+	if( J.fd >= 0 )
+		close( J.fd );
+	J.map = NULL;
+	J.map_size = 0;
+	J.fd = -1;
+}
+
+static int journal_open( void )
+{
+	struct stat st;
+
+	if( ( J.fd = open( J.path, O_RDWR|O_CREAT|O_CLOEXEC, 0600 ) ) < 0
+						|| fstat( J.fd, &st ) )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "backup_journal: %s", J.path );
+		return 0;
+	}
+	if( ! journal_map( st.st_size > JOURNAL_HDR ?
+				st.st_size : JOURNAL_HDR ) )
+		return 0;
+	if( ! st.st_size )
+		memcpy( J.map, JOURNAL_MAGIC, JOURNAL_HDR );
+	else if( memcmp( J.map, JOURNAL_MAGIC, JOURNAL_HDR ) )
+		msglog( MSG_FATAL, "%s is not a backup journal", J.path );
+	return 1;
+}
+
+/*records written before are made to last.
+  Page of the tail may be synced again*/
+static void journal_sync( size_t from )
+{
+	size_t page = sysconf( _SC_PAGESIZE );
+
+	from &= ~( page - 1 );
+	if( msync( J.map + from, J.tail - from, MS_SYNC ) )
+		msglog( MSG_ERR|LOG_ERRNO, "backup_journal: msync %s",
+								J.path );
+}
+
+/*buffer taken out under lock and copied to file*/
+static void journal_flush( void )
+{
+	char *buf;
+	size_t len, size;
+
+	pthread_mutex_lock( &J.lock );
+	buf = J.buf;
+	len = J.len;
+	size = J.size;
+	J.buf = NULL;
+	J.len = J.size = 0;
+	pthread_mutex_unlock( &J.lock );
+
+	if( len && journal_map( J.tail + len ) )
+	{
+		memcpy( J.map + J.tail, buf, len );
+		J.tail += len;
+		journal_sync( J.tail - len );
+		J.written += len;
+	}
+
+	/*buffer is kept for next round*/
+	pthread_mutex_lock( &J.lock );
+	if( ! J.buf )
+	{
+		J.buf = buf;
+		J.size = size;
+		buf = NULL;
+	}
+	pthread_mutex_unlock( &J.lock );
+	free( buf );
+}
+
+struct jsnap {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static void journal_snap_one( Session *s, void *arg )
+{
+	struct jsnap *snap = arg;
+
+	if( s->jstate == J_NONE )
+		return;
+	jrec_add( &snap->buf, &snap->len, &snap->size, J_ADD,
+						s->name, &s->jstamp );
+	if( s->jstate == J_RUNNING )
+		jrec_add( &snap->buf, &snap->len, &snap->size, J_STARTED,
+						s->name, &s->jstamp );
+}
+
+static int journal_write_file( const char *path, const char *buf, size_t len )
+{
+	int fd, r;
+
+	if( ( fd = open( path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600 ) ) < 0 )
+		return 0;
+	r = write_all( fd, buf, len ) && ! fdatasync( fd );
+	return ! close( fd ) && r;
+}
+
+/*rename is to last too*/
+static void journal_sync_dir( void )
+{
+	char dir[ PATH_MAX + 1 ];
+	int fd;
+
+	string_n_copy( dir, J.path, sizeof(dir) );
+	if( ( fd = open( dirname( dir ), O_RDONLY|O_DIRECTORY|O_CLOEXEC ) ) < 0 )
+		return;
+	if( fsync( fd ) )
+		msglog( MSG_ERR|LOG_ERRNO, "backup_journal: fsync %s", dir );
+	close( fd );
+}
+
+/*pending names are written to a new file which takes place
+  of the old one. Records buffered by then are covered by it*/
+static void journal_compact( void )
+{
+	char tmp[ PATH_MAX + 1 ];
+	struct jsnap snap;
+	size_t covered;
+
+	memset( &snap, 0, sizeof(snap) );
+	if( ! ( snap.buf = malloc( JOURNAL_HDR ) ) )
+	{
+		msglog( MSG_ALERT, "backup_journal: could not " \
+					"allocate memory" );
+		return;
+	}
+	memcpy( snap.buf, JOURNAL_MAGIC, JOURNAL_HDR );
+	snap.len = snap.size = JOURNAL_HDR;
+
+	pthread_mutex_lock( &J.lock );
+	session_foreach( journal_snap_one, &snap );
+	covered = J.len;
+	pthread_mutex_unlock( &J.lock );
+
+	snprintf( tmp, sizeof(tmp), "%s.new", J.path );
+	if( ! journal_write_file( tmp, snap.buf, snap.len ) ||
+					rename( tmp, J.path ) )
+	{
+		/*old file goes on with buffer as it is*/
+		msglog( MSG_ERR|LOG_ERRNO, "backup_journal: could not " \
+					"write %s", tmp );
+		unlink( tmp );
+		free( snap.buf );
+		return;
+	}
+	journal_sync_dir();
+	free( snap.buf );
+
+	pthread_mutex_lock( &J.lock );
+	memmove( J.buf, J.buf + covered, J.len - covered );
+	J.len -= covered;
+	pthread_mutex_unlock( &J.lock );
+
+	journal_unmap();
+	if( ! journal_open() )
+		msglog( MSG_FATAL, "could not open backup journal again" );
+	J.tail = J.compacted = snap.len;
+	J.compactions++;
+}
+
+/*Does not hold lock while writing*/
+static void *journal_thread( void *x )
+{
+	struct timespec due;
+
+	pthread_mutex_lock( &J.lock );
+	while( ! J.stop )
+	{
+		thread_cond_timespec( &due, J.interval );
+		pthread_cond_timedwait( &J.wake, &J.lock, &due );
+		pthread_mutex_unlock( &J.lock );
+
+		journal_flush();
+		if( J.tail > JOURNAL_CHUNK &&
+				J.tail > J.compacted * JOURNAL_SLACK )
+			journal_compact();
+		pthread_mutex_lock( &J.lock );
+	}
+	pthread_mutex_unlock( &J.lock );
+
+	journal_flush();
+	return x;
+}
+
+/***********************************************/
+/* replay at startup		               */
+/***********************************************/
+
+static int jstamp_cmp( const void *a, const void *b )
+{
+	const Session *x = *(Session * const *) a;
+	const Session *y = *(Session * const *) b;
+
+	if( x->jstamp.tv_sec != y->jstamp.tv_sec )
+		return x->jstamp.tv_sec < y->jstamp.tv_sec ? -1 : 1;
+	if( x->jstamp.tv_nsec != y->jstamp.tv_nsec )
+		return x->jstamp.tv_nsec < y->jstamp.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+static int ptr_cmp( const void *a, const void *b )
+{
+	uintptr_t x = (uintptr_t) *(void * const *) a;
+	uintptr_t y = (uintptr_t) *(void * const *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*records up to first broken one. Each record holds a
+  reference to its session, kept in list*/
+static size_t journal_read( Session ***list, size_t *n )
+{
+	struct timespec stamp;
+	size_t off, size = 0;
+	Session **tmp;
+	Jrec *r;
+
+	*list = NULL;
+	*n = 0;
+	for( off = JOURNAL_HDR; off + sizeof(Jrec) <= J.map_size;
+							off += r->len )
+	{
+		r = (Jrec *) ( J.map + off );
+		if( r->len < sizeof(Jrec) + 2 || r->len & 7 ||
+			off + r->len > J.map_size || jrec_sum( r ) != r->sum
+			|| r->name[ r->len - sizeof(Jrec) - 1 ] )
+			break;
+
+		if( *n == size )
+		{
+			size = size ? size * 2 : 1024;
+			if( ! ( tmp = realloc( *list, size * sizeof(**list) ) ) )
+				msglog( MSG_FATAL, "backup_journal: could " \
+						"not allocate memory" );
+			*list = tmp;
+		}
+		if( ! ( (*list)[ *n ] = session_get( r->name ) ) )
+			msglog( MSG_FATAL, "backup_journal: could not " \
+					"allocate memory" );
+		stamp.tv_sec = r->sec;
+		stamp.tv_nsec = r->nsec;
+		jstate_apply( (*list)[ ( *n )++ ], r->type, &stamp );
+	}
+
+	/*file is zeros after last record written*/
+	r = (Jrec *) ( J.map + off );
+	if( off + sizeof(Jrec) <= J.map_size && ( r->len || r->sum ) )
+		msglog( MSG_NOTICE, "backup journal %s: broken record " \
+				"at %lu ignored", J.path, (unsigned long) off );
+	return off;
+}
+
+/*names not finished are queued again in order they were
+  queued first, with their age kept. Names which were
+  running were cut short by the last exit*/
+void backup_journal_replay( void )
+{
+	struct timespec mnow, rnow, estamp;
+	Session **list, **pend = NULL;
+	size_t i, n, u;
+	int running = 0, queued = 0;
+
+	if( ! J.enabled )
+		return;
+
+	J.tail = J.compacted = journal_read( &list, &n );
+
+	/*pending ones, each once*/
+	qsort( list, n, sizeof(*list), ptr_cmp );
+	if( n && ! ( pend = malloc( n * sizeof(*pend) ) ) )
+		msglog( MSG_FATAL, "backup_journal: could not " \
+					"allocate memory" );
+	for( i = u = 0; i < n; i++ )
+		if( ( ! i || list[ i ] != list[ i - 1 ] ) &&
+					list[ i ]->jstate != J_NONE )
+			pend[ u++ ] = list[ i ];
+	qsort( pend, u, sizeof(*pend), jstamp_cmp );
+
+	mono_timespec( &mnow, 0, 0 );
+	clock_gettime( CLOCK_REALTIME, &rnow );
+	for( i = 0; i < u; i++ )
+	{
+		if( pend[ i ]->jstate == J_RUNNING )
+		{
+			msglog( MSG_INFO, "backup for %s was cut short",
+							pend[ i ]->name );
+			running++;
+		}
+		else queued++;
+
+		/*same age on monotonic clock, not before it starts*/
+		estamp.tv_sec = mnow.tv_sec - ( rnow.tv_sec -
+					pend[ i ]->jstamp.tv_sec );
+		estamp.tv_nsec = pend[ i ]->jstamp.tv_nsec;
+		if( estamp.tv_sec < 0 )
+			estamp.tv_sec = estamp.tv_nsec = 0;
+		backup_queue_add_at( pend[ i ], &estamp );
+	}
+
+	/*references of all records go*/
+	for( i = 0; i < n; i++ )
+		session_put( list[ i ] );
+	free( pend );
+	free( list );
+
+	if( queued || running )
+		msglog( MSG_NOTICE, "backup journal %s: %d backups queued " \
+				"again, %d of them cut short", J.path,
+				queued + running, running );
+
+	/*file starts anew with pending names only*/
+	journal_compact();
+
+	if( ! thread_new_joinable( journal_thread, NULL, &J.thread ) )
+		msglog( MSG_FATAL, "backup_journal_replay: could not " \
+					"start new thread" );
+}
+
+static void backup_journal_stats( void )
+{
+	pthread_mutex_lock( &J.lock );
+	msglog( MSG_NOTICE, "backup journal: %d names pending, %lu bytes " \
+		"in file, %lu bytes written, %lu compactions", J.pending,
+		(unsigned long) J.tail, J.written, J.compactions );
+	pthread_mutex_unlock( &J.lock );
+}
+
+/*file is read by replay, once queue can take names*/
+void backup_journal_init( void )
+{
+	if( ! J.enabled )
+		return;
+
+	thread_mutex_init( &J.lock );
+	thread_cond_init( &J.wake );
+	if( ! journal_open() )
+		msglog( MSG_FATAL, "could not open backup journal" );
+	stats_register( backup_journal_stats );
+}
+
+/*from now names stay as they are in journal, so
+  backups stopped at exit are done after restart*/
+void backup_journal_stop_set( void )
+{
+	if( ! J.enabled )
+		return;
+
+	pthread_mutex_lock( &J.lock );
+	J.stop = 1;
+	pthread_cond_signal( &J.wake );
+	pthread_mutex_unlock( &J.lock );
+}
+
+void backup_journal_stop( void )
+{
+	if( ! J.enabled )
+		return;
+
+	backup_journal_stop_set();
+	pthread_join( J.thread, NULL );
+	journal_unmap();
+}
+
+/**********command line option handling funtions***************/
+
+/*FILE[,SECS]. Journal file and how often it is synced*/
+void backup_journal_option( char ch, char *arg, int valid )
+{
+	char *secs;
+
+	if( ! valid )
+		return;
+
+	if( ( secs = strchr( arg, ',' ) ) )
+		*secs++ = '\0';
+
+	if( *arg != '/' )
+		msglog( MSG_FATAL, "absolute path expected for option -%c", ch );
+
+	if( secs && ( ! string_to_number( secs, &J.interval ) ||
+			J.interval < 1 || J.interval > INTERVAL_MAX ) )
+		msglog( MSG_FATAL, "invalid argument for -%c. " \
+				"1 to %d seconds expected", ch, INTERVAL_MAX );
+
+	J.path = arg;
+	J.enabled = 1;
+}
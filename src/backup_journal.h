@@ -0,0 +1,38 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _BACKUP_JOURNAL_H_INCLUDED_
+#define _BACKUP_JOURNAL_H_INCLUDED_
+
+#include <time.h>
+#include "session.h"
+
+void backup_journal_init( void );
+void backup_journal_replay( void );
+void backup_journal_add( Session *s, const struct timespec *estamp );
+void backup_journal_remove( Session *s );
+void backup_journal_started( Session *s );
+void backup_journal_finished( Session *s );
+void backup_journal_stop_set( void );
+void backup_journal_stop( void );
+
+void backup_journal_option( char ch, char *arg, int valid );
+
+#endif
@@ -19,245 +19,100 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <limits.h>
 #include <sys/types.h>
 #include "msg.h"
 #include "miscfuncs.h"
 #include "thread.h"
+#include "slab.h"
 #include "backup_pid.h"
 
 
 /*memory cache management for backup_child*/
 
-#define CACHE_MAX 50
-
-static struct {
-	pthread_mutex_t lock;
-	Backup_pid *list;
-	int count;
-} bcache;
+static Slab_cache bcache;
 
 static void entry_free( Backup_pid *to_free )
 {
 	Backup_pid *next;
 
-	if( bcache.count < CACHE_MAX )
-	{
-		pthread_mutex_lock( &bcache.lock );
-		for( ; to_free && bcache.count < CACHE_MAX; bcache.count++ )
-		{
-			next = to_free->next;
-			to_free->next = bcache.list;
-			bcache.list = to_free;
-			to_free = next;
-		}
-		pthread_mutex_unlock( &bcache.lock );
-	}
-	for( ; to_free; to_free = next)
+	for( ; to_free; to_free = next )
 	{
 		next = to_free->next;
-		free( to_free );
+		slab_free( &bcache, to_free );
 	}
 }
 
-/*IMP should be called from single thread. NOT THREAD SAFE*/
-/*use cache if available otherwise malloc*/
 static Backup_pid *entry_allocate( void )
 {
-	static Backup_pid *list = 0;
 	Backup_pid *tmp;
 
-	if( list )
-	{
-		tmp = list;
-		list = list->next;
-		memset( tmp, 0, sizeof(*tmp) );
-		return tmp;
-	}
-
-	if( bcache.count > 0 )
-	{
-		pthread_mutex_lock( &bcache.lock );
-		if( bcache.count <= 0 )
-		{
-			pthread_mutex_unlock( &bcache.lock );
-			goto dalloc;
-		}
-
-		tmp = bcache.list;
-		list = bcache.list->next;
-		bcache.list = NULL;
-		bcache.count = 0;
-		pthread_mutex_unlock( &bcache.lock );
-
-		memset( tmp, 0, sizeof(*tmp) );
-		return tmp;
-	}
-
-dalloc:
-	tmp = (Backup_pid *) malloc( sizeof(Backup_pid) );
-	if ( tmp )
+	if( ( tmp = (Backup_pid *) slab_alloc( &bcache ) ) )
 		memset( tmp, 0, sizeof(*tmp) );
 	return tmp;
 }
 
-/*this builds on top of memory cache management and emulates like above*/
-
-/*This additional layer is mainly to do waitpid without worrying 
-  about getting entry freed by someone else*/
-
-static Backup_pids pids1;
-static Backup_pids pids2;
+/*Monitor thread may still hold events for entries already
+  released by others. So released entries are kept here, and
+  the monitor frees them when it has nothing pending*/
 
 static struct {
 	pthread_mutex_t lock;
-	Backup_pids *pids1;
-	Backup_pids *pids2;
-} pid_holder;
+	Backup_pid *to_free;
+} reclaim;
 
-void backup_pid_init( int size )
+void backup_pid_init( void )
 {
-	thread_mutex_init( &bcache.lock );
-	bcache.list = 0;
-	bcache.count = 0;
-
-	size = size + size / 4;
-	thread_mutex_init( &pid_holder.lock );
-
-	pids1.s = (Backup_pid **) calloc( size, sizeof(Backup_pid) );
-	pids1.free_slot = 0;
-	pids1.in_use = 0;
-	pids1.size = size;
-	pids1.count = 0;
-	pids1.to_free = 0;
-	pid_holder.pids1 = &pids1;
-
-	pids2.s = (Backup_pid **) calloc( size, sizeof(Backup_pid) );
-	pids2.free_slot = 0;
-	pids2.in_use = 0;
-	pids2.size = size;
-	pids2.count = 0;
-	pids2.to_free = 0;
-	pid_holder.pids2 = &pids2;
+	slab_init( &bcache, "backup pid", sizeof(Backup_pid) );
+	thread_mutex_init( &reclaim.lock );
+	reclaim.to_free = NULL;
 }
 
-Backup_pids *backup_pids_get( void )
+Backup_pid *backup_pidmem_allocate( void )
 {
-	Backup_pids *pids;
+	Backup_pid *bp;
 
-	pthread_mutex_lock( &pid_holder.lock );
-	if( pid_holder.pids2->in_use )
-	{
-		pthread_mutex_unlock( &pid_holder.lock );
+	if( ! ( bp = entry_allocate() ) )
 		return NULL;
-	}
-	pid_holder.pids1->in_use = 1;
+	bp->pid = -1;
+	bp->pidfd = -1;
+	thread_mutex_init( &bp->lock );
+	thread_cond_init( &bp->wait );
 
-	/*swap*/
-	pids = pid_holder.pids1;
-	pid_holder.pids1 = pid_holder.pids2;
-	pid_holder.pids2 = pids;
+	return bp;
+}
 
-	pthread_mutex_unlock( &pid_holder.lock );
-	return pids;
+void backup_pidmem_free( Backup_pid *bp )
+{
+	pthread_mutex_lock( &reclaim.lock );
+	bp->next = reclaim.to_free;
+	reclaim.to_free = bp;
+	pthread_mutex_unlock( &reclaim.lock );
 }
 
-void backup_pids_unget( Backup_pids *pids )
+/*to be called from monitor thread only*/
+void backup_pidmem_reclaim( void )
 {
-	Backup_pid *to_free = 0;
-	Backup_pid *bp;
-	int free_slot = -1;
+	Backup_pid *to_free, *bp;
 
-	pthread_mutex_lock( &pid_holder.lock );
-	to_free = pids->to_free;
-	pids->to_free = NULL;
-	for( bp = to_free; bp; bp = bp->next )
-	{
-		pids->s[ bp->pids_idx ] = 0;
-		pids->count--;
-		if( free_slot < 0 )
-		    free_slot = bp->pids_idx;
-	}
-	pids->in_use = 0;
-	if( free_slot != -1 )
-		pids->free_slot = free_slot;
-	pthread_mutex_unlock( &pid_holder.lock );
+	pthread_mutex_lock( &reclaim.lock );
+	to_free = reclaim.to_free;
+	reclaim.to_free = NULL;
+	pthread_mutex_unlock( &reclaim.lock );
 
 	for( bp = to_free; bp; bp = bp->next )
 	{
+		if( bp->pidfd >= 0 )
+			close( bp->pidfd );
 		pthread_mutex_destroy( &bp->lock );
 		pthread_cond_destroy( &bp->wait );
 	}
 	entry_free( to_free );
 }
 
-static int free_slot_get( Backup_pids *pids )
-{
-	int start;
-	int i;
-
-	i = start = pids->free_slot;
-	do
-	{
-		if( ! pids->s[ i ] )
-		{
-			pids->free_slot++;
-			pids->free_slot %= pids->size;
-			return i;
-		}
-		i = ( i + 1 ) % pids->size;
-	} while ( i != start );
-	return -1;
-}
-
-/*use cache if available otherwise malloc*/
-Backup_pid *backup_pidmem_allocate( void )
-{
-	Backup_pid *bp;
-	int pids_idx;
-	Backup_pids *pids = 0;
-
-	bp = entry_allocate();
-	bp->pid = -1;
-	thread_mutex_init( &bp->lock );
-	thread_cond_init( &bp->wait );
-
-	pthread_mutex_lock( &pid_holder.lock );
-	pids = pid_holder.pids1;
-	pids_idx = free_slot_get( pids );
-	if( pids_idx < 0 ) {
-		pthread_mutex_unlock( &pid_holder.lock );
-		entry_free( bp );
-		return NULL;
-	}
-	bp->pids = pids;
-	bp->pids_idx = pids_idx;
-	pids->s[ pids_idx ] = bp;
-	pids->count++;
-	pthread_mutex_unlock( &pid_holder.lock );
-
-	return bp;
-}
-
-void backup_pidmem_free( Backup_pid *bp )
-{
-	pthread_mutex_lock( &pid_holder.lock );
-	if( bp->pids->in_use )
-	{
-		bp->next = bp->pids->to_free;
-		bp->pids->to_free = bp;
-		pthread_mutex_unlock( &pid_holder.lock );
-		return;
-	}
-	bp->pids->s[ bp->pids_idx ] = 0;
-	bp->pids->count--;
-	pthread_mutex_unlock( &pid_holder.lock );
-	bp->next = NULL;
-	pthread_mutex_destroy( &bp->lock );
-	pthread_cond_destroy( &bp->wait );
-	entry_free( bp );
-}
-
 
 
 
@@ -294,27 +149,15 @@ void *test_th(void *x)
 
 void *test_th2(void *x)
 {
-    Backup_pids *pids;
-    int i = 0, j;
-    Backup_pid *bc;
+    int i = 0;
 
     sleep (1);
 
     while (1) {
-	pids = backup_pids_get();
-	for( j = 0; j < pids->size; j++ )
-	{
-		bc = pids->s[ i ];
-		if( bc )
-		{
-			pthread_mutex_lock( &bc->lock );
-			pthread_mutex_unlock( &bc->lock );
-		}
-	}
-	backup_pids_unget(pids);
+	backup_pidmem_reclaim();
 	i++;
-	if (i == 10) {
-	    printf("backup_pids_get %d\n", i);
+	if (i == 1000000) {
+	    printf("backup_pidmem_reclaim %d\n", i);
 	    i = 0;
 	}
     }
@@ -324,7 +167,7 @@ int main(void)
 {
     pthread_t pt;
 
-    backup_pid_init(20000);
+    backup_pid_init();
 
     pthread_create(&pt, 0, test_th, 0);
     pthread_create(&pt, 0, test_th, 0);
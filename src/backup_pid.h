@@ -23,39 +23,36 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <limits.h>
 #include <pthread.h>
-
-typedef struct backup_pids Backup_pids;
+#include "session.h"
+#include "backup_dev.h"
 
 typedef struct backup_pid {
-	/*hash table info*/
-	unsigned int hash;
-	char name[ NAME_MAX+1 ];
-	pid_t pid;	/* backup pid*/
+	Session *s;	/*name this backup is for*/
+	pid_t pid;	/* backup pid. 0 once reaped*/
+	int pidfd;	/*readable when backup exits. -1 if none*/
 	time_t started;
 	pthread_mutex_t lock;
-	int waiting;
+	int waiting;	/*threads waiting for backup to finish*/
+	int done;	/*backup is gone*/
 	pthread_cond_t wait;
-
-	struct backup_pid *next;
-	Backup_pids *pids;
-	int pids_idx;
-	int kill;
+	int kill;	/*cancellation stage*/
+	Backup_dev *dev;	/*device slot held while running*/
+	struct backup_batch *batch;	/*process shared with other names*/
+	int engine;	/*no process. Runs in a thread of engine*/
+
+	/*time ordered list of monitor: running or cancelled*/
+	struct blist *on;
+	time_t due;
+	struct backup_pid *next_t;
+	struct backup_pid *prev_t;
+
+	struct backup_pid *next;	/*waiting to be freed*/
 } Backup_pid;
 
-struct backup_pids {
-	int size;
-	int count;
-	Backup_pid **s;
-	int free_slot;
-	int in_use;
-	Backup_pid *to_free;
-};
-
-void backup_pid_init( int size );
-Backup_pids *backup_pids_get( void );
-void backup_pids_unget( Backup_pids *pids );
+void backup_pid_init( void );
 
 Backup_pid *backup_pidmem_allocate( void );
 void backup_pidmem_free( Backup_pid *bc );
+void backup_pidmem_reclaim( void );
 
 #endif
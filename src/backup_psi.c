@@ -0,0 +1,263 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* backup concurrency following system pressure.
+
+   Kernel pressure stall information tells how much of the
+   time tasks were waiting for io or cpu. While it is high,
+   interactive users are stalling too, so backup limit is
+   halved. While it is low, limit grows by small steps back
+   to -c ceiling. Running backups are not touched; only new
+   ones wait.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include "msg.h"
+#include "miscfuncs.h"
+#include "thread.h"
+#include "time_mono.h"
+#include "stats.h"
+#include "backup_psi.h"
+
+#define PSI_IO_FILE		"/proc/pressure/io"
+#define PSI_CPU_FILE		"/proc/pressure/cpu"
+
+#define DFLT_FLOOR		4
+#define DFLT_IO_HIGH		10	/*percent of time stalled*/
+#define DFLT_CPU_HIGH		20
+#define DFLT_INTERVAL		5	/*secs*/
+#define INTERVAL_MAX		3600
+
+static struct {
+	int enabled;
+	int floor;
+	int interval;
+	double io_high;
+	double cpu_high;
+	const char *io_file;
+	const char *cpu_file;
+
+	pthread_mutex_t lock;
+	int limit;	/*0 until first reading*/
+	time_t last;
+	double io;	/*last readings. -1 if not available*/
+	double cpu;
+	unsigned long shrunk;
+	unsigned long grown;
+} psi = {
+	.floor = DFLT_FLOOR,
+	.interval = DFLT_INTERVAL,
+	.io_high = DFLT_IO_HIGH,
+	.cpu_high = DFLT_CPU_HIGH,
+	.io_file = PSI_IO_FILE,
+	.cpu_file = PSI_CPU_FILE,
+};
+
+/*share of time some tasks stalled in last 10 seconds*/
+static double psi_read( const char *path )
+{
+	char line[ 256 ];
+	double avg = -1;
+	FILE *fp;
+
+	if( ! ( fp = fopen( path, "r" ) ) )
+		return -1;
+	while( fgets( line, sizeof(line), fp ) )
+		if( sscanf( line, "some avg10=%lf", &avg ) == 1 )
+			break;
+	fclose( fp );
+	return avg;
+}
+
+/*how many backups may run now*/
+int backup_psi_limit( int ceiling )
+{
+	time_t now;
+	int limit, step;
+
+	if( ! psi.enabled )
+		return ceiling;
+
+	now = time_mono();
+	pthread_mutex_lock( &psi.lock );
+	if( psi.limit && now - psi.last < psi.interval )
+	{
+		limit = psi.limit < ceiling ? psi.limit : ceiling;
+		pthread_mutex_unlock( &psi.lock );
+		return limit;
+	}
+	psi.last = now;
+	psi.io = psi_read( psi.io_file );
+	psi.cpu = psi_read( psi.cpu_file );
+
+	limit = psi.limit ? psi.limit : psi.floor;
+	step = ceiling / 16 > 0 ? ceiling / 16 : 1;
+	if( psi.io > psi.io_high || psi.cpu > psi.cpu_high )
+	{
+		limit /= 2;
+		psi.shrunk++;
+	}
+	else if( psi.io < psi.io_high / 2 && psi.cpu < psi.cpu_high / 2 )
+	{
+		limit += step;
+		psi.grown++;
+	}
+
+	if( limit > ceiling )
+		limit = ceiling;
+	if( limit < psi.floor )
+		limit = psi.floor < ceiling ? psi.floor : ceiling;
+	if( limit != psi.limit )
+		msglog( MSG_DEBUG, "backup limit %d (io %.2f cpu %.2f)",
+						limit, psi.io, psi.cpu );
+	psi.limit = limit;
+	pthread_mutex_unlock( &psi.lock );
+	return limit;
+}
+
+static void backup_psi_stats( void )
+{
+	pthread_mutex_lock( &psi.lock );
+	msglog( MSG_NOTICE, "backup pressure: limit %d, io %.2f%% cpu %.2f%%, " \
+			"%lu times shrunk, %lu times grown", psi.limit,
+			psi.io, psi.cpu, psi.shrunk, psi.grown );
+	pthread_mutex_unlock( &psi.lock );
+}
+
+void backup_psi_init( void )
+{
+	if( ! psi.enabled )
+		return;
+
+	thread_mutex_init( &psi.lock );
+	psi.io = psi_read( psi.io_file );
+	psi.cpu = psi_read( psi.cpu_file );
+	if( psi.io < 0 && psi.cpu < 0 )
+		msglog( MSG_WARNING, "backup_psi_init: no pressure " \
+			"information in %s or %s. Backup limit will " \
+			"grow to its maximum", psi.io_file, psi.cpu_file );
+	stats_register( backup_psi_stats );
+}
+
+/**********command line option handling funtions***************/
+
+static int percent_option_check( char *value, const char *name )
+{
+	int pct;
+
+	if( ! value || ! string_to_number( value, &pct ) || pct > 100 )
+		msglog( MSG_FATAL, "invalid value for pressure " \
+					"suboption %s", name );
+	return pct;
+}
+
+static int number_option_check( char *value, const char *name,
+						int min, int max )
+{
+	int num;
+
+	if( ! value || ! string_to_number( value, &num )
+			|| num < min || num > max )
+		msglog( MSG_FATAL, "invalid value for pressure " \
+					"suboption %s", name );
+	return num;
+}
+
+static const char *path_option_check( char *value, const char *name )
+{
+	if( ! value || *value != '/' )
+		msglog( MSG_FATAL, "absolute path expected for pressure " \
+					"suboption %s", name );
+	return value;
+}
+
+/*min=NUM,io=PCT,cpu=PCT,interval=SECS,iofile=PATH,cpufile=PATH*/
+void backup_psi_option( char ch, char *arg, int valid )
+{
+	char *value;
+
+	enum {
+		FLOOR_IDX = 0,
+		IO_IDX,
+		CPU_IDX,
+		INTERVAL_IDX,
+		IOFILE_IDX,
+		CPUFILE_IDX,
+		END
+	};
+
+	char *const sos[] = {
+		[ FLOOR_IDX    ] = "min",
+		[ IO_IDX       ] = "io",
+		[ CPU_IDX      ] = "cpu",
+		[ INTERVAL_IDX ] = "interval",
+		[ IOFILE_IDX   ] = "iofile",
+		[ CPUFILE_IDX  ] = "cpufile",
+		[ END          ] = NULL
+	};
+
+	if( ! valid )
+		return;
+	psi.enabled = 1;
+
+	while( *arg != 0 )
+	{
+		switch( getsubopt( &arg, sos, &value ) )
+		{
+			case FLOOR_IDX:
+				psi.floor = number_option_check( value,
+					sos[ FLOOR_IDX ], 1, INT_MAX );
+				break;
+
+			case IO_IDX:
+				psi.io_high = percent_option_check( value,
+							sos[ IO_IDX ] );
+				break;
+
+			case CPU_IDX:
+				psi.cpu_high = percent_option_check( value,
+							sos[ CPU_IDX ] );
+				break;
+
+			case INTERVAL_IDX:
+				psi.interval = number_option_check( value,
+					sos[ INTERVAL_IDX ], 1, INTERVAL_MAX );
+				break;
+
+			case IOFILE_IDX:
+				psi.io_file = path_option_check( value,
+							sos[ IOFILE_IDX ] );
+				break;
+
+			case CPUFILE_IDX:
+				psi.cpu_file = path_option_check( value,
+							sos[ CPUFILE_IDX ] );
+				break;
+
+			default:
+				msglog( MSG_FATAL, "unknown pressure " \
+						"suboption %s", value );
+		}
+	}
+}
@@ -38,65 +38,115 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "msg.h"
 #include "miscfuncs.h"
 #include "thread.h"
+#include "slab.h"
+#include "stats.h"
 #include "time_mono.h"
+#include "session.h"
+#include "backup_dev.h"
+#include "backup_batch.h"
 #include "backup_queue.h"
 
 #ifdef TEST
 
-void backup_child_start(const char *name, const char *path);
+int backup_child_start(Session *s, Backup_dev *dev);
 int backup_child_count(void);
-void backup_child_kill(const char *name);
-void backup_child_wait(const char *name);
+int backup_child_cancel(Session *s);
+int backup_child_wait(Session *s);
+int backup_psi_limit(int ceiling);
+int backup_batch_start(Session **s, Backup_dev **dev, int n);
+int backup_worker_start(Session *s, Backup_dev *dev);
+int backup_engine_start(Session *s, Backup_dev *dev);
+void backup_journal_add(Session *s, const struct timespec *estamp);
+void backup_journal_remove(Session *s);
+void backup_snap_release(Session *s);
 
 #else
 #include "backup_child.h"
+#include "backup_psi.h"
+#include "backup_journal.h"
+#include "backup_engine.h"
+#include "backup_snap.h"
 #endif
 
-#define HASH_SIZE		13
+/*entries of one device in time order. Only the first of
+  them a scan can start is looked at, and a busy device is
+  passed over at once, however many entries wait for it*/
+typedef struct bqdev {
+	Backup_dev *dev;	/*NULL for names without device limit*/
+	struct bqueue *start_d;
+	struct bqueue *end_d;
+	struct bqueue *cur;	/*next one to start in this scan*/
+} Bqdev;
 
-typedef struct bqueue {
-	unsigned int hash;
+/*devices of backup_dev, and one list for names of none*/
+#define BQ_DEV_MAX		( BACKUP_DEV_MAX + 1 )
 
-	char dname[NAME_MAX+1];
-	char dpath[PATH_MAX+1];
-	time_t estamp;	 /*time when entry added to chain*/
+typedef struct bqueue {
+	Session *s;	/*name. Entry is found through its session.
+			  Path is asked from module when backup starts*/
+	struct timespec estamp;	/*time when entry added to chain*/
+	Backup_dev *dev;	/*device of real path*/
 
-	/*for hash double list*/
+	/*for memory cache list*/
 	struct bqueue *next;
-	struct bqueue *prev;
 
 	/*entry creation time stamp based double linked list*/
 	struct bqueue *next_t;
 	struct bqueue *prev_t;
 
+	/*same for entries of its device*/
+	Bqdev *qd;
+	struct bqueue *next_d;
+	struct bqueue *prev_d;
+
 	int in_bchain;
+	int cancelled;	/*name came back while in bchain*/
+	int retry;	/*no worker took it. Goes back to queue*/
 	struct bqueue *bchain_next;
 } Bqueue;
 
 static struct {
-	Bqueue **hash;
-	int hash_used;
-	int hash_size;
-
 	time_t wait; /*how long to wait before starting backup*/
 	int maxproc; /*max backup proc limit*/
+	int batch;	/*names for one backup process*/
+	time_t batch_age; /*how long due names may wait to fill a batch*/
+	int workers;	/*backups are jobs of running workers*/
+	int engine;	/*backups run in built in engine*/
 
-	/*mutex access to hash structure*/
+	/*mutex access to queue and session entries*/
 	pthread_mutex_t lock;
 
 	/*thread that keep track of entries
 	  which are ready for backup*/
 	pthread_t queue_watch; 
+	pthread_cond_t queue_wake;	/*queue got first entry or stopping*/
 
 	int stop; /* cleanup started? */
+	unsigned long wakes;	/*room for backups freed up*/
 
-	/*for time stamp based double linked list*/
+	/*for time stamp based double linked list. Entries
+	  leave it when moved to bchain*/
 	Bqueue *start_t;
 	Bqueue *end_t;
-	Bqueue *cur_t;
+	Bqueue *due_t;	/*first one not known to be due*/
+
+	/*device lists, only added to*/
+	Bqdev devs[ BQ_DEV_MAX ];
+	int ndevs;
 
-	pthread_cond_t bchain_wait;
 	Bqueue *bchain;
+
+	/*token bucket pacing backup starts. Used
+	  only by queue watching thread*/
+	int rate;	/*starts per second. 0 for no limit*/
+	int burst;	/*starts allowed at once*/
+	double tokens;
+	struct timespec refill;
+
+	/*statistics*/
+	unsigned long started;
+	unsigned long started_last;
+	struct timespec stats_last;
 } BQ;
 
 
@@ -107,169 +157,110 @@ static struct {
 
 /*for dynamic memory cache to minimize dependence on malloc.*/
 
-#define CACHE_MAX 50
-
-static struct {
-	int count;
-	Bqueue *list;
-	pthread_mutex_t lock;
-} bcache;
+static Slab_cache bcache;
 
 static void entry_free( Bqueue *bq )
 {
-	Bqueue *tmp;
-
-	if( bcache.count < CACHE_MAX )
-	{
-		pthread_mutex_lock( &bcache.lock );
-		if( bcache.count >= CACHE_MAX )
-		{
-			pthread_mutex_unlock( &bcache.lock );
-			free( bq );
-			return;
-		}
-		tmp = bcache.list;
-		bcache.list = bq;
-		bq->next = tmp;
-		bcache.count++;
-		pthread_mutex_unlock( &bcache.lock );
-
-		return;
-	}
-	free( bq );
+	slab_free( &bcache, bq );
 }
 
-/*use cache if available otherwise malloc*/
 static Bqueue *entry_allocate( void )
 {
 	Bqueue *tmp;
 
-	if( bcache.count > 0 )
-	{
-		pthread_mutex_lock( &bcache.lock );
-		if( bcache.count <= 0 )
-		{
-			pthread_mutex_unlock( &bcache.lock );
-			goto dalloc;
-		}
-
-		tmp = bcache.list;
-		bcache.list = bcache.list->next;
-		bcache.count--;
-		pthread_mutex_unlock( &bcache.lock );
-
-		memset( tmp, 0, sizeof(*tmp) );
-		return tmp;
-	}
-
-dalloc:
-	if( ( tmp = (Bqueue *) malloc( sizeof(Bqueue) ) ) )
+	if( ( tmp = (Bqueue *) slab_alloc( &bcache ) ) )
 		memset( tmp, 0, sizeof(*tmp) );
 	return tmp;
 }
 
 
 /***********************************************/
-/* hash manipulation		               */
+/* queue manipulation		               */
 /***********************************************/
 
 
-#define QUEUE_ENTRY_LOCATE(name, hash) \
-		(queue_entry_locate((name), (hash), (hash) % BQ.hash_size))
-
-/*
-   Mutual exclusion should be in effect before calling this.
- */
-static Bqueue *queue_entry_locate( const char *name, unsigned int hash,
-								    int key )
-{
-	Bqueue *bq;
-
-	bq = BQ.hash[ key ];
-
-	while( bq )
-	{
-		if( hash == bq->hash && 
-				*name == bq->dname[0] &&
-				! strcmp( bq->dname, name ) )
-			return bq;
-		bq = bq->next;
-	}
-	return NULL;
-}
-
-static void hash_resize( void )
-{
-	int new_size;
-	int old_size = BQ.hash_size;
-	Bqueue **new_hash;
-	Bqueue **dptr;
-	Bqueue **h = BQ.hash;
-	Bqueue *entry;
-	Bqueue *next;
-
-	new_size = BQ.hash_size * 2;
-	new_size |= 1;
-
-	new_hash = ( Bqueue ** ) calloc( new_size, sizeof(Bqueue *) );
-	if( new_hash == NULL )
-	    return;
-
-	while( old_size-- > 0 )
-	{
-		for( entry = *h++; entry; entry = next)
-		{
-			next = entry->next;
-			dptr = &new_hash[ entry->hash % new_size ];
-			if (*dptr) {
-			    entry->next = *dptr;
-			    (*dptr)->prev = entry;
-			} else {
-			    entry->next = NULL;
-			}
-			*dptr = entry;
-			entry->prev = NULL;
-		}
-	}
-	BQ.hash_size = new_size;
-	free(BQ.hash);
-	BQ.hash = new_hash;
-}
-
 /*Only linked lists and pointers to them are manipulated.
   Mutual exclusion should be in effect before calling this.
 
   Does not deal with bchain list.
 */
-static void queue_entry_release( Bqueue *bq )
+static void queue_entry_unlink( Bqueue *bq )
 {
 	Bqueue *nxt, *prv;
-	int key;
-
-	BQ.hash_used--;
 
 	prv = bq->prev_t;
 	nxt = bq->next_t;
 	/*update BQ structure if anything points to current entry*/
 	if( bq == BQ.start_t ) BQ.start_t = nxt;
-	if( bq == BQ.cur_t )   BQ.cur_t = nxt;
 	if( bq == BQ.end_t )   BQ.end_t = prv;
+	if( bq == BQ.due_t )   BQ.due_t = nxt;
 
 	/*release links in time based double link list*/
 	if( nxt ) nxt->prev_t = prv;
 	if( prv ) prv->next_t = nxt;
 
-	/*release links in hash double link list*/
-	prv = bq->prev;
-	nxt = bq->next;
+	/*and in list of its device*/
+	prv = bq->prev_d;
+	nxt = bq->next_d;
+	if( bq == bq->qd->start_d ) bq->qd->start_d = nxt;
+	if( bq == bq->qd->end_d )   bq->qd->end_d = prv;
+	if( nxt ) nxt->prev_d = prv;
+	if( prv ) prv->next_d = nxt;
+}
+
+/*a was queued before b*/
+static int queue_entry_before( Bqueue *a, Bqueue *b )
+{
+	if( a->estamp.tv_sec != b->estamp.tv_sec )
+		return a->estamp.tv_sec < b->estamp.tv_sec;
+	return a->estamp.tv_nsec < b->estamp.tv_nsec;
+}
+
+/*entry back from bchain goes to its place by time stamp.
+  It is due, so not far from head*/
+static void queue_entry_insert( Bqueue *bq )
+{
+	Bqdev *d = bq->qd;
+	Bqueue *nxt;
+
+	for( nxt = BQ.start_t ; nxt && ! queue_entry_before( bq, nxt ) ;
+							nxt = nxt->next_t );
+	bq->next_t = nxt;
+	bq->prev_t = nxt ? nxt->prev_t : BQ.end_t;
+	if( bq->prev_t ) bq->prev_t->next_t = bq;
+	else BQ.start_t = bq;
+	if( nxt ) nxt->prev_t = bq;
+	else BQ.end_t = bq;
+
+	for( nxt = d->start_d ; nxt && ! queue_entry_before( bq, nxt ) ;
+							nxt = nxt->next_d );
+	bq->next_d = nxt;
+	bq->prev_d = nxt ? nxt->prev_d : d->end_d;
+	if( bq->prev_d ) bq->prev_d->next_d = bq;
+	else d->start_d = bq;
+	if( nxt ) nxt->prev_d = bq;
+	else d->end_d = bq;
+}
+
+/*list of entries of device. There is room for every
+  device backup_dev knows. Mutual exclusion should be in
+  effect*/
+static Bqdev *queue_dev( Backup_dev *dev )
+{
+	int i;
 
-	if( nxt ) nxt->prev = prv;
-	if( prv ) prv->next = nxt;
+	for( i = 0; i < BQ.ndevs; i++ )
+		if( BQ.devs[ i ].dev == dev )
+			return &BQ.devs[ i ];
+	BQ.devs[ i ].dev = dev;
+	BQ.ndevs++;
+	return &BQ.devs[ i ];
+}
 
-	key = bq->hash % BQ.hash_size;
-	/*first entry in hash chain?*/
-	if( BQ.hash[ key ] == bq )
-	       BQ.hash[ key ] = nxt;
+static void queue_entry_release( Bqueue *bq )
+{
+	bq->s->bq = NULL;
+	queue_entry_unlink( bq );
 }
 
 /*
@@ -281,44 +272,39 @@ static void queue_entry_release( Bqueue *bq )
 */
 static int queue_entry_add( Bqueue *new )
 {
-	int key;
-	unsigned int hash;
-	Bqueue **dptr;
-
-	BQ.hash_used++;
-	if (BQ.hash_used > BQ.hash_size) {
-		hash_resize();
-	}
-
-	hash = new->hash = string_hash( new->dname );
-	key = hash % BQ.hash_size;
-	if (queue_entry_locate(new->dname, hash, key))
+	/*queued already*/
+	if( new->s->bq )
 		return (0);
-
-	dptr = &BQ.hash[ key ];
-	new->next = *dptr;
-	if( *dptr )
-		(*dptr)->prev = new;
-	*dptr = new;
-	new->prev = NULL;
+	new->s->bq = new;
 
 	/*update time based linked list*/
 	new->next_t = NULL;
 	if( ! BQ.start_t )
 	{
 		new->prev_t = NULL;
-		BQ.cur_t = BQ.start_t = BQ.end_t = new;
+		BQ.start_t = BQ.end_t = new;
 	}
 	else
 	{
 		new->prev_t = BQ.end_t;
-		if( ! BQ.cur_t )
-		{
-			BQ.cur_t = new;
-		}
 		BQ.end_t->next_t = new;
 		BQ.end_t = new;
 	}
+	/*queue watch may sleep with no entry to wait for*/
+	if( ! BQ.due_t )
+	{
+		BQ.due_t = new;
+		pthread_cond_signal( &BQ.queue_wake );
+	}
+
+	/*and list of its device*/
+	new->qd = queue_dev( new->dev );
+	new->next_d = NULL;
+	new->prev_d = new->qd->end_d;
+	if( new->qd->end_d )
+		new->qd->end_d->next_d = new;
+	else new->qd->start_d = new;
+	new->qd->end_d = new;
 	return 1;
 }
 
@@ -336,104 +322,383 @@ static int queue_entry_add( Bqueue *new )
 	starting as many backup programs as we wish at a time in between waitings.
 */
 
-static void bchain_process( void )
+static double timespec_diff( struct timespec *a, struct timespec *b )
 {
-	Bqueue *bc, *next;
+	return ( a->tv_sec - b->tv_sec ) + ( a->tv_nsec - b->tv_nsec ) / 1e9;
+}
+
+/*wait for a token. Bucket fills at rate per second
+  and holds burst tokens at most. Returns 0 if stopping*/
+static int bucket_take( void )
+{
+	struct timespec now;
+
+	while( 1 )
+	{
+		if( __atomic_load_n( &BQ.stop, __ATOMIC_RELAXED ) )
+			return 0;
+		if( BQ.rate <= 0 )
+			return 1;
+
+		mono_timespec( &now, 0, 0 );
+		BQ.tokens += timespec_diff( &now, &BQ.refill ) * BQ.rate;
+		if( BQ.tokens > BQ.burst )
+			BQ.tokens = BQ.burst;
+		BQ.refill = now;
+
+		if( BQ.tokens >= 1 )
+		{
+			BQ.tokens -= 1;
+			return 1;
+		}
+		/*at most a second away, as rate is at least one*/
+		mono_nanosleep( ( 1 - BQ.tokens ) / BQ.rate * 999999999 );
+	}
+}
+
+static int bchain_cancelled( Bqueue *bc )
+{
+	int r;
+
+	pthread_mutex_lock( &BQ.lock );
+	r = bc->cancelled;
+	pthread_mutex_unlock( &BQ.lock );
+	return r;
+}
+
+/*backup was not started. A name cancelled has left
+  journal already, and may be queued again on a new snapshot*/
+static void bchain_dropped( Bqueue *bc )
+{
+	int cancelled;
+
+	pthread_mutex_lock( &BQ.lock );
+	if( ! ( cancelled = bc->cancelled ) )
+		backup_journal_remove( bc->s );
+	pthread_mutex_unlock( &BQ.lock );
+	if( ! cancelled )
+		backup_snap_release( bc->s );
+}
+
+/*Returns -1 if no worker has room for it now*/
+static int bchain_start( Bqueue *bc )
+{
+	if( BQ.workers )
+		return backup_worker_start( bc->s, bc->dev );
+	if( BQ.engine )
+		return backup_engine_start( bc->s, bc->dev );
+	return backup_child_start( bc->s, bc->dev );
+}
+
+/*Names coming back do not wait for bchain. They only mark
+  their entry, and backup started meanwhile is cancelled here.
+  Device slot taken for entry goes with backup started. Nothing
+  is started once stopping; journal keeps names left. Entries
+  no worker took go back to queue, and their number is returned*/
+static int bchain_process( void )
+{
+	Bqueue *bc, *next, *gone = NULL;
+	int stopping = 0, r, retried = 0;
 
 	for( bc = BQ.bchain ; bc ; bc = bc->bchain_next )
 	{
-		backup_child_start(bc->dname, bc->dpath);
-		mono_nanosleep( 100000000 );
+		r = 0;
+		if( ! stopping && ! bchain_cancelled( bc ) )
+			stopping = ! bucket_take();
+		if( stopping || bchain_cancelled( bc ) ||
+					( r = bchain_start( bc ) ) <= 0 )
+		{
+			backup_dev_put( bc->dev );
+			if( r < 0 )
+				bc->retry = 1;
+			else bchain_dropped( bc );
+			continue;
+		}
+		__atomic_add_fetch( &BQ.started, 1, __ATOMIC_RELAXED );
+		if( bchain_cancelled( bc ) )
+			backup_child_cancel( bc->s );
+	}
+
+	/*cancelled entry may be replaced already. Entry back
+	  in queue may be removed as soon as lock is left*/
+	pthread_mutex_lock( &BQ.lock );
+	for( bc = BQ.bchain ; bc ; bc = next )
+	{
+		next = bc->bchain_next;
+		if( bc->retry && ! bc->cancelled )
+		{
+			bc->retry = bc->in_bchain = 0;
+			queue_entry_insert( bc );
+			retried++;
+			continue;
+		}
+		if( bc->s->bq == bc )
+			bc->s->bq = NULL;
+		bc->bchain_next = gone;
+		gone = bc;
+	}
+	pthread_mutex_unlock( &BQ.lock );
+
+	for( bc = gone ; bc ; bc = next ) {
+		next = bc->bchain_next;
+		session_put(bc->s);
+		entry_free(bc);
+	}
+	return retried;
+}
+
+/*Same as above, but names go in batches to backup processes*/
+static void bchain_process_batch( void )
+{
+	Session *s[ BACKUP_BATCH_MAX ];
+	Backup_dev *dev[ BACKUP_BATCH_MAX ];
+	Bqueue *bq[ BACKUP_BATCH_MAX ];
+	Bqueue *bc, *next;
+	int i, n;
+
+	for( bc = BQ.bchain ; bc ; )
+	{
+		for( n = 0 ; bc && n < BQ.batch ; bc = bc->bchain_next )
+		{
+			if( bchain_cancelled( bc ) )
+			{
+				backup_dev_put( bc->dev );
+				continue;
+			}
+			bq[ n ] = bc;
+			s[ n ] = bc->s;
+			dev[ n++ ] = bc->dev;
+		}
+		if( ! n )
+			break;
+
+		if( ! bucket_take() )
+		{
+			for( i = 0 ; i < n ; i++ )
+			{
+				backup_dev_put( dev[ i ] );
+				bchain_dropped( bq[ i ] );
+			}
+			continue;
+		}
+		__atomic_add_fetch( &BQ.started, backup_batch_start( s, dev, n ),
+							__ATOMIC_RELAXED );
+		for( i = 0 ; i < n ; i++ )
+			if( ! s[ i ] )
+				bchain_dropped( bq[ i ] );
+			else if( bchain_cancelled( bq[ i ] ) )
+				backup_child_cancel( s[ i ] );
 	}
 
 	pthread_mutex_lock( &BQ.lock );
 	for( bc = BQ.bchain ; bc ; bc = bc->bchain_next )
-		queue_entry_release( bc );
+		if( bc->s->bq == bc )
+			bc->s->bq = NULL;
 	pthread_mutex_unlock( &BQ.lock );
 
-	pthread_cond_broadcast( &BQ.bchain_wait );
 	for( bc = BQ.bchain ; bc ; bc = next ) {
 		next = bc->bchain_next;
+		session_put(bc->s);
 		entry_free(bc);
 	}
 }
 
-/*monitor time based linked list
-  and start backup when wait time expired
- */
+/*Entries are appended as they come and all wait the same time,
+  so the time based list is ordered by deadline too. Only its head
+  decides how long to sleep. Backups start oldest first from the
+  heads of device lists. Entries of a busy device, or of a name
+  whose backup is not gone yet, stay and are looked at again
+  when a backup is gone or a device slot is given back*/
+
+#define BACK_START_MAX		300
+
+/*time to start backup for entry*/
+static int queue_entry_due( Bqueue *bq, struct timespec *now )
+{
+	if( now->tv_sec != bq->estamp.tv_sec + BQ.wait )
+		return now->tv_sec > bq->estamp.tv_sec + BQ.wait;
+	return now->tv_nsec >= bq->estamp.tv_nsec;
+}
 
-static void queue_watch_wait( int dift )
+/*device list with the oldest due entry that may start now.
+  Entries waiting for a backup of their name to go are passed
+  over; they are no more than backups running. Mutual
+  exclusion should be in effect*/
+static Bqdev *queue_dev_next( struct timespec *now )
 {
-	while( ! BQ.cur_t || dift > 0 )
+	Bqdev *d, *best = NULL;
+	int i;
+
+	for( i = 0; i < BQ.ndevs; i++ )
 	{
-		sleep( 1 );
-		if( dift > 0 )
-			dift--;
-		if( BQ.stop )
-			pthread_exit( NULL );
+		d = &BQ.devs[ i ];
+		while( d->cur && __atomic_load_n( &d->cur->s->bp,
+							__ATOMIC_RELAXED ) )
+			d->cur = d->cur->next_d;
+		if( d->cur && queue_entry_due( d->cur, now ) && ( ! best ||
+				queue_entry_before( d->cur, best->cur ) ) )
+			best = d;
 	}
-	if( BQ.stop )
-		pthread_exit( NULL );
+	return best;
 }
 
-#define BACK_START_MAX		300
+/*sleep until head of list is due, something is queued or
+  cleanup starts. Mutual exclusion should be in effect*/
+static void queue_watch_wait( struct timespec *now )
+{
+	struct timespec due;
+
+	while( ! BQ.stop )
+	{
+		if( ! BQ.start_t )
+			pthread_cond_wait( &BQ.queue_wake, &BQ.lock );
+		else if( ! queue_entry_due( BQ.start_t, mono_timespec( now, 0, 0 ) ) )
+		{
+			due = BQ.start_t->estamp;
+			due.tv_sec += BQ.wait;
+			pthread_cond_timedwait( &BQ.queue_wake, &BQ.lock, &due );
+		}
+		else return;
+	}
+}
+
+/*due entries all wait for room. Sleep until some is freed,
+  one more entry gets due, or cleanup starts. now is when
+  the due ones were looked at. Mutual exclusion should be
+  in effect*/
+static void queue_watch_blocked( struct timespec *now )
+{
+	unsigned long wakes = BQ.wakes;
+	struct timespec due;
+
+	while( BQ.due_t && queue_entry_due( BQ.due_t, now ) )
+		BQ.due_t = BQ.due_t->next_t;
+
+	while( wakes == BQ.wakes && ! BQ.stop )
+	{
+		if( ! BQ.due_t )
+			pthread_cond_wait( &BQ.queue_wake, &BQ.lock );
+		else if( ! queue_entry_due( BQ.due_t, mono_timespec( now, 0, 0 ) ) )
+		{
+			due = BQ.due_t->estamp;
+			due.tv_sec += BQ.wait;
+			pthread_cond_timedwait( &BQ.queue_wake, &BQ.lock, &due );
+		}
+		else return;
+	}
+}
+
+/*batch is not full yet. Due names wait a bit more for others
+  until head of list is batch age past due. Mutual exclusion
+  should be in effect*/
+static int queue_batch_wait( struct timespec *now )
+{
+	struct timespec due;
+	Bqueue *bq;
+	int n = 0;
+
+	for( bq = BQ.start_t ; bq && n < BQ.batch
+			&& queue_entry_due( bq, now ) ; bq = bq->next_t )
+		n++;
+	if( n >= BQ.batch )
+		return 0;
+
+	due = BQ.start_t->estamp;
+	due.tv_sec += BQ.wait + BQ.batch_age;
+	if( now->tv_sec != due.tv_sec ? now->tv_sec > due.tv_sec
+				: now->tv_nsec >= due.tv_nsec )
+		return 0;
+	pthread_cond_timedwait( &BQ.queue_wake, &BQ.lock, &due );
+	return 1;
+}
 
 /*monitor queue*/
 static void *queue_watch_thread( void *x )
 {
-	int dift;
-	int i;
-	time_t cte;
-	Bqueue **bchain;
+	int i, retried;
+	unsigned long wakes;
+	struct timespec now;
+	Bqueue **bchain, *bq;
+	Bqdev *d;
 	int child_count;
+	int limit;
 
+	pthread_mutex_lock( &BQ.lock );
 	while( 1 )
 	{
-		dift = 0;
-
-		/* get locks and set something to workon*/
-		queue_watch_wait( dift );
-		child_count = backup_child_count();
-		if( child_count < 0 || pthread_mutex_trylock( &BQ.lock ) )
-		{
-			dift = 1;
+		queue_watch_wait( &now );
+		if( BQ.stop )
+			break;
+		if( BQ.batch > 1 && BQ.batch_age && queue_batch_wait( &now ) )
 			continue;
-		}
 
-		cte = time_mono();
-		/* still got to wait for starting backup?*/
-		if( ! BQ.cur_t ||
-			( dift = BQ.wait - ( cte - BQ.cur_t->estamp ) ) > 0 )
+		/*backup process limit reached. Look again when a backup
+		  finishes; one is running, as limit is never below 0.
+		  Limit itself may be lowered under system pressure*/
+		limit = backup_psi_limit( BQ.maxproc );
+		child_count = backup_child_count();
+		if( child_count > limit )
 		{
-			pthread_mutex_unlock( &BQ.lock );
+			wakes = BQ.wakes;
+			while( wakes == BQ.wakes && ! BQ.stop )
+				pthread_cond_wait( &BQ.queue_wake, &BQ.lock );
 			continue;
 		}
 
 		bchain = &BQ.bchain;
 		*bchain = NULL;
-		/*who is ready for backup? make a list first while mutex locked*/
-		for( i = 0 ; i < BACK_START_MAX
-				    && ( ! BQ.wait || dift <= 0 )
-				    && BQ.cur_t
-				    && child_count + i <= BQ.maxproc; i++ )
+		/*who is ready for backup? make a list first while mutex
+		  locked. Entries of a busy device do not hold back those
+		  of other devices behind them*/
+		for( i = 0; i < BQ.ndevs; i++ )
+			BQ.devs[ i ].cur = BQ.devs[ i ].start_d;
+		for( i = 0 ; i < BACK_START_MAX && child_count + i <= limit
+				&& ( d = queue_dev_next( &now ) ) ; )
 		{
-			*bchain = BQ.cur_t;
-			BQ.cur_t->in_bchain = 1;
-			bchain = &( BQ.cur_t->bchain_next );
+			bq = d->cur;
+			d->cur = bq->next_d;
+			/*none of device can start*/
+			if( ! backup_dev_take( bq->dev ) )
+			{
+				d->cur = NULL;
+				continue;
+			}
+			queue_entry_unlink( bq );
+			bq->in_bchain = 1;
+			*bchain = bq;
+			bchain = &( bq->bchain_next );
 			*bchain = NULL;
-			if( ( BQ.cur_t = BQ.cur_t->next_t ) )
-				dift = BQ.wait - ( cte - BQ.cur_t->estamp );
+			i++;
 		}
+
+		/*due ones all wait for their devices or old backups*/
+		if( ! BQ.bchain )
+		{
+			queue_watch_blocked( &now );
+			continue;
+		}
+		wakes = BQ.wakes;
 		pthread_mutex_unlock( &BQ.lock );
 
-		/*something in bchain list?*/
-		if( BQ.bchain )
-			bchain_process();
+		if( BQ.batch > 1 )
+		{
+			bchain_process_batch();
+			retried = 0;
+		}
+		else retried = bchain_process();
+		pthread_mutex_lock( &BQ.lock );
+
+		/*workers are all full. Look again when one has room*/
+		while( retried && wakes == BQ.wakes && ! BQ.stop )
+			pthread_cond_wait( &BQ.queue_wake, &BQ.lock );
 	}
-    return x;
+	pthread_mutex_unlock( &BQ.lock );
+	return x;
 }
 
-void backup_queue_add( const char *name, const char *path )
+/*estamp is when name was queued first, on monotonic clock.
+  Names must come in order of it*/
+void backup_queue_add_at( Session *s, const struct timespec *estamp )
 {
 	int r;
 	Bqueue *bc;
@@ -449,40 +714,55 @@ void backup_queue_add( const char *name, const char *path )
 	}
 
 	/* initialize entry data here*/
-	string_n_copy( bc->dname, name, sizeof(bc->dname) );
-	string_n_copy( bc->dpath, path, sizeof(bc->dpath) );
-	bc->estamp = time_mono();
+	bc->s = s;
+	bc->dev = backup_dev_lookup( s->name );
+	bc->estamp = *estamp;
+
+	/*queued entry keeps session alive*/
+	session_hold( s );
 
 	/*add to the list and update links while mutex locked*/
 	pthread_mutex_lock( &BQ.lock );
-	r = queue_entry_add( bc );
+	if( ( r = queue_entry_add( bc ) ) )
+		backup_journal_add( s, &bc->estamp );
 	pthread_mutex_unlock( &BQ.lock );
 
-	if( ! r )
+	if( ! r ) {
+	    session_put( s );
 	    entry_free( bc );
+	}
 }
 
-int backup_queue_remove( const char *name )
+void backup_queue_add( Session *s )
 {
-	Bqueue *bq;
-	unsigned int hash;
+	struct timespec now;
+
+	backup_queue_add_at( s, mono_timespec( &now, 0, 0 ) );
+}
 
-	hash = string_hash( name );
+int backup_queue_remove( Session *s )
+{
+	Bqueue *bq;
 
 	pthread_mutex_lock( &BQ.lock );
-	bq = QUEUE_ENTRY_LOCATE( name, hash );
-	if( bq ) {
-		/* entry in bchain list? then wait*/
+	if( ( bq = s->bq ) ) {
+		backup_journal_remove( s );
+		/* entry in bchain list? then let bchain_process
+		   know, and leave room for a new entry*/
 		if( bq->in_bchain )
 		{
-			pthread_cond_wait( &( BQ.bchain_wait ), &BQ.lock );
+			bq->cancelled = 1;
+			s->bq = NULL;
 			pthread_mutex_unlock( &BQ.lock );
-			return 0;
+			backup_snap_release( s );
+			return 1;
 		}
 		else
 		{
 			queue_entry_release( bq );
 			pthread_mutex_unlock( &BQ.lock );
+			backup_snap_release( s );
+			session_put( s );
 			entry_free( bq );
 			return (1);
 		}
@@ -491,37 +771,82 @@ int backup_queue_remove( const char *name )
 	return 0;
 }
 
+/*backup done, device slot given back, or worker ready.
+  Entries waiting for room are looked at again. Queue watch
+  looks again by itself after giving back what it took*/
+void backup_queue_wake( void )
+{
+	if( pthread_equal( pthread_self(), BQ.queue_watch ) )
+		return;
+	pthread_mutex_lock( &BQ.lock );
+	BQ.wakes++;
+	pthread_cond_signal( &BQ.queue_wake );
+	pthread_mutex_unlock( &BQ.lock );
+}
+
 void backup_queue_stop_set( void )
 {
+	pthread_mutex_lock( &BQ.lock );
 	BQ.stop = 1;
+	pthread_cond_signal( &BQ.queue_wake );
+	pthread_mutex_unlock( &BQ.lock );
 }
 
 /*before autodir exit*/
 void backup_queue_stop( void )
 {
-	BQ.stop = 1;
+	backup_queue_stop_set();
 	pthread_join( BQ.queue_watch, NULL );
 }
 
+static void backup_queue_stats( void )
+{
+	struct timespec now;
+	unsigned long started;
+	double secs;
+
+	mono_timespec( &now, 0, 0 );
+	started = __atomic_load_n( &BQ.started, __ATOMIC_RELAXED );
+	secs = timespec_diff( &now, &BQ.stats_last );
+
+	if( BQ.rate > 0 )
+		msglog( MSG_NOTICE, "backup queue: %lu backups started, " \
+			"%.1f/sec since last report, limit %d/sec burst %d",
+			started, secs > 0 ? ( started - BQ.started_last ) / secs : 0,
+			BQ.rate, BQ.burst );
+	else
+		msglog( MSG_NOTICE, "backup queue: %lu backups started, " \
+			"%.1f/sec since last report, no limit", started,
+			secs > 0 ? ( started - BQ.started_last ) / secs : 0 );
+
+	BQ.started_last = started;
+	BQ.stats_last = now;
+}
+
 /* startup initialization*/
-void backup_queue_init( int bwait, int maxproc )
+void backup_queue_init( int bwait, int maxproc, int rate, int burst,
+				int batch, int batch_age, int workers,
+				int engine )
 {
 	memset( &BQ, 0, sizeof(BQ) );
-	BQ.hash = (Bqueue **) calloc( HASH_SIZE, sizeof(Bqueue *) );
-	if( ! BQ.hash )
-		msglog( MSG_FATAL, 
-			"backup_queue_init: could not allocate memory" );
-	BQ.hash_size = HASH_SIZE;
 
 	BQ.wait = bwait;
 	BQ.maxproc = maxproc;
+	BQ.batch = batch;
+	BQ.batch_age = batch_age;
+	BQ.workers = workers;
+	BQ.engine = engine;
+	BQ.rate = rate;
+	BQ.burst = burst > 0 ? burst : 1;
+	BQ.tokens = BQ.burst;
+	mono_timespec( &BQ.refill, 0, 0 );
+	BQ.stats_last = BQ.refill;
+	stats_register( backup_queue_stats );
 
         thread_mutex_init(&BQ.lock);
-        thread_cond_init(&BQ.bchain_wait);
+        thread_cond_init(&BQ.queue_wake);
 
-        thread_mutex_init(&bcache.lock);
-	bcache.list = NULL;
-	bcache.count = 0;
+	slab_init( &bcache, "backup queue", sizeof(Bqueue) );
 
 	if( ! thread_new_joinable( queue_watch_thread, NULL, &BQ.queue_watch ) )
 		msglog( MSG_FATAL, 
@@ -552,10 +877,11 @@ void backup_child_stop(void)
 {
 }
 
-void backup_child_start(const char *name, const char *path)
+int backup_child_start(Session *s, Backup_dev *dev)
 {
-    printf("start %s, path %s\n", name, path);
+    printf("start %s\n", s->name);
     sleep( 5 );
+    return 1;
 }
 
 int backup_child_count(void)
@@ -563,40 +889,93 @@ int backup_child_count(void)
     return (1);
 }
 
-void backup_child_kill(const char *name)
+int backup_child_cancel(Session *s)
+{
+    printf("cancel %s\n", s->name);
+    return (1);
+}
+
+int backup_child_wait(Session *s)
+{
+    printf("wait %s\n", s->name);
+    return 0;
+}
+
+int backup_psi_limit(int ceiling)
+{
+    return ceiling;
+}
+
+Backup_dev *backup_dev_lookup(const char *name)
+{
+    return NULL;
+}
+
+int backup_dev_take(Backup_dev *d)
+{
+    return 1;
+}
+
+void backup_dev_put(Backup_dev *d)
 {
-    printf("kill %s\n", name);
-    sleep( 5 );
 }
 
-void backup_child_wait(const char *name)
+void backup_journal_add(Session *s, const struct timespec *estamp)
 {
-    printf("wait %s\n", name);
+}
+
+void backup_journal_remove(Session *s)
+{
+}
+
+void backup_snap_release(Session *s)
+{
+}
+
+int backup_worker_start(Session *s, Backup_dev *dev)
+{
+    printf("job %s\n", s->name);
+    return 1;
+}
+
+int backup_engine_start(Session *s, Backup_dev *dev)
+{
+    printf("engine %s\n", s->name);
+    return 1;
+}
+
+int backup_batch_start(Session **s, Backup_dev **dev, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	printf("batch %s\n", s[i]->name);
+    return n;
 }
 
 #ifdef TEST1
 
-void *test_th(void *s)
+void *test_th(void *v)
 {
-    char *str = (char *) s;
+    Session *s = session_get((char *) v);
     int i = 0;
 
     sleep(2);
     while (1) {
 	i++;
-	backup_queue_add(str, "/tmp");
+	backup_queue_add(s);
 	//sleep(1);
 	//backup_queue_remove(str);
 	if (i == 1000000) {
-	    printf("%s: %d\n", str, i);
+	    printf("%s: %d\n", s->name, i);
 	    i = 0;
 	}
     }
 }
 
-void *test_th2(void *s)
+void *test_th2(void *v)
 {
-    char *str = (char *) s;
+    Session *s = session_get((char *) v);
     int i = 0;
 
     sleep(2);
@@ -604,9 +983,9 @@ void *test_th2(void *s)
 	i++;
 	//backup_queue_add(str, "/tmp");
 	//sleep(1);
-	backup_queue_remove(str);
+	backup_queue_remove(s);
 	if (i == 1000000) {
-	    printf("%s: %d\n", str, i);
+	    printf("%s: %d\n", s->name, i);
 	    i = 0;
 	}
     }
@@ -621,7 +1000,8 @@ int main(void)
     msg_option_verbose('x', "", 1);
     msg_init();
     msg_console_on();
-    backup_queue_init(0, 1000);
+    session_init();
+    backup_queue_init(0, 1000, 10, 10, 1, 0, 0, 0);
 
     pthread_create(&id, 0, test_th, "1");
     pthread_create(&id, 0, test_th, "2");
@@ -770,5 +1150,75 @@ int main(void)
     pthread_join(id, NULL);
 }
 
+#endif
+
+#ifdef TEST3
+
+#include <assert.h>
+#include <malloc.h>
+
+/* memory kept per name queued for backup, before and after the
+   session table. A name waiting for backup is not mounted, so
+   it had only its backup queue entry before. That entry is
+   allocated here as the old code did, with malloc, and both
+   are measured the same way.
+
+   compile gcc -DTEST -DTEST3 backup_queue.c session.o name_arena.o slab.o stats.o
+		msg.o miscfuncs.o thread.o time_mono.o -lpthread
+   run with number of names to track */
+
+struct old_bqueue {
+    unsigned int hash;
+    char dname[NAME_MAX + 1];
+    char dpath[PATH_MAX + 1];
+    time_t estamp;
+    void *next, *prev, *next_t, *prev_t;
+    int in_bchain;
+    void *bchain_next;
+};
+
+int main(int argc, char *argv[])
+{
+    int i, n = argc > 1 ? atoi(argv[1]) : 200000;
+    size_t before, old, now;
+    struct old_bqueue **ob;
+    char name[32];
+    Session *s;
+
+    thread_init();
+    msg_init();
+    session_init();
+    backup_queue_init(86400, 1000, 0, 0, 1, 0, 0, 0);
+
+    assert((ob = malloc(n * sizeof(*ob))));
+    before = mallinfo2().uordblks;
+    for (i = 0; i < n; i++) {
+	assert((ob[i] = malloc(sizeof(struct old_bqueue))));
+	snprintf(ob[i]->dname, sizeof(ob[i]->dname), "user%06d", i);
+    }
+    old = mallinfo2().uordblks - before;
+    for (i = 0; i < n; i++)
+	free(ob[i]);
+    free(ob);
+
+    before = mallinfo2().uordblks;
+    for (i = 0; i < n; i++) {
+	snprintf(name, sizeof(name), "user%06d", i);
+	s = session_get(name);
+	backup_queue_add(s);
+	session_put(s);
+    }
+    now = mallinfo2().uordblks - before;
+
+    printf("names tracked with pending backup: %d\n", n);
+    printf("before: %zu bytes per name measured (backup queue %zu)\n",
+	old / n, sizeof(struct old_bqueue));
+    printf("now: %zu bytes per name measured " \
+	"(session %zu, backup queue %zu, name arena)\n",
+	now / n, sizeof(Session), sizeof(Bqueue));
+    printf("total: %zu MB before, %zu MB now\n", old >> 20, now >> 20);
+    return 0;
+}
+
 #endif
 #endif
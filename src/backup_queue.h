@@ -21,9 +21,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef _BACKUP_QUEUE_H_INCLUDED_
 #define _BACKUP_QUEUE_H_INCLUDED_
 
-void backup_queue_init( int backup_wait, int maxproc );
-int backup_queue_remove( const char *name );
-void backup_queue_add( const char *name, const char *path );
+#include "session.h"
+
+void backup_queue_init( int backup_wait, int maxproc, int rate, int burst,
+				int batch, int batch_age, int workers,
+				int engine );
+int backup_queue_remove( Session *s );
+void backup_queue_add( Session *s );
+void backup_queue_add_at( Session *s, const struct timespec *estamp );
+void backup_queue_wake( void );
 void backup_queue_stop_set( void );
 void backup_queue_stop( void );
 
@@ -0,0 +1,441 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* snapshots of names for backup.
+
+   When a name expires, its real directory is cloned with
+   reflinks into the staging directory, and its backup reads
+   the clone. A name mounted again does not have to stop its
+   backup then; only a newer snapshot of the name does.
+   Clones of backups done go to trash, which is emptied by
+   a thread of its own.
+
+   Files are cloned with FICLONE only, so that a snapshot
+   never turns into a copy of the data. Names which can not
+   be cloned are backed up from their real directory.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "msg.h"
+#include "thread.h"
+#include "stats.h"
+#include "miscfuncs.h"
+#include "module.h"
+#include "backup_tree.h"
+#include "backup_snap.h"
+
+#define SNAP_NAMES		"names"	/*clones, by name*/
+#define SNAP_TRASH		"trash"	/*clones to be removed*/
+
+/*state of a name*/
+enum { SNAP_NONE = 0, SNAP_READY, SNAP_BUSY };
+
+static struct {
+	char *dir;	/*staging directory*/
+	char *names;
+	int nfd;	/*of names*/
+	int tfd;	/*of trash*/
+	unsigned long seq;	/*trash entries*/
+
+	pthread_mutex_t lock;	/*for sstate of names*/
+	pthread_cond_t gc;
+	int gc_pending;
+	int stop;
+	pthread_t thread;
+
+	/*statistics*/
+	unsigned long taken;
+	unsigned long failed;
+} S = {
+	.nfd = -1,
+	.tfd = -1,
+};
+
+static int clone_file( int sfd, int dfd, const char *name,
+				const struct stat *st, Backup_tree *c )
+{
+	int in, out, ok;
+
+	if( ( in = openat( sfd, name, O_RDONLY|O_NOFOLLOW|O_NOATIME|
+						O_CLOEXEC ) ) < 0 )
+		return backup_tree_fail( c, "open", name );
+	if( ( out = openat( dfd, name, O_WRONLY|O_CREAT|O_EXCL|
+						O_CLOEXEC, 0600 ) ) < 0 )
+	{
+		close( in );
+		return backup_tree_fail( c, "create", name );
+	}
+	if( st->st_size && ioctl( out, FICLONE, in ) )
+		ok = backup_tree_fail( c, "FICLONE", name );
+	else ok = backup_tree_attr( in, out, st, c );
+	close( in );
+	close( out );
+	return ok;
+}
+
+static int clone_dir( int sfd, int dfd, Backup_tree *c )
+{
+	struct dirent *de;
+	struct stat st;
+	int nsfd, ndfd, ok = 1, fd;
+	DIR *d;
+
+	if( ( fd = dup( sfd ) ) < 0 || ! ( d = fdopendir( fd ) ) )
+	{
+		if( fd >= 0 )
+			close( fd );
+		return backup_tree_fail( c, "opendir", "" );
+	}
+	while( ok && ( errno = 0, de = readdir( d ) ) )
+	{
+		if( ! strcmp( de->d_name, "." ) || ! strcmp( de->d_name, ".." ) )
+			continue;
+		if( fstatat( sfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW ) )
+			ok = backup_tree_fail( c, "stat", de->d_name );
+		else if( S_ISREG( st.st_mode ) )
+			ok = clone_file( sfd, dfd, de->d_name, &st, c );
+		else if( ! S_ISDIR( st.st_mode ) )
+			ok = backup_tree_special( sfd, dfd, de->d_name, &st, c );
+
+		/*mounts under name are not part of it*/
+		else if( st.st_dev == c->dev )
+		{
+			if( mkdirat( dfd, de->d_name, 0700 ) )
+				ok = backup_tree_fail( c, "mkdir", de->d_name );
+			else if( ( nsfd = openat( sfd, de->d_name, O_RDONLY|
+					O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC ) ) < 0 )
+				ok = backup_tree_fail( c, "open", de->d_name );
+			else
+			{
+				if( ( ndfd = openat( dfd, de->d_name, O_RDONLY|
+					O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC ) ) < 0 )
+					ok = backup_tree_fail( c, "open", de->d_name );
+				else
+				{
+					/*times of directory after its entries*/
+					ok = clone_dir( nsfd, ndfd, c ) &&
+						backup_tree_attr( nsfd, ndfd, &st, c );
+					close( ndfd );
+				}
+				close( nsfd );
+			}
+		}
+	}
+	if( ok && errno )
+		ok = backup_tree_fail( c, "readdir", "" );
+	closedir( d );
+	return ok;
+}
+
+/*clone goes away now, and its space later*/
+static void snap_trash( const char *name )
+{
+	char tname[ 32 ];
+
+	snprintf( tname, sizeof(tname), "%lu",
+			__atomic_add_fetch( &S.seq, 1, __ATOMIC_RELAXED ) );
+	if( renameat( S.nfd, name, S.tfd, tname ) )
+	{
+		if( errno != ENOENT )
+			msglog( MSG_ERR|LOG_ERRNO, "backup_snap: rename %s/%s",
+							S.names, name );
+		return;
+	}
+	pthread_mutex_lock( &S.lock );
+	S.gc_pending = 1;
+	pthread_cond_signal( &S.gc );
+	pthread_mutex_unlock( &S.lock );
+}
+
+static void snap_empty_trash( void )
+{
+	struct dirent *de;
+	int fd;
+	DIR *d;
+
+	if( ( fd = dup( S.tfd ) ) < 0 || ! ( d = fdopendir( fd ) ) )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "backup_snap: opendir %s/"
+					SNAP_TRASH, S.dir );
+		if( fd >= 0 )
+			close( fd );
+		return;
+	}
+	rewinddir( d );
+	while( ( de = readdir( d ) ) )
+		if( strcmp( de->d_name, "." ) && strcmp( de->d_name, ".." ) &&
+				! backup_tree_remove( S.tfd, de->d_name ) )
+			msglog( MSG_ERR|LOG_ERRNO, "backup_snap: could not " \
+					"remove %s/" SNAP_TRASH "/%s",
+					S.dir, de->d_name );
+	closedir( d );
+}
+
+static void *snap_gc_thread( void *x )
+{
+	pthread_mutex_lock( &S.lock );
+	while( ! S.stop )
+	{
+		if( ! S.gc_pending )
+		{
+			pthread_cond_wait( &S.gc, &S.lock );
+			continue;
+		}
+		S.gc_pending = 0;
+		pthread_mutex_unlock( &S.lock );
+		snap_empty_trash();
+		pthread_mutex_lock( &S.lock );
+	}
+	pthread_mutex_unlock( &S.lock );
+	return x;
+}
+
+static int snap_clone( const char *path, const char *name )
+{
+	struct stat st;
+	Backup_tree c;
+	int sfd, dfd, ok = 0;
+
+	if( ! backup_tree_begin( &c, 0 ) )
+	{
+		msglog( MSG_ALERT, "backup_snap: could not allocate memory" );
+		return 0;
+	}
+
+	/*left by a clone that failed*/
+	snap_trash( name );
+
+	if( ( sfd = open( path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|
+					O_CLOEXEC ) ) < 0 || fstat( sfd, &st ) )
+		backup_tree_fail( &c, "open", path );
+	else if( mkdirat( S.nfd, name, 0700 ) )
+		backup_tree_fail( &c, "mkdir", name );
+	else if( ( dfd = openat( S.nfd, name, O_RDONLY|O_DIRECTORY|
+					O_NOFOLLOW|O_CLOEXEC ) ) < 0 )
+		backup_tree_fail( &c, "open", name );
+	else
+	{
+		c.dev = st.st_dev;
+		ok = clone_dir( sfd, dfd, &c ) &&
+			backup_tree_attr( sfd, dfd, &st, &c );
+		close( dfd );
+	}
+	if( ! ok )
+	{
+		errno = c.err;
+		msglog( MSG_INFO|LOG_ERRNO, "no snapshot of %s. %s %s",
+						path, c.what, c.name );
+	}
+	if( sfd >= 0 )
+		close( sfd );
+	backup_tree_end( &c );
+	return ok;
+}
+
+/*name has expired, and is not mounted. Caller has
+  cancelled backup of older snapshot, if there was one*/
+void backup_snap_take( Session *s )
+{
+	char path[ PATH_MAX+1 ];
+	int state;
+
+	if( ! S.dir )
+		return;
+
+	pthread_mutex_lock( &S.lock );
+	if( ( state = s->sstate ) == SNAP_READY )
+		s->sstate = SNAP_NONE;
+	pthread_mutex_unlock( &S.lock );
+
+	/*backup started meanwhile is on its way out.
+	  Real directory for the next one then*/
+	if( state == SNAP_BUSY )
+		return;
+	if( state == SNAP_READY )
+		snap_trash( s->name );
+
+	mod_dir( path, sizeof(path), s->name );
+	if( ! snap_clone( path, s->name ) )
+	{
+		__atomic_add_fetch( &S.failed, 1, __ATOMIC_RELAXED );
+		snap_trash( s->name );
+		return;
+	}
+	__atomic_add_fetch( &S.taken, 1, __ATOMIC_RELAXED );
+	pthread_mutex_lock( &S.lock );
+	s->sstate = SNAP_READY;
+	pthread_mutex_unlock( &S.lock );
+}
+
+/*path for backup of name starting now*/
+void backup_snap_path( Session *s, char *path, int size )
+{
+	if( S.dir )
+	{
+		pthread_mutex_lock( &S.lock );
+		if( s->sstate == SNAP_READY )
+		{
+			s->sstate = SNAP_BUSY;
+			pthread_mutex_unlock( &S.lock );
+			snprintf( path, size, "%s/%s", S.names, s->name );
+			return;
+		}
+		pthread_mutex_unlock( &S.lock );
+	}
+	mod_dir( path, size, s->name );
+}
+
+/*backup of name is done, or was not started after all*/
+void backup_snap_done( Session *s )
+{
+	int busy;
+
+	if( ! S.dir )
+		return;
+
+	pthread_mutex_lock( &S.lock );
+	if( ( busy = ( s->sstate == SNAP_BUSY ) ) )
+		s->sstate = SNAP_NONE;
+	pthread_mutex_unlock( &S.lock );
+	if( busy )
+		snap_trash( s->name );
+}
+
+/*backup queued on snapshot will not start. Snapshot taken
+  by a backup starting meanwhile is left to it*/
+void backup_snap_release( Session *s )
+{
+	int ready;
+
+	if( ! S.dir )
+		return;
+
+	pthread_mutex_lock( &S.lock );
+	if( ( ready = ( s->sstate == SNAP_READY ) ) )
+		s->sstate = SNAP_NONE;
+	pthread_mutex_unlock( &S.lock );
+	if( ready )
+		snap_trash( s->name );
+}
+
+/*name has a backup queued or running on its snapshot. It
+  goes on when name is mounted again*/
+int backup_snap_held( Session *s )
+{
+	int held;
+
+	if( ! S.dir )
+		return 0;
+
+	pthread_mutex_lock( &S.lock );
+	held = s->sstate != SNAP_NONE;
+	pthread_mutex_unlock( &S.lock );
+	return held;
+}
+
+static void backup_snap_stats( void )
+{
+	msglog( MSG_NOTICE, "backup snapshots: %lu taken, %lu failed",
+			__atomic_load_n( &S.taken, __ATOMIC_RELAXED ),
+			__atomic_load_n( &S.failed, __ATOMIC_RELAXED ) );
+}
+
+void backup_snap_init( void )
+{
+	char path[ PATH_MAX+1 ];
+	struct dirent *de;
+	DIR *d;
+	int fd;
+
+	if( ! S.dir )
+		return;
+
+	thread_mutex_init( &S.lock );
+	thread_cond_init( &S.gc );
+	stats_register( backup_snap_stats );
+
+	if( ! create_dir( S.dir, 0700 ) )
+		msglog( MSG_FATAL, "could not create snapshot dir %s", S.dir );
+	snprintf( path, sizeof(path), "%s/" SNAP_NAMES, S.dir );
+	if( ! ( S.names = strdup( path ) ) )
+		msglog( MSG_FATAL, "backup_snap_init: could not allocate memory" );
+	if( ( mkdir( S.names, 0700 ) && errno != EEXIST ) ||
+			( S.nfd = open( S.names, O_RDONLY|O_DIRECTORY|
+					O_NOFOLLOW|O_CLOEXEC ) ) < 0 )
+		msglog( MSG_FATAL|LOG_ERRNO, "backup_snap_init: %s", S.names );
+	snprintf( path, sizeof(path), "%s/" SNAP_TRASH, S.dir );
+	if( ( mkdir( path, 0700 ) && errno != EEXIST ) ||
+			( S.tfd = open( path, O_RDONLY|O_DIRECTORY|
+					O_NOFOLLOW|O_CLOEXEC ) ) < 0 )
+		msglog( MSG_FATAL|LOG_ERRNO, "backup_snap_init: %s", path );
+
+	/*snapshots of last run are not used again*/
+	if( ( fd = dup( S.nfd ) ) < 0 || ! ( d = fdopendir( fd ) ) )
+		msglog( MSG_FATAL|LOG_ERRNO, "backup_snap_init: opendir %s",
+								S.names );
+	while( ( de = readdir( d ) ) )
+		if( strcmp( de->d_name, "." ) && strcmp( de->d_name, ".." ) )
+			snap_trash( de->d_name );
+	closedir( d );
+
+	S.gc_pending = 1;
+	if( ! thread_new_joinable( snap_gc_thread, NULL, &S.thread ) )
+		msglog( MSG_FATAL, "backup_snap_init: could not " \
+					"start new thread" );
+}
+
+/*snapshots left are removed at next start*/
+void backup_snap_stop( void )
+{
+	if( ! S.dir )
+		return;
+
+	pthread_mutex_lock( &S.lock );
+	S.stop = 1;
+	pthread_cond_signal( &S.gc );
+	pthread_mutex_unlock( &S.lock );
+	pthread_join( S.thread, NULL );
+}
+
+/**********command line option handling funtions***************/
+
+void backup_snap_option( char ch, char *arg, int valid )
+{
+	if( ! valid )
+		S.dir = NULL;
+	else if( ! check_abs_path( arg ) )
+		msglog( MSG_FATAL, "invalid argument for path -%c option", ch );
+	else S.dir = arg;
+}
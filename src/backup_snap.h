@@ -0,0 +1,36 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _BACKUP_SNAP_H_INCLUDED_
+#define _BACKUP_SNAP_H_INCLUDED_
+
+#include "session.h"
+
+void backup_snap_init( void );
+void backup_snap_take( Session *s );
+void backup_snap_path( Session *s, char *path, int size );
+void backup_snap_done( Session *s );
+void backup_snap_release( Session *s );
+int backup_snap_held( Session *s );
+void backup_snap_stop( void );
+
+void backup_snap_option( char ch, char *arg, int valid );
+
+#endif
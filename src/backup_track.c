@@ -0,0 +1,540 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* backups only for names written to while mounted.
+
+   The file system of every name mounted gets a fanotify mark,
+   and events come with the directory they happened in. The
+   directory is walked up till the real directory of a name
+   mounted is found, and that name is changed. Names changed
+   are not looked for any more. Directories found in no name
+   are kept in a small cache till the next mount.
+
+   Writes, files and directories made, removed or renamed, and
+   changes of owner, mode or times are seen. A name is taken as
+   changed whenever an event can not be placed, so backup is
+   only left out when nothing was seen for sure.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include "msg.h"
+#include "thread.h"
+#include "slab.h"
+#include "stats.h"
+#include "session.h"
+#include "module.h"
+#include "backup_track.h"
+
+#define TRACK_HASH		256	/*buckets of real directories*/
+#define TRACK_EVENTS		4096	/*bytes read at once*/
+#define TRACK_FS_MAX		16	/*file systems marked*/
+#define TRACK_DEPTH		256	/*directories walked up at most*/
+#define TRACK_CACHE		256	/*directories in no name*/
+#define TRACK_MASK		( FAN_MODIFY | FAN_ATTRIB | FAN_CREATE | \
+				  FAN_DELETE | FAN_MOVE | FAN_ONDIR )
+
+/*state of a name*/
+enum { TRACK_NONE = 0, TRACK_CLEAN, TRACK_CHANGED };
+
+/*real directory of a name mounted, not changed yet*/
+typedef struct track_mnt {
+	dev_t dev;
+	ino_t ino;
+	Session *s;
+	struct track_mnt *next;
+} Track_mnt;
+
+/*file system marked. fd is a directory on it*/
+typedef struct track_fs {
+	fsid_t fsid;
+	int fd;
+} Track_fs;
+
+/*directory found in no name*/
+typedef struct track_miss {
+	unsigned long gen;	/*of mounts. Stale when they change*/
+	fsid_t fsid;
+	int type;
+	unsigned int bytes;
+	unsigned char handle[ MAX_HANDLE_SZ ];
+} Track_miss;
+
+static struct {
+	int enabled;
+	int fd;		/*fanotify. -1 if not available*/
+	int wake_fd;	/*stopping*/
+	pthread_t thread;
+	pthread_mutex_t rlock;	/*events are read and handled under it*/
+
+	pthread_mutex_t lock;	/*for mounts and file systems*/
+	Track_mnt *mnt[ TRACK_HASH ];
+	int nmnt;	/*Atomic read*/
+	unsigned long gen;	/*mounts added. Atomic read*/
+	Track_fs fs[ TRACK_FS_MAX ];
+	int nfs;
+
+	Track_miss miss[ TRACK_CACHE ];	/*under rlock*/
+
+	/*statistics*/
+	unsigned long skipped;
+	unsigned long done;
+	unsigned long overflows;
+} T = {
+	.fd = -1,
+	.wake_fd = -1,
+};
+
+static Slab_cache tcache;
+
+static void track_set( Session *s, int state )
+{
+	__atomic_store_n( &s->tstate, state, __ATOMIC_RELAXED );
+}
+
+/*under T.lock*/
+static void mnt_unlink( Track_mnt **tp )
+{
+	Track_mnt *t = *tp;
+
+	*tp = t->next;
+	session_put( t->s );
+	slab_free( &tcache, t );
+	__atomic_store_n( &T.nmnt, T.nmnt - 1, __ATOMIC_RELAXED );
+}
+
+/*file system of path is marked. Under T.lock*/
+static int fs_mark( const char *path )
+{
+	struct statfs sf;
+	int i, fd;
+
+	if( statfs( path, &sf ) )
+		return 0;
+	for( i = 0; i < T.nfs; i++ )
+		if( ! memcmp( &T.fs[ i ].fsid, &sf.f_fsid, sizeof(sf.f_fsid) ) )
+			return 1;
+	if( T.nfs == TRACK_FS_MAX )
+	{
+		msglog( MSG_ERR, "backup_track: too many file systems" );
+		return 0;
+	}
+	if( ( fd = open( path, O_RDONLY|O_DIRECTORY|O_CLOEXEC ) ) < 0 )
+		return 0;
+	if( fanotify_mark( T.fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM,
+						TRACK_MASK, AT_FDCWD, path ) )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "backup_track: fanotify_mark %s",
+								path );
+		close( fd );
+		return 0;
+	}
+	T.fs[ T.nfs ].fsid = sf.f_fsid;
+	T.fs[ T.nfs++ ].fd = fd;
+	return 1;
+}
+
+/*real directory of name is watched, not its mount, which
+  must not be kept busy. Returns 0 if changes can not be seen*/
+static int mnt_add( Session *s )
+{
+	char path[ PATH_MAX+1 ];
+	Track_mnt **tp, *t;
+	struct stat st;
+
+	mod_dir( path, sizeof(path), s->name );
+	if( stat( path, &st ) )
+		return 0;
+
+	session_hold( s );
+	pthread_mutex_lock( &T.lock );
+	if( ! fs_mark( path ) )
+	{
+		pthread_mutex_unlock( &T.lock );
+		session_put( s );
+		return 0;
+	}
+	for( tp = &T.mnt[ st.st_ino % TRACK_HASH ]; *tp; tp = &( *tp )->next )
+		if( ( *tp )->ino == st.st_ino && ( *tp )->dev == st.st_dev )
+			break;
+	if( ( t = *tp ) )
+		session_put( t->s );
+	else if( ( t = slab_alloc( &tcache ) ) )
+	{
+		t->dev = st.st_dev;
+		t->ino = st.st_ino;
+		t->next = NULL;
+		*tp = t;
+		__atomic_store_n( &T.nmnt, T.nmnt + 1, __ATOMIC_RELAXED );
+	}
+	else
+	{
+		pthread_mutex_unlock( &T.lock );
+		msglog( MSG_ALERT, "backup_track: could not allocate memory" );
+		session_put( s );
+		return 0;
+	}
+	t->s = s;
+	/*directories cached as in no name may be in this one*/
+	__atomic_store_n( &T.gen, T.gen + 1, __ATOMIC_RELEASE );
+	pthread_mutex_unlock( &T.lock );
+	return 1;
+}
+
+/*mounts of name are gone. Caller holds name, so
+  references dropped here are not the last*/
+static void mnt_drop( Session *s )
+{
+	Track_mnt **tp;
+	int i;
+
+	pthread_mutex_lock( &T.lock );
+	for( i = 0; i < TRACK_HASH; i++ )
+		for( tp = &T.mnt[ i ]; *tp; )
+			if( ( *tp )->s == s )
+				mnt_unlink( tp );
+			else tp = &( *tp )->next;
+	pthread_mutex_unlock( &T.lock );
+}
+
+/*events could not be told apart. Anyone could have changed*/
+static void mnt_all_changed( void )
+{
+	int i;
+
+	pthread_mutex_lock( &T.lock );
+	for( i = 0; i < TRACK_HASH; i++ )
+		while( T.mnt[ i ] )
+		{
+			track_set( T.mnt[ i ]->s, TRACK_CHANGED );
+			mnt_unlink( &T.mnt[ i ] );
+		}
+	pthread_mutex_unlock( &T.lock );
+}
+
+/*directory is real directory of a name. It is changed then*/
+static int mnt_changed( const struct stat *st )
+{
+	Track_mnt **tp;
+	int found = 0;
+
+	pthread_mutex_lock( &T.lock );
+	for( tp = &T.mnt[ st->st_ino % TRACK_HASH ]; *tp; tp = &( *tp )->next )
+		if( ( *tp )->ino == st->st_ino && ( *tp )->dev == st->st_dev )
+		{
+			track_set( ( *tp )->s, TRACK_CHANGED );
+			mnt_unlink( tp );
+			found = 1;
+			break;
+		}
+	pthread_mutex_unlock( &T.lock );
+	return found;
+}
+
+/*directory of handle is in name mounted? Returns 1 if so,
+  0 if not, and -1 if that can not be told*/
+static int track_dir( const fsid_t *fsid, struct file_handle *fh )
+{
+	struct stat st, last;
+	int i, fd, nfd, ret, depth;
+
+	pthread_mutex_lock( &T.lock );
+	for( i = 0; i < T.nfs; i++ )
+		if( ! memcmp( &T.fs[ i ].fsid, fsid, sizeof(*fsid) ) )
+			break;
+	fd = i < T.nfs ? T.fs[ i ].fd : -1;
+	pthread_mutex_unlock( &T.lock );
+	if( fd < 0 )
+		return -1;
+
+	if( ( fd = open_by_handle_at( fd, fh, O_PATH|O_DIRECTORY|
+						O_CLOEXEC ) ) < 0 )
+		return -1;
+	for( depth = 0; ; depth++ )
+	{
+		if( fstat( fd, &st ) || depth == TRACK_DEPTH )
+		{
+			ret = -1;
+			break;
+		}
+		/*top of file system*/
+		if( depth && ( st.st_dev != last.st_dev ||
+					st.st_ino == last.st_ino ) )
+		{
+			ret = 0;
+			break;
+		}
+		if( mnt_changed( &st ) )
+		{
+			ret = 1;
+			break;
+		}
+		last = st;
+		nfd = openat( fd, "..", O_PATH|O_DIRECTORY|O_CLOEXEC );
+		close( fd );
+		if( ( fd = nfd ) < 0 )
+			return -1;
+	}
+	close( fd );
+	return ret;
+}
+
+/*cache slot of directory. Under T.rlock*/
+static Track_miss *track_miss( const fsid_t *fsid, struct file_handle *fh )
+{
+	unsigned int h = 2166136261U, i;
+
+	for( i = 0; i < fh->handle_bytes; i++ )
+		h = ( h ^ fh->f_handle[ i ] ) * 16777619U;
+	return &T.miss[ ( h ^ fsid->__val[ 0 ] ) % TRACK_CACHE ];
+}
+
+static void track_event( struct fanotify_event_metadata *ev )
+{
+	struct fanotify_event_info_fid *info;
+	struct file_handle *fh;
+	unsigned long gen;
+	Track_miss *m;
+	int r;
+
+	if( ev->mask & FAN_Q_OVERFLOW )
+	{
+		T.overflows++;
+		mnt_all_changed();
+		return;
+	}
+
+	/*every name mounted is changed already*/
+	if( ! __atomic_load_n( &T.nmnt, __ATOMIC_RELAXED ) )
+		return;
+
+	info = (struct fanotify_event_info_fid *) ( ev + 1 );
+	if( ev->event_len < sizeof(*ev) + sizeof(*info) +
+					sizeof(struct file_handle) ||
+			( info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME &&
+			  info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID ) )
+	{
+		mnt_all_changed();
+		return;
+	}
+	fh = (struct file_handle *) info->handle;
+
+	gen = __atomic_load_n( &T.gen, __ATOMIC_ACQUIRE );
+	m = track_miss( (fsid_t *) &info->fsid, fh );
+	if( m->gen == gen && m->bytes == fh->handle_bytes &&
+			m->type == fh->handle_type &&
+			! memcmp( &m->fsid, &info->fsid, sizeof(m->fsid) ) &&
+			! memcmp( m->handle, fh->f_handle, fh->handle_bytes ) )
+		return;
+
+	if( ( r = track_dir( (fsid_t *) &info->fsid, fh ) ) < 0 )
+		mnt_all_changed();
+	else if( ! r && fh->handle_bytes <= MAX_HANDLE_SZ )
+	{
+		m->gen = gen;
+		memcpy( &m->fsid, &info->fsid, sizeof(m->fsid) );
+		m->type = fh->handle_type;
+		m->bytes = fh->handle_bytes;
+		memcpy( m->handle, fh->f_handle, fh->handle_bytes );
+	}
+}
+
+/*handle events till none are queued. One reader at a time,
+  so no one finds the queue empty while events read by
+  another are still being handled*/
+static void track_drain( void )
+{
+	char buf[ TRACK_EVENTS ]
+		__attribute__ ((aligned( __alignof__( struct fanotify_event_metadata ) )));
+	struct fanotify_event_metadata *ev;
+	ssize_t r;
+
+	pthread_mutex_lock( &T.rlock );
+	while( 1 )
+	{
+		if( ( r = read( T.fd, buf, sizeof(buf) ) ) < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			if( errno != EAGAIN )
+				msglog( MSG_ERR|LOG_ERRNO, "backup_track: read" );
+			break;
+		}
+		if( ! r )
+			break;
+		for( ev = (struct fanotify_event_metadata *) buf;
+				FAN_EVENT_OK( ev, r ); ev = FAN_EVENT_NEXT( ev, r ) )
+			track_event( ev );
+	}
+	pthread_mutex_unlock( &T.rlock );
+}
+
+static void *track_thread( void *x )
+{
+	struct pollfd pfd[ 2 ];
+
+	pfd[ 0 ].fd = T.fd;
+	pfd[ 0 ].events = POLLIN;
+	pfd[ 1 ].fd = T.wake_fd;
+	pfd[ 1 ].events = POLLIN;
+
+	while( 1 )
+	{
+		if( poll( pfd, 2, -1 ) < 0 )
+		{
+			if( errno != EINTR )
+			{
+				msglog( MSG_ERR|LOG_ERRNO, "backup_track: poll" );
+				sleep( 1 );
+			}
+			continue;
+		}
+		if( pfd[ 1 ].revents )
+			break;
+		track_drain();
+	}
+	return x;
+}
+
+/*path of name is bind mounted now. A name already
+  changed stays so, till its backup is queued*/
+void backup_track_mount( Session *s, const char *path )
+{
+	int none = TRACK_NONE;
+
+	if( ! T.enabled )
+		return;
+
+	__atomic_compare_exchange_n( &s->tstate, &none, TRACK_CLEAN,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED );
+	if( __atomic_load_n( &s->tstate, __ATOMIC_RELAXED ) == TRACK_CHANGED )
+		return;
+
+	if( T.fd < 0 || ! mnt_add( s ) )
+		track_set( s, TRACK_CHANGED );
+}
+
+/*backup queued or running for name was stopped
+  before it was done*/
+void backup_track_changed( Session *s )
+{
+	if( T.enabled )
+		track_set( s, TRACK_CHANGED );
+}
+
+/*name has expired. Returns 0 if backup can be left out.
+  Tracking of name starts anew*/
+int backup_track_needed( Session *s )
+{
+	int state;
+
+	if( ! T.enabled )
+		return 1;
+
+	/*writes done before umount may still be queued*/
+	if( T.fd >= 0 )
+		track_drain();
+	mnt_drop( s );
+	state = __atomic_exchange_n( &s->tstate, TRACK_NONE, __ATOMIC_RELAXED );
+	if( state == TRACK_CLEAN )
+	{
+		__atomic_add_fetch( &T.skipped, 1, __ATOMIC_RELAXED );
+		msglog( MSG_INFO, "%s not written to. No backup", s->name );
+		return 0;
+	}
+	__atomic_add_fetch( &T.done, 1, __ATOMIC_RELAXED );
+	return 1;
+}
+
+static void backup_track_stats( void )
+{
+	msglog( MSG_NOTICE, "backup tracking: %lu backups left out " \
+			"for names not written to, %lu done, %lu " \
+			"event overflows",
+			__atomic_load_n( &T.skipped, __ATOMIC_RELAXED ),
+			__atomic_load_n( &T.done, __ATOMIC_RELAXED ),
+			T.overflows );
+}
+
+void backup_track_init( void )
+{
+	if( ! T.enabled )
+		return;
+
+	thread_mutex_init( &T.lock );
+	thread_mutex_init( &T.rlock );
+	slab_init( &tcache, "backup track", sizeof(Track_mnt) );
+	stats_register( backup_track_stats );
+
+	/*without fanotify every name counts as changed*/
+	if( ( T.fd = fanotify_init( FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK|
+				FAN_UNLIMITED_QUEUE|FAN_REPORT_DFID_NAME,
+				O_RDONLY|O_LARGEFILE ) ) < 0 )
+	{
+		msglog( MSG_WARNING|LOG_ERRNO, "backup_track_init: " \
+				"fanotify_init. All names will be backed up" );
+		return;
+	}
+	if( ( T.wake_fd = eventfd( 0, EFD_CLOEXEC ) ) < 0 )
+		msglog( MSG_FATAL|LOG_ERRNO, "backup_track_init: eventfd" );
+	if( ! thread_new_joinable( track_thread, NULL, &T.thread ) )
+		msglog( MSG_FATAL, "backup_track_init: could not " \
+					"start new thread" );
+}
+
+void backup_track_stop( void )
+{
+	uint64_t val = 1;
+
+	if( T.fd < 0 )
+		return;
+
+	if( write( T.wake_fd, &val, sizeof(val) ) < 0 )
+		msglog( MSG_ERR|LOG_ERRNO, "backup_track_stop: write" );
+	pthread_join( T.thread, NULL );
+	while( T.nfs )
+		close( T.fs[ --T.nfs ].fd );
+	close( T.fd );
+	close( T.wake_fd );
+	T.fd = T.wake_fd = -1;
+}
+
+/**********command line option handling funtions***************/
+
+void backup_track_option( char ch, char *arg, int valid )
+{
+	T.enabled = valid ? 1 : 0;
+}
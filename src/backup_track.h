@@ -0,0 +1,34 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _BACKUP_TRACK_H_INCLUDED_
+#define _BACKUP_TRACK_H_INCLUDED_
+
+#include "session.h"
+
+void backup_track_init( void );
+void backup_track_mount( Session *s, const char *path );
+void backup_track_changed( Session *s );
+int backup_track_needed( Session *s );
+void backup_track_stop( void );
+
+void backup_track_option( char ch, char *arg, int valid );
+
+#endif
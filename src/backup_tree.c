@@ -0,0 +1,165 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* copying trees of names, for snapshots and backups.
+
+   Everything goes through directory fds, so that depth of a
+   tree is not limited by PATH_MAX, and nothing is looked up
+   twice. Failures are kept in the context, with their errno,
+   for the caller to log.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "backup_tree.h"
+
+#define TREE_XATTR		65536	/*largest list and value*/
+
+int backup_tree_begin( Backup_tree *t, dev_t dev )
+{
+	memset( t, 0, sizeof(*t) );
+	t->dev = dev;
+	t->what = "";
+	t->name = "";
+	if( ! ( t->list = malloc( TREE_XATTR ) ) ||
+			! ( t->val = malloc( TREE_XATTR ) ) )
+	{
+		free( t->list );
+		return 0;
+	}
+	return 1;
+}
+
+void backup_tree_end( Backup_tree *t )
+{
+	free( t->list );
+	free( t->val );
+}
+
+int backup_tree_fail( Backup_tree *t, const char *what, const char *name )
+{
+	t->err = errno;
+	t->what = what;
+	t->name = name;
+	return 0;
+}
+
+/*extended attributes, owner, mode and times from
+  file or directory to its copy*/
+int backup_tree_attr( int sfd, int dfd, const struct stat *st,
+							Backup_tree *t )
+{
+	struct timespec ts[ 2 ];
+	ssize_t len, vlen;
+	char *k;
+
+	if( ( len = flistxattr( sfd, t->list, TREE_XATTR ) ) < 0 &&
+			errno != ENOTSUP )
+		return backup_tree_fail( t, "flistxattr", "" );
+	for( k = t->list; len > 0 && k < t->list + len; k += strlen( k ) + 1 )
+	{
+		if( ( vlen = fgetxattr( sfd, k, t->val, TREE_XATTR ) ) < 0 )
+			return backup_tree_fail( t, "fgetxattr", k );
+		if( fsetxattr( dfd, k, t->val, vlen, 0 ) && errno != ENOTSUP )
+			return backup_tree_fail( t, "fsetxattr", k );
+	}
+
+	ts[ 0 ] = st->st_atim;
+	ts[ 1 ] = st->st_mtim;
+	if( fchown( dfd, st->st_uid, st->st_gid ) ||
+			fchmod( dfd, st->st_mode & 07777 ) ||
+			futimens( dfd, ts ) )
+		return backup_tree_fail( t, "attributes", "" );
+	return 1;
+}
+
+/*symbolic links, fifos and sockets. Devices
+  can not be made and are left out*/
+int backup_tree_special( int sfd, int dfd, const char *name,
+				const struct stat *st, Backup_tree *t )
+{
+	struct timespec ts[ 2 ];
+	ssize_t len;
+
+	if( S_ISLNK( st->st_mode ) )
+	{
+		if( ( len = readlinkat( sfd, name, t->link,
+					sizeof(t->link) - 1 ) ) < 0 )
+			return backup_tree_fail( t, "readlink", name );
+		t->link[ len ] = '\0';
+		if( symlinkat( t->link, dfd, name ) )
+			return backup_tree_fail( t, "symlink", name );
+	}
+	else if( S_ISFIFO( st->st_mode ) || S_ISSOCK( st->st_mode ) )
+	{
+		if( mknodat( dfd, name, st->st_mode & ( S_IFMT | 07777 ), 0 ) )
+			return backup_tree_fail( t, "mknod", name );
+	}
+	else return 1;
+
+	ts[ 0 ] = st->st_atim;
+	ts[ 1 ] = st->st_mtim;
+	if( fchownat( dfd, name, st->st_uid, st->st_gid,
+					AT_SYMLINK_NOFOLLOW ) ||
+			utimensat( dfd, name, ts, AT_SYMLINK_NOFOLLOW ) ||
+			( ! S_ISLNK( st->st_mode ) &&
+			  fchmodat( dfd, name, st->st_mode & 07777, 0 ) ) )
+		return backup_tree_fail( t, "attributes", name );
+	return 1;
+}
+
+/*name in dfd, whatever it is*/
+int backup_tree_remove( int dfd, const char *name )
+{
+	struct dirent *de;
+	int fd, ok = 1;
+	DIR *d;
+
+	if( ! unlinkat( dfd, name, 0 ) || errno == ENOENT )
+		return 1;
+	if( errno != EISDIR )
+		return 0;
+
+	if( ( fd = openat( dfd, name, O_RDONLY|O_DIRECTORY|
+					O_NOFOLLOW|O_CLOEXEC ) ) < 0 )
+		return 0;
+	if( ! ( d = fdopendir( fd ) ) )
+	{
+		close( fd );
+		return 0;
+	}
+	while( ( de = readdir( d ) ) )
+		if( strcmp( de->d_name, "." ) && strcmp( de->d_name, ".." ) &&
+				! backup_tree_remove( fd, de->d_name ) )
+			ok = 0;
+	closedir( d );
+	return unlinkat( dfd, name, AT_REMOVEDIR ) == 0 && ok;
+}
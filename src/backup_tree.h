@@ -0,0 +1,48 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef _BACKUP_TREE_H_INCLUDED_
+#define _BACKUP_TREE_H_INCLUDED_
+
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*one tree being copied*/
+typedef struct backup_tree {
+	dev_t dev;	/*of top directory. Mounts under it are left out*/
+	char *list;	/*extended attribute names*/
+	char *val;
+	char link[ PATH_MAX+1 ];
+	const char *what;	/*of failure*/
+	const char *name;
+	int err;
+} Backup_tree;
+
+int backup_tree_begin( Backup_tree *t, dev_t dev );
+void backup_tree_end( Backup_tree *t );
+int backup_tree_fail( Backup_tree *t, const char *what, const char *name );
+int backup_tree_attr( int sfd, int dfd, const struct stat *st,
+							Backup_tree *t );
+int backup_tree_special( int sfd, int dfd, const char *name,
+				const struct stat *st, Backup_tree *t );
+int backup_tree_remove( int dfd, const char *name );
+
+#endif
@@ -19,7 +19,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
-/*Keeps file descripter and other details in hash table for the locked files.
+/*Keeps lock file descripter in the session of the name.
 Uses fcntl file locks before mounting and remove fcntl locks after unmounting.*/
 
 #include <stdio.h>
@@ -32,247 +32,19 @@ Uses fcntl file locks before mounting and remove fcntl locks after unmounting.*/
 #include "msg.h"
 #include "miscfuncs.h"
 #include "thread.h"
+#include "session.h"
 #include "lockfile.h"
 
 
-#define LOCKFILE_HASH_SIZE 13
-
-/*cache size of used memory*/
-#define LOCKFILE_CACHE_SIZE 50
-
 #define DEFAULT_LOCKDIR	"/var/lock"
 
-typedef struct lentry {
-	char name[ NAME_MAX + 1 ];
-	char path[ PATH_MAX + 1 ];
-	int fd;
-	unsigned int hash;
-	struct lentry *next;
-} Lentry;
-
-/* for reuse of malloced memory */
-static struct {
-	Lentry *list;
-	int count;
-	pthread_mutex_t lock;
-} lcache;
-
-static Lentry **lhash;
-static pthread_mutex_t hash_lock; /*exclusive access for hash table*/
 static int lockfiles; /*lock file option selected?*/
 static char *lockdir; /*where to keep lockfiles*/
 static char spid[ 128 ]; /*string form of pid*/
 static int spid_len; /*len of above string*/
 
-static int lhash_size;
-static int lhash_used;
-
 static int lockstop = 0; /* set before shutdown*/
 
-/***************Memory management********************/
-
-/*allocate from the unused previousely allocated memory
-or else create new dynamic memory.
-*/
-static Lentry *lentry_malloc( void )
-{
-	Lentry *ent;
-
-	if( lcache.count > 0 )
-	{
-		pthread_mutex_lock( &lcache.lock );
-		if( lcache.count <= 0 )
-		{
-			pthread_mutex_unlock( &lcache.lock );
-			goto dyn_alloc;
-		}
-		ent = lcache.list;
-		lcache.list = lcache.list->next;
-		lcache.count--;
-		pthread_mutex_unlock( &lcache.lock );
-		return ent;
-	}
-
-dyn_alloc:
-	return (Lentry *) malloc( sizeof(Lentry) );
-}
-
-static void lentry_free( Lentry *le )
-{
-	Lentry *tmp;
-
-	if( ! le )
-		return;
-	if( lcache.count < LOCKFILE_CACHE_SIZE )
-	{
-		pthread_mutex_lock( &lcache.lock );
-		if( lcache.count >= LOCKFILE_CACHE_SIZE )
-		{
-			pthread_mutex_unlock( &lcache.lock );
-			free( le );
-			return;
-		}
-		tmp = lcache.list;
-		lcache.list = le;
-		le->next = tmp;
-		lcache.count++;
-		pthread_mutex_unlock( &lcache.lock );
-		return;
-	}
-	else free( le );
-}
-
-/******************Hash management*****************/
-
-#define lentry_key( s )		( s % lhash_size )
-
-static void lhash_resize( void )
-{
-	int new_size;
-	int old_size = lhash_size;
-	Lentry **new_lhash;
-	Lentry **dptr;
-	Lentry **h = lhash;
-	Lentry *lentry;
-	Lentry *next;
-
-	new_size = lhash_size * 2;
-	new_size |= 1;
-
-	new_lhash = ( Lentry ** ) calloc( new_size, sizeof(Lentry *) );
-	if( new_lhash == NULL )
-	    return;
-
-	while( old_size-- > 0 )
-	{
-		for( lentry = *h++; lentry; lentry = next)
-		{
-			next = lentry->next;
-			dptr = &new_lhash[ lentry->hash % new_size ];
-			lentry->next = *dptr;
-			*dptr = lentry;
-		}
-	}
-	lhash_size = new_size;
-	free(lhash);
-	lhash = new_lhash;
-}
-
-/*not thread safe. mutual exclusion must be
-  setup.
- */
-
-#define LENTRY_LOCATE( name, hash, dptr )			\
-do {								\
-	dptr = &( lhash[ lentry_key( hash ) ] );		\
-	while( *dptr )						\
-	{							\
-		if( (*dptr)->hash == hash &&			\
-			*name == (*dptr)->name[0] && 		\
-		       	! strcmp( name, (*dptr)->name ) )	\
-			break;					\
-		dptr = &( (*dptr)->next );			\
-	}							\
-} while( 0 );
-
-/*PERFORMANCE:
-	We allocate and prepare entry 'outside mutex lock'
-	before checking if that entry exist already.
-
-	Collision with existing entry is very rare case.*/
-static Lentry* lockfile_add2hash( const char *name,
-				const char *path,
-				int *exist )
-{
-	unsigned int hash;
-	Lentry *ent, **dptr;
-
-	*exist = 0;
-
-	/*get and prepare entry*/
-	if( ! ( ent = lentry_malloc() ) )
-	{
-		msglog( MSG_ALERT, "lockfile_add2hash: " \
-					    "could not allocate memory" );
-		return NULL;
-	}
-
-	hash = string_hash( name );
-
-	string_n_copy( ent->name, name, sizeof(ent->name) );
-	string_n_copy( ent->path, path, sizeof(ent->path) );
-	ent->fd = -1;
-	ent->hash = hash;
-	ent->next = NULL;
-
-	pthread_mutex_lock( &hash_lock );
-	/*always after mutex*/
-	LENTRY_LOCATE( name, hash, dptr );
-
-	/*already exist*/
-	if( *dptr )
-	{
-		if( (*dptr)->fd != -1 )
-			*exist = 1;
-		pthread_mutex_unlock( &hash_lock );
-
-		if( ! *exist )
-			msglog( MSG_ALERT, "lockfile_add2hash: " \
-					"Invalid state: %s", name );
-		/*free our preallocated entry*/
-		lentry_free( ent );
-		return NULL;
-	}
-		
-	*dptr = ent;
-	lhash_used++;
-	if (lhash_used > lhash_size)
-	    lhash_resize();
-	pthread_mutex_unlock( &hash_lock );
-
-	return ent;
-}
-
-/*remove from hash*/
-static Lentry *lockfile_unhash( const char *name, int force )
-{
-	unsigned int hash = string_hash( name );
-	Lentry **dptr, *ent;
-
-	pthread_mutex_lock( &hash_lock );
-	/*always after mutex*/
-	LENTRY_LOCATE( name, hash, dptr );
-
-	ent = *dptr;
-	if( ! ent ) /*entry does not exist*/
-	{
-		pthread_mutex_unlock( &hash_lock );
-		msglog( MSG_ALERT, "lockfile_unhash: " \
-			"entry for %s does not exist", name );
-		return NULL;
-	}
-	lhash_used--;
-
-	if( ent->fd == -1 && ! force )
-	{
-		pthread_mutex_unlock( &hash_lock );
-		msglog( MSG_ALERT, "lockfile_unhash: " \
-				"Invalid state for %s", name );
-		return NULL;
-	}
-
-	(*dptr) = ent->next;
-	pthread_mutex_unlock( &hash_lock );
-
-	if( force )
-	{
-		lentry_free( ent );
-		return NULL;
-	}
-	else
-		return ent;
-}
-
 static int exclusive_lock( int fd, const char *path )
 {
 	struct flock lk;
@@ -353,27 +125,27 @@ static int shared_lock( int fd, const char *path )
 		  This protocol is expected to be followed by external programs
 		  which create these lock files for their access.
 */
-int lockfile_create( const char *name )
+int lockfile_create( Session *s )
 {
 	int fd = -1;
-	int i, exist;
+	int i;
 	char path[ PATH_MAX + 1 ];
 	struct stat st;
-	Lentry *le;
 
 	if( ! lockfiles ) return 1;
 
-	if( ! name || ! *name )
+	if( ! s )
 	{
-		msglog( MSG_ERR, "lockfile_create: invalid name" );
+		msglog( MSG_ERR, "lockfile_create: invalid session" );
 		return 0;
 	}
 
-	snprintf( path, sizeof(path), "%s/%s.lock",
-			lockdir, name );
+	/*we hold it already*/
+	if( s->lock_fd != -1 )
+		return 1;
 
-	if( ! ( le = lockfile_add2hash( name, path, &exist ) ) )
-		return exist ? 1: 0;
+	snprintf( path, sizeof(path), "%s/%s.lock",
+			lockdir, s->name );
 
 	/*loop until we get rid of dead files.*/
 	for( i = 0 ; i < 10 ; i++ )
@@ -381,7 +153,6 @@ int lockfile_create( const char *name )
 		if( ( fd = open( path, O_RDWR | O_CREAT, 0644 ) ) == -1 )
 		{
 			msglog( MSG_ERR|LOG_ERRNO, "open %s", path );
-			lockfile_unhash( name, 1 );
 			return 0;
 		}
 
@@ -391,14 +162,12 @@ int lockfile_create( const char *name )
 
 		if( ! shared_lock( fd, path ) )
 		{
-			lockfile_unhash( name, 1 );
 			close( fd );
 			return 0;
 		}
 
 		if( fstat( fd, &st ) )
 		{
-			lockfile_unhash( name, 1 );
 			close( fd );
 			msglog( MSG_ERR|LOG_ERRNO, "fstat %s", path );
 			return 0;
@@ -414,7 +183,6 @@ int lockfile_create( const char *name )
 	/*We do not operate on dead file whose hard link count is zero*/
 	if( i >= 10 )
 	{
-		lockfile_unhash( name, 1 );
 		msglog( MSG_NOTICE, "Giving up on dead file %s", path );
 		return 0;
 	}
@@ -423,14 +191,30 @@ int lockfile_create( const char *name )
         {
                 msglog( MSG_NOTICE, "could not write pid %s to lock file %s",
 					spid, path );
-		lockfile_unhash( name, 1 );
                 close( fd );
                 return 0;
         }
-	le->fd = fd;
+
+	/*lock file keeps session alive until removed*/
+	s->lock_fd = fd;
+	session_hold( s );
 	return 1;
 }
 
+/*unlink lock file if no one else uses it and close*/
+static void lockfile_unlink( int fd, const char *name )
+{
+	char path[ PATH_MAX + 1 ];
+
+	snprintf( path, sizeof(path), "%s/%s.lock",
+			lockdir, name );
+
+	if( exclusive_lock( fd, path ) )
+		if( unlink( path ) == -1 )
+			msglog( MSG_ERR|LOG_ERRNO, "unlink %s", path );
+	close( fd );
+}
+
 /**********Public interface for lock file removal****************/
 
 
@@ -439,104 +223,44 @@ int lockfile_create( const char *name )
    unlinking of the lock file should not be performed
    if autodir lock protocol is to be followed.*/
 
-void lockfile_remove( const char *name )
+void lockfile_remove( Session *s )
 {
-	Lentry *le;
-
 	if( ! lockfiles ) return;
 
-	if( ! name || ! *name )
+	if( ! s )
 	{
-		msglog( MSG_ERR, "lockfile_remove: invalid name" );
+		msglog( MSG_ERR, "lockfile_remove: invalid session" );
 		return; 
 	}
 
-	if( ! ( le = lockfile_unhash( name, 0 ) ) )
+	if( s->lock_fd == -1 )
 	{
-		msglog( MSG_ALERT, "could not remove lock file for %s", name );
+		msglog( MSG_ALERT, "could not remove lock file for %s",
+								s->name );
 		return;
 	}
 
-	if( exclusive_lock( le->fd, le->path ) )
-		if( unlink( le->path ) == -1 )
-			msglog( MSG_ERR|LOG_ERRNO, "unlink %s", le->path );
-	close( le->fd );
-	lentry_free( le );
+	lockfile_unlink( s->lock_fd, s->name );
+	s->lock_fd = -1;
+	session_put( s );
 }
 
 /*******Cleaning and initialization**************/
 
-static void free_hash( void )
+/*at exit. sessions go away on their own after this*/
+static void lockfile_drop( Session *s, void *unused )
 {
-	int i;
-	Lentry *le, *tmp;
-
-	for( i = 0 ; i < lhash_size ; i ++ )
-	{
-		if( ! lhash[ i ] ) continue;
-		le = lhash[ i ];
-		while( le && le->fd != -1 )
-		{
-			tmp = le;
-			le = le->next;
-
-			if( exclusive_lock( tmp->fd, tmp->path ) )
-				if( unlink( tmp->path ) == -1 )
-					msglog( MSG_ERR|LOG_ERRNO,
-						"unlink %s", tmp->path );
-			close( tmp->fd );
-			lentry_free( tmp );
-		}
-	}
-	free( lhash );
-}
-
-static void lockfile_hash_clean( void )
-{
-	Lentry *le, *tmp;
-
-	/*clean hash first*/
-	pthread_mutex_destroy( &hash_lock );
-
-	if( lhash )
-		free_hash();
-
-	/*clean cache*/
-	pthread_mutex_destroy( &lcache.lock );
-	le = lcache.list;
-
-	while( le )
-	{
-		tmp = le;
-		le = le->next;
-		free( tmp );
-	}
-}
-
-static void lockfile_hash_init( void )
-{
-	lhash = ( Lentry ** ) calloc( LOCKFILE_HASH_SIZE,
-			sizeof(Lentry *) );
-
-	if( ! lhash )
-		msglog( MSG_FATAL, "lockfile_hash_init: " \
-			"could not allocate hash table" );
-
-	lhash_used = 0;
-	lhash_size = LOCKFILE_HASH_SIZE;
-
-        thread_mutex_init(&hash_lock);
-        thread_mutex_init(&lcache.lock);
-
-	lcache.list = NULL;
-	lcache.count = 0;
+	if( s->lock_fd == -1 )
+		return;
+	lockfile_unlink( s->lock_fd, s->name );
+	s->lock_fd = -1;
 }
 
 static void lockfile_clean( void )
 {
+	session_foreach( lockfile_drop, NULL );
 	if( lockdir )
 		free( lockdir );
-	lockfile_hash_clean();
 }
 
 void lockfile_init( pid_t pid, const char *mod_name )
@@ -566,8 +290,6 @@ void lockfile_init( pid_t pid, const char *mod_name )
 	if( ! create_dir( lockdir, 0755 ) )
 		msglog( MSG_FATAL, "could not create lock dir %s", lockdir );
 
-	lockfile_hash_init();
-
 	if( atexit( lockfile_clean ) )
 	{
 		lockfile_clean();
@@ -627,22 +349,23 @@ char *autodir_name(void)
     return "test autodir";
 }
 
-void *test_th(void *s)
+void *test_th(void *v)
 {
-    char *str = (char *) s;
+    char *str = (char *) v;
+    Session *s;
     int i = 0;
 
     sleep(2);
     while (1) {
 	i++;
-	if (workon_name(str)) {
-	    if (!lockfile_create(str))
+	if ((s = session_acquire(str))) {
+	    if (!lockfile_create(s))
 		printf("could not create lockfile for %s\n", str);
-	    workon_release(str);
+	    session_release(s);
 	}
-	if (workon_name(str)) {
-	    lockfile_remove(str);
-	    workon_release(str);
+	if ((s = session_acquire(str))) {
+	    lockfile_remove(s);
+	    session_release(s);
 	}
 	if (i == 10000) {
 	    printf("%s: %d\n", str, i);
@@ -651,14 +374,14 @@ void *test_th(void *s)
     }
 }
 
-/* compile  gcc -g -DTEST lockfile.c workon.o msg.o  miscfuncs.o -lpthread thread.o */
+/* compile  gcc -g -DTEST lockfile.c session.o name_arena.o slab.o stats.o msg.o  miscfuncs.o -lpthread thread.o */
 
 int main(void)
 {
     pthread_t id;
 
     msg_init();
-    workon_init();
+    session_init();
     thread_init();
     lockfile_option_lockfiles('x', "unused arg", 1);
     lockfile_option_lockdir('x', strdup("/tmp/lockdir"), 1);
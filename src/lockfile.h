@@ -22,9 +22,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define LOCKFILE_H
 
 #include <sys/types.h>
+#include "session.h"
 
-int lockfile_create(const char *name);
-void lockfile_remove(const char *name);
+int lockfile_create(Session *s);
+void lockfile_remove(Session *s);
 void lockfile_option_lockdir(char ch, char *arg, int valid);
 void lockfile_option_lockfiles(char ch, char *arg, int valid);
 void lockfile_init( pid_t pid, const char *mod_name );
@@ -36,6 +36,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define SYMBOL_MODULE_DIR		"module_dir"
 #define SYMBOL_MODULE_DOWORK		"module_dowork"
 #define SYMBOL_MODULE_CLEAN	 	"module_clean"
+#define SYMBOL_MODULE_START		"module_start"
 
 /* for loading requested module from command line option*/
 
@@ -50,6 +51,9 @@ static struct {
 
 static module_info *modinfo;
 
+/*optional. Starts threads of module*/
+static void (*mod_start)( void );
+
 /***************************************************
   ltdl is not made thread safe because,
   ltdl library calls are made from only single thread
@@ -113,6 +117,7 @@ void module_load( char *apath )
 	mod_dir = module_symbol( SYMBOL_MODULE_DIR );
 	mod_dowork = module_symbol( SYMBOL_MODULE_DOWORK );
 	mod_clean = module_symbol( SYMBOL_MODULE_CLEAN );
+	mod_start = lt_dlsym( module.handle, SYMBOL_MODULE_START );
 
 	if( ! ( modinfo = mod_init( module.mod_subopt, apath ) ) )
 		msglog( MSG_FATAL, "could not initialize module" );
@@ -129,6 +134,13 @@ void module_load( char *apath )
 			modinfo->name, module.mod_path );
 }
 
+/*module threads are started only after daemon forks*/
+void module_run( void )
+{
+	if( mod_start )
+		mod_start();
+}
+
 const char *module_name( void )
 {
     return modinfo->name;
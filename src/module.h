@@ -42,6 +42,7 @@ extern void (*mod_clean)( void );
 #endif
 
 void module_load(char *apath);
+void module_run(void);
 void module_option_modpath(char ch, char *arg, int valid);
 void module_option_modopt(char ch, char *arg, int valid);
 const char *module_name(void);
@@ -596,6 +596,7 @@ void module_clean( void )
 #ifdef TEST
 
 #include <assert.h>
+#include "session.h"
 
 char *autodir_name(void)
 {
@@ -606,14 +607,15 @@ void *test_th(void *x)
 {
     char realdir[PATH_MAX+1];
     char name[128];
+    Session *s;
     int i;
 
     while (1) {
 	for (i = 10000; i < 19000; i++) {
 	    snprintf(name, sizeof(name), "t%d", i);
-	    workon_name(name);
+	    s = session_acquire(name);
 	    assert(module_dowork(name, NULL, realdir, sizeof(realdir)));
-	    workon_release(name);
+	    session_release(s);
 	}
 	printf("i=%d\n", i);
     }
@@ -626,7 +628,7 @@ int main(void)
     thread_init();
     msg_init();
     msg_console_on();
-    workon_init();
+    session_init();
     module_init(strdup("renamedir=/tmp/renamedir"), "/test");
 
     //test_th(NULL);
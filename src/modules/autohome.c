@@ -21,8 +21,13 @@ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
@@ -31,9 +36,17 @@ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <dirent.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include "thread.h"
+#include "time_mono.h"
+#include "stats.h"
+#include "session.h"
 #include "miscfuncs.h"
 #include "module.h"
 #include "msg.h"
@@ -83,6 +96,18 @@ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 /*Rename dir to copy all those home dirs with uid mismatch/stale homes*/
 #define SUB_OPTION_RENAMEDIR		"renamedir"
 
+/*threads to copy skel files of big skel directories*/
+#define SUB_OPTION_SKELTHREADS		"skelthreads"
+
+/*seconds between passes creating homes of users before first use*/
+#define SUB_OPTION_PROVISION		"provision"
+
+/*file of user names for provision instead of all users*/
+#define SUB_OPTION_PROVISIONLIST	"provisionlist"
+
+/*homes created by provision in a second at most*/
+#define SUB_OPTION_PROVISIONRATE	"provisionrate"
+
 /************************************************************/
 
 
@@ -91,6 +116,8 @@ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #define DFLT_AUTOHOME_SKELDIR		"/etc/skel"
 #define DFLT_AUTOHOME_LEVEL		2
 #define DFLT_AUTOHOME_MODE		S_IRWXU /*full owner permissions*/
+#define DFLT_AUTOHOME_SKELTHREADS	4
+#define DFLT_AUTOHOME_PROVISIONRATE	10
 
 /****************************
  * module interface methods  
@@ -104,6 +131,8 @@ int module_dowork(const char *name,
 
 void module_clean( void );
 
+void module_start( void );
+
 module_info *module_init( char *subopt, const char *hdir );
 
 /*****************************/
@@ -119,6 +148,10 @@ module_info autohome_info = { MODULE_NAME, MODULE_PROTOCOL };
 #define AUTOHOME_STAMP_FILE		"." MODULE_NAME
 #define READ_BUF_SIZE			8000
 #define SKEL_FILE_MAX_COPY		(1024*1024) /*1MB*/
+#define SKEL_FILE_INLINE		(64*1024) /*kept in memory*/
+#define SKEL_THREADS_MAX		64
+#define SKEL_PARALLEL_FILES		64 /*fewer are copied by caller alone*/
+#define SKEL_CHUNK			8 /*files taken at once*/
 
 
 /*module sub-option values*/
@@ -132,6 +165,10 @@ static struct {
 	int noskelcheck; 
 	int fastmode;
  	int nohomecheck;
+	int skelthreads;
+	char provisionlist[ PATH_MAX+1 ];
+	int provision;	/*seconds. 0 for no provision*/
+	int provisionrate;
 	mode_t mode; 
 	gid_t group; 
 	uid_t owner;
@@ -240,6 +277,21 @@ static uid_t owner_option_check( const char *val )
 	return 0;
 }
 
+static int number_option_check( const char *val, const char *option,
+							int min, int max )
+{
+	int n;
+
+	if( ! string_to_number( val, &n ) )
+		msglog( MSG_FATAL, "module suboption '%s' needs value",
+				option );
+	else if( n < min || n > max )
+		msglog( MSG_FATAL, "invalid '%s' module suboption %s",
+				option, val );
+
+	return n;
+}
+
 static void option_process( char *subopt )
 {
 	char *value;
@@ -256,6 +308,10 @@ static void option_process( char *subopt )
 		OPTION_FASTMODE_IDX,
  		OPTION_NOHOMECHECK_IDX,
 		OPTION_RENAMEDIR_IDX,
+		OPTION_SKELTHREADS_IDX,
+		OPTION_PROVISION_IDX,
+		OPTION_PROVISIONLIST_IDX,
+		OPTION_PROVISIONRATE_IDX,
 		END
 	};
 
@@ -272,6 +328,10 @@ static void option_process( char *subopt )
 		[ OPTION_FASTMODE_IDX ] = SUB_OPTION_FASTMODE,
  		[ OPTION_NOHOMECHECK_IDX ] = SUB_OPTION_NOHOMECHECK,
 		[ OPTION_RENAMEDIR_IDX ] = SUB_OPTION_RENAMEDIR,
+		[ OPTION_SKELTHREADS_IDX ] = SUB_OPTION_SKELTHREADS,
+		[ OPTION_PROVISION_IDX ] = SUB_OPTION_PROVISION,
+		[ OPTION_PROVISIONLIST_IDX ] = SUB_OPTION_PROVISIONLIST,
+		[ OPTION_PROVISIONRATE_IDX ] = SUB_OPTION_PROVISIONRATE,
 		[ END                 ] = NULL
 	};
 
@@ -339,6 +399,31 @@ static void option_process( char *subopt )
 					sizeof( ah_conf.renamedir) );
 				break;
 
+			case OPTION_SKELTHREADS_IDX:
+				ah_conf.skelthreads = number_option_check( value,
+					sos[ OPTION_SKELTHREADS_IDX ],
+					0, SKEL_THREADS_MAX );
+				break;
+
+			case OPTION_PROVISION_IDX:
+				ah_conf.provision = number_option_check( value,
+					sos[ OPTION_PROVISION_IDX ],
+					1, INT_MAX );
+				break;
+
+			case OPTION_PROVISIONLIST_IDX:
+				string_n_copy( ah_conf.provisionlist,
+					path_option_check( value,
+						sos[ OPTION_PROVISIONLIST_IDX ] ),
+					sizeof( ah_conf.provisionlist) );
+				break;
+
+			case OPTION_PROVISIONRATE_IDX:
+				ah_conf.provisionrate = number_option_check( value,
+					sos[ OPTION_PROVISIONRATE_IDX ],
+					1, 1000 );
+				break;
+
 			default:
 				msglog( MSG_FATAL,
 				    "unknown module suboption '%s'", value );
@@ -360,6 +445,10 @@ static void autohome_conf_init( char *opts )
 	ah_conf.group = -1;
 	ah_conf.fastmode = 0;
  	ah_conf.nohomecheck = 0;
+	ah_conf.skelthreads = -1;
+	ah_conf.provisionlist[ 0 ] = 0;
+	ah_conf.provision = 0;
+	ah_conf.provisionrate = DFLT_AUTOHOME_PROVISIONRATE;
 
 	option_process( opts );
 
@@ -392,36 +481,41 @@ static void autohome_conf_init( char *opts )
 				DFLT_AUTOHOME_MODE, SUB_OPTION_MODE );
 		ah_conf.mode = DFLT_AUTOHOME_MODE;
 	}
+	if( ah_conf.skelthreads == -1 )
+		ah_conf.skelthreads = DFLT_AUTOHOME_SKELTHREADS;
 }
 
 /*
    When auto home stamp file is missing in home dir,
-  every skel file is checked for correct ownership
+  every skel file is checked for correct ownership.
+  Path is relative to home directory hfd
  */
-static int check_file_owner( const char *file, uid_t uid )
+static int check_file_owner( int hfd, const char *home,
+				const char *file, uid_t uid )
 {
 	struct stat st;
 
-	if( lstat( file, &st ) )
+	if( fstatat( hfd, file, &st, AT_SYMLINK_NOFOLLOW ) )
 	{
-		msglog( MSG_ERR|LOG_ERRNO, "check_file_owner: lstat %s", file );
+		msglog( MSG_ERR|LOG_ERRNO, "check_file_owner: lstat %s/%s",
+								home, file );
 		return 0;
 	}
 	if( ! S_ISREG( st.st_mode ) )
 	{
 		msglog( MSG_NOTICE, "check_file_owner: " \
-			"%s is not regular file", file );
+			"%s/%s is not regular file", home, file );
 		return 0;
 	}
 	if( st.st_uid != uid )
 	{
-		msglog( MSG_NOTICE, "improper owner for file %s. fixing",
-					file );
+		msglog( MSG_NOTICE, "improper owner for file %s/%s. fixing",
+							home, file );
 
-		if( chown( file, uid, -1 ) )
+		if( fchownat( hfd, file, uid, -1, AT_SYMLINK_NOFOLLOW ) )
 		{
-			msglog( MSG_ERR|LOG_ERRNO, "check_file_owner: chown %s",
-					file );
+			msglog( MSG_ERR|LOG_ERRNO, "check_file_owner: " \
+					"chown %s/%s", home, file );
 			return 0;
 		}
 	}
@@ -432,172 +526,219 @@ static int check_file_owner( const char *file, uid_t uid )
    When auto home stamp file is missing in home dir,
   every skel dir is checked for correct ownership
  */
-static int check_dir_owner( const char *dir, uid_t uid )
+static int check_dir_owner( int hfd, const char *home,
+				const char *dir, uid_t uid )
 {
 	struct stat st;
 
-	if( lstat( dir, &st ) )
+	if( fstatat( hfd, dir, &st, AT_SYMLINK_NOFOLLOW ) )
 	{
-	       msglog( MSG_ERR|LOG_ERRNO, "check_dir_owner: lstat %s", dir );
+	       msglog( MSG_ERR|LOG_ERRNO, "check_dir_owner: lstat %s/%s",
+	       						home, dir );
 	       return 0;
 	}
 	if( ! S_ISDIR( st.st_mode ) )
 	{
 	       msglog( MSG_NOTICE, "check_dir_owner: " \
-		       "%s is not directory", dir );
+		       "%s/%s is not directory", home, dir );
 	       return 0;
 	}
 	if( st.st_uid != uid )
 	{
-		msglog( MSG_NOTICE, "improper owner for dir %s. fixing", dir );
+		msglog( MSG_NOTICE, "improper owner for dir %s/%s. fixing",
+							home, dir );
 
-		if( chown( dir, uid, -1 ) )
+		if( fchownat( hfd, dir, uid, -1, AT_SYMLINK_NOFOLLOW ) )
 		{
-			msglog( MSG_ERR|LOG_ERRNO, "check_dir_owner: chown %s",
-					dir );
+			msglog( MSG_ERR|LOG_ERRNO, "check_dir_owner: " \
+					"chown %s/%s", home, dir );
 			return 0;
 		}
 	}
 	return 1;
 }
 
-static int copy_skel_file( const char *sfile, /*source file*/
-				const char *dfile, /*destination file*/
-				const struct stat *st, /*stat of source file*/
-				uid_t uid, /*file owner*/
-				gid_t gid ) /*file group*/
+/*************************************************************
+ skel directory is read once into memory, and every new home is
+ made from that. inotify on every skel directory tells when it
+ has to be read again. Entries are in tree order, so that a
+ directory always comes before what is in it
+*************************************************************/
+
+typedef struct skel_ent {
+	char *path;	/*relative to skel directory*/
+	mode_t mode;
+	off_t size;
+	char *data;	/*contents of small files. NULL to read from skel*/
+	int end;	/*of entries in directory*/
+} Skel_ent;
+
+typedef struct skel_tree {
+	Skel_ent *ent;
+	int n;
+	int size;
+	int *files;	/*entries of regular files*/
+	int nfiles;
+	int sfd;	/*skel directory*/
+	int refs;	/*homes being made from it, and one while current*/
+} Skel_tree;
+
+static struct {
+	pthread_mutex_t lock;
+	Skel_tree *cur;
+	int ifd;	/*inotify. -1 reads skel every time*/
+} skel = {
+	.ifd = -1,
+};
+
+static void skel_free( Skel_tree *t )
 {
-	char buf[ READ_BUF_SIZE ];
-	int sfd, dfd, count = 0, n;
+	int i;
 
-	/*must be absolute path*/
-	if( ! sfile || ! dfile ||
-		sfile[ 0 ] != '/' ||
-		dfile[ 0 ] != '/' )
+	for( i = 0; i < t->n; i++ )
 	{
-		msglog( MSG_WARNING, "copy_skel_file: invalid path" );
-		return 0;
+		free( t->ent[ i ].path );
+		free( t->ent[ i ].data );
 	}
+	if( t->sfd >= 0 )
+		close( t->sfd );
+	free( t->files );
+	free( t->ent );
+	free( t );
+}
 
-	if( ! ah_conf.noskelcheck )
-	{
-		/*definitly NO*/
-		if( st->st_mode & S_IWOTH )
-		{
-			msglog( MSG_WARNING, "copy_skel_file: " \
-				"world write permission for %s. omitting", sfile );
-			return 0;
-		}
+static void skel_put( Skel_tree *t )
+{
+	int last;
 
-		/*we do not want more then one door to this file*/
-		if( st->st_nlink > 1 )
-		{
-			msglog( MSG_WARNING, "copy_skel_file: " \
-				"more then one hard link for %s. omitting", sfile );
-			return 0;
-		}
+	pthread_mutex_lock( &skel.lock );
+	last = --t->refs == 0;
+	pthread_mutex_unlock( &skel.lock );
+	if( last )
+		skel_free( t );
+}
+
+static Skel_ent *skel_add( Skel_tree *t, const char *path,
+						const struct stat *st )
+{
+	Skel_ent *tmp;
+
+	if( t->n == t->size )
+	{
+		if( ! ( tmp = realloc( t->ent, ( t->size * 2 + 16 ) *
+							sizeof(*tmp) ) ) )
+			return NULL;
+		t->ent = tmp;
+		t->size = t->size * 2 + 16;
 	}
+	tmp = &t->ent[ t->n ];
+	if( ! ( tmp->path = strdup( path ) ) )
+		return NULL;
+	tmp->mode = st->st_mode;
+	tmp->size = st->st_size;
+	tmp->data = NULL;
+	tmp->end = ++t->n;
+	return tmp;
+}
+
+/*small files are kept in memory*/
+static int skel_read( Skel_tree *t, Skel_ent *e )
+{
+	ssize_t n;
+	off_t got = 0;
+	int fd;
 
-	if( ( sfd = open( sfile, O_RDONLY ) ) == -1 )
+	if( e->size > SKEL_FILE_INLINE )
+		return 1;
+	if( ( fd = openat( t->sfd, e->path, O_RDONLY|O_CLOEXEC|
+			( ah_conf.noskelcheck ? 0 : O_NOFOLLOW ) ) ) < 0 ||
+			! ( e->data = malloc( e->size + 1 ) ) )
 	{
-		msglog( MSG_WARNING, "copy_skel_file: " \
-				"open %s", sfile );
+		if( fd >= 0 )
+			close( fd );
 		return 0;
 	}
+	/*file changing now is read again after its event*/
+	while( got < e->size && ( n = read( fd, e->data + got,
+						e->size - got ) ) > 0 )
+		got += n;
+	close( fd );
+	e->size = got;
+	return 1;
+}
 
-	dfd = open( dfile, O_WRONLY | O_CREAT | O_EXCL,
-			st->st_mode & S_IRWXU );
-	if( dfd == -1 )
+/*checks of skel that were done for every file copied*/
+static int skel_allowed( const char *src, const struct stat *st )
+{
+	if( ah_conf.noskelcheck )
+		return 1;
+
+	/*definitly NO*/
+	if( st->st_mode & S_IWOTH )
 	{
-		if( errno == EEXIST )
-		{
-			msglog( MSG_NOTICE, "copy_skel_file: " \
-				"file %s already exists", dfile );
-			check_file_owner( dfile, uid );
-		}
-		else msglog( MSG_ERR|LOG_ERRNO, "copy_skel_file: open %s",
-						dfile );
+		msglog( MSG_WARNING, "skel_load: world write " \
+				"permission for %s. omitting", src );
 		return 0;
 	}
-
-	while( 1 )
+	if( S_ISREG( st->st_mode ) )
 	{
-		n = read( sfd, buf, sizeof(buf) );
-		if( ! n )
+		/*we do not want more then one door to this file*/
+		if( st->st_nlink > 1 )
 		{
-			if( fchown( dfd, uid, gid ) == -1 )
-			{
-				msglog( MSG_ERR|LOG_ERRNO, 
-					"copy_skel_file: fchown %s", dfile );
-				return 0;
-			}
-			close( sfd );
-			close( dfd );
-			return 1;
+			msglog( MSG_WARNING, "skel_load: more then one " \
+				"hard link for %s. omitting", src );
+			return 0;
+		}
+		if( st->st_size > SKEL_FILE_MAX_COPY )
+		{
+			msglog( MSG_WARNING, "skel_load: " \
+				"%s exceeding size limit. omitting", src );
+			return 0;
 		}
-		else if( n < 0 )
-			msglog( MSG_ERR|LOG_ERRNO, "copy_skel_file: read %s",
-					sfile );
-
-		else if( ( count = count + n ) > SKEL_FILE_MAX_COPY
-				&& ! ah_conf.noskelcheck )
-			msglog( MSG_WARNING, "copy_skel_file: " \
-				"%s exceeding size limit", sfile );
-
-		else if( ! write_all( dfd, buf, n ) )
-			msglog( MSG_ERR, "copy_skel_file: write error %s",
-					dfile );
-
-		else continue;
-
-		/*Remove the file if half copied or for some other errors.*/
-		/*Assuming nothing better then something in inconsistent state.*/
-		unlink( dfile );
-		break;
 	}
-
-	close( sfd );
-	close( dfd );
-
-	return 0;
+	return 1;
 }
 
-/*recursive function*/
-static int copy_skel_dir( const char *src, /*source directory*/
-				const char *dest, /*destination directory*/
-				const struct stat *st, /*stat of source directory*/
-				uid_t uid,
-				gid_t gid )
+/*recursive function. rel is "" for skel directory itself.
+  Changes missed in one directory would keep a stale tree,
+  so skel is read for every home once a watch can not be set.
+  Under skel.lock*/
+static int skel_scan( Skel_tree *t, const char *src, const char *rel )
 {
 	char sdent[ PATH_MAX+1 ]; /*source directory entry*/
-	char ddent[ PATH_MAX+1 ]; /*destination directory entry*/
-	struct stat sdent_st; /*source directory entry stat*/
-	DIR *dir;
+	char rdent[ PATH_MAX+1 ]; /*relative to skel*/
+	struct stat st;
 	struct dirent *dent;
+	Skel_ent *e;
+	int fd, i;
+	DIR *dir;
 
-	if( ! src || ! dest ||
-			src[ 0 ] != '/' ||
-			dest[ 0 ] !='/' )
+	if( snprintf( sdent, sizeof(sdent), "%s%s%s", src, *rel ? "/" : "",
+						rel ) >= (int) sizeof(sdent) )
 	{
-		msglog( MSG_WARNING, "copy_skel_dir: invalid directory name");
+		msglog( MSG_ERR, "skel_load: path too long %s/%s", src, rel );
 		return 0;
 	}
-
-	/*definitly NO*/
-	if( ! ah_conf.noskelcheck && st->st_mode & S_IWOTH )
+	if( skel.ifd >= 0 && inotify_add_watch( skel.ifd, sdent, IN_CREATE|
+			IN_DELETE|IN_MODIFY|IN_ATTRIB|IN_MOVED_FROM|
+			IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|
+			( ah_conf.noskelcheck ? 0 : IN_DONT_FOLLOW ) ) < 0 )
 	{
-		msglog( MSG_WARNING, "copy_skel_dir: " \
-			"dir %s has world write " \
-			"permission. omitting", src );
-		return 0;
+		msglog( MSG_WARNING|LOG_ERRNO, "skel_load: inotify_add_watch " \
+				"%s. skel dir %s is read for every home",
+				sdent, src );
+		close( skel.ifd );
+		skel.ifd = -1;
 	}
 
 	/*careful. opendir return value must be closed
 	  to avoid memory leaks.*/
-	if( ( dir = opendir( src ) ) == NULL )
+	if( ( fd = openat( t->sfd, *rel ? rel : ".", O_RDONLY|O_DIRECTORY|
+				O_CLOEXEC ) ) < 0 || ! ( dir = fdopendir( fd ) ) )
 	{
-		msglog( MSG_ERR|LOG_ERRNO, "copy_skel_dir: opendir %s",
-				src );
+		msglog( MSG_ERR|LOG_ERRNO, "skel_load: opendir %s", sdent );
+		if( fd >= 0 )
+			close( fd );
 		return 0;
 	}
 
@@ -607,70 +748,225 @@ static int copy_skel_dir( const char *src, /*source directory*/
 		    ! strcmp( dent->d_name, ".." ) )
 			continue;
 
-		snprintf( sdent, sizeof(sdent),
-			"%s/%s", src, dent->d_name );
-		snprintf( ddent, sizeof(ddent),
-			"%s/%s", dest, dent->d_name );
+		if( snprintf( sdent, sizeof(sdent), "%s%s%s/%s", src,
+				*rel ? "/" : "", rel, dent->d_name )
+						>= (int) sizeof(sdent) ||
+				snprintf( rdent, sizeof(rdent), "%s%s%s",
+				rel, *rel ? "/" : "", dent->d_name )
+						>= (int) sizeof(rdent) )
+		{
+			msglog( MSG_ERR, "skel_load: path of %s under %s/%s " \
+				"too long. omitting", dent->d_name, src, rel );
+			continue;
+		}
 
-		if( ! ah_conf.noskelcheck && lstat( sdent, &sdent_st ) == -1 )
+		if( fstatat( t->sfd, rdent, &st, ah_conf.noskelcheck ?
+						0 : AT_SYMLINK_NOFOLLOW ) )
 		{
 			msglog( MSG_ERR|LOG_ERRNO, "lstat %s", sdent );
 			continue;
 		}
-		else if( ah_conf.noskelcheck && stat( sdent, &sdent_st ) == -1 )
+		if( ! S_ISREG( st.st_mode ) && ! S_ISDIR( st.st_mode ) )
 		{
-			msglog( MSG_ERR|LOG_ERRNO, "stat %s", sdent );
+			msglog( MSG_WARNING, "skel_load: %s is not " \
+				"regular file or directory", sdent );
 			continue;
 		}
+		if( S_ISREG( st.st_mode ) && ! skel_allowed( sdent, &st ) )
+			continue;
 
-		if( S_ISREG( sdent_st.st_mode ) )
+		if( ! ( e = skel_add( t, rdent, &st ) ) )
 		{
-			copy_skel_file( sdent, ddent, &sdent_st, uid, gid );
+			msglog( MSG_ERR, "skel_load: could not allocate memory" );
+			closedir( dir );
+			return 0;
 		}
-		else if( S_ISDIR( sdent_st.st_mode ) )
+		if( S_ISREG( st.st_mode ) && ! skel_read( t, e ) )
 		{
-			if( mkdir( ddent, sdent_st.st_mode & S_IRWXU ) == -1 )
-			{
-				if( errno == EEXIST )
-				{
-					msglog( MSG_NOTICE, "copy_skel_dir: " \
-						"skel dir %s already exists", ddent );
-					check_dir_owner( ddent, uid );
-					copy_skel_dir( sdent, ddent, &sdent_st, uid, gid );
-					continue;
-				}
-				msglog( MSG_ERR|LOG_ERRNO,
-					"copy_skel_dir: mkdir %s",
-					ddent );
-				continue;
-			}
-			else
+			msglog( MSG_ERR|LOG_ERRNO, "skel_load: read %s", sdent );
+			free( e->path );
+			t->n--;
+			continue;
+		}
+
+		/*directory is made, but nothing in it*/
+		if( S_ISDIR( st.st_mode ) && skel_allowed( sdent, &st ) )
+		{
+			i = t->n - 1;
+			if( ! skel_scan( t, src, rdent ) )
 			{
-				copy_skel_dir( sdent, ddent, &sdent_st, uid, gid );
-				if ( chown( ddent, uid, gid ) ) return 0;
+				closedir( dir );
+				return 0;
 			}
+			t->ent[ i ].end = t->n;
 		}
-		else msglog( MSG_WARNING, "copy_skel_dir: %s is not " \
-			"regular file or directory", sdent );
 	}
 
 	/*do not return without doing this*/
 	closedir( dir );
+	return 1;
+}
 
+/*files are copied apart from directories*/
+static int skel_index( Skel_tree *t )
+{
+	int i;
+
+	if( ! ( t->files = malloc( ( t->n + 1 ) * sizeof(int) ) ) )
+	{
+		msglog( MSG_ERR, "skel_load: could not allocate memory" );
+		return 0;
+	}
+	for( i = 0; i < t->n; i++ )
+		if( S_ISREG( t->ent[ i ].mode ) )
+			t->files[ t->nfiles++ ] = i;
 	return 1;
 }
 
+static Skel_tree *skel_load( const char *src )
+{
+	struct stat st;
+	Skel_tree *t;
+
+	if( ! ( t = calloc( 1, sizeof(*t) ) ) )
+	{
+		msglog( MSG_ERR, "skel_load: could not allocate memory" );
+		return NULL;
+	}
+	t->refs = 1;
+
+	/*watches of earlier tree go with it*/
+	if( skel.ifd >= 0 )
+		close( skel.ifd );
+	if( ( skel.ifd = inotify_init1( IN_NONBLOCK|IN_CLOEXEC ) ) < 0 )
+		msglog( MSG_WARNING|LOG_ERRNO, "skel_load: inotify_init. " \
+				"skel dir %s is read for every home", src );
+
+	if( ( t->sfd = open( src, O_RDONLY|O_DIRECTORY|O_CLOEXEC|
+			( ah_conf.noskelcheck ? 0 : O_NOFOLLOW ) ) ) < 0 ||
+			fstat( t->sfd, &st ) )
+		msglog( MSG_ERR|LOG_ERRNO, "skel_load: open %s", src );
+
+	else if( ! ah_conf.noskelcheck && st.st_mode & S_IWOTH )
+		msglog( MSG_WARNING, "skel_load: dir %s has world write " \
+			"permission. omitting", src );
+
+	else if( skel_scan( t, src, "" ) &&
+			skel_index( t ) )
+		return t;
+
+	skel_free( t );
+	return NULL;
+}
+
+/*skel tree, read again if skel has changed since*/
+static Skel_tree *skel_get( const char *src )
+{
+	char buf[ 4096 ]
+		__attribute__ ((aligned( __alignof__( struct inotify_event ) )));
+	Skel_tree *t;
+	int changed;
+
+	pthread_mutex_lock( &skel.lock );
+	changed = skel.ifd < 0;
+	while( skel.ifd >= 0 && read( skel.ifd, buf, sizeof(buf) ) > 0 )
+		changed = 1;
+	if( changed && ( t = skel.cur ) )
+	{
+		skel.cur = NULL;
+		if( --t->refs == 0 )
+			skel_free( t );
+	}
+	if( ! skel.cur )
+		skel.cur = skel_load( src );
+	if( ( t = skel.cur ) )
+		t->refs++;
+	pthread_mutex_unlock( &skel.lock );
+	return t;
+}
+
+/*files too big to be kept in memory*/
+static int skel_copy( Skel_tree *t, Skel_ent *e, int dfd )
+{
+	char buf[ READ_BUF_SIZE ];
+	ssize_t n;
+	int sfd, ok = 0;
+
+	if( ( sfd = openat( t->sfd, e->path, O_RDONLY|O_CLOEXEC|
+			( ah_conf.noskelcheck ? 0 : O_NOFOLLOW ) ) ) < 0 )
+		return 0;
+
+	/*shares blocks with skel where file system can*/
+	if( ! ioctl( dfd, FICLONE, sfd ) )
+		ok = 1;
+	else
+	{
+		while( ( n = copy_file_range( sfd, NULL, dfd, NULL,
+						SKEL_FILE_MAX_COPY, 0 ) ) > 0 );
+		if( ! ( ok = n == 0 ) && lseek( sfd, 0, SEEK_SET ) == 0 &&
+				ftruncate( dfd, 0 ) == 0 )
+		{
+			while( ( n = read( sfd, buf, sizeof(buf) ) ) > 0 &&
+						write_all( dfd, buf, n ) );
+			ok = n == 0;
+		}
+	}
+	close( sfd );
+	return ok;
+}
+
+/*returns 0 if file could not be made*/
+static int skel_make_file( Skel_tree *t, Skel_ent *e, int hfd,
+				const char *home, uid_t uid, gid_t gid )
+{
+	int dfd, ok;
+
+	dfd = openat( hfd, e->path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC,
+						e->mode & S_IRWXU );
+	if( dfd == -1 )
+	{
+		if( errno == EEXIST )
+		{
+			msglog( MSG_NOTICE, "copy_skel: " \
+				"file %s/%s already exists", home, e->path );
+			/*what is there is of user now*/
+			check_file_owner( hfd, home, e->path, uid );
+			return 1;
+		}
+		msglog( MSG_ERR|LOG_ERRNO, "copy_skel: open %s/%s",
+							home, e->path );
+		return 0;
+	}
+
+	if( e->data )
+		ok = ! e->size || write_all( dfd, e->data, e->size );
+	else ok = skel_copy( t, e, dfd );
+	if( ! ok )
+		msglog( MSG_ERR|LOG_ERRNO, "copy_skel: write error %s/%s",
+							home, e->path );
+	else if( fchown( dfd, uid, gid ) == -1 )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "copy_skel: fchown %s/%s",
+							home, e->path );
+		ok = 0;
+	}
+	close( dfd );
+
+	/*Remove the file if half copied or for some other errors.*/
+	/*Assuming nothing better then something in inconsistent state.*/
+	if( ! ok )
+		unlinkat( hfd, e->path, 0 );
+	return ok;
+}
+
 /*stamp file is used to mark that
   home dir building complete and successfull*/
-static int autohome_stamp( const char *dir )
+static int autohome_stamp( int hfd )
 {
 	int fd;
-	char stamp[ PATH_MAX+1 ];
-	
-	snprintf( stamp, sizeof(stamp),
-		"%s/%s", dir, AUTOHOME_STAMP_FILE );
 
-	fd = open( stamp, O_WRONLY | O_CREAT | O_TRUNC, 0 );
+	fd = openat( hfd, AUTOHOME_STAMP_FILE,
+			O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0 );
 	if( fd != -1 )
 	{
 		close( fd );
@@ -679,36 +975,272 @@ static int autohome_stamp( const char *dir )
 	return 0;
 }
 
+/*************************************************************
+ Files of big skel directories are copied by a pool of threads
+ together with the thread making the home. Directories are all
+ made by the caller before any file is given out, so a file
+ never comes before its directory.
+*************************************************************/
+
+/*from linux/ioprio.h, not there with older headers*/
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_IDLE	3
+
+#define IOPRIO_IDLE		( IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT )
+
+/*io priority of calling thread. Returns 0 on failure*/
+static int thread_ioprio_set( int prio )
+{
+	if( syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS,
+				syscall( SYS_gettid ), prio ) )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "ioprio_set" );
+		return 0;
+	}
+	return 1;
+}
+
+typedef struct skel_job {
+	Skel_tree *t;
+	int hfd;
+	const char *home;
+	uid_t uid;
+	gid_t gid;
+	int ioprio;	/*for helpers working on it. 0 as they are*/
+	char *skip;	/*entries under directories not made*/
+	int next;	/*of t->files to be taken. Atomic*/
+	int failed;	/*Atomic*/
+	int helpers;	/*threads of pool in it. Under pool lock*/
+	struct skel_job *link;
+} Skel_job;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/*job given or stopping*/
+	pthread_cond_t idle;	/*helpers left a job*/
+	Skel_job *jobs;
+	pthread_t tid[ SKEL_THREADS_MAX ];
+	int threads;
+	int stop;
+} pool;
+
+static void skel_job_files( Skel_job *j )
+{
+	Skel_tree *t = j->t;
+	int i, k, end;
+
+	while( ( i = __atomic_fetch_add( &j->next, SKEL_CHUNK,
+				__ATOMIC_RELAXED ) ) < t->nfiles )
+	{
+		end = i + SKEL_CHUNK < t->nfiles ? i + SKEL_CHUNK : t->nfiles;
+		for( ; i < end; i++ )
+		{
+			k = t->files[ i ];
+			if( ! j->skip[ k ] && ! skel_make_file( t, &t->ent[ k ],
+					j->hfd, j->home, j->uid, j->gid ) )
+				__atomic_store_n( &j->failed, 1,
+							__ATOMIC_RELAXED );
+		}
+	}
+}
+
+/*under pool lock*/
+static void skel_job_unlink( Skel_job *j )
+{
+	Skel_job **jp;
+
+	for( jp = &pool.jobs; *jp; jp = &( *jp )->link )
+		if( *jp == j )
+		{
+			*jp = j->link;
+			break;
+		}
+}
+
+static void *skel_thread( void *x )
+{
+	Skel_job *j;
+	int prio;
+
+	prio = syscall( SYS_ioprio_get, IOPRIO_WHO_PROCESS,
+					syscall( SYS_gettid ) );
+	pthread_mutex_lock( &pool.lock );
+	while( 1 )
+	{
+		while( ! pool.stop && ! pool.jobs )
+			pthread_cond_wait( &pool.wake, &pool.lock );
+		if( pool.stop )
+			break;
+
+		j = pool.jobs;
+		j->helpers++;
+		pthread_mutex_unlock( &pool.lock );
+
+		/*provision is not to slow down anyone*/
+		if( j->ioprio && prio >= 0 && thread_ioprio_set( j->ioprio ) )
+		{
+			skel_job_files( j );
+			thread_ioprio_set( prio );
+		}
+		else skel_job_files( j );
+
+		pthread_mutex_lock( &pool.lock );
+		/*nothing left to take*/
+		skel_job_unlink( j );
+		if( --j->helpers == 0 )
+			pthread_cond_broadcast( &pool.idle );
+	}
+	pthread_mutex_unlock( &pool.lock );
+	return x;
+}
+
+static void skel_job_run( Skel_job *j )
+{
+	if( pool.threads == 0 || j->t->nfiles < SKEL_PARALLEL_FILES )
+	{
+		skel_job_files( j );
+		return;
+	}
+
+	pthread_mutex_lock( &pool.lock );
+	j->link = pool.jobs;
+	pool.jobs = j;
+	pthread_cond_broadcast( &pool.wake );
+	pthread_mutex_unlock( &pool.lock );
+
+	skel_job_files( j );
+
+	/*helpers may still be on their last files*/
+	pthread_mutex_lock( &pool.lock );
+	skel_job_unlink( j );
+	while( j->helpers )
+		pthread_cond_wait( &pool.idle, &pool.lock );
+	pthread_mutex_unlock( &pool.lock );
+}
+
+static void skel_pool_init( void )
+{
+	thread_mutex_init( &pool.lock );
+	thread_cond_init( &pool.wake );
+	thread_cond_init( &pool.idle );
+
+	for( pool.threads = 0; pool.threads < ah_conf.skelthreads;
+							pool.threads++ )
+		if( ! thread_new_joinable( skel_thread, NULL,
+					&pool.tid[ pool.threads ] ) )
+		{
+			msglog( MSG_WARNING, "could not start skel thread. " \
+				"%d started", pool.threads );
+			break;
+		}
+}
+
+static void skel_pool_stop( void )
+{
+	int i;
+
+	if( ! pool.threads )
+		return;
+
+	pthread_mutex_lock( &pool.lock );
+	pool.stop = 1;
+	pthread_cond_broadcast( &pool.wake );
+	pthread_mutex_unlock( &pool.lock );
+
+	for( i = 0; i < pool.threads; i++ )
+		pthread_join( pool.tid[ i ], NULL );
+	pool.threads = 0;
+}
+
+/*stamp is made only if every skel entry is made*/
 static int copy_skel( const char *src, /*skel directory*/
 			const char *dst, /*home directory*/
 			uid_t uid, /*file owner*/
-			gid_t gid ) /*file group*/
+			gid_t gid, /*file group*/
+			int ioprio ) /*of pool threads helping. 0 as they are*/
 {
-	struct stat st;
+	Skel_job j;
+	Skel_tree *t;
+	Skel_ent *e;
+	int i, ok = 0;
 
 	if( ! src || ! dst ||
 			src[ 0 ] != '/' ||
 			dst[ 0 ] != '/' )
+	{
 		msglog( MSG_WARNING, "copy_skel: invalid dir name" );
+		return 0;
+	}
+	if( ! ( t = skel_get( src ) ) )
+		return 0;
+	if( ! ( j.skip = calloc( t->n + 1, 1 ) ) )
+	{
+		msglog( MSG_ERR, "copy_skel: could not allocate memory" );
+		skel_put( t );
+		return 0;
+	}
+	if( ( j.hfd = open( dst, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|
+						O_CLOEXEC ) ) < 0 )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "copy_skel: open %s", dst );
+		free( j.skip );
+		skel_put( t );
+		return 0;
+	}
+	j.t = t;
+	j.home = dst;
+	j.uid = uid;
+	j.gid = gid;
+	j.ioprio = ioprio;
+	j.next = j.failed = j.helpers = 0;
+
+	for( i = 0; i < t->n; i++ )
+	{
+		e = &t->ent[ i ];
+		if( j.skip[ i ] || ! S_ISDIR( e->mode ) )
+			continue;
 
-	else if( ! ah_conf.noskelcheck && lstat( src, &st ) == -1 )
-		msglog( MSG_ERR|LOG_ERRNO, "copy_skel: lstat %s", src );
-
-	else if( ah_conf.noskelcheck && stat( src, &st ) == -1 )
-		msglog( MSG_ERR|LOG_ERRNO, "copy_skel: stat %s", src );
-
-	else if( ! S_ISDIR( st.st_mode ) )
-		msglog( MSG_WARNING, "copy_skel: skel source %s is " \
-			"not directory", src );
+		if( ! mkdirat( j.hfd, e->path, e->mode & S_IRWXU ) )
+		{
+			if( fchownat( j.hfd, e->path, uid, gid,
+						AT_SYMLINK_NOFOLLOW ) )
+			{
+				msglog( MSG_ERR|LOG_ERRNO, "copy_skel: " \
+					"chown %s/%s", dst, e->path );
+				j.failed = 1;
+			}
+		}
+		else if( errno == EEXIST )
+		{
+			msglog( MSG_NOTICE, "copy_skel: " \
+				"skel dir %s/%s already exists", dst, e->path );
+			/*not a directory of user is left as it is*/
+			if( ! check_dir_owner( j.hfd, dst, e->path, uid ) )
+				memset( j.skip + i + 1, 1, e->end - i - 1 );
+		}
+		else
+		{
+			msglog( MSG_ERR|LOG_ERRNO, "copy_skel: mkdir %s/%s",
+							dst, e->path );
+			/*nothing of it either*/
+			memset( j.skip + i + 1, 1, e->end - i - 1 );
+			j.failed = 1;
+		}
+	}
 
-	else if( copy_skel_dir( src, dst, &st, uid, gid ) &&
-			autohome_stamp( dst ) )
-		return 1;
+	skel_job_run( &j );
 
-	return 0;
+	if( j.failed )
+		msglog( MSG_WARNING, "copy_skel: skel of %s not complete. " \
+				"no stamp file", dst );
+	else ok = autohome_stamp( j.hfd );
+	close( j.hfd );
+	free( j.skip );
+	skel_put( t );
+	return ok;
 }
 
-
 #define TME_FORMAT "-%Y_%d%b_%H:%M:%S." MODULE_NAME
 
 static int create_home_dir( const char *name,
@@ -791,7 +1323,7 @@ static int create_home_dir( const char *name,
 				msglog( MSG_NOTICE, "create_home_dir: " \
 					"skel stamp file %s does not exist. " \
 					"copying skel dir", stamp );
-				copy_skel( skel, home, uid, gid );
+				copy_skel( skel, home, uid, gid, 0 );
 			}
 		}
 	}
@@ -803,7 +1335,7 @@ home_create:
 		if( ! create_dir( home, S_IRUSR | S_IWUSR | S_IXUSR ) )
 			return 0;
 		if( ! ah_conf.noskel )
-			copy_skel( skel, home, uid, gid );
+			copy_skel( skel, home, uid, gid, 0 );
 		if( chmod( home, ah_conf.mode ) )
 		{
 			msglog( MSG_ERR|LOG_ERRNO, "create_home_dir: chmod %s",
@@ -824,6 +1356,362 @@ home_create:
 	return 1;
 }
 
+static int get_passwd_info( const char *name, uid_t *uid,
+		gid_t *gid, char *home, int len )
+{
+	char *buf = alloca( sizeof(char)*pwd_bufsz );
+	struct passwd pwd, *pass;
+	
+	if( ! buf )
+	{
+		msglog( MSG_ERR, "alloca: could not allocate stack" );
+		return 0;
+	}
+	errno = getpwnam_r( name, &pwd, buf, pwd_bufsz, &pass );
+	if( pass )
+	{
+		(*uid) = ah_conf.owner != -1 ? ah_conf.owner : pass->pw_uid;
+		(*gid) = ah_conf.group != -1 ? ah_conf.group : pass->pw_gid;
+		string_n_copy( home, pass->pw_dir ,len );
+		return 1;
+	}
+	if( ! errno )
+		msglog( MSG_WARNING, "no user found with name %s", name );
+	else
+		msglog( MSG_ERR|LOG_ERRNO, "get_passwd_info: getpwnam_r" );
+
+	return 0;
+}
+
+/*owner of home of name. Returns 0 if home of name in
+  passwd is not under homebase, unless that is not checked*/
+static int home_owner( const char *name, const char *homebase,
+						uid_t *uid, gid_t *gid )
+{
+	char tmp[ PATH_MAX+1 ];
+	char home[ PATH_MAX+1 ];
+
+	if( ! get_passwd_info( name, uid, gid, home, sizeof(home) ) )
+		return 0;
+
+ 	if( ( ! ah_conf.nohomecheck ) )
+	{
+		snprintf( tmp, sizeof(tmp), "%s/%s", homebase, name );
+		if( strcmp( home, tmp ) ) {
+			msglog( MSG_NOTICE, "home dirs %s,%s do not match",
+					home, tmp );
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*************************************************************
+ Provision creates homes of users before their first lookup,
+ so that the lookup finds everything ready. Every pass takes
+ all users, or names in provision list file, and makes homes
+ missing under real path. Work is done at idle io priority and
+ at most provisionrate homes a second. Homes are made under a
+ temporary name without lock of their name, so a lookup never
+ waits for them; only the rename to real path is done under
+ it, at io priority of lookups.
+*************************************************************/
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/*stopping*/
+	pthread_t tid;
+	int started;
+	int stop;
+	int ioprio;	/*of thread when not idle*/
+	char base[ PATH_MAX+1 ];	/*home base*/
+
+	/*progress. Atomic*/
+	unsigned long passes;
+	unsigned long names;	/*of this pass*/
+	unsigned long checked;	/*of this pass*/
+	unsigned long created;
+	unsigned long failed;
+} prov;
+
+typedef struct prov_names {
+	char **name;
+	int n;
+	int size;
+} Prov_names;
+
+static int prov_name_add( Prov_names *pn, const char *name )
+{
+	char **tmp;
+	const char *c;
+
+	/*becomes part of a path*/
+	if( ! *name || *name == '.' || strlen( name ) > NAME_MAX )
+		return 1;
+	for( c = name; *c; c++ )
+		if( ! isgraph( *c ) || *c == '/' )
+			return 1;
+
+	if( pn->n == pn->size )
+	{
+		if( ! ( tmp = realloc( pn->name, ( pn->size * 2 + 64 ) *
+							sizeof(*tmp) ) ) )
+			return 0;
+		pn->name = tmp;
+		pn->size = pn->size * 2 + 64;
+	}
+	if( ! ( pn->name[ pn->n ] = strdup( name ) ) )
+		return 0;
+	pn->n++;
+	return 1;
+}
+
+static void prov_names_free( Prov_names *pn )
+{
+	while( pn->n )
+		free( pn->name[ --pn->n ] );
+	free( pn->name );
+	pn->name = NULL;
+	pn->size = 0;
+}
+
+/*one name in a line. Lines starting with # are left out*/
+static int prov_names_file( Prov_names *pn )
+{
+	char line[ NAME_MAX+2 ];
+	char *c;
+	FILE *f;
+	int ok = 1;
+
+	if( ! ( f = fopen( ah_conf.provisionlist, "re" ) ) )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "provision: fopen %s",
+						ah_conf.provisionlist );
+		return 0;
+	}
+	while( ok && fgets( line, sizeof(line), f ) )
+	{
+		for( c = line; *c && ! isspace( *c ); c++ );
+		*c = 0;
+		if( *line != '#' )
+			ok = prov_name_add( pn, line );
+	}
+	fclose( f );
+	return ok;
+}
+
+/*users whose home is under home base*/
+static int prov_names_users( Prov_names *pn )
+{
+	char home[ PATH_MAX+1 ];
+	char *buf = alloca( sizeof(char)*pwd_bufsz );
+	struct passwd pwd, *pass;
+	int ok = 1;
+
+	setpwent();
+	while( ok && ! getpwent_r( &pwd, buf, pwd_bufsz, &pass ) )
+	{
+		/*home of a name that long is not under base*/
+		if( snprintf( home, sizeof(home), "%s/%s", prov.base,
+				pass->pw_name ) >= (int) sizeof(home) )
+			continue;
+		if( ! strcmp( home, pass->pw_dir ) )
+			ok = prov_name_add( pn, pass->pw_name );
+	}
+	endpwent();
+	return ok;
+}
+
+/*returns 0 if stopping*/
+static int prov_sleep( long nsec )
+{
+	struct timespec tp;
+	int stop;
+
+	mono_timespec( &tp, 0, nsec );
+	pthread_mutex_lock( &prov.lock );
+	while( ! prov.stop && pthread_cond_timedwait( &prov.wake,
+				&prov.lock, &tp ) != ETIMEDOUT );
+	stop = prov.stop;
+	pthread_mutex_unlock( &prov.lock );
+	return ! stop;
+}
+
+/*not following links*/
+static int remove_tree( int dfd, const char *name )
+{
+	struct dirent *de;
+	int fd, ok = 1;
+	DIR *d;
+
+	if( ! unlinkat( dfd, name, 0 ) || errno == ENOENT )
+		return 1;
+	if( errno != EISDIR )
+		return 0;
+	if( ( fd = openat( dfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|
+				O_CLOEXEC ) ) < 0 || ! ( d = fdopendir( fd ) ) )
+	{
+		if( fd >= 0 )
+			close( fd );
+		return 0;
+	}
+	while( ( de = readdir( d ) ) )
+		if( strcmp( de->d_name, "." ) && strcmp( de->d_name, ".." ) &&
+					! remove_tree( fd, de->d_name ) )
+			ok = 0;
+	closedir( d );
+	return ok && ! unlinkat( dfd, name, AT_REMOVEDIR );
+}
+
+/*returns 1 if home is made, -1 if a lookup made it meanwhile*/
+static int prov_make( const char *name, const char *real )
+{
+	char tmp[ PATH_MAX+1 ];
+	struct stat st;
+	const char *c;
+	Session *s;
+	uid_t uid;
+	gid_t gid;
+	int ret = 0;
+
+	if( ! home_owner( name, prov.base, &uid, &gid ) )
+		return 0;
+	c = strrchr( real, '/' );
+	if( snprintf( tmp, sizeof(tmp), "%.*s/." MODULE_NAME ".%s",
+			(int) ( c - real ), real, name ) >= (int) sizeof(tmp) )
+		return 0;
+
+	/*left by a pass cut short*/
+	if( ! remove_tree( AT_FDCWD, tmp ) )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "provision: remove %s", tmp );
+		return 0;
+	}
+	if( ! create_dir( tmp, S_IRUSR | S_IWUSR | S_IXUSR ) )
+		return 0;
+	if( ! ah_conf.noskel )
+		copy_skel( ah_conf.skel, tmp, uid, gid, IOPRIO_IDLE );
+	if( chmod( tmp, ah_conf.mode ) )
+		msglog( MSG_ERR|LOG_ERRNO, "provision: chmod %s", tmp );
+	else if( chown( tmp, uid, gid ) )
+		msglog( MSG_ERR|LOG_ERRNO, "provision: chown %s", tmp );
+
+	/*lookups of name wait, except in affinity mode where the
+	  session is not locked. Never replaces what a lookup made*/
+	else if( thread_ioprio_set( prov.ioprio ) &&
+				( s = session_acquire( name ) ) )
+	{
+		if( ! lstat( real, &st ) || errno != ENOENT )
+			ret = -1;
+		else if( ! renameat2( AT_FDCWD, tmp, AT_FDCWD, real,
+						RENAME_NOREPLACE ) )
+			ret = 1;
+		else if( errno == EEXIST || errno == ENOTEMPTY )
+			ret = -1;
+		else msglog( MSG_ERR|LOG_ERRNO, "provision: rename %s", tmp );
+		session_release( s );
+	}
+	thread_ioprio_set( IOPRIO_IDLE );
+
+	if( ret <= 0 && ! remove_tree( AT_FDCWD, tmp ) )
+		msglog( MSG_ERR|LOG_ERRNO, "provision: remove %s", tmp );
+	return ret;
+}
+
+static void prov_pass( void )
+{
+	char real[ PATH_MAX+1 ];
+	Prov_names pn = { NULL, 0, 0 };
+	struct stat st;
+	int i, ok;
+
+	if( *ah_conf.provisionlist )
+		ok = prov_names_file( &pn );
+	else ok = prov_names_users( &pn );
+	if( ! ok )
+		msglog( MSG_ERR, "provision: could not allocate memory" );
+
+	__atomic_store_n( &prov.names, pn.n, __ATOMIC_RELAXED );
+	__atomic_store_n( &prov.checked, 0, __ATOMIC_RELAXED );
+
+	for( i = 0; i < pn.n; i++ )
+	{
+		__atomic_add_fetch( &prov.checked, 1, __ATOMIC_RELAXED );
+
+		/*there already. Mount does the rest*/
+		module_dir( real, sizeof(real), pn.name[ i ] );
+		if( ! lstat( real, &st ) || errno != ENOENT )
+			continue;
+
+		msglog( MSG_INFO, "provision: creating home of %s",
+							pn.name[ i ] );
+		ok = prov_make( pn.name[ i ], real );
+		if( ok > 0 )
+			__atomic_add_fetch( &prov.created, 1,
+						__ATOMIC_RELAXED );
+		else if( ! ok )
+			__atomic_add_fetch( &prov.failed, 1, __ATOMIC_RELAXED );
+
+		if( ! prov_sleep( 1000000000L / ah_conf.provisionrate ) )
+			break;
+	}
+	prov_names_free( &pn );
+	__atomic_add_fetch( &prov.passes, 1, __ATOMIC_RELAXED );
+}
+
+static void *prov_thread( void *x )
+{
+	if( ( prov.ioprio = syscall( SYS_ioprio_get, IOPRIO_WHO_PROCESS,
+					syscall( SYS_gettid ) ) ) < 0 )
+	{
+		msglog( MSG_ERR|LOG_ERRNO, "provision: ioprio_get" );
+		prov.ioprio = 0;
+	}
+	thread_ioprio_set( IOPRIO_IDLE );
+
+	do prov_pass();
+	while( prov_sleep( ah_conf.provision * 1000000000L ) );
+
+	return x;
+}
+
+static void prov_stats( void )
+{
+	msglog( MSG_NOTICE, "autohome provision: %lu passes, " \
+			"%lu of %lu names checked in this pass, " \
+			"%lu homes created, %lu failed",
+			__atomic_load_n( &prov.passes, __ATOMIC_RELAXED ),
+			__atomic_load_n( &prov.checked, __ATOMIC_RELAXED ),
+			__atomic_load_n( &prov.names, __ATOMIC_RELAXED ),
+			__atomic_load_n( &prov.created, __ATOMIC_RELAXED ),
+			__atomic_load_n( &prov.failed, __ATOMIC_RELAXED ) );
+}
+
+static void prov_init( void )
+{
+	thread_mutex_init( &prov.lock );
+	thread_cond_init( &prov.wake );
+	stats_register( prov_stats );
+
+	if( ! ( prov.started = thread_new_joinable( prov_thread, NULL,
+							&prov.tid ) ) )
+		msglog( MSG_ERR, "could not start provision thread" );
+}
+
+static void prov_stop( void )
+{
+	if( ! prov.started )
+		return;
+
+	pthread_mutex_lock( &prov.lock );
+	prov.stop = 1;
+	pthread_cond_broadcast( &prov.wake );
+	pthread_mutex_unlock( &prov.lock );
+
+	pthread_join( prov.tid, NULL );
+	prov.started = 0;
+}
+
 module_info *module_init( char *subopt, const char *homebase )
 {
 	autohome_conf_init( subopt );
@@ -851,6 +1739,7 @@ module_info *module_init( char *subopt, const char *homebase )
 		msglog( MSG_ALERT|LOG_ERRNO, "sysconf _SC_GETPW_R_SIZE_MAX" );
 		return NULL;
 	}
+	string_n_copy( prov.base, homebase, sizeof(prov.base) );
 
 	return &autohome_info;
 }
@@ -882,33 +1771,6 @@ void module_dir( char *buf, int len, const char *name )
 	}
 }
 
-static int get_passwd_info( const char *name, uid_t *uid,
-		gid_t *gid, char *home, int len )
-{
-	char *buf = alloca( sizeof(char)*pwd_bufsz );
-	struct passwd pwd, *pass;
-	
-	if( ! buf )
-	{
-		msglog( MSG_ERR, "alloca: could not allocate stack" );
-		return 0;
-	}
-	errno = getpwnam_r( name, &pwd, buf, pwd_bufsz, &pass );
-	if( pass )
-	{
-		(*uid) = ah_conf.owner != -1 ? ah_conf.owner : pass->pw_uid;
-		(*gid) = ah_conf.group != -1 ? ah_conf.group : pass->pw_gid;
-		string_n_copy( home, pass->pw_dir ,len );
-		return 1;
-	}
-	if( ! errno )
-		msglog( MSG_WARNING, "no user found with name %s", name );
-	else
-		msglog( MSG_ERR|LOG_ERRNO, "get_passwd_info: getpwnam_r" );
-
-	return 0;
-}
-
 /* create real home dir under realpath,
    and check permissions.
  */
@@ -918,8 +1780,6 @@ int module_dowork( const char *name,
 					This value is returned to autodir daemon*/
 			int reallen ) /*realhome buf length*/
 {
-	char tmp[ PATH_MAX+1 ];
-	char home[ PATH_MAX+1 ];
 	struct stat st;
 	uid_t uid;
 	gid_t gid;
@@ -933,25 +1793,33 @@ int module_dowork( const char *name,
 	if( ah_conf.fastmode && ! stat( realhome, &st ) )
 		return 1;
 
-	if( ! get_passwd_info( name, &uid, &gid, home, sizeof(home) ) )
+	if( ! home_owner( name, homebase, &uid, &gid ) )
 		return 0;
 
- 	if( ( ! ah_conf.nohomecheck ) )
-	{
-		snprintf( tmp, sizeof(tmp), "%s/%s", homebase, name );
-		if( strcmp( home, tmp ) ) {
-			msglog( MSG_NOTICE, "home dirs %s,%s do not match",
-					home, tmp );
-			return 0;
-		}
-	}
-
 	return create_home_dir( name, realhome, ah_conf.skel, uid, gid );
 }
 
+/*daemon is ready. Threads started before would not be
+  there after it forks*/
+void module_start( void )
+{
+	thread_mutex_init( &skel.lock );
+	if( ! ah_conf.noskel )
+		skel_pool_init();
+	if( ah_conf.provision )
+		prov_init();
+}
+
 void module_clean( void )
 {
-	/*nothing to be done*/
+	prov_stop();
+	skel_pool_stop();
+	if( skel.cur )
+		skel_put( skel.cur );
+	skel.cur = NULL;
+	if( skel.ifd >= 0 )
+		close( skel.ifd );
+	skel.ifd = -1;
 }
 
 
@@ -966,6 +1834,7 @@ void module_clean( void )
 #ifdef TEST
 
 #include <assert.h>
+#include <time.h>
 
 char *autodir_name(void)
 {
@@ -976,28 +1845,171 @@ void *test_th(void *x)
 {
     char realdir[PATH_MAX+1];
     char name[128];
+    Session *s;
     int i;
 
     while (1) {
 	for (i = 10000; i < 19000; i++) {
 	    snprintf(name, sizeof(name), "t%d", i);
-	    workon_name(name);
+	    s = session_acquire(name);
 	    assert(module_dowork(name, "/test", realdir, sizeof(realdir)));
-	    workon_release(name);
+	    session_release(s);
 	}
 	printf("i=%d\n", i);
     }
 }
 
-int main(void)
+/*skel copy as it was before skel tree, to compare with*/
+static int old_copy_skel_file(const char *sfile, const char *dfile,
+			      const struct stat *st, uid_t uid, gid_t gid)
+{
+    char buf[READ_BUF_SIZE];
+    int sfd, dfd, n, ok;
+
+    if (st->st_mode & S_IWOTH || st->st_nlink > 1)
+	return 0;
+    if ((sfd = open(sfile, O_RDONLY)) == -1)
+	return 0;
+    if ((dfd = open(dfile, O_WRONLY | O_CREAT | O_EXCL,
+		    st->st_mode & S_IRWXU)) == -1) {
+	close(sfd);
+	return 0;
+    }
+    while ((n = read(sfd, buf, sizeof(buf))) > 0 && write_all(dfd, buf, n));
+    ok = !n && !fchown(dfd, uid, gid);
+    close(sfd);
+    close(dfd);
+    return ok;
+}
+
+static int old_copy_skel_dir(const char *src, const char *dest,
+			     const struct stat *st, uid_t uid, gid_t gid)
+{
+    char sdent[PATH_MAX + 1];
+    char ddent[PATH_MAX + 1];
+    struct stat sdent_st;
+    struct dirent *dent;
+    DIR *dir;
+
+    if (st->st_mode & S_IWOTH || !(dir = opendir(src)))
+	return 0;
+    while ((dent = readdir(dir))) {
+	if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+	    continue;
+	snprintf(sdent, sizeof(sdent), "%s/%s", src, dent->d_name);
+	snprintf(ddent, sizeof(ddent), "%s/%s", dest, dent->d_name);
+	if (lstat(sdent, &sdent_st) == -1)
+	    continue;
+	if (S_ISREG(sdent_st.st_mode))
+	    old_copy_skel_file(sdent, ddent, &sdent_st, uid, gid);
+	else if (S_ISDIR(sdent_st.st_mode) &&
+		 !mkdir(ddent, sdent_st.st_mode & S_IRWXU)) {
+	    old_copy_skel_dir(sdent, ddent, &sdent_st, uid, gid);
+	    if (chown(ddent, uid, gid))
+		return 0;
+	}
+    }
+    closedir(dir);
+    return 1;
+}
+
+static int old_copy_skel(const char *src, const char *dst,
+			 uid_t uid, gid_t gid)
+{
+    char stamp[PATH_MAX + 1];
+    struct stat st;
+    int fd;
+
+    if (lstat(src, &st) || !old_copy_skel_dir(src, dst, &st, uid, gid))
+	return 0;
+    snprintf(stamp, sizeof(stamp), "%s/%s", dst, AUTOHOME_STAMP_FILE);
+    if ((fd = open(stamp, O_WRONLY | O_CREAT | O_TRUNC, 0)) == -1)
+	return 0;
+    close(fd);
+    return 1;
+}
+
+#define BENCH_SKEL	"/tmp/autohome_bench/skel"
+#define BENCH_HOMES	"/tmp/autohome_bench/homes"
+#define BENCH_FILES	200
+#define BENCH_RUNS	500
+
+/*200 files in 10 directories, 0.5KB to 200KB*/
+static void bench_skel(void)
+{
+    char path[PATH_MAX + 1];
+    char *buf;
+    int i, fd, size;
+
+    assert(create_dir(BENCH_SKEL, 0755));
+    assert((buf = calloc(1, 200 * 1024)));
+    for (i = 0; i < BENCH_FILES; i++) {
+	snprintf(path, sizeof(path), "%s/d%d", BENCH_SKEL, i % 10);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/d%d/f%d", BENCH_SKEL, i % 10, i);
+	size = i % 20 ? 512 * (i % 8 + 1) : 200 * 1024;
+	assert((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+	assert(write_all(fd, buf, size));
+	close(fd);
+    }
+    free(buf);
+}
+
+static double bench_run(const char *what,
+			int (*copy)(const char *, const char *, uid_t, gid_t))
+{
+    char home[PATH_MAX + 1];
+    struct timespec a, b;
+    double secs;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (i = 0; i < BENCH_RUNS; i++) {
+	snprintf(home, sizeof(home), "%s/%s%d", BENCH_HOMES, what, i);
+	assert(create_dir(home, 0700));
+	assert(copy(BENCH_SKEL, home, getuid(), getgid()));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    secs = b.tv_sec - a.tv_sec + (b.tv_nsec - a.tv_nsec) / 1e9;
+    printf("%s: %d homes of %d files in %.2fs, %.0f homes/s\n", what,
+	   BENCH_RUNS, BENCH_FILES, secs, BENCH_RUNS / secs);
+    return secs;
+}
+
+static int bench_copy_skel(const char *src, const char *dst,
+			   uid_t uid, gid_t gid)
+{
+    return copy_skel(src, dst, uid, gid, 0);
+}
+
+static void bench(void)
+{
+    assert(!system("rm -rf /tmp/autohome_bench"));
+    bench_skel();
+    bench_run("old", old_copy_skel);
+    bench_run("tree", bench_copy_skel);
+    ah_conf.skelthreads = DFLT_AUTOHOME_SKELTHREADS;
+    skel_pool_init();
+    bench_run("pool", bench_copy_skel);
+    skel_pool_stop();
+    assert(!system("rm -rf /tmp/autohome_bench"));
+}
+
+int main(int argc, char **argv)
 {
     pthread_t id;
 
     thread_init();
     msg_init();
     msg_console_on();
-    workon_init();
+    session_init();
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+	thread_mutex_init(&skel.lock);
+	bench();
+	return 0;
+    }
     module_init(strdup("renamedir=/tmp/renamedir"), "/test");
+    module_start();
 
     //test_th(NULL);
     pthread_create(&id, 0, test_th, NULL);
@@ -26,59 +26,24 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <unistd.h>
 #include "msg.h"
 #include "thread.h"
+#include "slab.h"
 #include "mpacket.h"
 
-/*cache size of used memory.*/
-#define PACKET_CACHE_MAX 150 /*OPTIMIZE*/
+static Slab_cache packet_slab;
 
-static struct {
-	Packet *list;
-	int count;
-	pthread_mutex_t lock;
-} pcache;
-
-/*use junk if available otherwise malloc
-  returns more then one packet if available*/
-static Packet *packet_get_free_list( void )
-{
-	Packet *list;
-
-	if( pcache.count > 0 )
-	{
-		pthread_mutex_lock( &pcache.lock );
-		if( pcache.count <= 0 )
-		{
-			pthread_mutex_unlock( &pcache.lock );
-			goto dalloc;
-		}
-		list = pcache.list;
-		pcache.list = NULL;
-		pcache.count = 0;
-		pthread_mutex_unlock( &pcache.lock );
-		return list;
-	}
-dalloc:
-	list = ( Packet * ) malloc( sizeof(Packet) );
-	if( list )
-		list->next = NULL;
-	return list;
-}
-
-/*PERFORMANCE:
-Not thread safe. To be called from single thread only.*/
+/*allocating thread keeps its own magazines, so packets freed
+  by workers come back to it through the depot*/
 Packet *packet_allocate( void )
 {
-	static Packet *list = NULL;
 	Packet *pkt;
 
-	while( ! list && ! ( list = packet_get_free_list() ) )
+	while( ! ( pkt = (Packet *) slab_alloc( &packet_slab ) ) )
 	{
 		msglog( MSG_ALERT, "packet_allocate: " \
-				"could not get free packet list" );
+				"could not get free packet" );
 		sleep( 1 );
 	}
-	pkt = list;
-	list = list->next;
+	pkt->next = NULL;
 
 	return pkt;
 }
@@ -86,42 +51,17 @@ Packet *packet_allocate( void )
 /*thread safe*/
 void packet_free( Packet *pk )
 {
-	Packet *tmp;
-
-	if( ! pk ) return;
-
-	if( pcache.count < PACKET_CACHE_MAX )
-	{
-		pthread_mutex_lock( &pcache.lock );
-		tmp = pcache.list;
-		pcache.list = pk;
-		pk->next = tmp;
-		pcache.count++;
-		pthread_mutex_unlock( &pcache.lock );
-		return;
-	}
-	else free( pk );
+	slab_free( &packet_slab, pk );
 }
 
 static void packet_clean( void )
 {
-	Packet *pk, *tmp;
-
-	pk = pcache.list;
-	while( pk )
-	{
-		tmp = pk;
-		pk = pk->next;
-		free( tmp );
-	}
-	pthread_mutex_destroy( &pcache.lock );
+	slab_clean( &packet_slab );
 }
 
 void packet_init( void )
 {
-	pcache.list = NULL;
-	pcache.count = 0;
-        thread_mutex_init(&pcache.lock);
+	slab_init( &packet_slab, "packet", sizeof(Packet) );
 
 	if( atexit( packet_clean ) )
 	{
@@ -21,9 +21,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef MULTIPATH_H
 #define MULTIPATH_H
 
-void multipath_init(void);
+#include "session.h"
 
-int multipath_inc(const char *name);
-int multipath_dec(const char *name);
+int multipath_inc(Session *s);
+int multipath_dec(Session *s);
 
 #endif
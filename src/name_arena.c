@@ -0,0 +1,111 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* names are carved out of big chunks instead of each
+   record carrying a NAME_MAX buffer. Space is given in
+   NAME_ALIGN steps, so that a released name can be reused
+   by any other name of the same size class. Chunks are
+   only given back when the arena goes away.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "name_arena.h"
+
+#define NAME_CHUNK	( 64 * 1024 )
+
+struct name_chunk {
+	struct name_chunk *next;
+	char data[] __attribute__(( aligned( NAME_ALIGN ) ));
+};
+
+#define name_class( len )	( (len) / NAME_ALIGN )
+#define class_size( c )		( ( (c) + 1 ) * NAME_ALIGN )
+
+void name_arena_init( Name_arena *na )
+{
+	memset( na, 0, sizeof(*na) );
+}
+
+/*copy of name with len characters*/
+char *name_arena_get( Name_arena *na, const char *name, size_t len )
+{
+	struct name_chunk *nc;
+	size_t sz;
+	char *s;
+	int c;
+
+	if( len > NAME_MAX )
+		return NULL;
+
+	c = name_class( len );
+	sz = class_size( c );
+
+	if( ( s = na->free[ c ] ) )
+		memcpy( &na->free[ c ], s, sizeof(char *) );
+	else
+	{
+		if( na->left < sz )
+		{
+			nc = (struct name_chunk *) malloc( NAME_CHUNK );
+			if( ! nc )
+				return NULL;
+			nc->next = na->chunks;
+			na->chunks = nc;
+			na->pos = nc->data;
+			na->left = NAME_CHUNK - offsetof( struct name_chunk, data );
+			na->size += NAME_CHUNK;
+		}
+		s = na->pos;
+		na->pos += sz;
+		na->left -= sz;
+	}
+
+	memcpy( s, name, len );
+	s[ len ] = '\0';
+	na->used += sz;
+	return s;
+}
+
+/*name is free for reuse by another name of the same size*/
+void name_arena_put( Name_arena *na, char *name )
+{
+	int c;
+
+	if( ! name )
+		return;
+
+	c = name_class( strlen( name ) );
+	memcpy( name, &na->free[ c ], sizeof(char *) );
+	na->free[ c ] = name;
+	na->used -= class_size( c );
+}
+
+void name_arena_clean( Name_arena *na )
+{
+	struct name_chunk *nc;
+
+	while( ( nc = na->chunks ) )
+	{
+		na->chunks = nc->next;
+		free( nc );
+	}
+	name_arena_init( na );
+}
@@ -0,0 +1,48 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef NAME_ARENA_H
+#define NAME_ARENA_H
+
+#include <stddef.h>
+#include <limits.h>
+
+#define NAME_ALIGN	(16)
+#define NAME_CLASSES	( ( NAME_MAX + NAME_ALIGN ) / NAME_ALIGN )
+
+struct name_chunk;
+
+/*storage for names. Not thread safe, owner does the locking*/
+typedef struct name_arena {
+	char *free[ NAME_CLASSES ];	/*released names by size class*/
+	struct name_chunk *chunks;
+	char *pos;	/*unused part of the newest chunk*/
+	size_t left;
+	size_t used;	/*bytes given out*/
+	size_t size;	/*bytes taken from malloc*/
+} Name_arena;
+
+/* name_arena.c */
+void name_arena_init(Name_arena *na);
+char *name_arena_get(Name_arena *na, const char *name, size_t len);
+void name_arena_put(Name_arena *na, char *name);
+void name_arena_clean(Name_arena *na);
+
+#endif
@@ -33,11 +33,18 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "autodir.h"
 #include "backup.h"
 #include "backup_fork.h"
+#include "backup_psi.h"
+#include "backup_cgroup.h"
+#include "backup_dev.h"
+#include "backup_journal.h"
+#include "backup_track.h"
+#include "backup_snap.h"
 #include "module.h"
 #include "lockfile.h"
+#include "slab.h"
 #include "options.h"
 
-#define MAX_OPTIONS	20
+#define MAX_OPTIONS	40
 
 #define ARG_REQUIRED	1
 #define ARG_NOTREQ	0
@@ -62,6 +69,20 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define OPTION_MULTI_PREFIX	    'x'
 #define OPTION_VERBOSE_LOG	    'V'
 #define OPTION_BACKUP_LIFE	    'L'
+#define OPTION_BACKUP_RATE	    'R'
+#define OPTION_PRESSURE		    'P'
+#define OPTION_IO_CLASS		    'I'
+#define OPTION_CGROUP		    'G'
+#define OPTION_DEV_BPROC	    'D'
+#define OPTION_BATCH		    'B'
+#define OPTION_WORKERS		    'W'
+#define OPTION_JOURNAL		    'J'
+#define OPTION_TRACK		    'M'
+#define OPTION_SNAPSHOT		    's'
+#define OPTION_ENGINE		    'E'
+#define OPTION_THREADS		    'T'
+#define OPTION_AFFINITY		    'S'
+#define OPTION_CACHE		    'C'
 
 struct opt_cb{
 	char opch;                  /*option char*/
@@ -109,15 +130,29 @@ static void option_usage( void )
 	helpopt(OPTION_WAIT4BACKUP, "wait-for-backup", "not to kill backup process but wait for it to finish");
 	helpopt(OPTION_NO_KILL, "no-kill", "not to kill backup process and not to wait for it to finish");
 	helpopt(OPTION_MAX_BPROC, "max-backups=NUM", "maximum backup processes");
+	helpopt(OPTION_DEV_BPROC, "device-backups=NUM[,PATH=NUM]", "maximum backup processes per device");
 	helpopt(OPTION_BACKUP_LIFE, "backup-life=SECS", "maximum time in seconds backup can run");
+	helpopt(OPTION_BACKUP_RATE, "backup-rate=NUM[,BURST]", "backup processes started per second, and at once");
+	helpopt(OPTION_PRESSURE, "pressure=OPTS", "lower backup processes under io/cpu pressure");
+	helpopt(OPTION_BATCH, "backup-batch=NUM[,SECS]", "names given to one backup process on stdin");
+	helpopt(OPTION_WORKERS, "backup-workers=NUM", "long running backup processes taking names on stdin");
+	helpopt(OPTION_JOURNAL, "journal=FILE[,SECS]", "keep backup queue in FILE across restarts");
+	helpopt(OPTION_TRACK, "track-changes", "no backup for names not written to while mounted");
+	helpopt(OPTION_SNAPSHOT, "snapshot-dir=DIR", "back up reflink snapshots kept in DIR");
 	helpopt(OPTION_BPROC_PRI, "priority=NUM", "backup process priority");
+	helpopt(OPTION_IO_CLASS, "io-class=idle|be[,NUM]", "backup process io scheduling class");
+	helpopt(OPTION_CGROUP, "cgroup=OPTS", "cgroup v2 subtree for backup processes");
 	helpopt(OPTION_BACKUP, "backup=PROG", "backup executable absolute path");
+	helpopt(OPTION_ENGINE, "backup-dir=DIR[,THREADS]", "built in incremental backups into DIR");
 	helpopt(OPTION_USE_LOCKS, "use-locks", "use backup locks");
 	helpopt(OPTION_LOCK_DIR, "lock-dir=DIR", "backup lock files directory path");
 
 	helpopt(OPTION_MULTI_PATH, "multipath", "multi path support");
 	helpopt(OPTION_MULTI_PREFIX, "prefix=CHAR", "multi path prefix");
 
+	helpopt(OPTION_THREADS, "threads=NUM", "worker threads handling mount requests");
+	helpopt(OPTION_AFFINITY, "affinity", "handle each directory always in the same worker thread");
+	helpopt(OPTION_CACHE, "cache=ROUNDS[,DEPOT]", "objects cached per thread magazine and magazines kept in depot");
 	helpopt(OPTION_FOREGROUND, "foreground", "stay foreground and log messages to console");
 	helpopt(OPTION_VERBOSE_LOG, "verbose", "verbose logging");
 	helpopt(OPTION_VERSION, "version", "version");
@@ -265,14 +300,28 @@ void option_init( int argc, char *argv[] )
 	OREG( OPTION_WAIT4BACKUP,	backup_option_wait2finish,  ARG_NOTREQ,   "wait-for-backup", "wait for backup to finish" );
 	OREG( OPTION_NO_KILL,		backup_option_nokill,	    ARG_NOTREQ,   "no-kill", "don't kill backup processes" );
 	OREG( OPTION_MAX_BPROC,		backup_option_max_proc,	    ARG_REQUIRED, "max-backups", "maximum backup processes" );
+	OREG( OPTION_DEV_BPROC,		backup_dev_option,	    ARG_REQUIRED, "device-backups", "backup processes per device" );
 	OREG( OPTION_BPROC_PRI,		backup_fork_option_pri,	    ARG_REQUIRED, "priority", "backup process priority" );
+	OREG( OPTION_IO_CLASS,		backup_fork_option_ioclass, ARG_REQUIRED, "io-class", "backup io scheduling class" );
+	OREG( OPTION_CGROUP,		backup_cgroup_option,	    ARG_REQUIRED, "cgroup", "backup cgroup" );
 	OREG( OPTION_BACKUP,		backup_option_path,	    ARG_REQUIRED, "backup", "backup program path" );
+	OREG( OPTION_ENGINE,		backup_option_engine,	    ARG_REQUIRED, "backup-dir", "built in backup directory" );
 	OREG( OPTION_BACKUP_LIFE,	backup_option_life,	    ARG_REQUIRED, "backup-life", "backup process lifetime" );
+	OREG( OPTION_BACKUP_RATE,	backup_option_rate,	    ARG_REQUIRED, "backup-rate", "backup start rate" );
+	OREG( OPTION_BATCH,		backup_option_batch,	    ARG_REQUIRED, "backup-batch", "names per backup process" );
+	OREG( OPTION_WORKERS,		backup_option_workers,	    ARG_REQUIRED, "backup-workers", "backup worker processes" );
+	OREG( OPTION_JOURNAL,		backup_journal_option,	    ARG_REQUIRED, "journal", "backup queue journal" );
+	OREG( OPTION_TRACK,		backup_track_option,	    ARG_NOTREQ,   "track-changes", "backup changed names only" );
+	OREG( OPTION_SNAPSHOT,		backup_snap_option,	    ARG_REQUIRED, "snapshot-dir", "backup snapshot directory" );
+	OREG( OPTION_PRESSURE,		backup_psi_option,	    ARG_REQUIRED, "pressure", "pressure based backup limit" );
 	OREG( OPTION_USE_LOCKS,		lockfile_option_lockfiles,  ARG_NOTREQ,   "use-locks", "use backup locks" );
 	OREG( OPTION_LOCK_DIR,		lockfile_option_lockdir,    ARG_REQUIRED, "lock-dir", "lock files directory" );
 	OREG( OPTION_MULTI_PATH,	autodir_option_multipath,   ARG_NOTREQ,   "multipath", "enable multipath support" );
 	OREG( OPTION_VERBOSE_LOG,	msg_option_verbose, 	    ARG_NOTREQ,   "verbose", "verbose logging" );
 	OREG( OPTION_MULTI_PREFIX,      autodir_option_multiprefix, ARG_REQUIRED, "prefix", "multipath prefix character" );
+	OREG( OPTION_THREADS,		autodir_option_threads,	    ARG_REQUIRED, "threads", "worker threads" );
+	OREG( OPTION_AFFINITY,		autodir_option_affinity,    ARG_NOTREQ,   "affinity", "per name worker affinity" );
+	OREG( OPTION_CACHE,		slab_option_cache,	    ARG_REQUIRED, "cache", "object cache sizes" );
 
 	option_process( argv,argc );
 }
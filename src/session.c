@@ -18,8 +18,25 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
-/* mutual execlusion based on strings.
-   ie locking string names and unlocking.
+/* per name session records.
+
+   Everything autodir keeps about one name lives in one
+   record: the name lock taken while mounting/unmounting,
+   the lock file descriptor, the multi path usage count,
+   the pending backup entry and the running backup. So one
+   lookup finds all of it.
+
+   Records are kept in a hash split into stripes, each with
+   its own lock, so that threads working on different names
+   rarely meet. A stripe grows by moving a few buckets at a
+   time to the bigger table instead of rehashing everything
+   at once. Name lock is a single futex word, so nothing
+   has to be initialized or destroyed per record.
+
+   A record lives as long as someone holds a reference on it.
+   Every subsystem storing something in the record holds one.
+   So a name is stored only once, however many subsystems
+   use it, and only with as many bytes as it needs.
 */
 
 #include <stdio.h>
@@ -27,308 +44,468 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <limits.h>
 #include <malloc.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <linux/limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "miscfuncs.h"
 #include "msg.h"
 #include "thread.h"
-#include "workon.h"
+#include "name_arena.h"
+#include "slab.h"
+#include "stats.h"
+#include "session.h"
 
-#define WORKON_HASH_SIZE (13)
-#define WORKON_CACHE_SIZE (50)
+#define SESSION_STRIPES (64)
+#define SESSION_HASH_SIZE (13)
+#define SESSION_MOVE (4)	/*buckets moved per operation while resizing*/
 
-typedef struct wentry {
-	char name[ NAME_MAX + 1 ]; /*file/dir name can not exceed more then this*/
-	unsigned int hash;
-	int in_use;
-	pthread_mutex_t wait;	/*hang on here if some one else locked it already*/
-	struct wentry *next;
-} Wentry;
-
-/* for reuse of malloced memory */
-static struct {
-	Wentry *list;
-	int count;
-	pthread_mutex_t lock;
-} wcache;
-
-static Wentry **whash;
-static int whash_size;
-static int whash_used;
-static pthread_mutex_t hash_lock;
-
-#define wentry_key( s )		( s % whash_size )
+static Slab_cache session_slab;
 
-/*allocate from the unused previousely allocated memory
-or else create new dynamic memory.
-*/
-static Wentry *wentry_malloc( void )
+static struct sstripe {
+	pthread_mutex_t lock;
+	Session **hash;
+	int size;
+	int used;
+	Session **old;	/*table being emptied while resizing*/
+	int old_size;
+	int moved;	/*old buckets below this are empty already*/
+	Name_arena names;
+} stripes[ SESSION_STRIPES ];
+
+/*callers guarantee that a name is never worked
+  on by two threads at the same time*/
+static int affinity;
+
+#define sstripe_of( h )		( stripes + ( h ) % SESSION_STRIPES )
+#define session_key( h, size )	( ( ( h ) / SESSION_STRIPES ) % ( size ) )
+
+static Session *session_malloc( void )
 {
-	Wentry *tmp;
-
-	if( wcache.count > 0 )
-	{
-		pthread_mutex_lock( &wcache.lock );
-		if( wcache.count <= 0 )
-		{
-			pthread_mutex_unlock( &wcache.lock );
-			goto dyn_alloc;
-		}
-		tmp = wcache.list;
-		wcache.list = wcache.list->next;
-		wcache.count--;
-		pthread_mutex_unlock( &wcache.lock );
-		return tmp;
-	}
+	return (Session *) slab_alloc( &session_slab );
+}
 
-dyn_alloc:
-	return (Wentry *) malloc( sizeof(Wentry) );
+static void session_free( Session *s )
+{
+	slab_free( &session_slab, s );
 }
 
-static void wentry_free( Wentry *we )
+static void futex_wait( int *addr, int val )
 {
-	Wentry *tmp;
+	syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 );
+}
 
-	if( ! we )
-		return;
+static void futex_wake( int *addr )
+{
+	syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+}
 
-	pthread_mutex_destroy( &we->wait );
+/*move some buckets from old table to the new one.
+  stripe lock must be held*/
+static void sstripe_move( struct sstripe *ss )
+{
+	Session *s, *next, **dptr;
+	int i;
 
-	if( wcache.count < WORKON_CACHE_SIZE )
+	for( i = 0 ; i < SESSION_MOVE && ss->moved < ss->old_size ; i++ )
 	{
-		pthread_mutex_lock( &wcache.lock );
-		if( wcache.count >= WORKON_CACHE_SIZE )
+		for( s = ss->old[ ss->moved ]; s; s = next )
 		{
-			pthread_mutex_unlock( &wcache.lock );
-			free( we );
-			return;
+			next = s->next;
+			dptr = &ss->hash[ session_key( s->hash, ss->size ) ];
+			s->next = *dptr;
+			*dptr = s;
 		}
-		tmp = wcache.list;
-		wcache.list = we;
-		we->next = tmp;
-		wcache.count++;
-		pthread_mutex_unlock( &wcache.lock );
-		return;
+		ss->old[ ss->moved++ ] = NULL;
+	}
+
+	if( ss->moved == ss->old_size )
+	{
+		free( ss->old );
+		ss->old = NULL;
+		ss->old_size = 0;
 	}
-	else free( we );
 }
 
-static void whash_resize( void )
+/*start moving to a bigger table. stripe lock must be held*/
+static void sstripe_resize( struct sstripe *ss )
 {
 	int new_size;
-	int old_size = whash_size;
-	Wentry **new_whash;
-	Wentry **dptr;
-	Wentry **h = whash;
-	Wentry *wentry;
-	Wentry *next;
-
-	new_size = whash_size * 2;
+	Session **new_hash;
+
+	new_size = ss->size * 2;
 	new_size |= 1;
 
-	new_whash = ( Wentry ** ) calloc( new_size, sizeof(Wentry *) );
-	if( new_whash == NULL )
+	new_hash = ( Session ** ) calloc( new_size, sizeof(Session *) );
+	if( new_hash == NULL )
 	    return;
 
-	while( old_size-- > 0 )
-	{
-		for( wentry = *h++; wentry; wentry = next)
-		{
-			next = wentry->next;
-			dptr = &new_whash[ wentry->hash % new_size ];
-			wentry->next = *dptr;
-			*dptr = wentry;
-		}
-	}
-	whash_size = new_size;
-	free(whash);
-	whash = new_whash;
+	ss->old = ss->hash;
+	ss->old_size = ss->size;
+	ss->moved = 0;
+	ss->hash = new_hash;
+	ss->size = new_size;
 }
 
-/*not thread safe. mutual exclusion must be
-  setup before calling this.
+/*not thread safe. stripe lock must be held.
+  Looks in the new table and in the part of
+  old table not moved yet.
  */
 
-#define WENTRY_LOCATE( name, hash, dptr )			\
+#define SESSION_FIND( nm, h, dptr )				\
 do {								\
-	dptr = &( whash[ wentry_key( hash ) ] ); 		\
-	while( *dptr ) 						\
+	while( *dptr )						\
 	{							\
-		if( (*dptr)->hash == hash && 			\
-			*name == (*dptr)->name[0] &&		\
-		       	! strcmp( name, (*dptr)->name ) ) 	\
-			break; 					\
-		dptr = &( (*dptr)->next ); 			\
-	} 							\
+		if( (*dptr)->hash == h &&			\
+			*nm == (*dptr)->name[0] &&		\
+		       	! strcmp( nm, (*dptr)->name ) )		\
+			break;					\
+		dptr = &( (*dptr)->next );			\
+	}							\
 } while( 0 )
 
+#define SESSION_LOCATE( ss, nm, h, dptr )			\
+do {								\
+	int k_;							\
+	dptr = &( ss->hash[ session_key( h, ss->size ) ] );	\
+	SESSION_FIND( nm, h, dptr );				\
+	if( ! *dptr && ss->old )				\
+	{							\
+		k_ = session_key( h, ss->old_size );		\
+		if( k_ >= ss->moved )				\
+		{						\
+			dptr = &( ss->old[ k_ ] );		\
+			SESSION_FIND( nm, h, dptr );		\
+		}						\
+	}							\
+} while( 0 )
 
-int workon_name( const char *name )
+/*find session of the name or create new one.
+  Reference is taken and if asked, name lock too*/
+static Session *session_find( const char *name, int lock )
 {
 	unsigned int hash;
-	Wentry **dptr, *new_ent, *ent;
-
-	if( ! name || ! (*name) )
-	{
-		msglog( MSG_ERR, "workon_name: invalid name" );
-		return 0;
-	}
-
-	/*PERFORMANCE:
-	we allocate in advance. in almost all cases we
-	need new entry to be added.*/
-	new_ent = wentry_malloc();
-	if( ! new_ent )
-	{
-		msglog( MSG_ALERT, "workon_name: " \
-				"could not allocate memory" );
-		return 0;
-	}
+	struct sstripe *ss;
+	Session **dptr, *new_ent, *ent;
+	size_t len;
 
 	hash = string_hash( name );
-	string_n_copy( new_ent->name, name, sizeof(new_ent->name) );
-	new_ent->hash = hash;
-	new_ent->in_use = 1;
-	new_ent->next = NULL;
-        thread_mutex_init(&new_ent->wait);
+	len = strlen( name );
+	ss = sstripe_of( hash );
 
 	/*Now the actual part*/
- 	pthread_mutex_lock( &hash_lock );
+ 	pthread_mutex_lock( &ss->lock );
+
+	if( ss->old )
+		sstripe_move( ss );
 
-	WENTRY_LOCATE( name, hash, dptr );
+	SESSION_LOCATE( ss, name, hash, dptr );
 	ent = *dptr;
 	if( ent ) /*entry exists*/
 	{
-		( ent->in_use )++;
-		pthread_mutex_unlock( &hash_lock );
+		( ent->refs )++;
+		pthread_mutex_unlock( &ss->lock );
+		if( lock )
+			session_lock( ent );
+		return ent;
+	}
 
-		/*we need to free new entry allocated above*/
-		wentry_free( new_ent );
-		pthread_mutex_lock( &( ent->wait ) );
-		return 1;
+	new_ent = session_malloc();
+	if( ! new_ent || ! ( new_ent->name =
+			name_arena_get( &ss->names, name, len ) ) )
+	{
+		pthread_mutex_unlock( &ss->lock );
+		session_free( new_ent );
+		msglog( MSG_ALERT, "session_find: " \
+				"could not allocate memory" );
+		return NULL;
 	}
 
+	new_ent->hash = hash;
+	new_ent->refs = 1;
+	/*locked by us already*/
+	new_ent->state = ( lock && ! affinity ) ? 1 : 0;
+	new_ent->lock_fd = -1;
+	new_ent->mp_count = 0;
+	new_ent->bq = NULL;
+	new_ent->bp = NULL;
+	new_ent->jstate = 0;
+	new_ent->tstate = 0;
+	new_ent->sstate = 0;
+
+	/*new entries always go to the new table*/
+	dptr = &( ss->hash[ session_key( hash, ss->size ) ] );
+	new_ent->next = *dptr;
 	(*dptr) = new_ent;
-	whash_used++;
-	if( whash_used > whash_size )
-	    whash_resize();
-	pthread_mutex_unlock( &hash_lock );
-	pthread_mutex_lock( &new_ent->wait );
+	ss->used++;
+	if( ss->used > ss->size && ! ss->old )
+	    sstripe_resize( ss );
+	pthread_mutex_unlock( &ss->lock );
 
-	return 1;
+	return new_ent;
 }
 
-void workon_release( const char *name )
+/*unlink session from the hash and give its name back.
+  stripe lock must be held*/
+static void session_unhash( struct sstripe *ss, Session *s )
 {
-	Wentry **dptr, *ent, *tmp = NULL;
-	unsigned int hash;
+	Session **dptr;
 
+	SESSION_LOCATE( ss, s->name, s->hash, dptr );
+	if( *dptr )
+	{
+		(*dptr) = s->next;
+		ss->used--;
+	}
+	name_arena_put( &ss->names, s->name );
+	s->name = NULL;
+}
+
+/*get session of the name with a reference on it*/
+Session *session_get( const char *name )
+{
 	if( ! name || ! (*name) )
 	{
-		msglog( MSG_ERR, "workon_release: invalid name" );
-		return;
+		msglog( MSG_ERR, "session_get: invalid name" );
+		return NULL;
 	}
+	return session_find( name, 0 );
+}
 
-	hash = string_hash( name );
+/*one more reference on session already referenced*/
+void session_hold( Session *s )
+{
+	struct sstripe *ss = sstripe_of( s->hash );
 
-	pthread_mutex_lock( &hash_lock );
-	WENTRY_LOCATE( name, hash, dptr );
-	ent = *dptr;
-	if( ! ent ) /*entry does not exist*/
-	{
-		pthread_mutex_unlock( &hash_lock );
-		msglog( MSG_ALERT, "workon_release: " \
-				"entry for %s does not exist", name );
+	pthread_mutex_lock( &ss->lock );
+	( s->refs )++;
+	pthread_mutex_unlock( &ss->lock );
+}
+
+/*drop reference. Last one frees the session*/
+void session_put( Session *s )
+{
+	struct sstripe *ss;
+
+	if( ! s )
 		return;
-	}
 
-	( ent->in_use )--;
-	if( ! ( ent->in_use ) )
+	ss = sstripe_of( s->hash );
+	pthread_mutex_lock( &ss->lock );
+	if( --( s->refs ) )
 	{
-		(*dptr) = ent->next;
-		tmp = ent;
-		whash_used--;
+		pthread_mutex_unlock( &ss->lock );
+		return;
 	}
-	pthread_mutex_unlock( &hash_lock );
-	pthread_mutex_unlock( &ent->wait );
-
-	if( tmp ) 
-		wentry_free( tmp );
+	session_unhash( ss, s );
+	pthread_mutex_unlock( &ss->lock );
+	session_free( s );
 }
 
-static void workon_cleanup( void )
+void session_lock( Session *s )
 {
-	int i;
-	Wentry *we, *tmp;
+	int c = 0;
 
-	/*clean hash first*/
-	pthread_mutex_destroy( &hash_lock );
+	if( affinity )
+		return;
 
-	for( i = 0 ; i < whash_size ; i ++ )
+	if( __atomic_compare_exchange_n( &s->state, &c, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+		return;
+
+	/*mark contended and sleep until released*/
+	if( c != 2 )
+		c = __atomic_exchange_n( &s->state, 2, __ATOMIC_ACQUIRE );
+	while( c )
 	{
-		if( ! whash[ i ] ) continue;
-		we = whash[ i ];
-		while( we )
-		{
-			pthread_mutex_destroy( &we->wait );
-			tmp = we;
-			we = we->next;
-			free( tmp );
-		}
+		futex_wait( &s->state, 2 );
+		c = __atomic_exchange_n( &s->state, 2, __ATOMIC_ACQUIRE );
 	}
-	free( whash );
+}
 
-	/*clean cache*/
-	pthread_mutex_destroy( &wcache.lock );
-	we = wcache.list;
+void session_unlock( Session *s )
+{
+	if( affinity )
+		return;
 
-	while( we )
+	if( __atomic_exchange_n( &s->state, 0, __ATOMIC_RELEASE ) == 2 )
+		futex_wake( &s->state );
+}
+
+/*mutual exclusion on name. Returns locked and referenced session*/
+Session *session_acquire( const char *name )
+{
+	if( ! name || ! (*name) )
 	{
-		tmp = we;
-		we = we->next;
-		free( tmp );
+		msglog( MSG_ERR, "session_acquire: invalid name" );
+		return NULL;
 	}
+	return session_find( name, 1 );
 }
 
-void workon_init( void )
+void session_release( Session *s )
 {
-	whash = ( Wentry ** ) calloc( WORKON_HASH_SIZE, sizeof(Wentry *) );
+	struct sstripe *ss;
 
-	if( ! whash )
-		msglog( MSG_FATAL, "workon_init: " \
-			"could not allocate hash table" );
+	if( ! s )
+		return;
 
-	whash_used = 0;
-	whash_size = WORKON_HASH_SIZE;
+	ss = sstripe_of( s->hash );
+	pthread_mutex_lock( &ss->lock );
 
-        thread_mutex_init(&hash_lock);
+	/*no one else holding it. session can go*/
+	if( s->refs == 1 )
+	{
+		session_unhash( ss, s );
+		pthread_mutex_unlock( &ss->lock );
+		session_free( s );
+		return;
+	}
 
-	wcache.list = NULL;
-	wcache.count = 0;
-        thread_mutex_init(&wcache.lock);
+	/*others keep session alive until we are done with it*/
+	pthread_mutex_unlock( &ss->lock );
+	session_unlock( s );
+	session_put( s );
+}
+
+/*call fn for every session. Stripe lock is held while
+  fn runs, so fn must not get or drop sessions.*/
+void session_foreach( void (*fn)( Session *s, void *arg ), void *arg )
+{
+	struct sstripe *ss;
+	Session *s;
+	int i, j;
 
-	if( atexit( workon_cleanup ) )
+	for( i = 0 ; i < SESSION_STRIPES ; i++ )
 	{
-		workon_cleanup();
-		msglog( MSG_FATAL, "workon_init: " \
-			"could not reigster cleanup method" );
+		ss = stripes + i;
+		pthread_mutex_lock( &ss->lock );
+		for( j = 0 ; j < ss->size ; j++ )
+			for( s = ss->hash[ j ]; s; s = s->next )
+				fn( s, arg );
+		for( j = ss->moved ; ss->old && j < ss->old_size ; j++ )
+			for( s = ss->old[ j ]; s; s = s->next )
+				fn( s, arg );
+		pthread_mutex_unlock( &ss->lock );
 	}
 }
 
+struct session_count {
+	int count;
+	size_t name_used;
+	size_t name_size;
+};
+
+static void session_dump_one( Session *s, void *arg )
+{
+	struct session_count *sc = (struct session_count *) arg;
+
+	sc->count++;
+	msglog( MSG_INFO, "session %s: refs %d%s lockfd %d " \
+			"paths %d%s%s", s->name, s->refs,
+			s->state ? " locked" : "", s->lock_fd,
+			__atomic_load_n( &s->mp_count, __ATOMIC_RELAXED ),
+			s->bq ? " backup-queued" : "",
+			s->bp ? " backup-running" : "" );
+}
 
+/*log state of every name we know about*/
+static void session_dump( void )
+{
+	struct session_count sc;
+	int i;
 
+	memset( &sc, 0, sizeof(sc) );
+	session_foreach( session_dump_one, &sc );
 
+	for( i = 0 ; i < SESSION_STRIPES ; i++ )
+	{
+		pthread_mutex_lock( &stripes[ i ].lock );
+		sc.name_used += stripes[ i ].names.used;
+		sc.name_size += stripes[ i ].names.size;
+		pthread_mutex_unlock( &stripes[ i ].lock );
+	}
+	msglog( MSG_NOTICE, "%d sessions, %lu bytes of %lu used for names",
+			sc.count, (unsigned long) sc.name_used,
+			(unsigned long) sc.name_size );
+}
 
+/*every name is always handled by the same thread.
+  No need to lock names any more*/
+void session_affinity( void )
+{
+	affinity = 1;
+}
 
+/*names go away with the arena*/
+static void session_free_chains( Session **h, int size )
+{
+	int i;
+	Session *s, *tmp;
 
+	for( i = 0 ; i < size ; i ++ )
+	{
+		s = h[ i ];
+		while( s )
+		{
+			tmp = s;
+			s = s->next;
+			session_free( tmp );
+		}
+	}
+	free( h );
+}
 
+static void session_cleanup( void )
+{
+	int i;
 
+	/*clean hash first*/
+	for( i = 0 ; i < SESSION_STRIPES ; i++ )
+	{
+		pthread_mutex_destroy( &stripes[ i ].lock );
+		session_free_chains( stripes[ i ].hash, stripes[ i ].size );
+		if( stripes[ i ].old )
+			session_free_chains( stripes[ i ].old,
+					stripes[ i ].old_size );
+		name_arena_clean( &stripes[ i ].names );
+	}
 
+	slab_clean( &session_slab );
+}
 
+void session_init( void )
+{
+	int i;
 
+	for( i = 0 ; i < SESSION_STRIPES ; i++ )
+	{
+		stripes[ i ].hash = ( Session ** ) calloc( SESSION_HASH_SIZE,
+							sizeof(Session *) );
+		if( ! stripes[ i ].hash )
+			msglog( MSG_FATAL, "session_init: " \
+				"could not allocate hash table" );
+		stripes[ i ].size = SESSION_HASH_SIZE;
+		stripes[ i ].used = 0;
+		stripes[ i ].old = NULL;
+		stripes[ i ].old_size = 0;
+		stripes[ i ].moved = 0;
+		name_arena_init( &stripes[ i ].names );
+		thread_mutex_init( &stripes[ i ].lock );
+	}
 
+	slab_init( &session_slab, "session", sizeof(Session) );
+	stats_register( session_dump );
 
+	if( atexit( session_cleanup ) )
+	{
+		session_cleanup();
+		msglog( MSG_FATAL, "session_init: " \
+			"could not reigster cleanup method" );
+	}
+}
 
 #ifdef TEST
 
@@ -337,16 +514,74 @@ char *autodir_name(void)
     return "test autodir";
 }
 
-void *test_th(void *s)
+#define BENCH_SECS	2
+#define BENCH_NAMES	1024
+
+static volatile int bench_stop;
+
+/*each thread takes names in its own order out of a common set*/
+void *bench_th(void *v)
+{
+    unsigned long *ops = (unsigned long *) v;
+    unsigned int r = (unsigned int) (unsigned long) ops;
+    char name[16];
+    Session *s;
+
+    while (!bench_stop) {
+	r = r * 1103515245 + 12345;
+	snprintf(name, sizeof(name), "user%u", (r >> 8) % BENCH_NAMES);
+	if ((s = session_acquire(name))) {
+	    session_release(s);
+	    (*ops)++;
+	}
+    }
+    return NULL;
+}
+
+/*lock/unlock operations per second with different thread counts*/
+void bench(void)
+{
+    static const int nthreads[] = { 1, 8, 32, 128 };
+    unsigned long ops[128 * 8];
+    pthread_t id[128];
+    unsigned long total;
+    struct timespec s, e;
+    double secs;
+    int i, t;
+
+    for (t = 0; t < sizeof(nthreads) / sizeof(nthreads[0]); t++) {
+	memset(ops, 0, sizeof(ops));
+	bench_stop = 0;
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	/*counters are kept apart to avoid false sharing*/
+	for (i = 0; i < nthreads[t]; i++)
+	    pthread_create(&id[i], 0, bench_th, &ops[i * 8]);
+	sleep(BENCH_SECS);
+	bench_stop = 1;
+	for (i = 0; i < nthreads[t]; i++)
+	    pthread_join(id[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+
+	total = 0;
+	for (i = 0; i < nthreads[t]; i++)
+	    total += ops[i * 8];
+	secs = (e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9;
+	printf("%3d threads: %12.0f lock/unlock ops/sec\n",
+				nthreads[t], total / secs);
+    }
+}
+
+void *test_th(void *v)
 {
-    char *str = (char *) s;
+    char *str = (char *) v;
+    Session *s;
     int i = 0;
 
     sleep(2);
     while (1) {
 	i++;
-	if (workon_name(str)) {
-	    workon_release(str);
+	if ((s = session_acquire(str))) {
+	    session_release(s);
 	}
 	if (i == 1000000) {
 	    printf("%s: %d\n", str, i);
@@ -355,15 +590,21 @@ void *test_th(void *s)
     }
 }
 
-/* compile  gcc -g -DTEST workon.c msg.o  miscfuncs.o -lpthread thread.o */
+/* compile  gcc -g -DTEST session.c name_arena.o slab.o stats.o msg.o  miscfuncs.o -lpthread thread.o
+   run with 'bench' argument for lock/unlock throughput */
 
-int main(void)
+int main(int argc, char *argv[])
 {
     pthread_t id;
 
     msg_init();
     thread_init();
-    workon_init();
+    session_init();
+
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+	bench();
+	return 0;
+    }
 
     pthread_create(&id, 0, test_th, "1");
     pthread_create(&id, 0, test_th, "2");
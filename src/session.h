@@ -0,0 +1,62 @@
+/*
+
+Copyright (C) (2004 - 2005) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <limits.h>
+#include <time.h>
+
+struct bqueue;
+struct backup_pid;
+
+/*everything kept about one name*/
+typedef struct session {
+	char *name;	/*kept in the name arena of the stripe*/
+	unsigned int hash;
+	int refs;	/*references held. Under stripe lock*/
+	int state;	/*futex: 0 free, 1 locked, 2 locked and contended*/
+
+	/*owned by other subsystems*/
+	int lock_fd;		/*lockfile.c. Under name lock*/
+	int mp_count;		/*multipath.c. Atomic*/
+	struct bqueue *bq;	/*backup_queue.c. Under its lock*/
+	struct backup_pid *bp;	/*backup_child.c. Under its lock*/
+	int jstate;		/*backup_journal.c. Under its lock*/
+	struct timespec jstamp;	/*wall clock time name was queued*/
+	int tstate;		/*backup_track.c. Atomic*/
+	int sstate;		/*backup_snap.c. Under its lock*/
+
+	struct session *next;
+} Session;
+
+/* session.c */
+void session_init(void);
+void session_affinity(void);
+Session *session_get(const char *name);
+void session_hold(Session *s);
+void session_put(Session *s);
+void session_lock(Session *s);
+void session_unlock(Session *s);
+Session *session_acquire(const char *name);
+void session_release(Session *s);
+void session_foreach(void (*fn)(Session *s, void *arg), void *arg);
+
+#endif
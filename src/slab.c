@@ -0,0 +1,367 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* object caches with per thread magazines.
+
+   Every thread keeps two magazines of free objects per cache,
+   so that most allocations and frees do not take any lock.
+   When both are empty (or full) the thread trades one with
+   the depot of the cache. Objects come from malloc when the
+   depot has nothing, and go back to malloc when the depot
+   already keeps as many magazines as configured.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "miscfuncs.h"
+#include "msg.h"
+#include "thread.h"
+#include "stats.h"
+#include "slab.h"
+
+#define SLAB_MAX	(16)	/*caches*/
+
+#define DFLT_ROUNDS	(32)	/*objects in a magazine*/
+#define MAX_ROUNDS	(1024)
+#define DFLT_DEPOT	(64)	/*full magazines kept by depot*/
+#define MAX_DEPOT	(65536)
+
+typedef struct magazine {
+	struct magazine *next;
+	int rounds;
+	void *obj[];
+} Magazine;
+
+/*magazines of current thread*/
+struct slab_tls {
+	Magazine *loaded;
+	Magazine *prev;
+};
+
+static __thread struct slab_tls tls[ SLAB_MAX ];
+static __thread int tls_registered;
+static pthread_key_t tls_key;
+static pthread_once_t tls_once = PTHREAD_ONCE_INIT;
+
+static Slab_cache *caches[ SLAB_MAX ];
+static int n_caches;
+
+static int rounds = DFLT_ROUNDS;
+static int depot_max = DFLT_DEPOT;
+
+static Magazine *magazine_new( void )
+{
+	Magazine *m;
+
+	m = (Magazine *) malloc( sizeof(Magazine) + rounds * sizeof(void *) );
+	if( m )
+		m->rounds = 0;
+	return m;
+}
+
+/*objects of the magazine back to malloc*/
+static void magazine_empty( Slab_cache *sc, Magazine *m )
+{
+	int n = m->rounds;
+
+	while( m->rounds > 0 )
+		free( m->obj[ --m->rounds ] );
+
+	pthread_mutex_lock( &sc->lock );
+	sc->shrunk += n;
+	pthread_mutex_unlock( &sc->lock );
+}
+
+/*depot takes magazine if it has room. Otherwise magazine
+  and its objects are freed*/
+static void depot_put( Slab_cache *sc, Magazine *m )
+{
+	if( ! m )
+		return;
+
+	pthread_mutex_lock( &sc->lock );
+	if( m->rounds > 0 && sc->n_full < depot_max )
+	{
+		m->next = sc->full;
+		sc->full = m;
+		sc->n_full++;
+		m = NULL;
+	}
+	else if( m->rounds == 0 && sc->n_empty < depot_max )
+	{
+		m->next = sc->empty;
+		sc->empty = m;
+		sc->n_empty++;
+		m = NULL;
+	}
+	pthread_mutex_unlock( &sc->lock );
+
+	if( m )
+	{
+		magazine_empty( sc, m );
+		free( m );
+	}
+}
+
+/*thread is going away. Its magazines go to depot*/
+static void slab_tls_release( void *x )
+{
+	int i;
+
+	for( i = 0 ; i < n_caches ; i++ )
+	{
+		depot_put( caches[ i ], tls[ i ].loaded );
+		depot_put( caches[ i ], tls[ i ].prev );
+		tls[ i ].loaded = tls[ i ].prev = NULL;
+	}
+}
+
+static void slab_tls_key( void )
+{
+	if( pthread_key_create( &tls_key, slab_tls_release ) )
+		msglog( MSG_FATAL, "slab: could not create thread key" );
+}
+
+/*make sure magazines are returned when thread exits*/
+static void slab_tls_register( void )
+{
+	if( tls_registered )
+		return;
+	pthread_once( &tls_once, slab_tls_key );
+	pthread_setspecific( tls_key, tls );
+	tls_registered = 1;
+}
+
+/*both magazines are empty. Trade previous one
+  for a full magazine from depot*/
+static int slab_reload( Slab_cache *sc, struct slab_tls *t )
+{
+	Magazine *m;
+
+	slab_tls_register();
+
+	pthread_mutex_lock( &sc->lock );
+	if( ! ( m = sc->full ) )
+	{
+		sc->misses++;
+		pthread_mutex_unlock( &sc->lock );
+		return 0;
+	}
+	sc->full = m->next;
+	sc->n_full--;
+	pthread_mutex_unlock( &sc->lock );
+
+	depot_put( sc, t->prev );
+	t->prev = t->loaded;
+	t->loaded = m;
+	return 1;
+}
+
+/*both magazines are full. Trade previous one
+  for an empty magazine from depot*/
+static int slab_unload( Slab_cache *sc, struct slab_tls *t )
+{
+	Magazine *m;
+
+	slab_tls_register();
+
+	pthread_mutex_lock( &sc->lock );
+	if( t->prev && sc->n_full >= depot_max )
+	{
+		pthread_mutex_unlock( &sc->lock );
+		return 0;
+	}
+	if( ( m = sc->empty ) )
+	{
+		sc->empty = m->next;
+		sc->n_empty--;
+	}
+	pthread_mutex_unlock( &sc->lock );
+
+	if( ! m && ! ( m = magazine_new() ) )
+		return 0;
+
+	depot_put( sc, t->prev );
+	t->prev = t->loaded;
+	t->loaded = m;
+	return 1;
+}
+
+void *slab_alloc( Slab_cache *sc )
+{
+	struct slab_tls *t = tls + sc->id;
+	Magazine *m;
+	void *obj;
+
+	while( 1 )
+	{
+		if( ( m = t->loaded ) && m->rounds > 0 )
+			return m->obj[ --m->rounds ];
+
+		if( t->prev && t->prev->rounds > 0 )
+		{
+			t->loaded = t->prev;
+			t->prev = m;
+			continue;
+		}
+
+		if( ! slab_reload( sc, t ) )
+			break;
+	}
+
+	/*nothing cached anywhere*/
+	if( ( obj = malloc( sc->size ) ) )
+	{
+		pthread_mutex_lock( &sc->lock );
+		sc->grown++;
+		pthread_mutex_unlock( &sc->lock );
+	}
+	return obj;
+}
+
+void slab_free( Slab_cache *sc, void *obj )
+{
+	struct slab_tls *t = tls + sc->id;
+	Magazine *m;
+
+	if( ! obj )
+		return;
+
+	while( 1 )
+	{
+		if( ( m = t->loaded ) && m->rounds < rounds )
+		{
+			m->obj[ m->rounds++ ] = obj;
+			return;
+		}
+
+		if( t->prev && t->prev->rounds < rounds )
+		{
+			t->loaded = t->prev;
+			t->prev = m;
+			continue;
+		}
+
+		if( ! slab_unload( sc, t ) )
+			break;
+	}
+
+	/*depot has enough already*/
+	free( obj );
+	pthread_mutex_lock( &sc->lock );
+	sc->shrunk++;
+	pthread_mutex_unlock( &sc->lock );
+}
+
+static void slab_stats( void )
+{
+	Slab_cache *sc;
+	int i;
+
+	for( i = 0 ; i < n_caches ; i++ )
+	{
+		sc = caches[ i ];
+		pthread_mutex_lock( &sc->lock );
+		msglog( MSG_NOTICE, "cache %s: %lu objects of %lu bytes, " \
+			"%lu in depot (%d full %d empty magazines " \
+			"of %d), %lu freed, %lu depot misses",
+			sc->name, sc->grown - sc->shrunk,
+			(unsigned long) sc->size,
+			(unsigned long) sc->n_full * rounds,
+			sc->n_full, sc->n_empty, rounds,
+			sc->shrunk, sc->misses );
+		pthread_mutex_unlock( &sc->lock );
+	}
+}
+
+void slab_init( Slab_cache *sc, const char *name, size_t size )
+{
+	if( n_caches == SLAB_MAX )
+		msglog( MSG_FATAL, "slab_init: too many caches" );
+
+	memset( sc, 0, sizeof(*sc) );
+	sc->name = name;
+	sc->size = size;
+	thread_mutex_init( &sc->lock );
+
+	if( n_caches == 0 )
+		stats_register( slab_stats );
+	sc->id = n_caches;
+	caches[ n_caches++ ] = sc;
+}
+
+static int magazines_free( Magazine *m )
+{
+	Magazine *next;
+	int n = 0;
+
+	for( ; m; m = next )
+	{
+		next = m->next;
+		n += m->rounds;
+		while( m->rounds > 0 )
+			free( m->obj[ --m->rounds ] );
+		free( m );
+	}
+	return n;
+}
+
+/*at exit. Depot and magazines of calling thread*/
+void slab_clean( Slab_cache *sc )
+{
+	struct slab_tls *t = tls + sc->id;
+	int n;
+
+	if( t->loaded )
+		t->loaded->next = NULL;
+	if( t->prev )
+		t->prev->next = NULL;
+	n = magazines_free( t->loaded );
+	n += magazines_free( t->prev );
+	t->loaded = t->prev = NULL;
+
+	pthread_mutex_lock( &sc->lock );
+	n += magazines_free( sc->full );
+	n += magazines_free( sc->empty );
+	sc->shrunk += n;
+	sc->full = sc->empty = NULL;
+	sc->n_full = sc->n_empty = 0;
+	pthread_mutex_unlock( &sc->lock );
+}
+
+/*ROUNDS[,DEPOT]*/
+void slab_option_cache( char ch, char *arg, int valid )
+{
+	char *depot;
+
+	if( ! valid )
+		return;
+
+	if( ( depot = strchr( arg, ',' ) ) )
+		*depot++ = '\0';
+
+	if( ! string_to_number( arg, &rounds ) ||
+			rounds < 1 || rounds > MAX_ROUNDS ||
+			( depot && ( ! string_to_number( depot, &depot_max ) ||
+			depot_max < 0 || depot_max > MAX_DEPOT ) ) )
+		msglog( MSG_FATAL, "invalid argument for cache -%c option", ch );
+}
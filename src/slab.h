@@ -0,0 +1,56 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct magazine;
+
+/*objects of one size. Threads keep a couple of magazines
+  of free objects each, and trade full and empty ones with
+  the depot here*/
+typedef struct slab_cache {
+	const char *name;
+	size_t size;
+	int id;
+
+	pthread_mutex_t lock;	/*depot*/
+	struct magazine *full;
+	int n_full;
+	struct magazine *empty;
+	int n_empty;
+
+	/*statistics. Under depot lock*/
+	unsigned long grown;	/*objects taken from malloc*/
+	unsigned long shrunk;	/*objects given back to malloc*/
+	unsigned long misses;	/*depot had no full magazine*/
+} Slab_cache;
+
+/* slab.c */
+void slab_init(Slab_cache *sc, const char *name, size_t size);
+void *slab_alloc(Slab_cache *sc);
+void slab_free(Slab_cache *sc, void *obj);
+void slab_clean(Slab_cache *sc);
+void slab_option_cache(char ch, char *arg, int valid);
+
+#endif
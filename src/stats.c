@@ -0,0 +1,50 @@
+/*
+
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+
+This program is free software; you can redistribute it and/or 
+modify it under the terms of the GNU General Public License 
+as published by the Free Software Foundation; either 
+version 3 of the License, or (at your option) any later 
+version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+/* statistics of subsystems logged on request.
+   Subsystems register what to log while initializing,
+   before any threads start. */
+
+#include <stdio.h>
+#include "msg.h"
+#include "stats.h"
+
+#define STATS_MAX	(16)
+
+static void (*stats_fn[ STATS_MAX ])( void );
+static int stats_count;
+
+void stats_register( void (*fn)( void ) )
+{
+	if( stats_count == STATS_MAX )
+	{
+		msglog( MSG_ALERT, "stats_register: too many" );
+		return;
+	}
+	stats_fn[ stats_count++ ] = fn;
+}
+
+void stats_dump( void )
+{
+	int i;
+
+	for( i = 0 ; i < stats_count ; i++ )
+		stats_fn[ i ]();
+}
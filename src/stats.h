@@ -1,6 +1,6 @@
 /*
 
-Copyright (C) (2004 - 2005) (Venkata Ramana Enaganti) <ramana@intraperson.com>
+Copyright (C) (2004 - 2006) (Venkata Ramana Enaganti) <ramana@intraperson.com>
 
 This program is free software; you can redistribute it and/or 
 modify it under the terms of the GNU General Public License 
@@ -18,12 +18,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
-#ifndef WORKON_H
-#define WORKON_H
+#ifndef STATS_H
+#define STATS_H
 
-/* workon.c */
-void workon_init(void);
-int workon_name(const char *name);
-void workon_release(const char *name);
+/* stats.c */
+void stats_register(void (*fn)(void));
+void stats_dump(void);
 
 #endif
@@ -20,7 +20,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include "thread.h"
 #include "mpacket.h"
@@ -28,202 +30,335 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "time_mono.h"
 #include "thread_cache.h"
 
-/*We maintain some spare threads here to improve performance*/
+/*Fixed number of worker threads are started at init time.
+Packets are passed to them through a bounded ring which
+needs no locks. Semaphores count filled and free slots,
+so that workers sleep while there is nothing to do.
+The reader never blocks. While the ring is full packets
+wait in a pending list of the ring, and workers move them
+in as they free slots.
+
+In keyed mode every worker has a ring of its own and
+packets with the same key always go to the same worker.
+So packets for one key are handled one after another,
+in the order they arrived. Pending lists are per ring
+too, so the order holds while a ring is full.*/
+
+static void sem_wait_intr( sem_t *s )
+{
+	while( sem_wait( s ) && errno == EINTR );
+}
+
+/*called only after a free slot has been reserved through r->space*/
+static void ring_put( struct tc_ring *r, Packet *pkt )
+{
+	struct tc_slot *slot;
+	unsigned long pos, seq;
 
+	pos = __atomic_load_n( &r->in, __ATOMIC_RELAXED );
+	while( 1 )
+	{
+		slot = r->slots + ( pos & r->mask );
+		seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE );
+
+		if( seq == pos )
+		{
+			if( __atomic_compare_exchange_n( &r->in, &pos, pos + 1,
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+				break;
+		}
+		else
+		{
+			/*consumer of this slot has not finished yet*/
+			if( (long) ( seq - pos ) < 0 )
+				sched_yield();
+			pos = __atomic_load_n( &r->in, __ATOMIC_RELAXED );
+		}
+	}
 
-/*New threads are given their own packets first.
-But subsequently, threads try to get packets
-from cache using following method.
+	slot->pkt = pkt;
+	__atomic_store_n( &slot->seq, pos + 1, __ATOMIC_RELEASE );
+}
 
-This could be exit point for a thread.*/
-static Packet *get_cache( thread_cache *tc )
+/*called only after a packet has been reserved through r->items*/
+static Packet *ring_get( struct tc_ring *r )
 {
-        Packet *pkt;
+	struct tc_slot *slot;
+	unsigned long pos, seq;
+	Packet *pkt;
+
+	pos = __atomic_load_n( &r->out, __ATOMIC_RELAXED );
+	while( 1 )
+	{
+		slot = r->slots + ( pos & r->mask );
+		seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE );
 
-        while( pthread_mutex_trylock( &tc->lock ) )
-		sleep( 1 );
-	pkt = tc->pkt_slots[ tc->out ];
-        while( 1 )
-        {
-                if( pkt )
-                {
-                        tc->pkt_slots[ tc->out ] = NULL;
-			tc->out = ( tc->out + 1 ) % tc->n_slots;
-                        pthread_mutex_unlock( &tc->lock );
-                        return pkt;
-                }
-		/*we do not keep more threads than allowed*/
-                if( tc->stop || tc->thread_waiting >= tc->max_thread_wait  )
-                {
-                        tc->thread_count--;
-                        if( tc->stop && ! tc->thread_count )
-                                pthread_cond_signal( &tc->count_cond );
-                        pthread_mutex_unlock( &tc->lock );
-                        pthread_exit( NULL );
-                }
-                tc->thread_waiting++;
-                pthread_cond_wait( &tc->waiting_cond, &tc->lock );
-                tc->thread_waiting--;
-
-		pkt = tc->pkt_slots[ tc->out ];
-        }
+		if( seq == pos + 1 )
+		{
+			if( __atomic_compare_exchange_n( &r->out, &pos, pos + 1,
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+				break;
+		}
+		else
+		{
+			/*producer of this slot has not finished yet*/
+			if( (long) ( seq - ( pos + 1 ) ) < 0 )
+				sched_yield();
+			pos = __atomic_load_n( &r->out, __ATOMIC_RELAXED );
+		}
+	}
+
+	pkt = slot->pkt;
+	__atomic_store_n( &slot->seq, pos + r->mask + 1, __ATOMIC_RELEASE );
+	return pkt;
 }
 
-#ifdef TEST
-#define MAX_REUSE 2
-#else
-#define MAX_REUSE 300
-#endif
+static void ring_init( thread_cache *tc, struct tc_ring *r, int n_slots )
+{
+	unsigned long i, size;
+
+	/*ring size must be power of 2*/
+	for( size = 2 ; size < n_slots ; size <<= 1 );
+	r->tc = tc;
+	r->mask = size - 1;
+	r->in = 0;
+	r->out = 0;
+
+	r->slots = ( struct tc_slot * ) malloc( size * sizeof(struct tc_slot) );
+	if( ! r->slots )
+		msglog( MSG_FATAL, "thread_cache_init: " \
+				"could not allocate memory" );
+	for( i = 0 ; i < size ; i++ )
+	{
+		r->slots[ i ].seq = i;
+		r->slots[ i ].pkt = NULL;
+	}
 
-/*re-usable thread. But we do not stay alive for ever.
-  Thread argument must not be null.*/
+	if( sem_init( &r->items, 0, 0 ) || sem_init( &r->space, 0, size ) )
+		msglog( MSG_FATAL|LOG_ERRNO, "thread_cache_init: sem_init" );
+
+	thread_mutex_init( &r->plock );
+	r->phead = NULL;
+	r->ptail = &r->phead;
+	r->stops = 0;
+	r->npending = 0;
+}
+
+/*move pending packets, and after them stop markers,
+  into free slots. Under plock*/
+static void ring_flush( struct tc_ring *r )
+{
+	Packet *pkt;
+
+	while( ( r->phead || r->stops ) && ! sem_trywait( &r->space ) )
+	{
+		if( ( pkt = r->phead ) )
+		{
+			if( ! ( r->phead = pkt->next ) )
+				r->ptail = &r->phead;
+		}
+		else r->stops--;
+
+		ring_put( r, pkt );
+		__atomic_sub_fetch( &r->npending, 1, __ATOMIC_SEQ_CST );
+		sem_post( &r->items );
+	}
+}
+
+/*ring is full, or others are waiting before pkt.
+  NULL pkt adds a stop marker*/
+static void ring_pend( struct tc_ring *r, Packet *pkt )
+{
+	pthread_mutex_lock( &r->plock );
+	if( pkt )
+	{
+		pkt->next = NULL;
+		*r->ptail = pkt;
+		r->ptail = &pkt->next;
+	}
+	else r->stops++;
+	__atomic_add_fetch( &r->npending, 1, __ATOMIC_SEQ_CST );
+
+	/*slots may have been freed since*/
+	ring_flush( r );
+	pthread_mutex_unlock( &r->plock );
+}
+
+/*reserves a free slot without waiting. Packets already
+  pending go first*/
+static int ring_try( struct tc_ring *r )
+{
+	return ! __atomic_load_n( &r->npending, __ATOMIC_SEQ_CST ) &&
+		! sem_trywait( &r->space );
+}
+
+/*worker thread. A NULL packet tells it to quit*/
 static void *thread_cache_thread( void *x )
 {
-	int i = 0;
-        Packet *pkt = (Packet *) x;
-        thread_cache *tc;
+        struct tc_ring *r = (struct tc_ring *) x;
+        thread_cache *tc = r->tc;
+        Packet *pkt;
 
-	pthread_detach( pthread_self() );
-	/*we only service limited requests per thread*/
-	do
+	while( 1 )
 	{
-        	tc = pkt->tc;
+		sem_wait_intr( &r->items );
+		pkt = ring_get( r );
+		sem_post( &r->space );
+
+		if( __atomic_load_n( &r->npending, __ATOMIC_SEQ_CST ) )
+		{
+			pthread_mutex_lock( &r->plock );
+			ring_flush( r );
+			pthread_mutex_unlock( &r->plock );
+		}
 
+		if( ! pkt )
+			break;
 		/*call back do the actual work*/
 		tc->cb( pkt );
-		if( ++i > MAX_REUSE )
-			break;
-		pkt = get_cache( tc );
-	} while( pkt );
-	
+	}
+
 	/*decrement count and exit*/
 	pthread_mutex_lock( &tc->lock );
-	tc->thread_count--;
+	if( ! --tc->thread_count )
+		pthread_cond_signal( &tc->count_cond );
 	pthread_mutex_unlock( &tc->lock );
-	pthread_exit( NULL );
+	return NULL;
 }
 
-/*Adding new packets to FIFO buffer.
+static struct tc_ring *ring_select( thread_cache *tc, Packet *pkt )
+{
+	if( tc->n_rings == 1 )
+		return tc->rings;
+	return tc->rings + tc->key( pkt ) % tc->n_rings;
+}
 
-Add new packets to the cache OR start threads to hanle them directly.
+/*never blocks. pkt waits in pending list if the ring is full*/
+static void ring_add( struct tc_ring *r, Packet *pkt )
+{
+	if( ! ring_try( r ) )
+	{
+		ring_pend( r, pkt );
+		return;
+	}
+	ring_put( r, pkt );
+	sem_post( &r->items );
+}
 
-pending_count is used by single thread and can be operated without locks.
-*/
+/*Adding new packet to the ring. A keyed ring full with packets
+  of a slow name keeps the rest in its pending list, so names
+  of other workers go on*/
 void thread_cache_new( thread_cache *tc, Packet *pkt )
 {
-	int pkt_pending;
-
 	pkt->tc = tc;
-	pthread_mutex_lock( &tc->lock );
-	pkt_pending = tc->out <= tc->in
-				? tc->in - tc->out
-				: tc->n_slots - tc->out + tc->in;
-	/*if( no thread waiting OR
-		cache buffer full OR
-		not enough waiting threads? )*/
-	if( ! tc->thread_waiting || tc->pkt_slots[ tc->in ] ||
-				pkt_pending > tc->thread_waiting )
+	ring_add( ring_select( tc, pkt ), pkt );
+}
+
+/*Adding a batch of packets. With a single ring workers
+  are woken up only after the whole batch is in.*/
+void thread_cache_new_batch( thread_cache *tc, Packet **pkts, int n )
+{
+	int i, put = 0;
+
+	if( tc->n_rings > 1 )
 	{
-		/*This is optimizatoin*/
-		if( tc->pending_count > 30000 )
-		{
-			tc->thread_count += tc->pending_count;
-			tc->pending_count = 0;
-		}
-		pthread_mutex_unlock( &tc->lock );
-		/*Try starting new thread*/
-		if( thread_new( thread_cache_thread, pkt, NULL ) )
-		{
-			tc->pending_count++;
-			return;
-		}
-		pthread_mutex_lock( &tc->lock );
-		/*if there is not even one thread waiting OR
-		buffer cache is full, we forcefully start a thread*/
-		if( ! tc->thread_waiting || tc->pkt_slots[ tc->in ] )
+		for( i = 0 ; i < n ; i++ )
+			thread_cache_new( tc, pkts[ i ] );
+		return;
+	}
+
+	for( i = 0 ; i < n ; i++ )
+	{
+		pkts[ i ]->tc = tc;
+		if( ring_try( tc->rings ) )
 		{
-			pthread_mutex_unlock( &tc->lock );
-			thread_new_wait( thread_cache_thread, pkt, 1 );
-			tc->pending_count++;
-			return;
+			ring_put( tc->rings, pkts[ i ] );
+			put++;
 		}
-		/*If the above conditions fail, we add packet
-		to the cache and hope existing threads handle
-		through thread reuse mechanism.*/
+		else ring_pend( tc->rings, pkts[ i ] );
 	}
-	/*add to the buffer and wake up existing threads.*/
-	tc->pkt_slots[ tc->in ] = pkt;
-	tc->in = ( tc->in + 1 ) % tc->n_slots;
-	pthread_mutex_unlock( &tc->lock );
-
-	pthread_cond_signal( &tc->waiting_cond );
+	for( i = 0 ; i < put ; i++ )
+		sem_post( &tc->rings->items );
 }
 
-void thread_cache_init( thread_cache *tc, void (*cb)( Packet *),
-			int n_slots, int max_thread_wait )
+static void thread_cache_setup( thread_cache *tc, void (*cb)( Packet *),
+			unsigned int (*key)( Packet * ), int n_slots,
+			int n_threads )
 {
+	int i;
+
         thread_mutex_init(&tc->lock);
         thread_cond_init(&tc->count_cond);
-        thread_cond_init(&tc->waiting_cond);
-
 	tc->stop = 0;
 	tc->cb = cb;
-
+	tc->key = key;
 	tc->thread_count = 0;
-	tc->pending_count = 0;
-	tc->thread_waiting = 0;
 
-	tc->n_slots = n_slots;
-	tc->max_thread_wait = max_thread_wait;
-	tc->pkt_slots = ( Packet ** ) calloc( n_slots, sizeof(Packet *) );
-	if( ! tc->pkt_slots )
+	tc->n_rings = key ? n_threads : 1;
+	tc->rings = ( struct tc_ring * ) calloc( tc->n_rings,
+					sizeof(struct tc_ring) );
+	if( ! tc->rings )
 		msglog( MSG_FATAL, "thread_cache_init: " \
 				"could not allocate memory" );
-	tc->in = 0;
-	tc->out = 0;
+
+	for( i = 0 ; i < tc->n_rings ; i++ )
+		ring_init( tc, tc->rings + i, n_slots );
+
+	for( i = 0 ; i < n_threads ; i++ )
+	{
+		if( ! thread_new( thread_cache_thread,
+				tc->rings + ( key ? i : 0 ), NULL ) )
+			msglog( MSG_FATAL, "thread_cache_init: " \
+					"could not start worker threads" );
+		pthread_mutex_lock( &tc->lock );
+		tc->thread_count++;
+		pthread_mutex_unlock( &tc->lock );
+	}
 }
 
-/*Before shutdown. Try waiting for all threads.*/
+void thread_cache_init( thread_cache *tc, void (*cb)( Packet *),
+			int n_slots, int n_threads )
+{
+	thread_cache_setup( tc, cb, NULL, n_slots, n_threads );
+}
+
+/*n_slots is per worker here*/
+void thread_cache_init_keyed( thread_cache *tc, void (*cb)( Packet *),
+			unsigned int (*key)( Packet * ), int n_slots,
+			int n_threads )
+{
+	thread_cache_setup( tc, cb, key, n_slots, n_threads );
+}
+
+/*Before shutdown. Let workers finish queued packets
+  and try waiting for all of them.*/
 void thread_cache_stop( thread_cache *tc )
 {
-	int i;
+	int i, n;
         struct timespec timeout;
 
+	if( ! tc->rings )
+		return;
 	tc->stop = 1;
 
 	pthread_mutex_lock( &tc->lock );
-	tc->thread_count += tc->pending_count;
-	tc->pending_count = 0;
+	n = tc->thread_count;
+	pthread_mutex_unlock( &tc->lock );
 
+	/*markers go after packets already given*/
+	for( i = 0 ; i < n ; i++ )
+		ring_pend( tc->rings + ( tc->n_rings > 1 ? i : 0 ), NULL );
+
+	pthread_mutex_lock( &tc->lock );
 	for( i = 0; i < 3 && tc->thread_count; i++ )
 	{
                 thread_cond_timespec(&timeout, 2 * i + 1);
-		pthread_cond_broadcast( &tc->waiting_cond );
                 pthread_cond_timedwait( &tc->count_cond,
 					&tc->lock, &timeout );
-#if 0
-		pthread_cond_wait( &tc->count_cond, &tc->lock);
-#endif
 	}
-#if 0
-	if( tc->thread_count )
-		msglog( MSG_ERR, "threads still remaining %d",
-				tc->thread_count );
-#endif
 	pthread_mutex_unlock( &tc->lock );
 }
 
-
-
-
-
-
-
-
-
-
-
-
 #ifdef TEST
 
 char *autodir_name(void)
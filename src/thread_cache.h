@@ -24,8 +24,39 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 typedef struct thread_cache thread_cache;
 
 #include <pthread.h>
+#include <semaphore.h>
 #include "mpacket.h"
 
+/*one slot of the packet ring. seq tells whether the
+  slot is free for a producer or filled for a consumer*/
+struct tc_slot {
+	unsigned long seq;
+	Packet *pkt;
+};
+
+/*lock free bounded ring of packets. Any number
+  of threads can add and take packets*/
+struct tc_ring {
+	thread_cache *tc;
+	struct tc_slot *slots;
+	unsigned long mask; /*ring size - 1*/
+	char pad1[ 64 ];
+	unsigned long in; /*packets in position*/
+	char pad2[ 64 ];
+	unsigned long out; /*packets out position*/
+	char pad3[ 64 ];
+
+	sem_t items; /*packets in the ring*/
+	sem_t space; /*free slots in the ring*/
+
+	/*packets waiting for free slots while the ring is full,
+	  and then stop markers for workers. Under plock*/
+	pthread_mutex_t plock;
+	Packet *phead, **ptail;
+	int stops;
+	int npending; /*all of them. Atomic*/
+};
+
 struct thread_cache {
         pthread_mutex_t lock;
         int stop;
@@ -33,32 +64,24 @@ struct thread_cache {
 	/*call-back to do the specific work.*/
         void (*cb)( Packet * );
 
-	/*No of threads running at any time*/
+	/*No of worker threads running at any time*/
         int thread_count;
-
-	/*We first add to pending_count and then at regualr intervels
-	   we transfer total accumulated count to thread_count*/
-        int pending_count;
-
         pthread_cond_t count_cond;
 
-	/*count of threads waiting for new packets*/
-        int thread_waiting;
-	/*We do not allow more then the following number of threads
-	to wait at any time.*/
-	int max_thread_wait;
-        pthread_cond_t waiting_cond;
-
-	/*FIFO buffer*/
-        Packet **pkt_slots;
-	int n_slots; /*size of FIFO buffer*/
-        int in; /*packets in index*/
-        int out; /*packets out index*/
+	/*either one ring shared by all workers or,
+	  when packets are keyed, one ring per worker*/
+	struct tc_ring *rings;
+	int n_rings;
+	unsigned int (*key)( Packet * );
 };
 
 void thread_cache_new( thread_cache *tc, Packet *pkt );
+void thread_cache_new_batch( thread_cache *tc, Packet **pkts, int n );
 void thread_cache_init( thread_cache *tc, void (*cb)( Packet *), int n_slots,
-				int max_thread_wait );
+				int n_threads );
+void thread_cache_init_keyed( thread_cache *tc, void (*cb)( Packet *),
+			unsigned int (*key)( Packet * ), int n_slots,
+			int n_threads );
 void thread_cache_stop( thread_cache *tc );
 
 #endif
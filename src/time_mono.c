@@ -80,28 +80,26 @@ struct timespec *thread_cond_timespec( struct timespec *tp, time_t sec )
 	return tp;
 }
 
-#if 0
+/*current time plus given offset. Same clock as thread_cond_timespec*/
 struct timespec *mono_timespec( struct timespec *tp, time_t sec, long nsec )
 {
 #if defined(_POSIX_TIMERS) && (_POSIX_TIMERS > 0)
-#if defined(_POSIX_MONOTONIC_CLOCK) && (_POSIX_MONOTONIC_CLOCK >= 0)
 	if ( clock_gettime( clockid, tp ) )
 		msglog( MSG_FATAL|LOG_ERRNO, 
 				    "mono_timespec: clock_gettime failed" );
-#else
-	if ( clock_gettime( CLOCK_REALTIME, tp ) )
-		msglog( MSG_FATAL|LOG_ERRNO, 
-				    "mono_timespec: clock_gettime failed" );
-#endif
 #else
 	tp->tv_sec = time( NULL );
 	tp->tv_nsec = 0;
 #endif
-	tp->tv_sec += sec;
-	tp->tv_nsec += nsec;
+	tp->tv_sec += sec + nsec / 1000000000;
+	tp->tv_nsec += nsec % 1000000000;
+	if( tp->tv_nsec >= 1000000000 )
+	{
+		tp->tv_sec++;
+		tp->tv_nsec -= 1000000000;
+	}
 	return tp;
 }
-#endif
 
 void mono_nanosleep( long nsec )
 {